@@ -381,6 +381,7 @@ BlockDriverState *bdrv_new(void)
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_mutex_init(&bs->reqs_lock);
     qemu_mutex_init(&bs->dirty_bitmap_mutex);
+    bdrv_bsc_init(bs);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -1317,6 +1318,9 @@ static void bdrv_child_cb_detach(BdrvChild *child)
         bdrv_backing_detach(child);
     }
 
+    /* Cached block status may refer to the child as its file */
+    bdrv_bsc_invalidate_all(bs);
+
     bdrv_unapply_subtree_drain(child, bs);
 }
 
@@ -4300,6 +4304,7 @@ void bdrv_reopen_commit(BDRVReopenState *reopen_state)
     if (drv->bdrv_reopen_commit) {
         drv->bdrv_reopen_commit(reopen_state);
     }
+    bdrv_bsc_invalidate_all(bs);
 
     /* set BDS specific flags now */
     qobject_unref(bs->explicit_options);
@@ -4401,6 +4406,8 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
+    bdrv_bsc_invalidate_all(bs);
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -4614,6 +4621,7 @@ static void bdrv_delete(BlockDriverState *bs)
     QTAILQ_REMOVE(&all_bdrv_states, bs, bs_list);
 
     bdrv_close(bs);
+    bdrv_bsc_destroy(bs);
 
     g_free(bs);
 }
@@ -4628,6 +4636,8 @@ static void bdrv_delete(BlockDriverState *bs)
 static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
                                       BdrvCheckResult *res, BdrvCheckMode fix)
 {
+    int ret;
+
     if (bs->drv == NULL) {
         return -ENOMEDIUM;
     }
@@ -4636,7 +4646,12 @@ static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    ret = bs->drv->bdrv_co_check(bs, res, fix);
+    if (fix) {
+        /* Repairs may change the allocation status */
+        bdrv_bsc_invalidate_all(bs);
+    }
+    return ret;
 }
 
 typedef struct CheckCo {
@@ -5827,6 +5842,7 @@ static int bdrv_inactivate_recurse(BlockDriverState *bs)
     }
 
     bs->open_flags |= BDRV_O_INACTIVE;
+    bdrv_bsc_invalidate_all(bs);
 
     /* Update permissions, they may differ for inactive nodes */
     bdrv_get_cumulative_perm(bs, &perm, &shared_perm);
@@ -6484,6 +6500,8 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                        BlockDriverAmendStatusCB *status_cb, void *cb_opaque,
                        Error **errp)
 {
+    int ret;
+
     if (!bs->drv) {
         error_setg(errp, "Node is ejected");
         return -ENOMEDIUM;
@@ -6493,7 +6511,9 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                    bs->drv->format_name);
         return -ENOTSUP;
     }
-    return bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque, errp);
+    ret = bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque, errp);
+    bdrv_bsc_invalidate_all(bs);
+    return ret;
 }
 
 /*
@@ -6905,6 +6925,7 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     }
 
     ret = drv->bdrv_make_empty(c->bs);
+    bdrv_bsc_invalidate_all(c->bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to empty %s",
                          c->bs->filename);
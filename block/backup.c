@@ -48,6 +48,10 @@ typedef struct BackupBlockJob {
     int64_t cluster_size;
 
     BlockCopyState *bcs;
+
+    /* Copy statistics of @bcs, saved when it is freed */
+    uint64_t offloaded_bytes;
+    uint64_t bounced_bytes;
 } BackupBlockJob;
 
 static const BlockJobDriver backup_job_driver;
@@ -126,6 +130,10 @@ static void backup_abort(Job *job)
 static void backup_clean(Job *job)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
+
+    /* Dropping the filter frees s->bcs */
+    block_copy_get_stats(s->bcs, &s->offloaded_bytes, &s->bounced_bytes);
+    s->bcs = NULL;
     bdrv_backup_top_drop(s->backup_top);
 }
 
@@ -279,6 +287,20 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
     return ret;
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    if (s->bcs) {
+        block_copy_get_stats(s->bcs, &s->offloaded_bytes, &s->bounced_bytes);
+    }
+
+    info->has_offloaded_bytes = true;
+    info->offloaded_bytes = s->offloaded_bytes;
+    info->has_bounced_bytes = true;
+    info->bounced_bytes = s->bounced_bytes;
+}
+
 static const BlockJobDriver backup_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(BackupBlockJob),
@@ -289,7 +311,8 @@ static const BlockJobDriver backup_job_driver = {
         .commit                 = backup_commit,
         .abort                  = backup_abort,
         .clean                  = backup_clean,
-    }
+    },
+    .query                  = backup_query,
 };
 
 static int64_t backup_calculate_cluster_size(BlockDriverState *target,
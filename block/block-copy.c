@@ -26,6 +26,12 @@
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
+/*
+ * Number of consecutive failed copy offload requests after which we stop
+ * trying.  Errors that say the configuration can't offload at all disable it
+ * immediately.
+ */
+#define BLOCK_COPY_MAX_COPY_RANGE_FAILURES 8
 
 static coroutine_fn int block_copy_task_entry(AioTask *task);
 
@@ -63,6 +69,7 @@ typedef struct BlockCopyState {
     int64_t in_flight_bytes;
     int64_t cluster_size;
     bool use_copy_range;
+    int copy_range_failures;
     int64_t copy_size;
     uint64_t len;
     QLIST_HEAD(, BlockCopyTask) tasks;
@@ -91,6 +98,10 @@ typedef struct BlockCopyState {
     void *progress_opaque;
 
     SharedResource *mem;
+
+    /* Bytes copied through copy_range offload and through bounce buffers */
+    uint64_t offloaded_bytes;
+    uint64_t bounced_bytes;
 } BlockCopyState;
 
 static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
@@ -353,10 +364,23 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
                                  0, s->write_flags);
         if (ret < 0) {
             trace_block_copy_copy_range_fail(s, offset, ret);
-            s->use_copy_range = false;
-            s->copy_size = MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
+            /*
+             * A single failing chunk (e.g. one that can't be cloned because
+             * of its alignment, or that extends beyond the end of the source
+             * file) doesn't mean that offloading won't work for the rest of
+             * the image.  Only give up if the configuration doesn't support
+             * it at all or if it keeps failing.
+             */
+            if (ret == -ENOTSUP ||
+                ++s->copy_range_failures >= BLOCK_COPY_MAX_COPY_RANGE_FAILURES)
+            {
+                s->use_copy_range = false;
+                s->copy_size = MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
+            }
             /* Fallback to read+write with allocated buffer */
         } else {
+            s->copy_range_failures = 0;
+            s->offloaded_bytes += nbytes;
             if (s->use_copy_range) {
                 /*
                  * Successful copy-range. Now increase copy_size.  copy_range
@@ -402,6 +426,7 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
         *error_is_read = false;
         goto out;
     }
+    s->bounced_bytes += nbytes;
 
 out:
     qemu_vfree(bounce_buffer);
@@ -679,3 +704,10 @@ void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
 {
     s->skip_unallocated = skip;
 }
+
+void block_copy_get_stats(BlockCopyState *s, uint64_t *offloaded_bytes,
+                          uint64_t *bounced_bytes)
+{
+    *offloaded_bytes = s->offloaded_bytes;
+    *bounced_bytes = s->bounced_bytes;
+}
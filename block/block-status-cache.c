@@ -0,0 +1,267 @@
+/*
+ * Block status cache
+ *
+ * Mapping queries over deep backing chains ask every layer of the chain for
+ * its allocation status, and tools like qemu-img convert, mirror or the NBD
+ * server keep asking about the same ranges.  For format nodes the answer
+ * only depends on the image metadata, which only changes when the node is
+ * written to, so the results of .bdrv_co_block_status() can be kept in a
+ * per-node extent tree until a write, discard or truncation touches them.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+
+/* Upper bound for the number of extents cached for a single node */
+#define BDRV_BSC_MAX_EXTENTS 16384
+
+typedef struct BdrvBlockStatusExtent {
+    int64_t offset;
+    int64_t bytes;
+
+    /* Whether the driver was queried with want_zero=true */
+    bool want_zero;
+    /* BDRV_BLOCK_* flags as returned by the driver (without EOF) */
+    int status;
+    /* Host offset of @offset, if BDRV_BLOCK_OFFSET_VALID is set */
+    int64_t map;
+    BlockDriverState *file;
+} BdrvBlockStatusExtent;
+
+/* Extents compare equal if they overlap */
+static gint bsc_extent_compare(gconstpointer a, gconstpointer b,
+                               gpointer opaque)
+{
+    const BdrvBlockStatusExtent *e1 = a, *e2 = b;
+
+    if (e1->offset >= e2->offset + e2->bytes) {
+        return 1;
+    }
+    if (e1->offset + e1->bytes <= e2->offset) {
+        return -1;
+    }
+    return 0;
+}
+
+static GTree *bsc_new_tree(void)
+{
+    /* Keys and values are the same objects, so only free the values */
+    return g_tree_new_full(bsc_extent_compare, NULL, NULL, g_free);
+}
+
+/* Called with bsc->lock held */
+static void bsc_remove_range(BdrvBlockStatusCache *bsc,
+                             int64_t offset, int64_t bytes)
+{
+    BdrvBlockStatusExtent key = { .offset = offset, .bytes = bytes };
+    BdrvBlockStatusExtent *e;
+
+    while ((e = g_tree_lookup(bsc->extents, &key))) {
+        g_tree_remove(bsc->extents, e);
+        bsc->nb_extents--;
+    }
+}
+
+/* Called with bsc->lock held */
+static void bsc_clear(BdrvBlockStatusCache *bsc)
+{
+    if (bsc->nb_extents) {
+        g_tree_destroy(bsc->extents);
+        bsc->extents = bsc_new_tree();
+        bsc->nb_extents = 0;
+    }
+}
+
+void bdrv_bsc_init(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+
+    qemu_mutex_init(&bsc->lock);
+    bsc->extents = bsc_new_tree();
+}
+
+void bdrv_bsc_destroy(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+
+    g_tree_destroy(bsc->extents);
+    bsc->extents = NULL;
+    qemu_mutex_destroy(&bsc->lock);
+}
+
+/*
+ * Only format drivers that can be part of a backing chain are cached: their
+ * allocation status is fully described by metadata that is only modified
+ * through the node itself.  Protocol drivers may see changes made behind our
+ * back, and filters just forward the query to their child.  Inactive nodes
+ * may be modified by another process (e.g. the migration destination).
+ */
+bool bdrv_bsc_is_enabled(BlockDriverState *bs)
+{
+    return bs->drv && bs->drv->supports_backing && !bs->drv->is_filter &&
+           !(bs->open_flags & BDRV_O_INACTIVE);
+}
+
+/*
+ * Returns the current generation of the cache, which must be passed to
+ * bdrv_bsc_fill() for the result of a driver query started afterwards.
+ */
+uint64_t bdrv_bsc_generation(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    uint64_t gen;
+
+    qemu_mutex_lock(&bsc->lock);
+    gen = bsc->gen;
+    qemu_mutex_unlock(&bsc->lock);
+
+    return gen;
+}
+
+/*
+ * Looks up the status of @offset in the cache.  On a hit, the results are
+ * returned like .bdrv_co_block_status() would (with *pnum limited to
+ * @bytes) and true is returned.
+ */
+bool bdrv_bsc_lookup(BlockDriverState *bs, bool want_zero,
+                     int64_t offset, int64_t bytes, int *status,
+                     int64_t *pnum, int64_t *map, BlockDriverState **file)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    BdrvBlockStatusExtent key = { .offset = offset, .bytes = 1 };
+    BdrvBlockStatusExtent *e;
+    bool hit = false;
+
+    qemu_mutex_lock(&bsc->lock);
+    e = g_tree_lookup(bsc->extents, &key);
+
+    /* A result obtained with want_zero=true is good for everyone */
+    if (e && (e->want_zero || !want_zero)) {
+        *status = e->status;
+        *pnum = MIN(e->offset + e->bytes - offset, bytes);
+        *map = 0;
+        if (e->status & BDRV_BLOCK_OFFSET_VALID) {
+            *map = e->map + (offset - e->offset);
+        }
+        *file = e->file;
+        bsc->hits++;
+        hit = true;
+    } else {
+        bsc->misses++;
+    }
+    qemu_mutex_unlock(&bsc->lock);
+
+    return hit;
+}
+
+/*
+ * Stores the result of a .bdrv_co_block_status() call for [@offset,
+ * @offset + @bytes).  If the cache was invalidated since @gen was retrieved
+ * with bdrv_bsc_generation(), the result may be stale and is dropped.
+ */
+void bdrv_bsc_fill(BlockDriverState *bs, uint64_t gen, bool want_zero,
+                   int64_t offset, int64_t bytes, int status,
+                   int64_t map, BlockDriverState *file)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    BdrvBlockStatusExtent *e;
+
+    assert(!(status & BDRV_BLOCK_RAW));
+    status &= ~BDRV_BLOCK_EOF;
+    if (!(status & BDRV_BLOCK_OFFSET_VALID)) {
+        map = 0;
+    }
+
+    qemu_mutex_lock(&bsc->lock);
+    if (bsc->gen != gen || bytes <= 0) {
+        goto out;
+    }
+
+    /* Replace older results, e.g. ones obtained with want_zero=false */
+    bsc_remove_range(bsc, offset, bytes);
+
+    /* Merge with the preceding extent if it describes the same mapping */
+    if (offset > 0) {
+        BdrvBlockStatusExtent key = { .offset = offset - 1, .bytes = 1 };
+
+        e = g_tree_lookup(bsc->extents, &key);
+        if (e && e->offset + e->bytes == offset &&
+            e->want_zero == want_zero && e->status == status &&
+            e->file == file &&
+            (!(status & BDRV_BLOCK_OFFSET_VALID) || e->map + e->bytes == map))
+        {
+            /* Growing the extent into the free range keeps the tree sorted */
+            e->bytes += bytes;
+            goto out;
+        }
+    }
+
+    if (bsc->nb_extents >= BDRV_BSC_MAX_EXTENTS) {
+        bsc_clear(bsc);
+    }
+
+    e = g_new(BdrvBlockStatusExtent, 1);
+    *e = (BdrvBlockStatusExtent) {
+        .offset     = offset,
+        .bytes      = bytes,
+        .want_zero  = want_zero,
+        .status     = status,
+        .map        = map,
+        .file       = file,
+    };
+    g_tree_insert(bsc->extents, e, e);
+    bsc->nb_extents++;
+
+out:
+    qemu_mutex_unlock(&bsc->lock);
+}
+
+/* Drops everything cached for [@offset, @offset + @bytes) */
+void bdrv_bsc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+
+    qemu_mutex_lock(&bsc->lock);
+    bsc->gen++;
+    if (bsc->nb_extents && bytes > 0) {
+        bsc->invalidations++;
+        bsc_remove_range(bsc, offset, bytes);
+    }
+    qemu_mutex_unlock(&bsc->lock);
+}
+
+/*
+ * Drops the whole cache, for changes to a node that are not described by a
+ * guest-visible range (truncation, snapshot switching, graph changes, ...)
+ */
+void bdrv_bsc_invalidate_all(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+
+    qemu_mutex_lock(&bsc->lock);
+    bsc->gen++;
+    if (bsc->nb_extents) {
+        bsc->invalidations++;
+        bsc_clear(bsc);
+    }
+    qemu_mutex_unlock(&bsc->lock);
+}
+
+BlockStatusCacheStats *bdrv_bsc_get_stats(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    BlockStatusCacheStats *stats = g_new0(BlockStatusCacheStats, 1);
+
+    qemu_mutex_lock(&bsc->lock);
+    stats->hits = bsc->hits;
+    stats->misses = bsc->misses;
+    stats->invalidations = bsc->invalidations;
+    stats->extents = bsc->nb_extents;
+    qemu_mutex_unlock(&bsc->lock);
+
+    return stats;
+}
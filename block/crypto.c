@@ -31,12 +31,25 @@
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/cutils.h"
+#include "block/aio_task.h"
+#include "block/thread-pool.h"
 #include "crypto.h"
 
+#define BLOCK_CRYPTO_DEFAULT_THREADS 4
+#define BLOCK_CRYPTO_MAX_THREADS 64
+
 typedef struct BlockCrypto BlockCrypto;
 
 struct BlockCrypto {
     QCryptoBlock *block;
+
+    /* Number of worker threads (and cipher instances) for data en/decryption */
+    int n_threads;
+
+    /* Protects nb_threads, thread_task_queue */
+    CoMutex lock;
+    int nb_threads;
+    CoQueue thread_task_queue;
 };
 
 
@@ -141,6 +154,12 @@ static QemuOptsList block_crypto_runtime_opts_luks = {
     .head = QTAILQ_HEAD_INITIALIZER(block_crypto_runtime_opts_luks.head),
     .desc = {
         BLOCK_CRYPTO_OPT_DEF_LUKS_KEY_SECRET(""),
+        {
+            .name = BLOCK_CRYPTO_OPT_LUKS_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of threads used for encryption and "
+                    "decryption",
+        },
         { /* end of list */ }
     },
 };
@@ -217,6 +236,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     QCryptoBlockOpenOptions *open_opts = NULL;
     unsigned int cflags = 0;
     QDict *cryptoopts = NULL;
+    uint64_t n_threads;
 
     bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
                                BDRV_CHILD_IMAGE, false, errp);
@@ -234,8 +254,21 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
         goto cleanup;
     }
 
+    n_threads = qemu_opt_get_number(opts, BLOCK_CRYPTO_OPT_LUKS_THREADS,
+                                    BLOCK_CRYPTO_DEFAULT_THREADS);
+    if (n_threads < 1 || n_threads > BLOCK_CRYPTO_MAX_THREADS) {
+        error_setg(errp, "'" BLOCK_CRYPTO_OPT_LUKS_THREADS "' must be "
+                   "between 1 and %d", BLOCK_CRYPTO_MAX_THREADS);
+        goto cleanup;
+    }
+    crypto->n_threads = n_threads;
+    qemu_co_mutex_init(&crypto->lock);
+    qemu_co_queue_init(&crypto->thread_task_queue);
+
     cryptoopts = qemu_opts_to_qdict(opts, NULL);
     qdict_put_str(cryptoopts, "format", QCryptoBlockFormat_str(format));
+    /* Not an option of the crypto layer, but of the block driver */
+    qdict_del(cryptoopts, BLOCK_CRYPTO_OPT_LUKS_THREADS);
 
     open_opts = block_crypto_open_opts_init(cryptoopts, errp);
     if (!open_opts) {
@@ -249,7 +282,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
-                                       1,
+                                       crypto->n_threads,
                                        errp);
 
     if (!crypto->block) {
@@ -351,6 +384,130 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
+/*
+ * Bounce buffers are en/decrypted in chunks of this size, which are
+ * processed in parallel by the thread pool
+ */
+#define BLOCK_CRYPTO_TASK_SIZE (64 * 1024)
+
+/*
+ * BlockCryptoEncDecFunc: common prototype of qcrypto_block_encrypt() and
+ * qcrypto_block_decrypt() functions.
+ */
+typedef int (*BlockCryptoEncDecFunc)(QCryptoBlock *block, uint64_t offset,
+                                     uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoEncDecData {
+    QCryptoBlock *block;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+
+    BlockCryptoEncDecFunc func;
+} BlockCryptoEncDecData;
+
+typedef struct BlockCryptoAioTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    BlockCryptoEncDecData data;
+} BlockCryptoAioTask;
+
+static int block_crypto_encdec_pool_func(void *opaque)
+{
+    BlockCryptoEncDecData *data = opaque;
+
+    return data->func(data->block, data->offset, data->buf, data->len, NULL);
+}
+
+static int coroutine_fn
+block_crypto_co_process(BlockDriverState *bs, BlockCryptoEncDecData *data)
+{
+    BlockCrypto *crypto = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    int ret;
+
+    /* Each thread needs one of the n_threads cipher instances */
+    qemu_co_mutex_lock(&crypto->lock);
+    while (crypto->nb_threads >= crypto->n_threads) {
+        qemu_co_queue_wait(&crypto->thread_task_queue, &crypto->lock);
+    }
+    crypto->nb_threads++;
+    qemu_co_mutex_unlock(&crypto->lock);
+
+    ret = thread_pool_submit_co(pool, block_crypto_encdec_pool_func, data);
+
+    qemu_co_mutex_lock(&crypto->lock);
+    crypto->nb_threads--;
+    qemu_co_queue_next(&crypto->thread_task_queue);
+    qemu_co_mutex_unlock(&crypto->lock);
+
+    return ret;
+}
+
+static coroutine_fn int block_crypto_co_encdec_task_entry(AioTask *task)
+{
+    BlockCryptoAioTask *t = container_of(task, BlockCryptoAioTask, task);
+
+    return block_crypto_co_process(t->bs, &t->data);
+}
+
+/*
+ * Encrypts or decrypts @buf in place, splitting it into chunks that are
+ * processed by up to n_threads worker threads in parallel.
+ */
+static int coroutine_fn
+block_crypto_co_encdec(BlockDriverState *bs, uint64_t offset,
+                       uint8_t *buf, size_t len, BlockCryptoEncDecFunc func)
+{
+    BlockCrypto *crypto = bs->opaque;
+    AioTaskPool *aio = NULL;
+    int ret = 0;
+
+    if (crypto->n_threads > 1 && len > BLOCK_CRYPTO_TASK_SIZE) {
+        aio = aio_task_pool_new(crypto->n_threads);
+    }
+
+    while (len > 0 && (!aio || aio_task_pool_status(aio) == 0)) {
+        size_t cur_len = MIN(len, BLOCK_CRYPTO_TASK_SIZE);
+        BlockCryptoEncDecData data = {
+            .block = crypto->block,
+            .offset = offset,
+            .buf = buf,
+            .len = cur_len,
+            .func = func,
+        };
+
+        if (aio) {
+            BlockCryptoAioTask *task = g_new(BlockCryptoAioTask, 1);
+
+            *task = (BlockCryptoAioTask) {
+                .task.func = block_crypto_co_encdec_task_entry,
+                .bs = bs,
+                .data = data,
+            };
+            aio_task_pool_start_task(aio, &task->task);
+        } else {
+            ret = block_crypto_co_process(bs, &data);
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        offset += cur_len;
+        buf += cur_len;
+        len -= cur_len;
+    }
+
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        ret = aio_task_pool_status(aio);
+        aio_task_pool_free(aio);
+    }
+
+    return ret;
+}
+
 static coroutine_fn int
 block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                        QEMUIOVector *qiov, int flags)
@@ -394,8 +551,8 @@ block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
+        if (block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                   cur_bytes, qcrypto_block_decrypt) < 0) {
             ret = -EIO;
             goto cleanup;
         }
@@ -450,8 +607,8 @@ block_crypto_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
 
         qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
+        if (block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                   cur_bytes, qcrypto_block_encrypt) < 0) {
             ret = -EIO;
             goto cleanup;
         }
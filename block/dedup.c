@@ -0,0 +1,862 @@
+/*
+ * Block driver for deduplicating, compressed backup images
+ *
+ * An image consists of a small index file and a content-addressed chunk
+ * store.  The index maps every chunk of the virtual disk to the SHA-256
+ * digest of its content; the data itself lives in the store directory, one
+ * zlib-compressed file per distinct chunk, named after its digest.  Any
+ * number of images can share a store, so a chunk that is already present
+ * (e.g. because another VM based on the same template was backed up into
+ * the same store) is neither compressed nor written again.
+ *
+ * Index file layout:
+ *
+ *   0                 DedupHeader, followed by the store path
+ *   index_offset      one DEDUP_DIGEST_LEN byte digest per chunk; a digest
+ *                     of all zeroes marks a chunk that reads as zeroes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/qobject-input-visitor.h"
+#include "qapi/qapi-visit-block-core.h"
+#include "block/aio_task.h"
+#include "block/block_int.h"
+#include "block/qdict.h"
+#include "block/thread-pool.h"
+#include "crypto/hash.h"
+#include "sysemu/block-backend.h"
+#include "migration/blocker.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "trace.h"
+
+#define DEDUP_MAGIC "QEMUDDUP"
+#define DEDUP_VERSION 1
+
+#define DEDUP_HEADER_SIZE 4096
+#define DEDUP_DIGEST_LEN 32
+#define DEDUP_HASH_ALG QCRYPTO_HASH_ALG_SHA256
+
+#define DEDUP_DEFAULT_CHUNK_SIZE (64 * KiB)
+#define DEDUP_MIN_CHUNK_SIZE (4 * KiB)
+#define DEDUP_MAX_CHUNK_SIZE (4 * MiB)
+
+/* Number of chunks of a single request that are processed in parallel */
+#define DEDUP_MAX_WORKERS 8
+
+#define DEDUP_OPT_STORE "store"
+
+typedef struct QEMU_PACKED DedupHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t disk_size;
+    uint64_t index_offset;
+    /* Length of the store path following the header (without NUL) */
+    uint32_t store_len;
+    uint32_t reserved;
+} DedupHeader;
+
+QEMU_BUILD_BUG_ON(sizeof(DedupHeader) >= DEDUP_HEADER_SIZE);
+
+typedef struct BDRVDedupState {
+    uint32_t chunk_size;
+    uint64_t disk_size;
+    uint64_t index_offset;
+    char *store;
+
+    /* Statistics for the chunks written through this node */
+    uint64_t nb_chunks_new;
+    uint64_t nb_chunks_dup;
+
+    Error *migration_blocker;
+} BDRVDedupState;
+
+static const uint8_t dedup_zero_digest[DEDUP_DIGEST_LEN];
+
+static QemuOptsList dedup_runtime_opts = {
+    .name = "dedup",
+    .head = QTAILQ_HEAD_INITIALIZER(dedup_runtime_opts.head),
+    .desc = {
+        {
+            .name = DEDUP_OPT_STORE,
+            .type = QEMU_OPT_STRING,
+            .help = "Chunk store directory (overrides the one recorded in "
+                    "the image)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList dedup_create_opts;
+
+static int dedup_probe(const uint8_t *buf, int buf_size, const char *filename)
+{
+    if (buf_size >= sizeof(DedupHeader) &&
+        !memcmp(buf, DEDUP_MAGIC, strlen(DEDUP_MAGIC)))
+    {
+        return 100;
+    }
+    return 0;
+}
+
+static char *dedup_chunk_path(const char *store, const uint8_t *digest)
+{
+    char hex[DEDUP_DIGEST_LEN * 2 + 1];
+    int i;
+
+    for (i = 0; i < DEDUP_DIGEST_LEN; i++) {
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+
+    /* Spread the chunks over 256 directories, like git objects */
+    return g_strdup_printf("%s/%.2s/%s", store, hex, hex + 2);
+}
+
+typedef struct DedupChunkData {
+    const char *store;
+    uint32_t chunk_size;
+
+    /* In: the chunk data, out: its digest (for stores) */
+    uint8_t *buf;
+    uint8_t digest[DEDUP_DIGEST_LEN];
+
+    /* Out: whether the chunk was already present in the store */
+    bool duplicate;
+} DedupChunkData;
+
+static int dedup_write_file(const char *path, const void *buf, size_t len)
+{
+    g_autofree char *tmp = g_strdup_printf("%s.XXXXXX", path);
+    int fd;
+    int ret = 0;
+
+    fd = mkstemp(tmp);
+    if (fd < 0 && errno == ENOENT) {
+        g_autofree char *dir = g_path_get_dirname(path);
+
+        if (g_mkdir_with_parents(dir, 0755) < 0) {
+            return -errno;
+        }
+        fd = mkstemp(tmp);
+    }
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (qemu_write_full(fd, buf, len) != len || qemu_fdatasync(fd) < 0) {
+        ret = -errno;
+    }
+    close(fd);
+
+    /* Chunks are immutable, so a concurrent writer may win the race */
+    if (ret == 0 && rename(tmp, path) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        unlink(tmp);
+    }
+    return ret;
+}
+
+/* Runs in a worker thread: hash a chunk and add it to the store if needed */
+static int dedup_store_chunk_func(void *opaque)
+{
+    DedupChunkData *d = opaque;
+    g_autofree char *path = NULL;
+    g_autofree uint8_t *zbuf = NULL;
+    uint8_t *result = NULL;
+    size_t result_len = 0;
+    uLongf zlen;
+    const void *data;
+    size_t data_len;
+
+    if (buffer_is_zero(d->buf, d->chunk_size)) {
+        memset(d->digest, 0, DEDUP_DIGEST_LEN);
+        d->duplicate = true;
+        return 0;
+    }
+
+    if (qcrypto_hash_bytes(DEDUP_HASH_ALG, (const char *)d->buf,
+                           d->chunk_size, &result, &result_len, NULL) < 0) {
+        return -EIO;
+    }
+    assert(result_len == DEDUP_DIGEST_LEN);
+    memcpy(d->digest, result, DEDUP_DIGEST_LEN);
+    g_free(result);
+
+    path = dedup_chunk_path(d->store, d->digest);
+    if (access(path, F_OK) == 0) {
+        d->duplicate = true;
+        return 0;
+    }
+    d->duplicate = false;
+
+    /*
+     * Incompressible chunks are stored as they are, which is recognised by
+     * the file having the size of a full chunk.
+     */
+    zlen = d->chunk_size - 1;
+    zbuf = g_malloc(zlen);
+    if (compress2(zbuf, &zlen, d->buf, d->chunk_size,
+                  Z_DEFAULT_COMPRESSION) == Z_OK) {
+        data = zbuf;
+        data_len = zlen;
+    } else {
+        data = d->buf;
+        data_len = d->chunk_size;
+    }
+
+    return dedup_write_file(path, data, data_len);
+}
+
+/* Runs in a worker thread: read a chunk from the store into d->buf */
+static int dedup_load_chunk_func(void *opaque)
+{
+    DedupChunkData *d = opaque;
+    g_autofree char *path = dedup_chunk_path(d->store, d->digest);
+    g_autofree uint8_t *zbuf = NULL;
+    uLongf len = d->chunk_size;
+    struct stat st;
+    int fd;
+    int ret = 0;
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        goto out;
+    }
+    if (st.st_size > d->chunk_size) {
+        ret = -EIO;
+        goto out;
+    }
+
+    if (st.st_size == d->chunk_size) {
+        if (read(fd, d->buf, d->chunk_size) != d->chunk_size) {
+            ret = -EIO;
+        }
+        goto out;
+    }
+
+    zbuf = g_malloc(st.st_size);
+    if (read(fd, zbuf, st.st_size) != st.st_size ||
+        uncompress(d->buf, &len, zbuf, st.st_size) != Z_OK ||
+        len != d->chunk_size)
+    {
+        ret = -EIO;
+    }
+
+out:
+    qemu_close(fd);
+    return ret;
+}
+
+static int coroutine_fn dedup_co_process(BlockDriverState *bs,
+                                         ThreadPoolFunc *func, void *arg)
+{
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+
+    return thread_pool_submit_co(pool, func, arg);
+}
+
+static int dedup_read_index(BlockDriverState *bs, uint64_t first_chunk,
+                            uint64_t nb_chunks, uint8_t *digests)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    return bdrv_pread(bs->file, s->index_offset +
+                      first_chunk * DEDUP_DIGEST_LEN,
+                      digests, nb_chunks * DEDUP_DIGEST_LEN);
+}
+
+static int dedup_write_index(BlockDriverState *bs, uint64_t first_chunk,
+                             uint64_t nb_chunks, const uint8_t *digests)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    return bdrv_pwrite(bs->file, s->index_offset +
+                       first_chunk * DEDUP_DIGEST_LEN,
+                       digests, nb_chunks * DEDUP_DIGEST_LEN);
+}
+
+static int dedup_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupHeader header;
+    QemuOpts *opts = NULL;
+    g_autofree char *store = NULL;
+    const char *store_opt;
+    Error *local_err = NULL;
+    int ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_IMAGE, false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&dedup_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read dedup header");
+        goto fail;
+    }
+
+    if (memcmp(header.magic, DEDUP_MAGIC, strlen(DEDUP_MAGIC))) {
+        error_setg(errp, "Image not in dedup format");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    header.version = le32_to_cpu(header.version);
+    header.chunk_size = le32_to_cpu(header.chunk_size);
+    header.disk_size = le64_to_cpu(header.disk_size);
+    header.index_offset = le64_to_cpu(header.index_offset);
+    header.store_len = le32_to_cpu(header.store_len);
+
+    if (header.version != DEDUP_VERSION) {
+        error_setg(errp, "Unsupported dedup version %" PRIu32,
+                   header.version);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+    if (header.chunk_size < DEDUP_MIN_CHUNK_SIZE ||
+        header.chunk_size > DEDUP_MAX_CHUNK_SIZE ||
+        !is_power_of_2(header.chunk_size))
+    {
+        error_setg(errp, "Unsupported dedup chunk size %" PRIu32,
+                   header.chunk_size);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+    if (header.index_offset < DEDUP_HEADER_SIZE ||
+        header.store_len >= DEDUP_HEADER_SIZE - sizeof(header) ||
+        header.disk_size > INT64_MAX - header.chunk_size ||
+        DIV_ROUND_UP(header.disk_size, header.chunk_size) >
+        (INT64_MAX - header.index_offset) / DEDUP_DIGEST_LEN)
+    {
+        error_setg(errp, "Corrupted dedup header");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (!qcrypto_hash_supports(DEDUP_HASH_ALG)) {
+        error_setg(errp, "SHA-256 is not supported by this build");
+        ret = -ENOTSUP;
+        goto fail;
+    }
+
+    store_opt = qemu_opt_get(opts, DEDUP_OPT_STORE);
+    if (store_opt) {
+        store = g_strdup(store_opt);
+    } else {
+        store = g_malloc0(header.store_len + 1);
+        ret = bdrv_pread(bs->file, sizeof(header), store, header.store_len);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read store path");
+            goto fail;
+        }
+    }
+    if (!*store) {
+        error_setg(errp, "No chunk store given for dedup image");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Relative store paths are relative to the index file */
+    s->store = path_combine(bs->file->bs->filename, store);
+    s->chunk_size = header.chunk_size;
+    s->disk_size = header.disk_size;
+    s->index_offset = header.index_offset;
+    bs->total_sectors = DIV_ROUND_UP(s->disk_size, BDRV_SECTOR_SIZE);
+
+    error_setg(&s->migration_blocker, "The dedup format used by node '%s' "
+               "does not support live migration",
+               bdrv_get_device_or_node_name(bs));
+    ret = migrate_add_blocker(s->migration_blocker, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        error_free(s->migration_blocker);
+        goto fail;
+    }
+
+    qemu_opts_del(opts);
+    return 0;
+
+fail:
+    g_free(s->store);
+    s->store = NULL;
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void dedup_close(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    trace_dedup_close(bs, s->nb_chunks_new, s->nb_chunks_dup);
+
+    g_free(s->store);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+}
+
+static int dedup_reopen_prepare(BDRVReopenState *state,
+                                BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void dedup_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    /* Chunks are only ever read and written as a whole */
+    bs->bl.request_alignment = s->chunk_size;
+    bs->bl.pwrite_zeroes_alignment = s->chunk_size;
+}
+
+static int dedup_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    /* Makes backup jobs copy whole chunks */
+    bdi->cluster_size = s->chunk_size;
+    bdi->unallocated_blocks_are_zero = true;
+    return 0;
+}
+
+static int dedup_has_zero_init(BlockDriverState *bs)
+{
+    return 1;
+}
+
+static int coroutine_fn dedup_co_block_status(BlockDriverState *bs,
+                                              bool want_zero,
+                                              int64_t offset, int64_t bytes,
+                                              int64_t *pnum, int64_t *map,
+                                              BlockDriverState **file)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t chunk = offset / s->chunk_size;
+    uint64_t nb_chunks;
+    g_autofree uint8_t *digests = NULL;
+    bool zero;
+    uint64_t i;
+    int ret;
+
+    /* Don't read arbitrarily large parts of the index at once */
+    bytes = MIN(bytes, 1024 * (int64_t)s->chunk_size);
+    nb_chunks = DIV_ROUND_UP(offset + bytes, s->chunk_size) - chunk;
+
+    digests = g_malloc(nb_chunks * DEDUP_DIGEST_LEN);
+    ret = dedup_read_index(bs, chunk, nb_chunks, digests);
+    if (ret < 0) {
+        return ret;
+    }
+
+    zero = !memcmp(digests, dedup_zero_digest, DEDUP_DIGEST_LEN);
+    for (i = 1; i < nb_chunks; i++) {
+        if (zero != !memcmp(digests + i * DEDUP_DIGEST_LEN, dedup_zero_digest,
+                            DEDUP_DIGEST_LEN)) {
+            break;
+        }
+    }
+
+    *pnum = MIN((chunk + i) * s->chunk_size - offset, bytes);
+    return zero ? BDRV_BLOCK_ZERO : BDRV_BLOCK_DATA;
+}
+
+static int coroutine_fn dedup_co_preadv(BlockDriverState *bs,
+                                        uint64_t offset, uint64_t bytes,
+                                        QEMUIOVector *qiov, int flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t chunk = offset / s->chunk_size;
+    uint64_t nb_chunks = bytes / s->chunk_size;
+    g_autofree uint8_t *digests = NULL;
+    DedupChunkData d = {
+        .store      = s->store,
+        .chunk_size = s->chunk_size,
+    };
+    uint64_t i;
+    int ret;
+
+    assert(QEMU_IS_ALIGNED(offset | bytes, s->chunk_size));
+
+    digests = g_malloc(nb_chunks * DEDUP_DIGEST_LEN);
+    ret = dedup_read_index(bs, chunk, nb_chunks, digests);
+    if (ret < 0) {
+        return ret;
+    }
+
+    d.buf = qemu_blockalign(bs, s->chunk_size);
+    for (i = 0; i < nb_chunks; i++) {
+        size_t qiov_offset = i * s->chunk_size;
+
+        memcpy(d.digest, digests + i * DEDUP_DIGEST_LEN, DEDUP_DIGEST_LEN);
+        if (!memcmp(d.digest, dedup_zero_digest, DEDUP_DIGEST_LEN)) {
+            qemu_iovec_memset(qiov, qiov_offset, 0, s->chunk_size);
+            continue;
+        }
+
+        ret = dedup_co_process(bs, dedup_load_chunk_func, &d);
+        trace_dedup_load_chunk(bs, (chunk + i) * s->chunk_size, ret);
+        if (ret < 0) {
+            break;
+        }
+        qemu_iovec_from_buf(qiov, qiov_offset, d.buf, s->chunk_size);
+    }
+    qemu_vfree(d.buf);
+
+    return ret;
+}
+
+typedef struct DedupStoreTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t offset;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    /* Where to put the digest of the chunk */
+    uint8_t *digest;
+} DedupStoreTask;
+
+static coroutine_fn int dedup_store_task_entry(AioTask *task)
+{
+    DedupStoreTask *t = container_of(task, DedupStoreTask, task);
+    BDRVDedupState *s = t->bs->opaque;
+    DedupChunkData d = {
+        .store      = s->store,
+        .chunk_size = s->chunk_size,
+    };
+    int ret;
+
+    d.buf = qemu_blockalign(t->bs, s->chunk_size);
+    qemu_iovec_to_buf(t->qiov, t->qiov_offset, d.buf, s->chunk_size);
+
+    ret = dedup_co_process(t->bs, dedup_store_chunk_func, &d);
+    trace_dedup_store_chunk(t->bs, t->offset, d.duplicate, ret);
+    if (ret == 0) {
+        memcpy(t->digest, d.digest, DEDUP_DIGEST_LEN);
+        if (d.duplicate) {
+            s->nb_chunks_dup++;
+        } else {
+            s->nb_chunks_new++;
+        }
+    }
+
+    qemu_vfree(d.buf);
+    return ret;
+}
+
+static int coroutine_fn dedup_co_pwritev(BlockDriverState *bs,
+                                         uint64_t offset, uint64_t bytes,
+                                         QEMUIOVector *qiov, int flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t chunk = offset / s->chunk_size;
+    uint64_t nb_chunks = bytes / s->chunk_size;
+    g_autofree uint8_t *digests = NULL;
+    AioTaskPool *aio = NULL;
+    uint64_t i;
+    int ret = 0;
+
+    assert(QEMU_IS_ALIGNED(offset | bytes, s->chunk_size));
+
+    digests = g_malloc(nb_chunks * DEDUP_DIGEST_LEN);
+
+    /*
+     * Hashing and compression dominate the cost of a write, so chunks are
+     * processed in parallel.  The index is only updated once all chunks of
+     * the request are safely in the store.
+     */
+    for (i = 0; i < nb_chunks; i++) {
+        DedupStoreTask *t = g_new(DedupStoreTask, 1);
+
+        *t = (DedupStoreTask) {
+            .task.func      = dedup_store_task_entry,
+            .bs             = bs,
+            .offset         = offset + i * s->chunk_size,
+            .qiov           = qiov,
+            .qiov_offset    = i * s->chunk_size,
+            .digest         = digests + i * DEDUP_DIGEST_LEN,
+        };
+
+        if (nb_chunks == 1) {
+            ret = dedup_store_task_entry(&t->task);
+            g_free(t);
+            break;
+        }
+
+        if (!aio) {
+            aio = aio_task_pool_new(DEDUP_MAX_WORKERS);
+        }
+        aio_task_pool_start_task(aio, &t->task);
+        if (aio_task_pool_status(aio) < 0) {
+            break;
+        }
+    }
+
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        ret = aio_task_pool_status(aio);
+        g_free(aio);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    return dedup_write_index(bs, chunk, nb_chunks, digests);
+}
+
+static int coroutine_fn dedup_co_pwrite_zeroes(BlockDriverState *bs,
+                                               int64_t offset, int bytes,
+                                               BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t nb_chunks = bytes / s->chunk_size;
+    g_autofree uint8_t *digests = NULL;
+
+    if (!QEMU_IS_ALIGNED(offset | bytes, s->chunk_size)) {
+        return -ENOTSUP;
+    }
+
+    digests = g_malloc0(nb_chunks * DEDUP_DIGEST_LEN);
+    return dedup_write_index(bs, offset / s->chunk_size, nb_chunks, digests);
+}
+
+static int coroutine_fn dedup_co_create(BlockdevCreateOptions *create_options,
+                                        Error **errp)
+{
+    BlockdevCreateOptionsDedup *dedup_opts;
+    BlockDriverState *bs_file = NULL;
+    BlockBackend *blk = NULL;
+    uint64_t chunk_size;
+    uint64_t nb_chunks;
+    size_t store_len;
+    g_autofree uint8_t *buf = NULL;
+    DedupHeader *header;
+    int ret;
+
+    assert(create_options->driver == BLOCKDEV_DRIVER_DEDUP);
+    dedup_opts = &create_options->u.dedup;
+
+    chunk_size = dedup_opts->has_chunk_size ? dedup_opts->chunk_size
+                                            : DEDUP_DEFAULT_CHUNK_SIZE;
+    if (chunk_size < DEDUP_MIN_CHUNK_SIZE ||
+        chunk_size > DEDUP_MAX_CHUNK_SIZE || !is_power_of_2(chunk_size))
+    {
+        error_setg(errp, "Chunk size must be a power of two between %d and "
+                   "%d", DEDUP_MIN_CHUNK_SIZE, DEDUP_MAX_CHUNK_SIZE);
+        return -EINVAL;
+    }
+    if (dedup_opts->size > INT64_MAX - chunk_size) {
+        error_setg(errp, "Image size is too large");
+        return -EINVAL;
+    }
+    nb_chunks = DIV_ROUND_UP(dedup_opts->size, chunk_size);
+
+    store_len = strlen(dedup_opts->store);
+    if (!store_len || store_len >= DEDUP_HEADER_SIZE - sizeof(*header)) {
+        error_setg(errp, "Invalid chunk store path");
+        return -EINVAL;
+    }
+
+    bs_file = bdrv_open_blockdev_ref(dedup_opts->file, errp);
+    if (!bs_file) {
+        return -EIO;
+    }
+
+    blk = blk_new_with_bs(bs_file, BLK_PERM_WRITE | BLK_PERM_RESIZE,
+                          BLK_PERM_ALL, errp);
+    if (!blk) {
+        ret = -EPERM;
+        goto out;
+    }
+    blk_set_allow_write_beyond_eof(blk, true);
+
+    buf = g_malloc0(DEDUP_HEADER_SIZE);
+    header = (DedupHeader *)buf;
+    memcpy(header->magic, DEDUP_MAGIC, sizeof(header->magic));
+    header->version = cpu_to_le32(DEDUP_VERSION);
+    header->chunk_size = cpu_to_le32(chunk_size);
+    header->disk_size = cpu_to_le64(dedup_opts->size);
+    header->index_offset = cpu_to_le64(DEDUP_HEADER_SIZE);
+    header->store_len = cpu_to_le32(store_len);
+    memcpy(buf + sizeof(*header), dedup_opts->store, store_len);
+
+    ret = blk_pwrite(blk, 0, buf, DEDUP_HEADER_SIZE, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write dedup header");
+        goto out;
+    }
+
+    /* An index of zeroes describes an image that reads as zeroes */
+    ret = blk_truncate(blk, DEDUP_HEADER_SIZE + nb_chunks * DEDUP_DIGEST_LEN,
+                       false, PREALLOC_MODE_OFF, 0, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = 0;
+out:
+    blk_unref(blk);
+    bdrv_unref(bs_file);
+    return ret;
+}
+
+static int coroutine_fn dedup_co_create_opts(BlockDriver *drv,
+                                             const char *filename,
+                                             QemuOpts *opts,
+                                             Error **errp)
+{
+    BlockdevCreateOptions *create_options = NULL;
+    QDict *qdict;
+    Visitor *v;
+    BlockDriverState *bs = NULL;
+    Error *local_err = NULL;
+    int ret;
+
+    static const QDictRenames opt_renames[] = {
+        { BLOCK_OPT_CLUSTER_SIZE,       "chunk-size" },
+        { NULL, NULL },
+    };
+
+    qdict = qemu_opts_to_qdict_filtered(opts, NULL, &dedup_create_opts, true);
+
+    if (!qdict_rename_keys(qdict, opt_renames, errp)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Create and open the file (protocol layer) */
+    ret = bdrv_create_file(filename, opts, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    bs = bdrv_open(filename, NULL, NULL,
+                   BDRV_O_RDWR | BDRV_O_RESIZE | BDRV_O_PROTOCOL, errp);
+    if (bs == NULL) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    /* Now get the QAPI type BlockdevCreateOptions */
+    qdict_put_str(qdict, "driver", "dedup");
+    qdict_put_str(qdict, "file", bs->node_name);
+
+    v = qobject_input_visitor_new_flat_confused(qdict, errp);
+    if (!v) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    visit_type_BlockdevCreateOptions(v, NULL, &create_options, &local_err);
+    visit_free(v);
+
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Silently round up size */
+    assert(create_options->driver == BLOCKDEV_DRIVER_DEDUP);
+    create_options->u.dedup.size = ROUND_UP(create_options->u.dedup.size,
+                                            BDRV_SECTOR_SIZE);
+
+    /* Create the dedup image (format layer) */
+    ret = dedup_co_create(create_options, errp);
+
+fail:
+    qobject_unref(qdict);
+    bdrv_unref(bs);
+    qapi_free_BlockdevCreateOptions(create_options);
+    return ret;
+}
+
+static QemuOptsList dedup_create_opts = {
+    .name = "dedup-create-opts",
+    .head = QTAILQ_HEAD_INITIALIZER(dedup_create_opts.head),
+    .desc = {
+        {
+            .name = BLOCK_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Virtual disk size"
+        },
+        {
+            .name = DEDUP_OPT_STORE,
+            .type = QEMU_OPT_STRING,
+            .help = "Chunk store directory (relative paths are relative to "
+                    "the image)"
+        },
+        {
+            .name = BLOCK_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Chunk size",
+            .def_value_str = stringify(DEDUP_DEFAULT_CHUNK_SIZE)
+        },
+        { /* end of list */ }
+    }
+};
+
+static const char *const dedup_strong_runtime_opts[] = {
+    DEDUP_OPT_STORE,
+
+    NULL
+};
+
+static BlockDriver bdrv_dedup = {
+    .format_name            = "dedup",
+    .instance_size          = sizeof(BDRVDedupState),
+
+    .bdrv_probe             = dedup_probe,
+    .bdrv_open              = dedup_open,
+    .bdrv_close             = dedup_close,
+    .bdrv_reopen_prepare    = dedup_reopen_prepare,
+    .bdrv_child_perm        = bdrv_default_perms,
+    .bdrv_co_create         = dedup_co_create,
+    .bdrv_co_create_opts    = dedup_co_create_opts,
+    .bdrv_refresh_limits    = dedup_refresh_limits,
+    .bdrv_has_zero_init     = dedup_has_zero_init,
+    .bdrv_co_block_status   = dedup_co_block_status,
+    .bdrv_get_info          = dedup_get_info,
+
+    .bdrv_co_preadv         = dedup_co_preadv,
+    .bdrv_co_pwritev        = dedup_co_pwritev,
+    .bdrv_co_pwrite_zeroes  = dedup_co_pwrite_zeroes,
+
+    .is_format              = true,
+    .create_opts            = &dedup_create_opts,
+    .strong_runtime_opts    = dedup_strong_runtime_opts,
+};
+
+static void bdrv_dedup_init(void)
+{
+    bdrv_register(&bdrv_dedup);
+}
+
+block_init(bdrv_dedup_init);
@@ -159,6 +159,7 @@ typedef struct BDRVRawState {
     bool use_linux_io_uring:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
+    bool has_clone_range;
     bool needs_alignment;
     bool drop_cache;
     bool check_cache_dropped;
@@ -630,6 +631,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->has_discard = true;
     s->has_write_zeroes = true;
+    s->has_clone_range = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0) {
         s->needs_alignment = true;
     }
@@ -1647,12 +1649,75 @@ static off_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
 }
 #endif
 
+/*
+ * Try to share the extents of the source with the destination instead of
+ * copying any data.  This only works if both files live on the same
+ * filesystem, the filesystem supports reflinks and the range is aligned to
+ * its block size (or ends at the end of the source file).
+ */
+static int do_clone_range(RawPosixAIOData *aiocb)
+{
+#ifdef FICLONERANGE
+    BDRVRawState *s = aiocb->bs->opaque;
+    struct file_clone_range range = {
+        .src_fd         = aiocb->aio_fildes,
+        .src_offset     = aiocb->aio_offset,
+        .src_length     = aiocb->aio_nbytes,
+        .dest_offset    = aiocb->copy_range.aio_offset2,
+    };
+    int ret;
+
+    if (!s->has_clone_range) {
+        return -ENOTSUP;
+    }
+
+    do {
+        ret = ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range);
+    } while (ret < 0 && errno == EINTR);
+    ret = ret < 0 ? -errno : 0;
+    trace_file_clone_range(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                           aiocb->copy_range.aio_fd2,
+                           aiocb->copy_range.aio_offset2, aiocb->aio_nbytes,
+                           ret);
+
+    switch (ret) {
+    case 0:
+        return 0;
+    case -EINVAL:
+        /* Unaligned range, copy_file_range() may still work for this one */
+        return -ENOTSUP;
+    case -EXDEV:
+    case -EOPNOTSUPP:
+    case -ENOTTY:
+        /*
+         * The file system of this node can't clone, or not to the one the
+         * destination is on.  The flag is per source node, so a copy to
+         * another destination won't try cloning either; falling back to
+         * copy_file_range() is always correct, just slower.
+         */
+        s->has_clone_range = false;
+        return -ENOTSUP;
+    default:
+        /* -ENOSPC, -EIO etc. say nothing about support, fail the request */
+        return ret;
+    }
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static int handle_aiocb_copy_range(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
     uint64_t bytes = aiocb->aio_nbytes;
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
+    int clone_ret;
+
+    clone_ret = do_clone_range(aiocb);
+    if (clone_ret != -ENOTSUP) {
+        return clone_ret;
+    }
 
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
@@ -1669,6 +1734,9 @@ static int handle_aiocb_copy_range(void *opaque)
         if (ret < 0) {
             switch (errno) {
             case ENOSYS:
+            case EXDEV:
+            case EOPNOTSUPP:
+                /* Let the caller fall back to bounce buffers */
                 return -ENOTSUP;
             case EINTR:
                 continue;
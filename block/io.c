@@ -1388,6 +1388,14 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BdrvChild *child,
                                           BDRV_REQ_WRITE_UNCHANGED);
             }
 
+            /*
+             * The data did not change, but the range is allocated now and
+             * this write does not go through bdrv_co_write_req_finish()
+             */
+            if (bdrv_bsc_is_enabled(bs)) {
+                bdrv_bsc_invalidate_range(bs, cluster_offset, pnum);
+            }
+
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
                  * requests.  If this is a deliberate copy-on-read
@@ -1914,6 +1922,14 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, uint64_t bytes,
 
     atomic_inc(&bs->write_gen);
 
+    if (bdrv_bsc_is_enabled(bs)) {
+        if (req->type == BDRV_TRACKED_TRUNCATE) {
+            bdrv_bsc_invalidate_all(bs);
+        } else {
+            bdrv_bsc_invalidate_range(bs, offset, bytes);
+        }
+    }
+
     /*
      * Discard cannot extend the image, but in error handling cases, such as
      * when reverting a qcow2 cluster allocation, the discarded range can pass
@@ -2303,6 +2319,7 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     BlockDriverState *local_file = NULL;
     int64_t aligned_offset, aligned_bytes;
     uint32_t align;
+    bool use_cache;
 
     assert(pnum);
     *pnum = 0;
@@ -2349,9 +2366,23 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     aligned_offset = QEMU_ALIGN_DOWN(offset, align);
     aligned_bytes = ROUND_UP(offset + bytes, align) - aligned_offset;
 
-    ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
-                                        aligned_bytes, pnum, &local_map,
-                                        &local_file);
+    use_cache = bdrv_bsc_is_enabled(bs);
+    if (use_cache &&
+        bdrv_bsc_lookup(bs, want_zero, aligned_offset, aligned_bytes, &ret,
+                        pnum, &local_map, &local_file))
+    {
+        /* Answered from the block status cache */
+    } else {
+        uint64_t bsc_gen = use_cache ? bdrv_bsc_generation(bs) : 0;
+
+        ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
+                                            aligned_bytes, pnum, &local_map,
+                                            &local_file);
+        if (use_cache && ret >= 0 && !(ret & BDRV_BLOCK_RAW)) {
+            bdrv_bsc_fill(bs, bsc_gen, want_zero, aligned_offset, *pnum, ret,
+                          local_map, local_file);
+        }
+    }
     if (ret < 0) {
         *pnum = 0;
         goto out;
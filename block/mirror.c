@@ -28,6 +28,16 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/* Interval over which the dirty and copy rates are measured */
+#define MIRROR_RATE_WINDOW_NS NANOSECONDS_PER_SECOND
+/* Upper bound for the number of requests in flight in adaptive mode */
+#define MIRROR_ADAPTIVE_MAX_IN_FLIGHT 64
+/*
+ * Number of consecutive rate windows without progress after which adaptive
+ * mode starts copying guest writes synchronously
+ */
+#define MIRROR_ADAPTIVE_STALL_WINDOWS 3
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -53,7 +63,12 @@ typedef struct MirrorBlockJob {
     BlockMirrorBackingMode backing_mode;
     /* Whether the target image requires explicit zero-initialization */
     bool zero_target;
+    /*
+     * Background or write-blocking; adaptive jobs start in background mode
+     * and may switch to write-blocking while running, so access atomically
+     */
     MirrorCopyMode copy_mode;
+    bool adaptive;
     BlockdevOnError on_source_error, on_target_error;
     bool synced;
     /* Set when the target is synced (dirty bitmap is clean, nothing
@@ -74,13 +89,35 @@ typedef struct MirrorBlockJob {
     unsigned long *in_flight_bitmap;
     int in_flight;
     int64_t bytes_in_flight;
+    /* Limits for background requests, tuned at runtime in adaptive mode */
+    int max_in_flight;
+    int64_t max_io_bytes;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
+
+    /* Bytes written by the guest without being copied synchronously */
+    uint64_t bytes_dirtied;
+    /* Bytes copied to the target by background requests */
+    uint64_t bytes_copied;
+    /* Rates in bytes per second, measured over MIRROR_RATE_WINDOW_NS */
+    int64_t rate_window_start_ns;
+    uint64_t window_bytes_dirtied;
+    uint64_t window_bytes_copied;
+    bool rates_valid;
+    int64_t dirty_rate;
+    int64_t copy_rate;
+    /* State of the adaptive mode tuning from the previous rate window */
+    int64_t last_copy_rate;
+    int64_t last_remaining;
+    int tune_direction;
+    int stalled_windows;
     int ret;
     bool unmap;
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
     int in_active_write_counter;
+    /* Guest writes in flight that mark the dirty bitmap when done */
+    int in_dirtying_write_counter;
     bool prepared;
     bool in_drain;
 } MirrorBlockJob;
@@ -188,6 +225,7 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
     bitmap_clear(s->in_flight_bitmap, chunk_num, nb_chunks);
     QTAILQ_REMOVE(&s->ops_in_flight, op, next);
     if (ret >= 0) {
+        s->bytes_copied += op->bytes;
         if (s->cow_bitmap) {
             bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
         }
@@ -462,7 +500,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->max_io_bytes;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -559,7 +597,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -865,6 +903,88 @@ static int mirror_flush(MirrorBlockJob *s)
     return ret;
 }
 
+/*
+ * Tunes the background copy and decides whether guest writes must be
+ * copied synchronously for the job to converge.  Called once per rate
+ * window with the number of bytes that still need to be copied.
+ */
+static void mirror_adapt(MirrorBlockJob *s, int64_t remaining)
+{
+    int max_in_flight = s->max_in_flight;
+
+    /*
+     * Hill climbing on the number of parallel requests: keep going in the
+     * same direction as long as the copy rate improves.  The buffer is
+     * shared between the requests, so more requests means smaller ones.
+     */
+    if (remaining > 0) {
+        if (s->copy_rate < s->last_copy_rate) {
+            s->tune_direction = -s->tune_direction;
+        }
+        if (s->tune_direction > 0) {
+            max_in_flight = MIN(max_in_flight * 2,
+                                MIRROR_ADAPTIVE_MAX_IN_FLIGHT);
+        } else {
+            max_in_flight = MAX(max_in_flight / 2, 1);
+        }
+        s->last_copy_rate = s->copy_rate;
+    }
+
+    if (max_in_flight != s->max_in_flight) {
+        s->max_in_flight = max_in_flight;
+        s->max_io_bytes = MAX(QEMU_ALIGN_DOWN(s->buf_size / max_in_flight,
+                                              s->granularity),
+                              s->granularity);
+        trace_mirror_adaptive_tune(s, s->copy_rate, s->max_in_flight,
+                                   s->max_io_bytes);
+    }
+
+    if (atomic_read(&s->copy_mode) != MIRROR_COPY_MODE_BACKGROUND) {
+        return;
+    }
+
+    if (remaining > 0 && remaining >= s->last_remaining &&
+        s->dirty_rate >= s->copy_rate)
+    {
+        s->stalled_windows++;
+    } else {
+        s->stalled_windows = 0;
+    }
+
+    if (s->stalled_windows >= MIRROR_ADAPTIVE_STALL_WINDOWS) {
+        /*
+         * Writes that were started before the switch still mark their
+         * area dirty in bdrv_mirror_top_do_write()
+         */
+        trace_mirror_adaptive_switch(s, s->dirty_rate, s->copy_rate);
+        atomic_set(&s->copy_mode, MIRROR_COPY_MODE_WRITE_BLOCKING);
+    }
+}
+
+static void mirror_update_rates(MirrorBlockJob *s, int64_t remaining)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->rate_window_start_ns;
+
+    if (elapsed < MIRROR_RATE_WINDOW_NS) {
+        return;
+    }
+
+    s->dirty_rate = (double)(s->bytes_dirtied - s->window_bytes_dirtied) *
+                    NANOSECONDS_PER_SECOND / elapsed;
+    s->copy_rate = (double)(s->bytes_copied - s->window_bytes_copied) *
+                   NANOSECONDS_PER_SECOND / elapsed;
+    s->window_bytes_dirtied = s->bytes_dirtied;
+    s->window_bytes_copied = s->bytes_copied;
+    s->rate_window_start_ns = now;
+    s->rates_valid = true;
+
+    if (s->adaptive) {
+        mirror_adapt(s, remaining);
+    }
+    s->last_remaining = remaining;
+}
+
 static int coroutine_fn mirror_run(Job *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
@@ -942,6 +1062,9 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         s->cow_bitmap = bitmap_new(length);
     }
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    s->tune_direction = 1;
 
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
@@ -961,6 +1084,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     assert(!s->dbi);
     s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap);
+    s->rate_window_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     for (;;) {
         uint64_t delay_ns = 0;
         int64_t cnt, delta;
@@ -984,6 +1108,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
          * the number of bytes currently being processed; together those are
          * the current remaining operation length */
         job_progress_set_remaining(&s->common.job, s->bytes_in_flight + cnt);
+        mirror_update_rates(s, s->bytes_in_flight + cnt);
 
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that bdrv_drain_all() returns.
@@ -992,7 +1117,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1017,9 +1142,20 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
                  */
                 job_transition_to_ready(&s->common.job);
                 s->synced = true;
-                if (s->copy_mode != MIRROR_COPY_MODE_BACKGROUND) {
-                    s->actively_synced = true;
-                }
+            }
+            /*
+             * Adaptive jobs can switch to write-blocking after READY; guest
+             * writes started before the switch may still dirty the bitmap,
+             * including while mirror_flush() yielded.  Only rely on active
+             * mirroring once the bitmap is clean and none of these writes
+             * is left, otherwise go around the loop again.
+             */
+            if (atomic_read(&s->copy_mode) != MIRROR_COPY_MODE_BACKGROUND &&
+                !s->actively_synced &&
+                !bdrv_get_dirty_count(s->dirty_bitmap) &&
+                !s->in_dirtying_write_counter)
+            {
+                s->actively_synced = true;
             }
 
             should_complete = s->should_complete ||
@@ -1175,6 +1311,34 @@ static bool mirror_drained_poll(BlockJob *job)
     return !!s->in_flight;
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+    int64_t remaining;
+
+    if (!s->adaptive) {
+        return;
+    }
+
+    info->has_copy_mode = true;
+    info->copy_mode = atomic_read(&s->copy_mode);
+
+    if (!s->rates_valid) {
+        return;
+    }
+    info->has_dirty_rate = true;
+    info->dirty_rate = s->dirty_rate;
+    info->has_copy_rate = true;
+    info->copy_rate = s->copy_rate;
+
+    /* Only predict a completion time if the job is converging */
+    remaining = MAX(info->len - info->offset, 0);
+    if (s->copy_rate > s->dirty_rate) {
+        info->has_remaining_ms = true;
+        info->remaining_ms = remaining * 1000 / (s->copy_rate - s->dirty_rate);
+    }
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(MirrorBlockJob),
@@ -1188,6 +1352,7 @@ static const BlockJobDriver mirror_job_driver = {
         .complete               = mirror_complete,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1203,6 +1368,7 @@ static const BlockJobDriver commit_active_job_driver = {
         .complete               = mirror_complete,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
@@ -1373,20 +1539,26 @@ static int coroutine_fn bdrv_mirror_top_preadv(BlockDriverState *bs,
     return bdrv_co_preadv(bs->backing, offset, bytes, qiov, flags);
 }
 
+static bool bdrv_mirror_top_copy_to_target(BlockDriverState *bs)
+{
+    MirrorBDSOpaque *s = bs->opaque;
+
+    return s->job->ret >= 0 &&
+           atomic_read(&s->job->copy_mode) == MIRROR_COPY_MODE_WRITE_BLOCKING;
+}
+
 static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
-    MirrorMethod method, uint64_t offset, uint64_t bytes, QEMUIOVector *qiov,
-    int flags)
+    MirrorMethod method, bool copy_to_target, uint64_t offset, uint64_t bytes,
+    QEMUIOVector *qiov, int flags)
 {
     MirrorOp *op = NULL;
     MirrorBDSOpaque *s = bs->opaque;
     int ret = 0;
-    bool copy_to_target;
-
-    copy_to_target = s->job->ret >= 0 &&
-                     s->job->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING;
 
     if (copy_to_target) {
         op = active_write_prepare(s->job, offset, bytes);
+    } else {
+        s->job->in_dirtying_write_counter++;
     }
 
     switch (method) {
@@ -1406,6 +1578,16 @@ static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
         abort();
     }
 
+    if (!copy_to_target) {
+        if (s->job->adaptive) {
+            /* See mirror_start_job() */
+            bdrv_set_dirty_bitmap(s->job->dirty_bitmap, offset, bytes);
+        }
+        /* Feeds the dirty rate used for convergence decisions */
+        s->job->bytes_dirtied += bytes;
+        s->job->in_dirtying_write_counter--;
+    }
+
     if (ret < 0) {
         goto out;
     }
@@ -1430,8 +1612,7 @@ static int coroutine_fn bdrv_mirror_top_pwritev(BlockDriverState *bs,
     int ret = 0;
     bool copy_to_target;
 
-    copy_to_target = s->job->ret >= 0 &&
-                     s->job->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING;
+    copy_to_target = bdrv_mirror_top_copy_to_target(bs);
 
     if (copy_to_target) {
         /* The guest might concurrently modify the data to write; but
@@ -1446,8 +1627,8 @@ static int coroutine_fn bdrv_mirror_top_pwritev(BlockDriverState *bs,
         qiov = &bounce_qiov;
     }
 
-    ret = bdrv_mirror_top_do_write(bs, MIRROR_METHOD_COPY, offset, bytes, qiov,
-                                   flags);
+    ret = bdrv_mirror_top_do_write(bs, MIRROR_METHOD_COPY, copy_to_target,
+                                   offset, bytes, qiov, flags);
 
     if (copy_to_target) {
         qemu_iovec_destroy(&bounce_qiov);
@@ -1469,15 +1650,17 @@ static int coroutine_fn bdrv_mirror_top_flush(BlockDriverState *bs)
 static int coroutine_fn bdrv_mirror_top_pwrite_zeroes(BlockDriverState *bs,
     int64_t offset, int bytes, BdrvRequestFlags flags)
 {
-    return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_ZERO, offset, bytes, NULL,
-                                    flags);
+    return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_ZERO,
+                                    bdrv_mirror_top_copy_to_target(bs),
+                                    offset, bytes, NULL, flags);
 }
 
 static int coroutine_fn bdrv_mirror_top_pdiscard(BlockDriverState *bs,
     int64_t offset, int bytes)
 {
-    return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_DISCARD, offset, bytes,
-                                    NULL, 0);
+    return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_DISCARD,
+                                    bdrv_mirror_top_copy_to_target(bs),
+                                    offset, bytes, NULL, 0);
 }
 
 static void bdrv_mirror_top_refresh_filename(BlockDriverState *bs)
@@ -1670,7 +1853,8 @@ static BlockJob *mirror_start_job(
     s->is_none_mode = is_none_mode;
     s->backing_mode = backing_mode;
     s->zero_target = zero_target;
-    s->copy_mode = copy_mode;
+    s->adaptive = copy_mode == MIRROR_COPY_MODE_ADAPTIVE;
+    s->copy_mode = s->adaptive ? MIRROR_COPY_MODE_BACKGROUND : copy_mode;
     s->base = base;
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
@@ -1683,7 +1867,12 @@ static BlockJob *mirror_start_job(
     if (!s->dirty_bitmap) {
         goto fail;
     }
-    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+    /*
+     * Adaptive jobs may switch to write-blocking mode while running.  Active
+     * writes must not find their area dirtied by their own write to the
+     * source, so the filter node marks background writes dirty instead.
+     */
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING || s->adaptive) {
         bdrv_disable_dirty_bitmap(s->dirty_bitmap);
     }
 
@@ -45,9 +45,10 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ (uint64_t)(intptr_t)(conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ (uint64_t)(intptr_t)(conn))
 
 typedef struct {
     Coroutine *coroutine;
@@ -62,17 +63,27 @@ typedef enum NBDClientState {
     NBD_CLIENT_QUIT
 } NBDClientState;
 
-typedef struct BDRVNBDState {
+typedef struct BDRVNBDState BDRVNBDState;
+
+/*
+ * A single connection to the server.  If the server advertises
+ * NBD_FLAG_CAN_MULTI_CONN, requests are spread across several of them,
+ * each one with its own reply coroutine and reconnect handling.
+ */
+typedef struct NBDConnection {
+    BDRVNBDState *s;
+
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    NBDExportInfo info;
+    uint32_t context_id; /* Negotiated on this connection */
 
     CoMutex send_mutex;
     CoQueue free_sema;
     Coroutine *connection_co;
     Coroutine *teardown_co;
     QemuCoSleepState *connection_co_sleep_ns_state;
-    bool drained;
+    /* connection_co must be entered by nbd_client_attach_aio_context_bh */
+    bool attach_pending;
     bool wait_drained_end;
     int in_flight;
     NBDClientState state;
@@ -82,21 +93,68 @@ typedef struct BDRVNBDState {
 
     NBDClientRequest requests[MAX_NBD_REQUESTS];
     NBDReply reply;
+} NBDConnection;
+
+/* An extent received from the server in a block status reply */
+typedef struct NBDCachedExtent {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t flags;
+} NBDCachedExtent;
+
+struct BDRVNBDState {
+    NBDExportInfo info;
+    bool drained;
+
+    /*
+     * The extents of the last NBD_CMD_BLOCK_STATUS reply, sorted by offset,
+     * so that the following queries for the same area can be answered
+     * without a round trip.  Any request that may change the allocation
+     * status drops them and bumps the generation, so that replies to
+     * requests that raced with it aren't cached.
+     *
+     * Only our own requests are seen: writes by other clients of the
+     * export, or by the server itself, don't drop the cache.  To bound
+     * how stale it can get, it expires NBD_EXTENT_CACHE_TIMEOUT_NS after
+     * it was filled (QEMU_CLOCK_REALTIME).
+     */
+    NBDCachedExtent *extent_cache;
+    unsigned int extent_cache_count;
+    uint64_t extent_cache_gen;
+    int64_t extent_cache_expire_ns;
+
+    NBDConnection *conns;
+    int nb_conns;
+    int next_conn;
+
     BlockDriverState *bs;
 
     /* Connection parameters */
     uint32_t reconnect_delay;
+    uint32_t multi_conn;
     SocketAddress *saddr;
     char *export, *tlscredsid;
     QCryptoTLSCreds *tlscreds;
     const char *hostname;
     char *x_dirty_bitmap;
-} BDRVNBDState;
+};
 
-static int nbd_client_connect(BlockDriverState *bs, Error **errp);
+static int nbd_client_connect(NBDConnection *conn, Error **errp);
 
 static void nbd_clear_bdrvstate(BDRVNBDState *s)
 {
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        error_free(s->conns[i].connect_err);
+    }
+    g_free(s->conns);
+    s->conns = NULL;
+    s->nb_conns = 0;
+    g_free(s->extent_cache);
+    s->extent_cache = NULL;
+    s->extent_cache_count = 0;
+
     object_unref(OBJECT(s->tlscreds));
     qapi_free_SocketAddress(s->saddr);
     s->saddr = NULL;
@@ -108,27 +166,28 @@ static void nbd_clear_bdrvstate(BDRVNBDState *s)
     s->x_dirty_bitmap = NULL;
 }
 
-static void nbd_channel_error(BDRVNBDState *s, int ret)
+static void nbd_channel_error(NBDConnection *conn, int ret)
 {
     if (ret == -EIO) {
-        if (s->state == NBD_CLIENT_CONNECTED) {
-            s->state = s->reconnect_delay ? NBD_CLIENT_CONNECTING_WAIT :
-                                            NBD_CLIENT_CONNECTING_NOWAIT;
+        if (conn->state == NBD_CLIENT_CONNECTED) {
+            conn->state = conn->s->reconnect_delay ?
+                          NBD_CLIENT_CONNECTING_WAIT :
+                          NBD_CLIENT_CONNECTING_NOWAIT;
         }
     } else {
-        if (s->state == NBD_CLIENT_CONNECTED) {
-            qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        if (conn->state == NBD_CLIENT_CONNECTED) {
+            qio_channel_shutdown(conn->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         }
-        s->state = NBD_CLIENT_QUIT;
+        conn->state = NBD_CLIENT_QUIT;
     }
 }
 
-static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
+static void nbd_recv_coroutines_wake_all(NBDConnection *conn)
 {
     int i;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        NBDClientRequest *req = &s->requests[i];
+        NBDClientRequest *req = &conn->requests[i];
 
         if (req->coroutine && req->receiving) {
             aio_co_wake(req->coroutine);
@@ -136,42 +195,73 @@ static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
     }
 }
 
+static void nbd_conn_detach_aio_context(NBDConnection *conn)
+{
+    qio_channel_detach_aio_context(QIO_CHANNEL(conn->ioc));
+}
+
 static void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].ioc) {
+            nbd_conn_detach_aio_context(&s->conns[i]);
+        }
+    }
 }
 
 static void nbd_client_attach_aio_context_bh(void *opaque)
 {
     BlockDriverState *bs = opaque;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
     /*
-     * The node is still drained, so we know the coroutine has yielded in
-     * nbd_read_eof(), the only place where bs->in_flight can reach 0, or it is
-     * entered for the first time. Both places are safe for entering the
-     * coroutine.
+     * The node is still drained, so we know the coroutines have yielded in
+     * nbd_read_eof(), the only place where bs->in_flight can reach 0, or they
+     * are entered for the first time. Both places are safe for entering the
+     * coroutines.
      */
-    qemu_aio_coroutine_enter(bs->aio_context, s->connection_co);
-    bdrv_dec_in_flight(bs);
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[i];
+
+        if (!conn->attach_pending) {
+            continue;
+        }
+        conn->attach_pending = false;
+        qemu_aio_coroutine_enter(bs->aio_context, conn->connection_co);
+        bdrv_dec_in_flight(bs);
+    }
 }
 
 static void nbd_client_attach_aio_context(BlockDriverState *bs,
                                           AioContext *new_context)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    /*
-     * s->connection_co is either yielded from nbd_receive_reply or from
-     * nbd_co_reconnect_loop()
-     */
-    if (s->state == NBD_CLIENT_CONNECTED) {
-        qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
-    }
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[i];
+
+        /* A connection that has quit has no coroutine left to enter */
+        if (!conn->connection_co) {
+            continue;
+        }
+
+        /*
+         * conn->connection_co is either yielded from nbd_receive_reply or
+         * from nbd_co_reconnect_loop()
+         */
+        if (conn->state == NBD_CLIENT_CONNECTED) {
+            qio_channel_attach_aio_context(QIO_CHANNEL(conn->ioc),
+                                           new_context);
+        }
 
-    bdrv_inc_in_flight(bs);
+        conn->attach_pending = true;
+        bdrv_inc_in_flight(bs);
+    }
 
     /*
      * Need to wait here for the BH to run because the BH must run while the
@@ -183,21 +273,29 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
 static void coroutine_fn nbd_client_co_drain_begin(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
     s->drained = true;
-    if (s->connection_co_sleep_ns_state) {
-        qemu_co_sleep_wake(s->connection_co_sleep_ns_state);
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].connection_co_sleep_ns_state) {
+            qemu_co_sleep_wake(s->conns[i].connection_co_sleep_ns_state);
+        }
     }
 }
 
 static void coroutine_fn nbd_client_co_drain_end(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
     s->drained = false;
-    if (s->wait_drained_end) {
-        s->wait_drained_end = false;
-        aio_co_wake(s->connection_co);
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[i];
+
+        if (conn->wait_drained_end) {
+            conn->wait_drained_end = false;
+            aio_co_wake(conn->connection_co);
+        }
     }
 }
 
@@ -205,64 +303,76 @@ static void coroutine_fn nbd_client_co_drain_end(BlockDriverState *bs)
 static void nbd_teardown_connection(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    if (s->state == NBD_CLIENT_CONNECTED) {
-        /* finish any pending coroutines */
-        assert(s->ioc);
-        qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
-    }
-    s->state = NBD_CLIENT_QUIT;
-    if (s->connection_co) {
-        if (s->connection_co_sleep_ns_state) {
-            qemu_co_sleep_wake(s->connection_co_sleep_ns_state);
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[i];
+
+        if (conn->state == NBD_CLIENT_CONNECTED) {
+            /* finish any pending coroutines */
+            assert(conn->ioc);
+            qio_channel_shutdown(conn->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+        conn->state = NBD_CLIENT_QUIT;
+        if (conn->connection_co) {
+            if (conn->connection_co_sleep_ns_state) {
+                qemu_co_sleep_wake(conn->connection_co_sleep_ns_state);
+            }
         }
     }
-    if (qemu_in_coroutine()) {
-        s->teardown_co = qemu_coroutine_self();
-        /* connection_co resumes us when it terminates */
-        qemu_coroutine_yield();
-        s->teardown_co = NULL;
-    } else {
-        BDRV_POLL_WHILE(bs, s->connection_co);
+
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[i];
+
+        if (qemu_in_coroutine()) {
+            if (conn->connection_co) {
+                conn->teardown_co = qemu_coroutine_self();
+                /* connection_co resumes us when it terminates */
+                qemu_coroutine_yield();
+                conn->teardown_co = NULL;
+            }
+        } else {
+            BDRV_POLL_WHILE(bs, conn->connection_co);
+        }
+        assert(!conn->connection_co);
     }
-    assert(!s->connection_co);
 }
 
-static bool nbd_client_connecting(BDRVNBDState *s)
+static bool nbd_client_connecting(NBDConnection *conn)
 {
-    return s->state == NBD_CLIENT_CONNECTING_WAIT ||
-        s->state == NBD_CLIENT_CONNECTING_NOWAIT;
+    return conn->state == NBD_CLIENT_CONNECTING_WAIT ||
+        conn->state == NBD_CLIENT_CONNECTING_NOWAIT;
 }
 
-static bool nbd_client_connecting_wait(BDRVNBDState *s)
+static bool nbd_client_connecting_wait(NBDConnection *conn)
 {
-    return s->state == NBD_CLIENT_CONNECTING_WAIT;
+    return conn->state == NBD_CLIENT_CONNECTING_WAIT;
 }
 
-static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
+static coroutine_fn void nbd_reconnect_attempt(NBDConnection *conn)
 {
     Error *local_err = NULL;
 
-    if (!nbd_client_connecting(s)) {
+    if (!nbd_client_connecting(conn)) {
         return;
     }
 
     /* Wait for completion of all in-flight requests */
 
-    qemu_co_mutex_lock(&s->send_mutex);
+    qemu_co_mutex_lock(&conn->send_mutex);
 
-    while (s->in_flight > 0) {
-        qemu_co_mutex_unlock(&s->send_mutex);
-        nbd_recv_coroutines_wake_all(s);
-        s->wait_in_flight = true;
+    while (conn->in_flight > 0) {
+        qemu_co_mutex_unlock(&conn->send_mutex);
+        nbd_recv_coroutines_wake_all(conn);
+        conn->wait_in_flight = true;
         qemu_coroutine_yield();
-        s->wait_in_flight = false;
-        qemu_co_mutex_lock(&s->send_mutex);
+        conn->wait_in_flight = false;
+        qemu_co_mutex_lock(&conn->send_mutex);
     }
 
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_unlock(&conn->send_mutex);
 
-    if (!nbd_client_connecting(s)) {
+    if (!nbd_client_connecting(conn)) {
         return;
     }
 
@@ -272,51 +382,52 @@ static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
      */
 
     /* Finalize previous connection if any */
-    if (s->ioc) {
-        nbd_client_detach_aio_context(s->bs);
-        object_unref(OBJECT(s->sioc));
-        s->sioc = NULL;
-        object_unref(OBJECT(s->ioc));
-        s->ioc = NULL;
+    if (conn->ioc) {
+        nbd_conn_detach_aio_context(conn);
+        object_unref(OBJECT(conn->sioc));
+        conn->sioc = NULL;
+        object_unref(OBJECT(conn->ioc));
+        conn->ioc = NULL;
     }
 
-    s->connect_status = nbd_client_connect(s->bs, &local_err);
-    error_free(s->connect_err);
-    s->connect_err = NULL;
-    error_propagate(&s->connect_err, local_err);
+    conn->connect_status = nbd_client_connect(conn, &local_err);
+    error_free(conn->connect_err);
+    conn->connect_err = NULL;
+    error_propagate(&conn->connect_err, local_err);
 
-    if (s->connect_status < 0) {
+    if (conn->connect_status < 0) {
         /* failed attempt */
         return;
     }
 
     /* successfully connected */
-    s->state = NBD_CLIENT_CONNECTED;
-    qemu_co_queue_restart_all(&s->free_sema);
+    conn->state = NBD_CLIENT_CONNECTED;
+    qemu_co_queue_restart_all(&conn->free_sema);
 }
 
-static coroutine_fn void nbd_co_reconnect_loop(BDRVNBDState *s)
+static coroutine_fn void nbd_co_reconnect_loop(NBDConnection *conn)
 {
+    BDRVNBDState *s = conn->s;
     uint64_t start_time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     uint64_t delay_ns = s->reconnect_delay * NANOSECONDS_PER_SECOND;
     uint64_t timeout = 1 * NANOSECONDS_PER_SECOND;
     uint64_t max_timeout = 16 * NANOSECONDS_PER_SECOND;
 
-    nbd_reconnect_attempt(s);
+    nbd_reconnect_attempt(conn);
 
-    while (nbd_client_connecting(s)) {
-        if (s->state == NBD_CLIENT_CONNECTING_WAIT &&
+    while (nbd_client_connecting(conn)) {
+        if (conn->state == NBD_CLIENT_CONNECTING_WAIT &&
             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time_ns > delay_ns)
         {
-            s->state = NBD_CLIENT_CONNECTING_NOWAIT;
-            qemu_co_queue_restart_all(&s->free_sema);
+            conn->state = NBD_CLIENT_CONNECTING_NOWAIT;
+            qemu_co_queue_restart_all(&conn->free_sema);
         }
 
         qemu_co_sleep_ns_wakeable(QEMU_CLOCK_REALTIME, timeout,
-                                  &s->connection_co_sleep_ns_state);
+                                  &conn->connection_co_sleep_ns_state);
         if (s->drained) {
             bdrv_dec_in_flight(s->bs);
-            s->wait_drained_end = true;
+            conn->wait_drained_end = true;
             while (s->drained) {
                 /*
                  * We may be entered once from nbd_client_attach_aio_context_bh
@@ -330,18 +441,19 @@ static coroutine_fn void nbd_co_reconnect_loop(BDRVNBDState *s)
             timeout *= 2;
         }
 
-        nbd_reconnect_attempt(s);
+        nbd_reconnect_attempt(conn);
     }
 }
 
 static coroutine_fn void nbd_connection_entry(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
+    BDRVNBDState *s = conn->s;
     uint64_t i;
     int ret = 0;
     Error *local_err = NULL;
 
-    while (s->state != NBD_CLIENT_QUIT) {
+    while (conn->state != NBD_CLIENT_QUIT) {
         /*
          * The NBD client can only really be considered idle when it has
          * yielded from qio_channel_readv_all_eof(), waiting for data. This is
@@ -352,16 +464,16 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          * only drop it temporarily here.
          */
 
-        if (nbd_client_connecting(s)) {
-            nbd_co_reconnect_loop(s);
+        if (nbd_client_connecting(conn)) {
+            nbd_co_reconnect_loop(conn);
         }
 
-        if (s->state != NBD_CLIENT_CONNECTED) {
+        if (conn->state != NBD_CLIENT_CONNECTED) {
             continue;
         }
 
-        assert(s->reply.handle == 0);
-        ret = nbd_receive_reply(s->bs, s->ioc, &s->reply, &local_err);
+        assert(conn->reply.handle == 0);
+        ret = nbd_receive_reply(s->bs, conn->ioc, &conn->reply, &local_err);
 
         if (local_err) {
             trace_nbd_read_reply_entry_fail(ret, error_get_pretty(local_err));
@@ -369,7 +481,7 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
             local_err = NULL;
         }
         if (ret <= 0) {
-            nbd_channel_error(s, ret ? ret : -EIO);
+            nbd_channel_error(conn, ret ? ret : -EIO);
             continue;
         }
 
@@ -378,13 +490,14 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          * handler acts as a synchronization point and ensures that only
          * one coroutine is called until the reply finishes.
          */
-        i = HANDLE_TO_INDEX(s, s->reply.handle);
+        i = HANDLE_TO_INDEX(conn, conn->reply.handle);
         if (i >= MAX_NBD_REQUESTS ||
-            !s->requests[i].coroutine ||
-            !s->requests[i].receiving ||
-            (nbd_reply_is_structured(&s->reply) && !s->info.structured_reply))
+            !conn->requests[i].coroutine ||
+            !conn->requests[i].receiving ||
+            (nbd_reply_is_structured(&conn->reply) &&
+             !s->info.structured_reply))
         {
-            nbd_channel_error(s, -EINVAL);
+            nbd_channel_error(conn, -EINVAL);
             continue;
         }
 
@@ -400,50 +513,84 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          *   connection_co happens through a bottom half, which can only
          *   run after we yield.
          */
-        aio_co_wake(s->requests[i].coroutine);
+        aio_co_wake(conn->requests[i].coroutine);
         qemu_coroutine_yield();
     }
 
-    qemu_co_queue_restart_all(&s->free_sema);
-    nbd_recv_coroutines_wake_all(s);
+    qemu_co_queue_restart_all(&conn->free_sema);
+    nbd_recv_coroutines_wake_all(conn);
     bdrv_dec_in_flight(s->bs);
 
-    s->connection_co = NULL;
-    if (s->ioc) {
-        nbd_client_detach_aio_context(s->bs);
-        object_unref(OBJECT(s->sioc));
-        s->sioc = NULL;
-        object_unref(OBJECT(s->ioc));
-        s->ioc = NULL;
+    conn->connection_co = NULL;
+    if (conn->ioc) {
+        nbd_conn_detach_aio_context(conn);
+        object_unref(OBJECT(conn->sioc));
+        conn->sioc = NULL;
+        object_unref(OBJECT(conn->ioc));
+        conn->ioc = NULL;
     }
 
-    if (s->teardown_co) {
-        aio_co_wake(s->teardown_co);
+    if (conn->teardown_co) {
+        aio_co_wake(conn->teardown_co);
     }
     aio_wait_kick();
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+/*
+ * Pick the connection for the next request: the connected one with the
+ * fewest requests in flight, starting the search after the connection
+ * that was picked last so that ties are broken round-robin.  If no
+ * connection is up, prefer one that will make requests wait for its
+ * reconnection over one that fails them.
+ */
+static NBDConnection *nbd_pick_connection(BDRVNBDState *s)
+{
+    NBDConnection *best = NULL;
+    int i;
+
+    for (i = 1; i <= s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[(s->next_conn + i) % s->nb_conns];
+
+        if (conn->state == NBD_CLIENT_CONNECTED) {
+            if (!best || best->state != NBD_CLIENT_CONNECTED ||
+                conn->in_flight < best->in_flight)
+            {
+                best = conn;
+            }
+        } else if (!best || (nbd_client_connecting_wait(conn) &&
+                             best->state != NBD_CLIENT_CONNECTED &&
+                             !nbd_client_connecting_wait(best)))
+        {
+            best = conn;
+        }
+    }
+
+    s->next_conn = best - s->conns;
+    return best;
+}
+
+static int nbd_co_send_request(NBDConnection *conn,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     int rc, i = -1;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    while (s->in_flight == MAX_NBD_REQUESTS || nbd_client_connecting_wait(s)) {
-        qemu_co_queue_wait(&s->free_sema, &s->send_mutex);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    while (conn->in_flight == MAX_NBD_REQUESTS ||
+           nbd_client_connecting_wait(conn))
+    {
+        qemu_co_queue_wait(&conn->free_sema, &conn->send_mutex);
     }
 
-    if (s->state != NBD_CLIENT_CONNECTED) {
+    if (conn->state != NBD_CLIENT_CONNECTED) {
         rc = -EIO;
         goto err;
     }
 
-    s->in_flight++;
+    conn->in_flight++;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->requests[i].coroutine == NULL) {
+        if (conn->requests[i].coroutine == NULL) {
             break;
         }
     }
@@ -451,44 +598,46 @@ static int nbd_co_send_request(BlockDriverState *bs,
     g_assert(qemu_in_coroutine());
     assert(i < MAX_NBD_REQUESTS);
 
-    s->requests[i].coroutine = qemu_coroutine_self();
-    s->requests[i].offset = request->from;
-    s->requests[i].receiving = false;
+    conn->requests[i].coroutine = qemu_coroutine_self();
+    conn->requests[i].offset = request->from;
+    conn->requests[i].receiving = false;
 
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(conn, i);
+    trace_nbd_co_send_request_conn(conn - conn->s->conns, request->handle,
+                                   request->type);
 
-    assert(s->ioc);
+    assert(conn->ioc);
 
     if (qiov) {
-        qio_channel_set_cork(s->ioc, true);
-        rc = nbd_send_request(s->ioc, request);
-        if (rc >= 0 && s->state == NBD_CLIENT_CONNECTED) {
-            if (qio_channel_writev_all(s->ioc, qiov->iov, qiov->niov,
+        qio_channel_set_cork(conn->ioc, true);
+        rc = nbd_send_request(conn->ioc, request);
+        if (rc >= 0 && conn->state == NBD_CLIENT_CONNECTED) {
+            if (qio_channel_writev_all(conn->ioc, qiov->iov, qiov->niov,
                                        NULL) < 0) {
                 rc = -EIO;
             }
         } else if (rc >= 0) {
             rc = -EIO;
         }
-        qio_channel_set_cork(s->ioc, false);
+        qio_channel_set_cork(conn->ioc, false);
     } else {
-        rc = nbd_send_request(s->ioc, request);
+        rc = nbd_send_request(conn->ioc, request);
     }
 
 err:
     if (rc < 0) {
-        nbd_channel_error(s, rc);
+        nbd_channel_error(conn, rc);
         if (i != -1) {
-            s->requests[i].coroutine = NULL;
-            s->in_flight--;
+            conn->requests[i].coroutine = NULL;
+            conn->in_flight--;
         }
-        if (s->in_flight == 0 && s->wait_in_flight) {
-            aio_co_wake(s->connection_co);
+        if (conn->in_flight == 0 && conn->wait_in_flight) {
+            aio_co_wake(conn->connection_co);
         } else {
-            qemu_co_queue_next(&s->free_sema);
+            qemu_co_queue_next(&conn->free_sema);
         }
     }
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_unlock(&conn->send_mutex);
     return rc;
 }
 
@@ -545,88 +694,185 @@ static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
 
 /*
  * nbd_parse_blockstatus_payload
- * Based on our request, we expect only one extent in reply, for the
- * base:allocation context.
+ * Parse the extents of a reply to a request for the base:allocation context
+ * at @offset into a newly allocated array.  With @req_one, we expect only
+ * one extent that doesn't go beyond the request; otherwise the server may
+ * send many extents and the last one may extend beyond @orig_length.
  */
-static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
+static int nbd_parse_blockstatus_payload(NBDConnection *conn,
                                          NBDStructuredReplyChunk *chunk,
-                                         uint8_t *payload, uint64_t orig_length,
-                                         NBDExtent *extent, Error **errp)
+                                         uint8_t *payload, uint64_t offset,
+                                         uint64_t orig_length, bool req_one,
+                                         NBDCachedExtent **extents,
+                                         unsigned int *nb_extents,
+                                         Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     uint32_t context_id;
+    unsigned int i, count;
 
     /* The server succeeded, so it must have sent [at least] one extent */
-    if (chunk->length < sizeof(context_id) + sizeof(*extent)) {
+    if (chunk->length < sizeof(context_id) + sizeof(NBDExtent)) {
         error_setg(errp, "Protocol error: invalid payload for "
                          "NBD_REPLY_TYPE_BLOCK_STATUS");
         return -EINVAL;
     }
 
     context_id = payload_advance32(&payload);
-    if (s->info.context_id != context_id) {
+    if (conn->context_id != context_id) {
         error_setg(errp, "Protocol error: unexpected context id %d for "
                          "NBD_REPLY_TYPE_BLOCK_STATUS, when negotiated context "
                          "id is %d", context_id,
-                         s->info.context_id);
-        return -EINVAL;
-    }
-
-    extent->length = payload_advance32(&payload);
-    extent->flags = payload_advance32(&payload);
-
-    if (extent->length == 0) {
-        error_setg(errp, "Protocol error: server sent status chunk with "
-                   "zero length");
+                         conn->context_id);
         return -EINVAL;
     }
 
-    /*
-     * A server sending unaligned block status is in violation of the
-     * protocol, but as qemu-nbd 3.1 is such a server (at least for
-     * POSIX files that are not a multiple of 512 bytes, since qemu
-     * rounds files up to 512-byte multiples but lseek(SEEK_HOLE)
-     * still sees an implicit hole beyond the real EOF), it's nicer to
-     * work around the misbehaving server. If the request included
-     * more than the final unaligned block, truncate it back to an
-     * aligned result; if the request was only the final block, round
-     * up to the full block and change the status to fully-allocated
-     * (always a safe status, even if it loses information).
-     */
-    if (s->info.min_block && !QEMU_IS_ALIGNED(extent->length,
-                                                   s->info.min_block)) {
-        trace_nbd_parse_blockstatus_compliance("extent length is unaligned");
-        if (extent->length > s->info.min_block) {
-            extent->length = QEMU_ALIGN_DOWN(extent->length,
-                                             s->info.min_block);
-        } else {
-            extent->length = s->info.min_block;
-            extent->flags = 0;
-        }
-    }
+    count = (chunk->length - sizeof(context_id)) / sizeof(NBDExtent);
 
     /*
-     * We used NBD_CMD_FLAG_REQ_ONE, so the server should not have
-     * sent us any more than one extent, nor should it have included
-     * status beyond our request in that extent. However, it's easy
-     * enough to ignore the server's noncompliance without killing the
-     * connection; just ignore trailing extents, and clamp things to
-     * the length of our request.
+     * With NBD_CMD_FLAG_REQ_ONE, the server should not have sent us any
+     * more than one extent, nor should it have included status beyond our
+     * request in that extent. However, it's easy enough to ignore the
+     * server's noncompliance without killing the connection; just ignore
+     * trailing extents, and clamp things to the length of our request.
      */
-    if (chunk->length > sizeof(context_id) + sizeof(*extent)) {
+    if (req_one && count > 1) {
         trace_nbd_parse_blockstatus_compliance("more than one extent");
+        count = 1;
     }
-    if (extent->length > orig_length) {
-        extent->length = orig_length;
-        trace_nbd_parse_blockstatus_compliance("extent length too large");
+
+    *extents = g_new(NBDCachedExtent, count);
+    *nb_extents = 0;
+
+    for (i = 0; i < count && offset < s->info.size; i++) {
+        NBDCachedExtent *extent = &(*extents)[i];
+        bool unaligned = false;
+
+        extent->offset = offset;
+        extent->length = payload_advance32(&payload);
+        extent->flags = payload_advance32(&payload);
+
+        if (extent->length == 0) {
+            error_setg(errp, "Protocol error: server sent status chunk with "
+                       "zero length");
+            g_free(*extents);
+            *extents = NULL;
+            return -EINVAL;
+        }
+
+        /*
+         * A server sending unaligned block status is in violation of the
+         * protocol, but as qemu-nbd 3.1 is such a server (at least for
+         * POSIX files that are not a multiple of 512 bytes, since qemu
+         * rounds files up to 512-byte multiples but lseek(SEEK_HOLE)
+         * still sees an implicit hole beyond the real EOF), it's nicer to
+         * work around the misbehaving server. If the extent is longer
+         * than the final unaligned block, truncate it back to an aligned
+         * result; if it was only the final block, round up to the full
+         * block and change the status to fully-allocated (always a safe
+         * status, even if it loses information).  The offsets of any
+         * following extents are off then, so drop them.
+         */
+        if (s->info.min_block && !QEMU_IS_ALIGNED(extent->length,
+                                                  s->info.min_block)) {
+            trace_nbd_parse_blockstatus_compliance("extent length is "
+                                                   "unaligned");
+            if (extent->length > s->info.min_block) {
+                extent->length = QEMU_ALIGN_DOWN(extent->length,
+                                                 s->info.min_block);
+            } else {
+                extent->length = s->info.min_block;
+                extent->flags = 0;
+            }
+            unaligned = true;
+        }
+
+        if (req_one && extent->length > orig_length) {
+            extent->length = orig_length;
+            trace_nbd_parse_blockstatus_compliance("extent length too large");
+        }
+        if (extent->length > s->info.size - offset) {
+            extent->length = s->info.size - offset;
+            trace_nbd_parse_blockstatus_compliance("extent beyond the end "
+                                                   "of the export");
+        }
+
+        offset += extent->length;
+        (*nb_extents)++;
+
+        if (unaligned) {
+            break;
+        }
     }
 
     return 0;
 }
 
 /*
- * nbd_parse_error_payload
- * on success @errp contains message describing nbd error reply
+ * How long cached extents are used.  Long enough for a walk over the
+ * extents of one reply (e.g. qemu-img map), short enough to notice the
+ * changes of other writers soon.
  */
+#define NBD_EXTENT_CACHE_TIMEOUT_NS (1 * NANOSECONDS_PER_SECOND)
+
+/* Called in the AioContext of the node */
+static void nbd_extent_cache_invalidate(BDRVNBDState *s)
+{
+    s->extent_cache_gen++;
+    g_free(s->extent_cache);
+    s->extent_cache = NULL;
+    s->extent_cache_count = 0;
+}
+
+/* Takes ownership of @extents */
+static void nbd_extent_cache_fill(BDRVNBDState *s, uint64_t gen,
+                                  NBDCachedExtent *extents,
+                                  unsigned int nb_extents)
+{
+    if (gen != s->extent_cache_gen || !nb_extents) {
+        g_free(extents);
+        return;
+    }
+
+    g_free(s->extent_cache);
+    s->extent_cache = extents;
+    s->extent_cache_count = nb_extents;
+    s->extent_cache_expire_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                                NBD_EXTENT_CACHE_TIMEOUT_NS;
+    trace_nbd_extent_cache_fill(extents[0].offset,
+                                extents[nb_extents - 1].offset +
+                                extents[nb_extents - 1].length -
+                                extents[0].offset, nb_extents);
+}
+
+static int nbd_extent_cache_compare(const void *key, const void *elem)
+{
+    uint64_t offset = *(const uint64_t *)key;
+    const NBDCachedExtent *extent = elem;
+
+    if (offset < extent->offset) {
+        return -1;
+    }
+    if (offset >= extent->offset + extent->length) {
+        return 1;
+    }
+    return 0;
+}
+
+static NBDCachedExtent *nbd_extent_cache_lookup(BDRVNBDState *s,
+                                                uint64_t offset)
+{
+    if (!s->extent_cache_count) {
+        return NULL;
+    }
+    if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) >= s->extent_cache_expire_ns) {
+        nbd_extent_cache_invalidate(s);
+        return NULL;
+    }
+    return bsearch(&offset, s->extent_cache, s->extent_cache_count,
+                   sizeof(NBDCachedExtent), nbd_extent_cache_compare);
+}
+
 static int nbd_parse_error_payload(NBDStructuredReplyChunk *chunk,
                                    uint8_t *payload, int *request_ret,
                                    Error **errp)
@@ -665,17 +911,18 @@ static int nbd_parse_error_payload(NBDStructuredReplyChunk *chunk,
     return 0;
 }
 
-static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
+static int nbd_co_receive_offset_data_payload(NBDConnection *conn,
                                               uint64_t orig_offset,
                                               QEMUIOVector *qiov, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     QEMUIOVector sub_qiov;
     uint64_t offset;
     size_t data_size;
     int ret;
-    NBDStructuredReplyChunk *chunk = &s->reply.structured;
+    NBDStructuredReplyChunk *chunk = &conn->reply.structured;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&conn->reply));
 
     /* The NBD spec requires at least one byte of payload */
     if (chunk->length <= sizeof(offset)) {
@@ -684,7 +931,7 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
         return -EINVAL;
     }
 
-    if (nbd_read64(s->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
+    if (nbd_read64(conn->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
         return -EIO;
     }
 
@@ -702,7 +949,7 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
 
     qemu_iovec_init(&sub_qiov, qiov->niov);
     qemu_iovec_concat(&sub_qiov, qiov, offset - orig_offset, data_size);
-    ret = qio_channel_readv_all(s->ioc, sub_qiov.iov, sub_qiov.niov, errp);
+    ret = qio_channel_readv_all(conn->ioc, sub_qiov.iov, sub_qiov.niov, errp);
     qemu_iovec_destroy(&sub_qiov);
 
     return ret < 0 ? -EIO : 0;
@@ -710,14 +957,14 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
 
 #define NBD_MAX_MALLOC_PAYLOAD 1000
 static coroutine_fn int nbd_co_receive_structured_payload(
-        BDRVNBDState *s, void **payload, Error **errp)
+        NBDConnection *conn, void **payload, Error **errp)
 {
     int ret;
-    uint32_t len;
+    uint32_t len, max_len;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&conn->reply));
 
-    len = s->reply.structured.length;
+    len = conn->reply.structured.length;
 
     if (len == 0) {
         return 0;
@@ -728,13 +975,22 @@ static coroutine_fn int nbd_co_receive_structured_payload(
         return -EINVAL;
     }
 
-    if (len > NBD_MAX_MALLOC_PAYLOAD) {
+    /*
+     * Without NBD_CMD_FLAG_REQ_ONE, block status replies carry up to one
+     * extent per 8 bytes, so they get a bound of their own.
+     */
+    if (conn->reply.structured.type == NBD_REPLY_TYPE_BLOCK_STATUS) {
+        max_len = NBD_MAX_BLOCK_STATUS_PAYLOAD;
+    } else {
+        max_len = NBD_MAX_MALLOC_PAYLOAD;
+    }
+    if (len > max_len) {
         error_setg(errp, "Payload too large");
         return -EINVAL;
     }
 
     *payload = g_new(char, len);
-    ret = nbd_read(s->ioc, *payload, len, "structured payload", errp);
+    ret = nbd_read(conn->ioc, *payload, len, "structured payload", errp);
     if (ret < 0) {
         g_free(*payload);
         *payload = NULL;
@@ -760,11 +1016,11 @@ static coroutine_fn int nbd_co_receive_structured_payload(
  * corresponding to the server's error reply), and errp is unchanged.
  */
 static coroutine_fn int nbd_co_do_receive_one_chunk(
-        BDRVNBDState *s, uint64_t handle, bool only_structured,
+        NBDConnection *conn, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, void **payload, Error **errp)
 {
     int ret;
-    int i = HANDLE_TO_INDEX(s, handle);
+    int i = HANDLE_TO_INDEX(conn, handle);
     void *local_payload = NULL;
     NBDStructuredReplyChunk *chunk;
 
@@ -774,36 +1030,36 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
     *request_ret = 0;
 
     /* Wait until we're woken up by nbd_connection_entry.  */
-    s->requests[i].receiving = true;
+    conn->requests[i].receiving = true;
     qemu_coroutine_yield();
-    s->requests[i].receiving = false;
-    if (s->state != NBD_CLIENT_CONNECTED) {
+    conn->requests[i].receiving = false;
+    if (conn->state != NBD_CLIENT_CONNECTED) {
         error_setg(errp, "Connection closed");
         return -EIO;
     }
-    assert(s->ioc);
+    assert(conn->ioc);
 
-    assert(s->reply.handle == handle);
+    assert(conn->reply.handle == handle);
 
-    if (nbd_reply_is_simple(&s->reply)) {
+    if (nbd_reply_is_simple(&conn->reply)) {
         if (only_structured) {
             error_setg(errp, "Protocol error: simple reply when structured "
                              "reply chunk was expected");
             return -EINVAL;
         }
 
-        *request_ret = -nbd_errno_to_system_errno(s->reply.simple.error);
+        *request_ret = -nbd_errno_to_system_errno(conn->reply.simple.error);
         if (*request_ret < 0 || !qiov) {
             return 0;
         }
 
-        return qio_channel_readv_all(s->ioc, qiov->iov, qiov->niov,
+        return qio_channel_readv_all(conn->ioc, qiov->iov, qiov->niov,
                                      errp) < 0 ? -EIO : 0;
     }
 
     /* handle structured reply chunk */
-    assert(s->info.structured_reply);
-    chunk = &s->reply.structured;
+    assert(conn->s->info.structured_reply);
+    chunk = &conn->reply.structured;
 
     if (chunk->type == NBD_REPLY_TYPE_NONE) {
         if (!(chunk->flags & NBD_REPLY_FLAG_DONE)) {
@@ -825,7 +1081,8 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
             return -EINVAL;
         }
 
-        return nbd_co_receive_offset_data_payload(s, s->requests[i].offset,
+        return nbd_co_receive_offset_data_payload(conn,
+                                                  conn->requests[i].offset,
                                                   qiov, errp);
     }
 
@@ -833,7 +1090,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
         payload = &local_payload;
     }
 
-    ret = nbd_co_receive_structured_payload(s, payload, errp);
+    ret = nbd_co_receive_structured_payload(conn, payload, errp);
     if (ret < 0) {
         return ret;
     }
@@ -853,29 +1110,29 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
  * Return value is a fatal error code or normal nbd reply error code
  */
 static coroutine_fn int nbd_co_receive_one_chunk(
-        BDRVNBDState *s, uint64_t handle, bool only_structured,
+        NBDConnection *conn, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, NBDReply *reply, void **payload,
         Error **errp)
 {
-    int ret = nbd_co_do_receive_one_chunk(s, handle, only_structured,
+    int ret = nbd_co_do_receive_one_chunk(conn, handle, only_structured,
                                           request_ret, qiov, payload, errp);
 
     if (ret < 0) {
         memset(reply, 0, sizeof(*reply));
-        nbd_channel_error(s, ret);
+        nbd_channel_error(conn, ret);
     } else {
         /* For assert at loop start in nbd_connection_entry */
-        *reply = s->reply;
+        *reply = conn->reply;
     }
-    s->reply.handle = 0;
+    conn->reply.handle = 0;
 
-    if (s->connection_co && !s->wait_in_flight) {
+    if (conn->connection_co && !conn->wait_in_flight) {
         /*
-         * We must check s->wait_in_flight, because we may entered by
+         * We must check conn->wait_in_flight, because we may entered by
          * nbd_recv_coroutines_wake_all(), in this case we should not
          * wake connection_co here, it will woken by last request.
          */
-        aio_co_wake(s->connection_co);
+        aio_co_wake(conn->connection_co);
     }
 
     return ret;
@@ -917,16 +1174,17 @@ static void nbd_iter_request_error(NBDReplyChunkIter *iter, int ret)
  * NBD_FOREACH_REPLY_CHUNK
  * The pointer stored in @payload requires g_free() to free it.
  */
-#define NBD_FOREACH_REPLY_CHUNK(s, iter, handle, structured, \
+#define NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, structured, \
                                 qiov, reply, payload) \
     for (iter = (NBDReplyChunkIter) { .only_structured = structured }; \
-         nbd_reply_chunk_iter_receive(s, &iter, handle, qiov, reply, payload);)
+         nbd_reply_chunk_iter_receive(conn, &iter, handle, qiov, reply, \
+                                      payload);)
 
 /*
  * nbd_reply_chunk_iter_receive
  * The pointer stored in @payload requires g_free() to free it.
  */
-static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
+static bool nbd_reply_chunk_iter_receive(NBDConnection *conn,
                                          NBDReplyChunkIter *iter,
                                          uint64_t handle,
                                          QEMUIOVector *qiov, NBDReply *reply,
@@ -936,7 +1194,7 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
     NBDReply local_reply;
     NBDStructuredReplyChunk *chunk;
     Error *local_err = NULL;
-    if (s->state != NBD_CLIENT_CONNECTED) {
+    if (conn->state != NBD_CLIENT_CONNECTED) {
         error_setg(&local_err, "Connection closed");
         nbd_iter_channel_error(iter, -EIO, &local_err);
         goto break_loop;
@@ -951,7 +1209,7 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
         reply = &local_reply;
     }
 
-    ret = nbd_co_receive_one_chunk(s, handle, iter->only_structured,
+    ret = nbd_co_receive_one_chunk(conn, handle, iter->only_structured,
                                    &request_ret, qiov, reply, payload,
                                    &local_err);
     if (ret < 0) {
@@ -961,7 +1219,7 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
     }
 
     /* Do not execute the body of NBD_FOREACH_REPLY_CHUNK for simple reply. */
-    if (nbd_reply_is_simple(reply) || s->state != NBD_CLIENT_CONNECTED) {
+    if (nbd_reply_is_simple(reply) || conn->state != NBD_CLIENT_CONNECTED) {
         goto break_loop;
     }
 
@@ -983,26 +1241,26 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
     return true;
 
 break_loop:
-    s->requests[HANDLE_TO_INDEX(s, handle)].coroutine = NULL;
+    conn->requests[HANDLE_TO_INDEX(conn, handle)].coroutine = NULL;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->in_flight--;
-    if (s->in_flight == 0 && s->wait_in_flight) {
-        aio_co_wake(s->connection_co);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    conn->in_flight--;
+    if (conn->in_flight == 0 && conn->wait_in_flight) {
+        aio_co_wake(conn->connection_co);
     } else {
-        qemu_co_queue_next(&s->free_sema);
+        qemu_co_queue_next(&conn->free_sema);
     }
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_unlock(&conn->send_mutex);
 
     return false;
 }
 
-static int nbd_co_receive_return_code(BDRVNBDState *s, uint64_t handle,
+static int nbd_co_receive_return_code(NBDConnection *conn, uint64_t handle,
                                       int *request_ret, Error **errp)
 {
     NBDReplyChunkIter iter;
 
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, NULL, NULL) {
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, false, NULL, NULL, NULL) {
         /* nbd_reply_chunk_iter_receive does all the work */
     }
 
@@ -1011,7 +1269,7 @@ static int nbd_co_receive_return_code(BDRVNBDState *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
+static int nbd_co_receive_cmdread_reply(NBDConnection *conn, uint64_t handle,
                                         uint64_t offset, QEMUIOVector *qiov,
                                         int *request_ret, Error **errp)
 {
@@ -1020,7 +1278,7 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
     void *payload = NULL;
     Error *local_err = NULL;
 
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, s->info.structured_reply,
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, conn->s->info.structured_reply,
                             qiov, &reply, &payload)
     {
         int ret;
@@ -1036,17 +1294,18 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
              */
             break;
         case NBD_REPLY_TYPE_OFFSET_HOLE:
-            ret = nbd_parse_offset_hole_payload(s, &reply.structured, payload,
-                                                offset, qiov, &local_err);
+            ret = nbd_parse_offset_hole_payload(conn->s, &reply.structured,
+                                                payload, offset, qiov,
+                                                &local_err);
             if (ret < 0) {
-                nbd_channel_error(s, ret);
+                nbd_channel_error(conn, ret);
                 nbd_iter_channel_error(&iter, ret, &local_err);
             }
             break;
         default:
             if (!nbd_reply_type_is_error(chunk->type)) {
                 /* not allowed reply type */
-                nbd_channel_error(s, -EINVAL);
+                nbd_channel_error(conn, -EINVAL);
                 error_setg(&local_err,
                            "Unexpected reply type: %d (%s) for CMD_READ",
                            chunk->type, nbd_reply_type_lookup(chunk->type));
@@ -1063,9 +1322,11 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
-                                            uint64_t handle, uint64_t length,
-                                            NBDExtent *extent,
+static int nbd_co_receive_blockstatus_reply(NBDConnection *conn,
+                                            uint64_t handle, uint64_t offset,
+                                            uint64_t length, bool req_one,
+                                            NBDCachedExtent **extents,
+                                            unsigned int *nb_extents,
                                             int *request_ret, Error **errp)
 {
     NBDReplyChunkIter iter;
@@ -1074,8 +1335,9 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
     Error *local_err = NULL;
     bool received = false;
 
-    assert(!extent->length);
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, &reply, &payload) {
+    assert(!*extents);
+    *nb_extents = 0;
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, false, NULL, &reply, &payload) {
         int ret;
         NBDStructuredReplyChunk *chunk = &reply.structured;
 
@@ -1084,23 +1346,25 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
         switch (chunk->type) {
         case NBD_REPLY_TYPE_BLOCK_STATUS:
             if (received) {
-                nbd_channel_error(s, -EINVAL);
+                nbd_channel_error(conn, -EINVAL);
                 error_setg(&local_err, "Several BLOCK_STATUS chunks in reply");
                 nbd_iter_channel_error(&iter, -EINVAL, &local_err);
+                break;
             }
             received = true;
 
-            ret = nbd_parse_blockstatus_payload(s, &reply.structured,
-                                                payload, length, extent,
+            ret = nbd_parse_blockstatus_payload(conn, &reply.structured,
+                                                payload, offset, length,
+                                                req_one, extents, nb_extents,
                                                 &local_err);
             if (ret < 0) {
-                nbd_channel_error(s, ret);
+                nbd_channel_error(conn, ret);
                 nbd_iter_channel_error(&iter, ret, &local_err);
             }
             break;
         default:
             if (!nbd_reply_type_is_error(chunk->type)) {
-                nbd_channel_error(s, -EINVAL);
+                nbd_channel_error(conn, -EINVAL);
                 error_setg(&local_err,
                            "Unexpected reply type: %d (%s) "
                            "for CMD_BLOCK_STATUS",
@@ -1113,7 +1377,7 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
         payload = NULL;
     }
 
-    if (!extent->length && !iter.request_ret) {
+    if (!*nb_extents && !iter.request_ret) {
         error_setg(&local_err, "Server did not reply with any status extents");
         nbd_iter_channel_error(&iter, -EIO, &local_err);
     }
@@ -1129,6 +1393,8 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *conn;
+    bool invalidate_cache;
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -1138,13 +1404,23 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
         assert(request->type != NBD_CMD_WRITE);
     }
 
+    /*
+     * Besides our own writes, a flush makes those of other clients
+     * visible, so don't keep any status from before it either.
+     */
+    invalidate_cache = request->type != NBD_CMD_CACHE;
+    if (invalidate_cache) {
+        nbd_extent_cache_invalidate(s);
+    }
+
     do {
-        ret = nbd_co_send_request(bs, request, write_qiov);
+        conn = nbd_pick_connection(s);
+        ret = nbd_co_send_request(conn, request, write_qiov);
         if (ret < 0) {
             continue;
         }
 
-        ret = nbd_co_receive_return_code(s, request->handle,
+        ret = nbd_co_receive_return_code(conn, request->handle,
                                          &request_ret, &local_err);
         if (local_err) {
             trace_nbd_co_request_fail(request->from, request->len,
@@ -1155,7 +1431,12 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
             error_free(local_err);
             local_err = NULL;
         }
-    } while (ret < 0 && nbd_client_connecting_wait(s));
+    } while (ret < 0 && nbd_client_connecting_wait(conn));
+
+    /* Block status requests may have been answered before we completed */
+    if (invalidate_cache) {
+        nbd_extent_cache_invalidate(s);
+    }
 
     return ret ? ret : request_ret;
 }
@@ -1166,6 +1447,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *conn;
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -1198,12 +1480,13 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     }
 
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        conn = nbd_pick_connection(s);
+        ret = nbd_co_send_request(conn, &request, NULL);
         if (ret < 0) {
             continue;
         }
 
-        ret = nbd_co_receive_cmdread_reply(s, request.handle, offset, qiov,
+        ret = nbd_co_receive_cmdread_reply(conn, request.handle, offset, qiov,
                                            &request_ret, &local_err);
         if (local_err) {
             trace_nbd_co_request_fail(request.from, request.len, request.handle,
@@ -1213,7 +1496,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
             error_free(local_err);
             local_err = NULL;
         }
-    } while (ret < 0 && nbd_client_connecting_wait(s));
+    } while (ret < 0 && nbd_client_connecting_wait(conn));
 
     return ret ? ret : request_ret;
 }
@@ -1308,21 +1591,37 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
     return nbd_co_request(bs, &request, NULL);
 }
 
+static int nbd_extent_to_block_status(uint32_t flags)
+{
+    return (flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+        (flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0) |
+        BDRV_BLOCK_OFFSET_VALID;
+}
+
 static int coroutine_fn nbd_client_co_block_status(
         BlockDriverState *bs, bool want_zero, int64_t offset, int64_t bytes,
         int64_t *pnum, int64_t *map, BlockDriverState **file)
 {
     int ret, request_ret;
-    NBDExtent extent = { 0 };
+    NBDCachedExtent *extents = NULL, *extent;
+    unsigned int nb_extents = 0;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *conn;
     Error *local_err = NULL;
+    uint64_t gen;
+
+    /*
+     * Bitmaps exposed with x-dirty-bitmap can change without us writing
+     * to the export, so don't cache them and only ask for what we need.
+     */
+    bool req_one = !!s->x_dirty_bitmap;
 
     NBDRequest request = {
         .type = NBD_CMD_BLOCK_STATUS,
         .from = offset,
         .len = MIN(QEMU_ALIGN_DOWN(INT_MAX, bs->bl.request_alignment),
                    MIN(bytes, s->info.size - offset)),
-        .flags = NBD_CMD_FLAG_REQ_ONE,
+        .flags = req_one ? NBD_CMD_FLAG_REQ_ONE : 0,
     };
 
     if (!s->info.base_allocation) {
@@ -1346,17 +1645,32 @@ static int coroutine_fn nbd_client_co_block_status(
         return BDRV_BLOCK_ZERO;
     }
 
+    extent = nbd_extent_cache_lookup(s, offset);
+    if (extent) {
+        *pnum = MIN(extent->offset + extent->length - offset, bytes);
+        *map = offset;
+        *file = bs;
+        trace_nbd_extent_cache_hit(offset, *pnum, extent->flags);
+        return nbd_extent_to_block_status(extent->flags);
+    }
+
     if (s->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
+    gen = s->extent_cache_gen;
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        g_free(extents);
+        extents = NULL;
+
+        conn = nbd_pick_connection(s);
+        ret = nbd_co_send_request(conn, &request, NULL);
         if (ret < 0) {
             continue;
         }
 
-        ret = nbd_co_receive_blockstatus_reply(s, request.handle, bytes,
-                                               &extent, &request_ret,
+        ret = nbd_co_receive_blockstatus_reply(conn, request.handle, offset,
+                                               bytes, req_one, &extents,
+                                               &nb_extents, &request_ret,
                                                &local_err);
         if (local_err) {
             trace_nbd_co_request_fail(request.from, request.len, request.handle,
@@ -1366,19 +1680,26 @@ static int coroutine_fn nbd_client_co_block_status(
             error_free(local_err);
             local_err = NULL;
         }
-    } while (ret < 0 && nbd_client_connecting_wait(s));
+    } while (ret < 0 && nbd_client_connecting_wait(conn));
 
     if (ret < 0 || request_ret < 0) {
+        g_free(extents);
         return ret ? ret : request_ret;
     }
 
-    assert(extent.length);
-    *pnum = extent.length;
+    assert(nb_extents);
+    *pnum = MIN(extents[0].length, bytes);
     *map = offset;
     *file = bs;
-    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
-        (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0) |
-        BDRV_BLOCK_OFFSET_VALID;
+    ret = nbd_extent_to_block_status(extents[0].flags);
+
+    if (req_one) {
+        g_free(extents);
+    } else {
+        nbd_extent_cache_fill(s, gen, extents, nb_extents);
+    }
+
+    return ret;
 }
 
 static int nbd_client_reopen_prepare(BDRVReopenState *state,
@@ -1397,9 +1718,12 @@ static void nbd_client_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    if (s->ioc) {
-        nbd_send_request(s->ioc, &request);
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].ioc) {
+            nbd_send_request(s->conns[i].ioc, &request);
+        }
     }
 
     nbd_teardown_connection(bs);
@@ -1426,10 +1750,36 @@ static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
     return sioc;
 }
 
-static int nbd_client_connect(BlockDriverState *bs, Error **errp)
+/*
+ * Checks that an additional connection negotiated the same export as the
+ * first one, as the server is free to change it between connections.
+ */
+static bool nbd_check_same_export(BDRVNBDState *s, NBDExportInfo *info,
+                                  Error **errp)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    if (info->size != s->info.size || info->flags != s->info.flags ||
+        info->structured_reply != s->info.structured_reply ||
+        info->base_allocation != s->info.base_allocation ||
+        info->min_block != s->info.min_block ||
+        info->max_block != s->info.max_block)
+    {
+        error_setg(errp, "Server exported different parameters on an "
+                   "additional connection");
+        return false;
+    }
+    return true;
+}
+
+static int nbd_client_connect(NBDConnection *conn, Error **errp)
+{
+    BDRVNBDState *s = conn->s;
+    BlockDriverState *bs = s->bs;
     AioContext *aio_context = bdrv_get_aio_context(bs);
+    NBDExportInfo info = {
+        .request_sizes = true,
+        .structured_reply = true,
+        .base_allocation = true,
+    };
     int ret;
 
     /*
@@ -1447,25 +1797,39 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     qio_channel_attach_aio_context(QIO_CHANNEL(sioc), aio_context);
 
-    s->info.request_sizes = true;
-    s->info.structured_reply = true;
-    s->info.base_allocation = true;
-    s->info.x_dirty_bitmap = g_strdup(s->x_dirty_bitmap);
-    s->info.name = g_strdup(s->export ?: "");
+    info.x_dirty_bitmap = g_strdup(s->x_dirty_bitmap);
+    info.name = g_strdup(s->export ?: "");
     ret = nbd_receive_negotiate(aio_context, QIO_CHANNEL(sioc), s->tlscreds,
-                                s->hostname, &s->ioc, &s->info, errp);
-    g_free(s->info.x_dirty_bitmap);
-    g_free(s->info.name);
+                                s->hostname, &conn->ioc, &info, errp);
+    g_free(info.x_dirty_bitmap);
+    g_free(info.name);
+    info.x_dirty_bitmap = NULL;
+    info.name = NULL;
     if (ret < 0) {
         object_unref(OBJECT(sioc));
         return ret;
     }
-    if (s->x_dirty_bitmap && !s->info.base_allocation) {
+    if (s->x_dirty_bitmap && !info.base_allocation) {
         error_setg(errp, "requested x-dirty-bitmap %s not found",
                    s->x_dirty_bitmap);
         ret = -EINVAL;
         goto fail;
     }
+
+    /*
+     * Requests on other connections may be in flight, so the export
+     * information is only updated once negotiation has completed.
+     */
+    if (conn != &s->conns[0] && !nbd_check_same_export(s, &info, errp)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->info = info;
+    conn->context_id = info.context_id;
+
+    /* The export may have changed while we were disconnected */
+    nbd_extent_cache_invalidate(s);
+
     if (s->info.flags & NBD_FLAG_READ_ONLY) {
         ret = bdrv_apply_auto_read_only(bs, "NBD export is read-only", errp);
         if (ret < 0) {
@@ -1483,11 +1847,11 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
         }
     }
 
-    s->sioc = sioc;
+    conn->sioc = sioc;
 
-    if (!s->ioc) {
-        s->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(s->ioc));
+    if (!conn->ioc) {
+        conn->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(conn->ioc));
     }
 
     trace_nbd_client_connect_success(s->export);
@@ -1502,7 +1866,7 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
     {
         NBDRequest request = { .type = NBD_CMD_DISC };
 
-        nbd_send_request(s->ioc ?: QIO_CHANNEL(sioc), &request);
+        nbd_send_request(conn->ioc ?: QIO_CHANNEL(sioc), &request);
 
         object_unref(OBJECT(sioc));
 
@@ -1827,6 +2191,12 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server allows "
+                    "several connections to the export (default 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -1886,6 +2256,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    s->multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (s->multi_conn < 1 || s->multi_conn > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -1899,7 +2276,7 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
-    int ret;
+    int ret, i;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     ret = nbd_process_options(bs, options, errp);
@@ -1908,20 +2285,44 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     s->bs = bs;
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_queue_init(&s->free_sema);
+    s->conns = g_new0(NBDConnection, s->multi_conn);
+    s->nb_conns = 1;
+    for (i = 0; i < s->multi_conn; i++) {
+        s->conns[i].s = s;
+        qemu_co_mutex_init(&s->conns[i].send_mutex);
+        qemu_co_queue_init(&s->conns[i].free_sema);
+    }
 
-    ret = nbd_client_connect(bs, errp);
+    ret = nbd_client_connect(&s->conns[0], errp);
     if (ret < 0) {
         nbd_clear_bdrvstate(s);
         return ret;
     }
     /* successfully connected */
-    s->state = NBD_CLIENT_CONNECTED;
+    s->conns[0].state = NBD_CLIENT_CONNECTED;
+
+    /*
+     * Only servers that advertise multi-conn guarantee that the connections
+     * see each other's writes once they are flushed.  The additional
+     * connections are established in the background by their connection_co,
+     * and only used once they are up.
+     */
+    if (s->info.flags & NBD_FLAG_CAN_MULTI_CONN) {
+        s->nb_conns = s->multi_conn;
+    }
+    trace_nbd_client_multi_conn(s->multi_conn, s->nb_conns);
 
-    s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
-    bdrv_inc_in_flight(bs);
-    aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[i];
+
+        if (i > 0) {
+            conn->state = NBD_CLIENT_CONNECTING_NOWAIT;
+        }
+        conn->connection_co = qemu_coroutine_create(nbd_connection_entry,
+                                                    conn);
+        bdrv_inc_in_flight(bs);
+        aio_co_schedule(bdrv_get_aio_context(bs), conn->connection_co);
+    }
 
     return 0;
 }
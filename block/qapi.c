@@ -555,6 +555,11 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
         s->has_driver_specific = true;
     }
 
+    if (bs->drv && bs->drv->supports_backing && !bs->drv->is_filter) {
+        s->has_block_status_cache = true;
+        s->block_status_cache = bdrv_bsc_get_stats(bs);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, blk_level);
@@ -208,7 +208,7 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
                    uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
-    int start_of_slice = sizeof(uint64_t) *
+    int start_of_slice = l2_entry_size(s) *
         (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
     return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
@@ -281,7 +281,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * l2_entry_size(s));
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -305,7 +305,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new entry in the l2 cache */
 
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     trace_qcow2_l2_allocate_get_empty(bs, l1_index);
@@ -369,7 +369,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -383,12 +383,14 @@ fail:
  * cluster which may require a different handling)
  */
 static int count_contiguous_clusters(BlockDriverState *bs, int nb_clusters,
-        int cluster_size, uint64_t *l2_slice, uint64_t stop_flags)
+        int cluster_size, uint64_t *l2_slice, int l2_index,
+        uint64_t stop_flags)
 {
+    BDRVQcow2State *s = bs->opaque;
     int i;
     QCow2ClusterType first_cluster_type;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_slice[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_slice, l2_index);
     uint64_t offset = first_entry & mask;
 
     first_cluster_type = qcow2_get_cluster_type(bs, first_entry);
@@ -401,7 +403,7 @@ static int count_contiguous_clusters(BlockDriverState *bs, int nb_clusters,
            first_cluster_type == QCOW2_CLUSTER_ZERO_ALLOC);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_slice[i]) & mask;
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i) & mask;
         if (offset + (uint64_t) i * cluster_size != l2_entry) {
             break;
         }
@@ -417,14 +419,16 @@ static int count_contiguous_clusters(BlockDriverState *bs, int nb_clusters,
 static int count_contiguous_clusters_unallocated(BlockDriverState *bs,
                                                  int nb_clusters,
                                                  uint64_t *l2_slice,
+                                                 int l2_index,
                                                  QCow2ClusterType wanted_type)
 {
+    BDRVQcow2State *s = bs->opaque;
     int i;
 
     assert(wanted_type == QCOW2_CLUSTER_ZERO_PLAIN ||
            wanted_type == QCOW2_CLUSTER_UNALLOCATED);
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t entry = be64_to_cpu(l2_slice[i]);
+        uint64_t entry = get_l2_entry(s, l2_slice, l2_index + i);
         QCow2ClusterType type = qcow2_get_cluster_type(bs, entry);
 
         if (type != wanted_type) {
@@ -435,6 +439,121 @@ static int count_contiguous_clusters_unallocated(BlockDriverState *bs,
     return i;
 }
 
+/*
+ * For images with extended L2 entries, returns the type of subcluster
+ * @sc_from of the cluster described by @l2_entry and @l2_bitmap in *type and
+ * the number of consecutive subclusters (starting from @sc_from, up to the
+ * end of the cluster) that have this same type.
+ *
+ * Subclusters of a cluster without a host offset are reported as either
+ * QCOW2_CLUSTER_UNALLOCATED or QCOW2_CLUSTER_ZERO_PLAIN; subclusters of an
+ * allocated cluster as QCOW2_CLUSTER_NORMAL, QCOW2_CLUSTER_ZERO_ALLOC or (if
+ * they are not allocated yet) QCOW2_CLUSTER_UNALLOCATED.
+ *
+ * Returns -EIO if the L2 entry and its bitmap are inconsistent.
+ */
+static int qcow2_get_subcluster_range_type(BlockDriverState *bs,
+                                           uint64_t l2_entry,
+                                           uint64_t l2_bitmap,
+                                           unsigned int sc_from,
+                                           QCow2ClusterType *type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
+    uint32_t alloc = (uint32_t)l2_bitmap >> sc_from;
+    uint32_t zero = (uint32_t)(l2_bitmap >> 32) >> sc_from;
+    int max = s->subclusters_per_cluster - sc_from;
+
+    assert(has_subclusters(s) && sc_from < s->subclusters_per_cluster);
+
+    if (cluster_type == QCOW2_CLUSTER_COMPRESSED) {
+        *type = QCOW2_CLUSTER_COMPRESSED;
+        return l2_bitmap ? -EIO : max;
+    }
+
+    if ((l2_entry & QCOW_OFLAG_ZERO) ||
+        ((uint32_t)l2_bitmap & (uint32_t)(l2_bitmap >> 32)) ||
+        (cluster_type == QCOW2_CLUSTER_UNALLOCATED &&
+         (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC)))
+    {
+        return -EIO;
+    }
+
+    if (zero & 1) {
+        *type = cluster_type == QCOW2_CLUSTER_NORMAL ?
+                QCOW2_CLUSTER_ZERO_ALLOC : QCOW2_CLUSTER_ZERO_PLAIN;
+        return MIN(cto32(zero), max);
+    } else if (alloc & 1) {
+        *type = QCOW2_CLUSTER_NORMAL;
+        return MIN(cto32(alloc), max);
+    } else {
+        *type = QCOW2_CLUSTER_UNALLOCATED;
+        return MIN(ctz32(alloc | zero), max);
+    }
+}
+
+/*
+ * For images with extended L2 entries, counts how many consecutive
+ * subclusters starting at subcluster @sc_index of the cluster at @l2_index
+ * have the same type (stored in *type) and, if they are allocated, are
+ * stored contiguously in the image file.
+ *
+ * Returns the number of subclusters or -EIO if the first L2 entry is
+ * invalid.
+ */
+static int count_contiguous_subclusters(BlockDriverState *bs, int nb_clusters,
+                                        unsigned int sc_index,
+                                        uint64_t *l2_slice, int l2_index,
+                                        QCow2ClusterType *type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t expected_offset = 0;
+    int i, count = 0;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+        unsigned int first_sc = i ? 0 : sc_index;
+        QCow2ClusterType sc_type;
+        int ret;
+
+        ret = qcow2_get_subcluster_range_type(bs, l2_entry, l2_bitmap,
+                                              first_sc, &sc_type);
+        if (ret < 0) {
+            if (i == 0) {
+                return ret;
+            }
+            /* Report the invalid entry when it is looked up by itself */
+            break;
+        }
+
+        if (i == 0) {
+            *type = sc_type;
+            expected_offset = l2_entry & L2E_OFFSET_MASK;
+            if (sc_type == QCOW2_CLUSTER_COMPRESSED) {
+                /* Compressed clusters can only be processed one by one */
+                return ret;
+            }
+        } else if (sc_type != *type) {
+            break;
+        } else if (sc_type == QCOW2_CLUSTER_NORMAL ||
+                   sc_type == QCOW2_CLUSTER_ZERO_ALLOC) {
+            expected_offset += s->cluster_size;
+            if ((l2_entry & L2E_OFFSET_MASK) != expected_offset) {
+                break;
+            }
+        }
+
+        count += ret;
+        /* Stop if the type changes before the end of the cluster */
+        if (first_sc + ret < s->subclusters_per_cluster) {
+            break;
+        }
+    }
+
+    return count;
+}
+
 static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
                                             uint64_t src_cluster_offset,
                                             unsigned offset_in_cluster,
@@ -517,7 +636,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     unsigned int l2_index;
     uint64_t l1_index, l2_offset, *l2_slice;
-    int c;
+    int c = 0;
     unsigned int offset_in_cluster;
     uint64_t bytes_available, bytes_needed, nb_clusters;
     QCow2ClusterType type;
@@ -570,7 +689,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = offset_to_l2_slice_index(s, offset);
-    *cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_slice, l2_index);
 
     nb_clusters = size_to_clusters(s, bytes_needed);
     /* bytes_needed <= *bytes + offset_in_cluster, both of which are unsigned
@@ -587,6 +706,23 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         ret = -EIO;
         goto fail;
     }
+    if (has_subclusters(s) && type != QCOW2_CLUSTER_COMPRESSED) {
+        unsigned int sc_index = offset_to_sc_index(s, offset);
+
+        c = count_contiguous_subclusters(bs, nb_clusters, sc_index,
+                                         l2_slice, l2_index, &type);
+        if (c < 0) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster "
+                                    "entry found (L2 offset: %#" PRIx64
+                                    ", L2 index: %#x)", l2_offset, l2_index);
+            ret = -EIO;
+            goto fail;
+        }
+        if (type == QCOW2_CLUSTER_UNALLOCATED ||
+            type == QCOW2_CLUSTER_ZERO_PLAIN) {
+            *cluster_offset = 0;
+        }
+    }
     switch (type) {
     case QCOW2_CLUSTER_COMPRESSED:
         if (has_data_file(bs)) {
@@ -604,15 +740,21 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     case QCOW2_CLUSTER_ZERO_PLAIN:
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_unallocated(bs, nb_clusters,
-                                                  &l2_slice[l2_index], type);
+        if (!has_subclusters(s)) {
+            c = count_contiguous_clusters_unallocated(bs, nb_clusters,
+                                                      l2_slice, l2_index,
+                                                      type);
+        }
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_ZERO_ALLOC:
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(bs, nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index], QCOW_OFLAG_ZERO);
+        if (!has_subclusters(s)) {
+            c = count_contiguous_clusters(bs, nb_clusters, s->cluster_size,
+                                          l2_slice, l2_index,
+                                          QCOW_OFLAG_ZERO);
+        }
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1,
@@ -641,7 +783,13 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
-    bytes_available = (int64_t)c * s->cluster_size;
+    if (has_subclusters(s) && type != QCOW2_CLUSTER_COMPRESSED) {
+        /* c counts subclusters starting from the one containing offset */
+        bytes_available = ((uint64_t)offset_to_sc_index(s, offset) + c)
+                          << s->subcluster_bits;
+    } else {
+        bytes_available = (int64_t)c * s->cluster_size;
+    }
 
 out:
     if (bytes_available > bytes_needed) {
@@ -709,7 +857,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                                 QCOW2_DISCARD_OTHER);
         }
 
@@ -765,7 +913,7 @@ int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
         return -EIO;
@@ -794,7 +942,10 @@ int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
-    l2_slice[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_slice, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_slice, l2_index, 0);
+    }
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
     *host_offset = cluster_offset & s->cluster_offset_mask;
@@ -987,14 +1138,37 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
          * cluster the second one has to do RMW (which is done above by
          * perform_cow()), update l2 table with its cluster pointer and free
          * old cluster. This is what this loop does */
-        if (l2_slice[l2_index + i] != 0) {
-            old_cluster[j++] = l2_slice[l2_index + i];
+        if (get_l2_entry(s, l2_slice, l2_index + i) != 0) {
+            old_cluster[j++] = get_l2_entry(s, l2_slice, l2_index + i);
         }
 
         /* The offset must fit in the offset field of the L2 table entry */
         assert((offset & L2E_OFFSET_MASK) == offset);
 
-        l2_slice[l2_index + i] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_slice, l2_index + i, offset | QCOW_OFLAG_COPIED);
+
+        /* Mark the subclusters that were written or copied as allocated */
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+            unsigned written_from = m->cow_start.offset;
+            unsigned written_to = m->cow_end.offset + m->cow_end.nb_bytes;
+            int first_sc, last_sc;
+
+            if (m->prealloc) {
+                written_from = 0;
+                written_to = m->nb_clusters << s->cluster_bits;
+            }
+
+            /* Narrow written_from and written_to down to this cluster */
+            written_from = MAX(written_from, i << s->cluster_bits);
+            written_to = MIN(written_to, (i + 1) << s->cluster_bits);
+            assert(written_from < written_to);
+            first_sc = offset_to_sc_index(s, written_from);
+            last_sc = offset_to_sc_index(s, written_to - 1);
+            l2_bitmap |= QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc + 1);
+            l2_bitmap &= ~QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc + 1);
+            set_l2_bitmap(s, l2_slice, l2_index + i, l2_bitmap);
+        }
      }
 
 
@@ -1008,7 +1182,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (!m->keep_old_clusters && j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -1041,10 +1215,11 @@ void qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m)
 static int count_cow_clusters(BlockDriverState *bs, int nb_clusters,
     uint64_t *l2_slice, int l2_index)
 {
+    BDRVQcow2State *s = bs->opaque;
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_slice[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
         QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
 
         switch(cluster_type) {
@@ -1093,11 +1268,21 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
 
         uint64_t start = guest_offset;
         uint64_t end = start + bytes;
-        uint64_t old_start = l2meta_cow_start(old_alloc);
-        uint64_t old_end = l2meta_cow_end(old_alloc);
+        uint64_t old_start = start_of_cluster(s, l2meta_cow_start(old_alloc));
+        uint64_t old_end = ROUND_UP(l2meta_cow_end(old_alloc),
+                                    s->cluster_size);
 
         if (end <= old_start || start >= old_end) {
             /* No intersection */
+        } else if (old_alloc->keep_old_clusters &&
+                   (end <= l2meta_cow_start(old_alloc) ||
+                    start >= l2meta_cow_end(old_alloc))) {
+            /*
+             * The in-flight request fills subclusters of an existing host
+             * cluster and doesn't touch the ones we are interested in.
+             * Requests that allocate new clusters are serialized at
+             * cluster granularity because they replace the whole L2 entry.
+             */
         } else {
             if (start < old_start) {
                 /* Stop at the start of a running allocation */
@@ -1131,6 +1316,45 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
     return 0;
 }
 
+/*
+ * For images with extended L2 entries, returns how many of the @bytes
+ * starting at @guest_offset are in subclusters that are already allocated,
+ * so that they can be overwritten in place. Only the @nb_clusters clusters
+ * starting at @l2_index are considered.
+ */
+static uint64_t count_allocated_subcluster_bytes(BlockDriverState *bs,
+                                                 uint64_t guest_offset,
+                                                 uint64_t bytes,
+                                                 int nb_clusters,
+                                                 uint64_t *l2_slice,
+                                                 int l2_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start = offset_into_cluster(s, guest_offset);
+    uint64_t end = start + bytes;
+    int i;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint32_t alloc = get_l2_bitmap(s, l2_slice, l2_index + i);
+        uint64_t cluster_start = (uint64_t)i << s->cluster_bits;
+        uint64_t cluster_end = cluster_start + s->cluster_size;
+        unsigned int first_sc =
+            offset_to_sc_index(s, MAX(start, cluster_start));
+        uint64_t alloc_end = cluster_start +
+            ((uint64_t)(first_sc + cto32(alloc >> first_sc))
+             << s->subcluster_bits);
+
+        if (alloc_end < MIN(end, cluster_end)) {
+            return alloc_end > start ? alloc_end - start : 0;
+        }
+        if (end <= cluster_end) {
+            break;
+        }
+    }
+
+    return bytes;
+}
+
 /*
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If *host_offset is
@@ -1187,7 +1411,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(bs, cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1195,7 +1419,9 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
     {
         /* If a specific host_offset is required, check it */
         bool offset_matches =
-            (cluster_offset & L2E_OFFSET_MASK) == *host_offset;
+            (cluster_offset & L2E_OFFSET_MASK) ==
+            start_of_cluster(s, *host_offset);
+        uint64_t keep_bytes;
 
         if (offset_into_cluster(s, cluster_offset & L2E_OFFSET_MASK)) {
             qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset "
@@ -1215,14 +1441,27 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
             count_contiguous_clusters(bs, nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index],
+                                      l2_slice, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
-        *bytes = MIN(*bytes,
-                 keep_clusters * s->cluster_size
-                 - offset_into_cluster(s, guest_offset));
+        keep_bytes = MIN(*bytes,
+                         keep_clusters * s->cluster_size
+                         - offset_into_cluster(s, guest_offset));
+
+        /* Unallocated and zero subclusters need to be allocated first */
+        if (has_subclusters(s)) {
+            keep_bytes = count_allocated_subcluster_bytes(bs, guest_offset,
+                                                          keep_bytes,
+                                                          keep_clusters,
+                                                          l2_slice, l2_index);
+            if (keep_bytes == 0) {
+                ret = 0;
+                goto out;
+            }
+        }
 
+        *bytes = keep_bytes;
         ret = 1;
     } else {
         ret = 0;
@@ -1296,6 +1535,83 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     }
 }
 
+/*
+ * For images with extended L2 entries, only the parts of the first and last
+ * subclusters touched by a write that are not overwritten need COW. In
+ * addition, if the request replaces an existing host cluster, all of its
+ * allocated subclusters need to be copied to the new location.
+ *
+ * Calculates the start of the COW region at the head and the end of the COW
+ * region at the tail of an allocation of @nb_clusters clusters for a write at
+ * @guest_offset that ends @nb_bytes after the start of the first cluster.
+ * Both values are relative to the start of the first cluster.
+ *
+ * Returns 0 on success, -errno on error.
+ */
+static int calculate_subcluster_cow(BlockDriverState *bs,
+                                    uint64_t guest_offset, int nb_clusters,
+                                    unsigned nb_bytes, bool keep_old,
+                                    unsigned *cow_start_from,
+                                    unsigned *cow_end_to)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned last_cluster_start = (nb_clusters - 1) << s->cluster_bits;
+    unsigned sc_start = offset_to_sc_index(s, guest_offset);
+    unsigned sc_end = DIV_ROUND_UP(nb_bytes - last_cluster_start,
+                                   s->subcluster_size);
+    uint64_t *l2_slice;
+    uint64_t l2_entry;
+    uint32_t alloc;
+    int l2_index, ret;
+
+    assert(nb_bytes > last_cluster_start);
+
+    *cow_start_from = sc_start << s->subcluster_bits;
+    *cow_end_to = last_cluster_start + (sc_end << s->subcluster_bits);
+
+    if (keep_old) {
+        /* The other subclusters of the cluster stay where they are */
+        return 0;
+    }
+
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    alloc = get_l2_bitmap(s, l2_slice, l2_index);
+    switch (qcow2_get_cluster_type(bs, l2_entry)) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        *cow_start_from = 0;
+        break;
+    case QCOW2_CLUSTER_NORMAL:
+        /* Copy all allocated subclusters before the write, too */
+        *cow_start_from = MIN(sc_start, ctz32(alloc)) << s->subcluster_bits;
+        break;
+    default:
+        break;
+    }
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index + nb_clusters - 1);
+    alloc = get_l2_bitmap(s, l2_slice, l2_index + nb_clusters - 1);
+    switch (qcow2_get_cluster_type(bs, l2_entry)) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        *cow_end_to = last_cluster_start + s->cluster_size;
+        break;
+    case QCOW2_CLUSTER_NORMAL:
+        /* Copy all allocated subclusters after the write, too */
+        *cow_end_to = last_cluster_start +
+                      (MAX(sc_end, 32 - clz32(alloc)) << s->subcluster_bits);
+        break;
+    default:
+        break;
+    }
+
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return 0;
+}
+
 /*
  * Allocates new clusters for an area that either is yet unallocated or needs a
  * copy on write. If *host_offset is not INV_OFFSET, clusters are only
@@ -1353,8 +1669,40 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_slice[l2_index]);
-    nb_clusters = count_cow_clusters(bs, nb_clusters, l2_slice, l2_index);
+    entry = get_l2_entry(s, l2_slice, l2_index);
+
+    if (has_subclusters(s) &&
+        qcow2_get_cluster_type(bs, entry) == QCOW2_CLUSTER_NORMAL &&
+        (entry & QCOW_OFLAG_COPIED))
+    {
+        /*
+         * handle_copied() found subclusters in this cluster that are not
+         * allocated yet. Allocate them in the existing host cluster.
+         */
+        if (offset_into_cluster(s, entry & L2E_OFFSET_MASK)) {
+            qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+            qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset "
+                                    "%#llx unaligned (guest offset: %#" PRIx64
+                                    ")", entry & L2E_OFFSET_MASK,
+                                    guest_offset);
+            ret = -EIO;
+            goto fail;
+        }
+
+        if (*host_offset != INV_OFFSET &&
+            start_of_cluster(s, *host_offset) != (entry & L2E_OFFSET_MASK)) {
+            /* Can't extend contiguous allocation */
+            qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+            *bytes = 0;
+            return 0;
+        }
+
+        nb_clusters = 1;
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
+        keep_old_clusters = true;
+    } else {
+        nb_clusters = count_cow_clusters(bs, nb_clusters, l2_slice, l2_index);
+    }
 
     /* This function is only called when there were no non-COW clusters, so if
      * we can't find any unallocated or COW clusters either, something is
@@ -1382,7 +1730,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
          * nb_clusters already to a range of COW clusters */
         preallocated_nb_clusters =
             count_contiguous_clusters(bs, nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index], QCOW_OFLAG_COPIED);
+                                      l2_slice, l2_index, QCOW_OFLAG_COPIED);
         assert(preallocated_nb_clusters > 0);
 
         nb_clusters = preallocated_nb_clusters;
@@ -1431,8 +1779,24 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t requested_bytes = *bytes + offset_into_cluster(s, guest_offset);
     int avail_bytes = nb_clusters << s->cluster_bits;
     int nb_bytes = MIN(requested_bytes, avail_bytes);
+    unsigned cow_start_from = 0;
+    unsigned cow_end_to = avail_bytes;
     QCowL2Meta *old_m = *m;
 
+    if (has_subclusters(s)) {
+        ret = calculate_subcluster_cow(bs, guest_offset, nb_clusters, nb_bytes,
+                                       keep_old_clusters, &cow_start_from,
+                                       &cow_end_to);
+        if (ret < 0) {
+            if (!has_data_file(bs) && !keep_old_clusters) {
+                qcow2_free_clusters(bs, alloc_cluster_offset,
+                                    nb_clusters << s->cluster_bits,
+                                    QCOW2_DISCARD_NEVER);
+            }
+            goto fail;
+        }
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1445,12 +1809,12 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .keep_old_clusters  = keep_old_clusters,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_bytes   = offset_into_cluster(s, guest_offset),
+            .offset     = cow_start_from,
+            .nb_bytes   = offset_into_cluster(s, guest_offset) - cow_start_from,
         },
         .cow_end = {
             .offset     = nb_bytes,
-            .nb_bytes   = avail_bytes - nb_bytes,
+            .nb_bytes   = cow_end_to - nb_bytes,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1623,9 +1987,10 @@ static int discard_in_l2_slice(BlockDriverState *bs, uint64_t offset,
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t old_l2_entry;
+        uint64_t old_l2_entry, old_l2_bitmap;
 
-        old_l2_entry = be64_to_cpu(l2_slice[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        old_l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1639,10 +2004,15 @@ static int discard_in_l2_slice(BlockDriverState *bs, uint64_t offset,
          *
          * If full_discard is true, the sector should not read back as zeroes,
          * but rather fall through to the backing file.
+         *
+         * With extended L2 entries, unallocated clusters may still have
+         * subclusters that are marked as zero.
          */
         switch (qcow2_get_cluster_type(bs, old_l2_entry)) {
         case QCOW2_CLUSTER_UNALLOCATED:
-            if (full_discard || !bs->backing) {
+            if (full_discard ? !old_l2_bitmap :
+                (!bs->backing || old_l2_bitmap == QCOW_L2_BITMAP_ALL_ZEROES))
+            {
                 continue;
             }
             break;
@@ -1664,10 +2034,14 @@ static int discard_in_l2_slice(BlockDriverState *bs, uint64_t offset,
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
-        if (!full_discard && s->qcow_version >= 3) {
-            l2_slice[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            set_l2_entry(s, l2_slice, l2_index + i, 0);
+            set_l2_bitmap(s, l2_slice, l2_index + i,
+                          full_discard ? 0 : QCOW_L2_BITMAP_ALL_ZEROES);
+        } else if (!full_discard && s->qcow_version >= 3) {
+            set_l2_entry(s, l2_slice, l2_index + i, QCOW_OFLAG_ZERO);
         } else {
-            l2_slice[l2_index + i] = cpu_to_be64(0);
+            set_l2_entry(s, l2_slice, l2_index + i, 0);
         }
 
         /* Then decrease the refcount */
@@ -1747,24 +2121,36 @@ static int zero_in_l2_slice(BlockDriverState *bs, uint64_t offset,
         uint64_t old_offset;
         QCow2ClusterType cluster_type;
 
-        old_offset = be64_to_cpu(l2_slice[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_slice, l2_index + i);
 
         /*
          * Minimize L2 changes if the cluster already reads back as
          * zeroes with correct allocation.
          */
         cluster_type = qcow2_get_cluster_type(bs, old_offset);
-        if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN ||
-            (cluster_type == QCOW2_CLUSTER_ZERO_ALLOC && !unmap)) {
+        if (has_subclusters(s)) {
+            if (get_l2_bitmap(s, l2_slice, l2_index + i) ==
+                QCOW_L2_BITMAP_ALL_ZEROES &&
+                (cluster_type == QCOW2_CLUSTER_UNALLOCATED || !unmap)) {
+                continue;
+            }
+        } else if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN ||
+                   (cluster_type == QCOW2_CLUSTER_ZERO_ALLOC && !unmap)) {
             continue;
         }
 
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
         if (cluster_type == QCOW2_CLUSTER_COMPRESSED || unmap) {
-            l2_slice[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_slice, l2_index + i,
+                         has_subclusters(s) ? 0 : QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
-        } else {
-            l2_slice[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+        } else if (!has_subclusters(s)) {
+            set_l2_entry(s, l2_slice, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
+        }
+        if (has_subclusters(s)) {
+            set_l2_bitmap(s, l2_slice, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
         }
     }
 
@@ -1847,7 +2233,10 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     int ret;
     int i, j;
 
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    /* qcow2_downgrade() refuses to downgrade images with extended L2 entries */
+    assert(!has_subclusters(s));
+
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     if (!is_active_l1) {
@@ -1902,7 +2291,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             }
 
             for (j = 0; j < s->l2_slice_size; j++) {
-                uint64_t l2_entry = be64_to_cpu(l2_slice[j]);
+                uint64_t l2_entry = get_l2_entry(s, l2_slice, j);
                 int64_t offset = l2_entry & L2E_OFFSET_MASK;
                 QCow2ClusterType cluster_type =
                     qcow2_get_cluster_type(bs, l2_entry);
@@ -1916,7 +2305,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                     if (!bs->backing) {
                         /* not backed; therefore we can simply deallocate the
                          * cluster */
-                        l2_slice[j] = 0;
+                        set_l2_entry(s, l2_slice, j, 0);
                         l2_dirty = true;
                         continue;
                     }
@@ -1982,9 +2371,9 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                 }
 
                 if (l2_refcount == 1) {
-                    l2_slice[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                    set_l2_entry(s, l2_slice, j, offset | QCOW_OFLAG_COPIED);
                 } else {
-                    l2_slice[j] = cpu_to_be64(offset);
+                    set_l2_entry(s, l2_slice, j, offset);
                 }
                 l2_dirty = true;
             }
@@ -33,6 +33,7 @@
 #include <zstd_errors.h>
 #endif
 
+#include "qapi/error.h"
 #include "qcow2.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
@@ -66,13 +67,22 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
  * Compression
  */
 
+struct Qcow2CompressionDict {
+#ifdef CONFIG_ZSTD
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+#endif
+};
+
 typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size);
+                                     const void *src, size_t src_size,
+                                     const Qcow2CompressionDict *dict);
 typedef struct Qcow2CompressData {
     void *dest;
     size_t dest_size;
     const void *src;
     size_t src_size;
+    const Qcow2CompressionDict *dict;
     ssize_t ret;
 
     Qcow2CompressFunc func;
@@ -85,17 +95,21 @@ typedef struct Qcow2CompressData {
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @dict - must be NULL, zlib images have no compression dictionary
  *
  * Returns: compressed size on success
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
 static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
-                                   const void *src, size_t src_size)
+                                   const void *src, size_t src_size,
+                                   const Qcow2CompressionDict *dict)
 {
     ssize_t ret;
     z_stream strm;
 
+    assert(!dict);
+
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
     ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
@@ -133,16 +147,20 @@ static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @dict - must be NULL, zlib images have no compression dictionary
  *
  * Returns: 0 on success
  *          -EIO on fail
  */
 static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size)
+                                     const void *src, size_t src_size,
+                                     const Qcow2CompressionDict *dict)
 {
     int ret;
     z_stream strm;
 
+    assert(!dict);
+
     memset(&strm, 0, sizeof(strm));
     strm.avail_in = src_size;
     strm.next_in = (void *) src;
@@ -180,13 +198,15 @@ static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @dict - digested compression dictionary of the image, or NULL
  *
  * Returns: compressed size on success
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
 static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
-                                   const void *src, size_t src_size)
+                                   const void *src, size_t src_size,
+                                   const Qcow2CompressionDict *dict)
 {
     ssize_t ret;
     size_t zstd_ret;
@@ -205,6 +225,12 @@ static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
     if (!cctx) {
         return -EIO;
     }
+
+    if (dict && ZSTD_isError(ZSTD_CCtx_refCDict(cctx, dict->cdict))) {
+        ret = -EIO;
+        goto out;
+    }
+
     /*
      * Use the zstd streamed interface for symmetry with decompression,
      * where streaming is essential since we don't record the exact
@@ -249,12 +275,14 @@ out:
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @dict - digested compression dictionary of the image, or NULL
  *
  * Returns: 0 on success
  *          -EIO on any error
  */
 static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size)
+                                     const void *src, size_t src_size,
+                                     const Qcow2CompressionDict *dict)
 {
     size_t zstd_ret = 0;
     ssize_t ret = 0;
@@ -274,6 +302,11 @@ static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
         return -EIO;
     }
 
+    if (dict && ZSTD_isError(ZSTD_DCtx_refDDict(dctx, dict->ddict))) {
+        ZSTD_freeDCtx(dctx);
+        return -EIO;
+    }
+
     /*
      * The compressed stream from the input buffer may consist of more
      * than one zstd frame. So we iterate until we get a fully
@@ -325,12 +358,68 @@ static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
 }
 #endif
 
+/*
+ * qcow2_compression_dict_new()
+ *
+ * Digest the compression dictionary @buf of @len bytes for use with
+ * the compression method @type.  Both trained zstd dictionaries and
+ * raw content (prefix) dictionaries are accepted.
+ *
+ * Returns: the digested dictionary on success
+ *          NULL on failure, with @errp set
+ */
+Qcow2CompressionDict *qcow2_compression_dict_new(Qcow2CompressionType type,
+                                                 const void *buf, size_t len,
+                                                 Error **errp)
+{
+    Qcow2CompressionDict *dict;
+
+    if (len == 0 || len > QCOW2_MAX_COMPRESSION_DICT_SIZE) {
+        error_setg(errp, "Compression dictionary size must be between 1 and "
+                   "%d bytes", QCOW2_MAX_COMPRESSION_DICT_SIZE);
+        return NULL;
+    }
+
+    switch (type) {
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        dict = g_new0(Qcow2CompressionDict, 1);
+        dict->cdict = ZSTD_createCDict(buf, len, ZSTD_CLEVEL_DEFAULT);
+        dict->ddict = ZSTD_createDDict(buf, len);
+        if (!dict->cdict || !dict->ddict) {
+            error_setg(errp, "Could not load zstd compression dictionary");
+            qcow2_compression_dict_free(dict);
+            return NULL;
+        }
+        return dict;
+#endif
+
+    default:
+        error_setg(errp, "Compression dictionaries are only supported with "
+                   "the zstd compression type");
+        return NULL;
+    }
+}
+
+void qcow2_compression_dict_free(Qcow2CompressionDict *dict)
+{
+    if (!dict) {
+        return;
+    }
+
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCDict(dict->cdict);
+    ZSTD_freeDDict(dict->ddict);
+#endif
+    g_free(dict);
+}
+
 static int qcow2_compress_pool_func(void *opaque)
 {
     Qcow2CompressData *data = opaque;
 
     data->ret = data->func(data->dest, data->dest_size,
-                           data->src, data->src_size);
+                           data->src, data->src_size, data->dict);
 
     return 0;
 }
@@ -339,11 +428,13 @@ static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
+    BDRVQcow2State *s = bs->opaque;
     Qcow2CompressData arg = {
         .dest = dest,
         .dest_size = dest_size,
         .src = src,
         .src_size = src_size,
+        .dict = s->compression_dict,
         .func = func,
     };
 
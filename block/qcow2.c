@@ -71,10 +71,12 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_COMPRESSION_DICT 0x7a646963
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t file_cluster_offset,
+                           const uint64_t *l2_entries,
+                           int nb_clusters,
                            uint64_t offset,
                            uint64_t bytes,
                            QEMUIOVector *qiov,
@@ -414,6 +416,72 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_COMPRESSION_DICT:
+        {
+            Qcow2CompressionDictHeaderExtension *dict_ext =
+                &s->compression_dict_header;
+            g_autofree uint8_t *dict_buf = NULL;
+
+            if (s->compression_dict) {
+                error_setg(errp, "Duplicate compression dictionary header "
+                           "extension");
+                return -EINVAL;
+            }
+
+            if (ext.len != sizeof(*dict_ext)) {
+                error_setg(errp, "Compression dictionary header extension "
+                           "size %u, but expected size %zu", ext.len,
+                           sizeof(*dict_ext));
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file, offset, dict_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Unable to read compression "
+                                 "dictionary header extension");
+                return ret;
+            }
+            dict_ext->offset = be64_to_cpu(dict_ext->offset);
+            dict_ext->length = be64_to_cpu(dict_ext->length);
+
+            if (offset_into_cluster(s, dict_ext->offset)) {
+                error_setg(errp, "Compression dictionary offset '%" PRIu64
+                           "' is not a multiple of cluster size '%u'",
+                           dict_ext->offset, s->cluster_size);
+                return -EINVAL;
+            }
+
+            if (dict_ext->length == 0 ||
+                dict_ext->length > QCOW2_MAX_COMPRESSION_DICT_SIZE) {
+                error_setg(errp, "Compression dictionary size %" PRIu64
+                           " is invalid (must be between 1 and %d)",
+                           dict_ext->length, QCOW2_MAX_COMPRESSION_DICT_SIZE);
+                return -EINVAL;
+            }
+
+            dict_buf = g_malloc(dict_ext->length);
+            ret = bdrv_pread(bs->file, dict_ext->offset, dict_buf,
+                             dict_ext->length);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not read compression "
+                                 "dictionary");
+                return ret;
+            }
+
+            s->compression_dict =
+                qcow2_compression_dict_new(s->compression_type, dict_buf,
+                                           dict_ext->length, errp);
+            if (!s->compression_dict) {
+                return -EINVAL;
+            }
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got compression dictionary extension: "
+                   "offset=%" PRIu64 " length=%" PRIu64 "\n",
+                   dict_ext->offset, dict_ext->length);
+#endif
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -679,6 +747,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_OVERLAP_INACTIVE_L1,
     QCOW2_OPT_OVERLAP_INACTIVE_L2,
     QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    QCOW2_OPT_OVERLAP_COMPRESSION_DICT,
     QCOW2_OPT_CACHE_SIZE,
     QCOW2_OPT_L2_CACHE_SIZE,
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
@@ -769,6 +838,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into the bitmap directory",
         },
+        {
+            .name = QCOW2_OPT_OVERLAP_COMPRESSION_DICT,
+            .type = QEMU_OPT_BOOL,
+            .help = "Check for unintended writes into the compression "
+                    "dictionary",
+        },
         {
             .name = QCOW2_OPT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -811,6 +886,7 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L1_BITNR]      = QCOW2_OPT_OVERLAP_INACTIVE_L1,
     [QCOW2_OL_INACTIVE_L2_BITNR]      = QCOW2_OPT_OVERLAP_INACTIVE_L2,
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR] = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    [QCOW2_OL_COMPRESSION_DICT_BITNR] = QCOW2_OPT_OVERLAP_COMPRESSION_DICT,
 };
 
 static void cache_clean_timer_cb(void *opaque)
@@ -870,7 +946,7 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     uint64_t max_l2_entries = DIV_ROUND_UP(virtual_disk_size, s->cluster_size);
     /* An L2 table is always one cluster in size so the max cache size
      * should be a multiple of the cluster size. */
-    uint64_t max_l2_cache = ROUND_UP(max_l2_entries * sizeof(uint64_t),
+    uint64_t max_l2_cache = ROUND_UP(max_l2_entries * l2_entry_size(s),
                                      s->cluster_size);
 
     combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
@@ -1031,7 +1107,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
                                            l2_cache_entry_size);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
@@ -1473,7 +1549,23 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s)) {
+        if (s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+            error_setg(errp, "Cluster size must be at least %u bytes for "
+                       "images with extended L2 entries",
+                       1U << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->subclusters_per_cluster = QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+    } else {
+        s->subclusters_per_cluster = 1;
+    }
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1589,6 +1681,15 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION_DICT) !=
+        !!s->compression_dict) {
+        error_setg(errp, "qcow2: Compression dictionary incompatible feature "
+                   "bit does not match the compression dictionary header "
+                   "extension");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* Open external data file */
     s->data_file = bdrv_open_child(NULL, options, "data-file", bs,
                                    &child_of_bds, BDRV_CHILD_DATA,
@@ -1837,6 +1938,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     }
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
+    qcow2_compression_dict_free(s->compression_dict);
+    s->compression_dict = NULL;
     return ret;
 }
 
@@ -2219,7 +2322,11 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
     switch (cluster_type) {
     case QCOW2_CLUSTER_ZERO_PLAIN:
     case QCOW2_CLUSTER_ZERO_ALLOC:
-        /* Both zero types are handled in qcow2_co_preadv_part */
+    case QCOW2_CLUSTER_COMPRESSED:
+        /*
+         * Both zero types and compressed clusters (which are read in
+         * batches) are handled in qcow2_co_preadv_part
+         */
         g_assert_not_reached();
 
     case QCOW2_CLUSTER_UNALLOCATED:
@@ -2229,10 +2336,6 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
         return bdrv_co_preadv_part(bs->backing, offset, bytes,
                                    qiov, qiov_offset, 0);
 
-    case QCOW2_CLUSTER_COMPRESSED:
-        return qcow2_co_preadv_compressed(bs, file_cluster_offset,
-                                          offset, bytes, qiov, qiov_offset);
-
     case QCOW2_CLUSTER_NORMAL:
         assert(offset_into_cluster(s, file_cluster_offset) == 0);
         if (bs->encrypted) {
@@ -2262,6 +2365,140 @@ static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task)
                                 t->offset, t->bytes, t->qiov, t->qiov_offset);
 }
 
+typedef struct Qcow2CompressedReadTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t l2_entries[QCOW2_MAX_COMPRESSED_BATCH];
+    int nb_clusters;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+} Qcow2CompressedReadTask;
+
+static coroutine_fn int qcow2_co_compressed_read_task_entry(AioTask *task)
+{
+    Qcow2CompressedReadTask *t = container_of(task, Qcow2CompressedReadTask,
+                                              task);
+
+    return qcow2_co_preadv_compressed(t->bs, t->l2_entries, t->nb_clusters,
+                                      t->offset, t->bytes, t->qiov,
+                                      t->qiov_offset);
+}
+
+static coroutine_fn int
+qcow2_add_compressed_read_task(BlockDriverState *bs, AioTaskPool *pool,
+                               const uint64_t *l2_entries, int nb_clusters,
+                               uint64_t offset, uint64_t bytes,
+                               QEMUIOVector *qiov, size_t qiov_offset)
+{
+    Qcow2CompressedReadTask local_task;
+    Qcow2CompressedReadTask *task =
+        pool ? g_new(Qcow2CompressedReadTask, 1) : &local_task;
+
+    assert(nb_clusters > 0 && nb_clusters <= QCOW2_MAX_COMPRESSED_BATCH);
+
+    *task = (Qcow2CompressedReadTask) {
+        .task.func = qcow2_co_compressed_read_task_entry,
+        .bs = bs,
+        .nb_clusters = nb_clusters,
+        .offset = offset,
+        .bytes = bytes,
+        .qiov = qiov,
+        .qiov_offset = qiov_offset,
+    };
+    memcpy(task->l2_entries, l2_entries, nb_clusters * sizeof(uint64_t));
+
+    if (!pool) {
+        return task->task.func(&task->task);
+    }
+
+    aio_task_pool_start_task(pool, &task->task);
+
+    return 0;
+}
+
+/*
+ * Extract the host offset and the (sector granular, upper bound) size of
+ * the compressed data referenced by the compressed cluster descriptor
+ * @l2_entry.
+ */
+static void qcow2_parse_compressed_l2_entry(BlockDriverState *bs,
+                                            uint64_t l2_entry,
+                                            uint64_t *coffset, int *csize)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int nb_csectors;
+
+    *coffset = l2_entry & s->cluster_offset_mask;
+    nb_csectors = ((l2_entry >> s->csize_shift) & s->csize_mask) + 1;
+    *csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
+        (*coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
+}
+
+/*
+ * Starting with the compressed cluster described by @l2_entry at guest
+ * @offset (and covering *@bytes bytes of the request), collect the
+ * following compressed clusters of the request whose compressed data
+ * directly follows in the image file, so that the whole batch can be
+ * read with a single request.  At most @max_bytes guest bytes are
+ * collected.
+ *
+ * On success, fills @l2_entries, updates *@bytes to cover all collected
+ * clusters and returns their number.
+ *
+ * Must be called with s->lock held.
+ */
+static int qcow2_get_compressed_batch(BlockDriverState *bs, uint64_t offset,
+                                      uint64_t l2_entry, unsigned int *bytes,
+                                      unsigned int max_bytes,
+                                      uint64_t *l2_entries)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t batch_start, batch_end, prev_coffset;
+    int nb_clusters = 1;
+    int csize;
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &batch_start, &csize);
+    l2_entries[0] = l2_entry;
+    prev_coffset = batch_start;
+    batch_end = batch_start + csize;
+
+    while (nb_clusters < QCOW2_MAX_COMPRESSED_BATCH && *bytes < max_bytes) {
+        unsigned int next_bytes = MIN(max_bytes - *bytes, s->cluster_size);
+        uint64_t next_entry, next_coffset;
+        int ret;
+
+        /* A compressed cluster always ends the range it was returned for */
+        assert(!offset_into_cluster(s, offset + *bytes));
+
+        ret = qcow2_get_cluster_offset(bs, offset + *bytes, &next_bytes,
+                                       &next_entry);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret != QCOW2_CLUSTER_COMPRESSED) {
+            break;
+        }
+
+        qcow2_parse_compressed_l2_entry(bs, next_entry, &next_coffset, &csize);
+        if (next_coffset < prev_coffset || next_coffset > batch_end ||
+            next_coffset + csize - batch_start >
+            QCOW2_MAX_COMPRESSED_BATCH_BYTES)
+        {
+            break;
+        }
+
+        l2_entries[nb_clusters++] = next_entry;
+        prev_coffset = next_coffset;
+        batch_end = MAX(batch_end, next_coffset + csize);
+        *bytes += next_bytes;
+    }
+
+    return nb_clusters;
+}
+
 static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                                              uint64_t offset, uint64_t bytes,
                                              QEMUIOVector *qiov,
@@ -2270,7 +2507,10 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
     int ret = 0;
     unsigned int cur_bytes; /* number of bytes in current iteration */
+    unsigned int max_bytes;
     uint64_t cluster_offset = 0;
+    uint64_t l2_entries[QCOW2_MAX_COMPRESSED_BATCH];
+    int nb_compressed = 0;
     AioTaskPool *aio = NULL;
 
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
@@ -2280,9 +2520,19 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
             cur_bytes = MIN(cur_bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
+        max_bytes = cur_bytes;
 
         qemu_co_mutex_lock(&s->lock);
         ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes, &cluster_offset);
+        if (ret == QCOW2_CLUSTER_COMPRESSED) {
+            nb_compressed = qcow2_get_compressed_batch(bs, offset,
+                                                       cluster_offset,
+                                                       &cur_bytes, max_bytes,
+                                                       l2_entries);
+            if (nb_compressed < 0) {
+                ret = nb_compressed;
+            }
+        }
         qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto out;
@@ -2293,6 +2543,16 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
             (ret == QCOW2_CLUSTER_UNALLOCATED && !bs->backing))
         {
             qemu_iovec_memset(qiov, qiov_offset, 0, cur_bytes);
+        } else if (ret == QCOW2_CLUSTER_COMPRESSED) {
+            if (!aio && cur_bytes != bytes) {
+                aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+            }
+            ret = qcow2_add_compressed_read_task(bs, aio, l2_entries,
+                                                 nb_compressed, offset,
+                                                 cur_bytes, qiov, qiov_offset);
+            if (ret < 0) {
+                goto out;
+            }
         } else {
             if (!aio && cur_bytes != bytes) {
                 aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
@@ -2409,6 +2669,11 @@ static int handle_alloc_space(BlockDriverState *bs, QCowL2Meta *l2meta)
             continue;
         }
 
+        /* Other subclusters of the cluster may already contain data */
+        if (m->keep_old_clusters && has_subclusters(s)) {
+            continue;
+        }
+
         if (!is_zero_cow(bs, m)) {
             continue;
         }
@@ -2674,6 +2939,9 @@ static void qcow2_close(BlockDriverState *bs)
     s->crypto = NULL;
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
 
+    qcow2_compression_dict_free(s->compression_dict);
+    s->compression_dict = NULL;
+
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
@@ -2890,6 +3158,21 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression dictionary pointer extension */
+    if (s->compression_dict_header.offset != 0) {
+        Qcow2CompressionDictHeaderExtension dict_header = {
+            .offset = cpu_to_be64(s->compression_dict_header.offset),
+            .length = cpu_to_be64(s->compression_dict_header.length),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION_DICT,
+                             &dict_header, sizeof(dict_header), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /*
      * Feature table.  A mere 8 feature names occupies 392 bytes, and
      * when coupled with the v3 minimum header of 104 bytes plus the
@@ -2920,6 +3203,16 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
                 .name = "compression type",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR,
+                .name = "compression dictionary",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3095,6 +3388,75 @@ static int qcow2_set_up_encryption(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Store the compression dictionary contained in the file @filename in the
+ * image and enable it for all subsequently compressed clusters.  Must only
+ * be called on an image that does not contain any compressed clusters yet.
+ */
+static int qcow2_set_up_compression_dict(BlockDriverState *bs,
+                                         const char *filename, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree char *dict_buf = NULL;
+    g_autoptr(GError) gerr = NULL;
+    Qcow2CompressionDict *dict;
+    int64_t dict_offset;
+    gsize dict_len;
+    int ret;
+
+    assert(!s->compression_dict);
+
+    if (!g_file_get_contents(filename, &dict_buf, &dict_len, &gerr)) {
+        error_setg(errp, "Could not read compression dictionary '%s': %s",
+                   filename, gerr->message);
+        return -EIO;
+    }
+
+    dict = qcow2_compression_dict_new(s->compression_type, dict_buf,
+                                      dict_len, errp);
+    if (!dict) {
+        return -EINVAL;
+    }
+
+    dict_offset = qcow2_alloc_clusters(bs, dict_len);
+    if (dict_offset < 0) {
+        ret = dict_offset;
+        error_setg_errno(errp, -ret, "Could not allocate clusters for the "
+                         "compression dictionary");
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, dict_offset, dict_len, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Compression dictionary overlaps with "
+                         "image metadata");
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, dict_offset, dict_buf, dict_len);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write compression dictionary");
+        goto fail;
+    }
+
+    s->compression_dict_header.offset = dict_offset;
+    s->compression_dict_header.length = dict_len;
+    s->compression_dict = dict;
+    s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION_DICT;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        return ret;
+    }
+
+    return 0;
+
+fail:
+    qcow2_compression_dict_free(dict);
+    return ret;
+}
+
 /**
  * Preallocates metadata structures for data clusters between @offset (in the
  * guest disk) and @new_length (which is thus generally the new guest disk
@@ -3230,28 +3592,31 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
  * @total_size: virtual disk size in bytes
  * @cluster_size: cluster size in bytes
  * @refcount_order: refcount bits power-of-2 exponent
+ * @extended_l2: true if the image has extended L2 entries
  *
  * Returns: Total number of bytes required for the fully allocated image
  * (including metadata).
  */
 static int64_t qcow2_calc_prealloc_size(int64_t total_size,
                                         size_t cluster_size,
-                                        int refcount_order)
+                                        int refcount_order,
+                                        bool extended_l2)
 {
     int64_t meta_size = 0;
     uint64_t nl1e, nl2e;
     int64_t aligned_total_size = ROUND_UP(total_size, cluster_size);
+    size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
 
     /* header: 1 cluster */
     meta_size += cluster_size;
 
     /* total size of L2 tables */
     nl2e = aligned_total_size / cluster_size;
-    nl2e = ROUND_UP(nl2e, cluster_size / sizeof(uint64_t));
-    meta_size += nl2e * sizeof(uint64_t);
+    nl2e = ROUND_UP(nl2e, cluster_size / l2e_size);
+    meta_size += nl2e * l2e_size;
 
     /* total size of L1 tables */
-    nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+    nl1e = nl2e * l2e_size / cluster_size;
     nl1e = ROUND_UP(nl1e, cluster_size / sizeof(uint64_t));
     meta_size += nl1e * sizeof(uint64_t);
 
@@ -3501,6 +3866,34 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         compression_type = qcow2_opts->compression_type;
     }
 
+    if (qcow2_opts->has_compression_dict &&
+        compression_type == QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Compression dictionaries require a non-zlib "
+                   "compression type (use compression-type=zstd)");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!qcow2_opts->has_extended_l2) {
+        qcow2_opts->extended_l2 = false;
+    }
+    if (qcow2_opts->extended_l2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
     /* Create BlockBackend to write to the image */
     blk = blk_new_with_bs(bs, BLK_PERM_WRITE | BLK_PERM_RESIZE, BLK_PERM_ALL,
                           errp);
@@ -3547,6 +3940,10 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         header->incompatible_features |=
             cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
     }
+    if (qcow2_opts->extended_l2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
 
     ret = blk_pwrite(blk, 0, header, cluster_size, 0);
     g_free(header);
@@ -3647,6 +4044,16 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         }
     }
 
+    /* Want a compression dictionary? There you go. */
+    if (qcow2_opts->has_compression_dict) {
+        ret = qcow2_set_up_compression_dict(blk_bs(blk),
+                                            qcow2_opts->compression_dict,
+                                            errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     blk_unref(blk);
     blk = NULL;
 
@@ -3733,6 +4140,8 @@ static int coroutine_fn qcow2_co_create_opts(BlockDriver *drv,
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
         { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
+        { BLOCK_OPT_COMPRESSION_DICT,   "compression-dict" },
+        { BLOCK_OPT_EXTL2,              "extended-l2" },
         { NULL, NULL },
     };
 
@@ -4253,7 +4662,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
          *  preallocation. All that matters is that we will not have to allocate
          *  new refcount structures for them.) */
         nb_new_l2_tables = DIV_ROUND_UP(nb_new_data_clusters,
-                                        s->cluster_size / sizeof(uint64_t));
+                                        s->cluster_size / l2_entry_size(s));
         /* The cluster range may not be aligned to L2 boundaries, so add one L2
          * table for a potential head/tail */
         nb_new_l2_tables++;
@@ -4321,6 +4730,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
                 .offset       = guest_offset,
                 .alloc_offset = host_offset,
                 .nb_clusters  = nb_clusters,
+                .prealloc     = true,
             };
             qemu_co_queue_init(&allocation.dependent_requests);
 
@@ -4556,47 +4966,129 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+typedef struct Qcow2DecompressTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    const uint8_t *src;
+    int src_size;
+    int offset_in_cluster;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+} Qcow2DecompressTask;
+
+static coroutine_fn int qcow2_co_decompress_task_entry(AioTask *task)
+{
+    Qcow2DecompressTask *t = container_of(task, Qcow2DecompressTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    uint8_t *out_buf;
+    int ret = 0;
+
+    out_buf = qemu_blockalign(t->bs, s->cluster_size);
+
+    if (qcow2_co_decompress(t->bs, out_buf, s->cluster_size,
+                            t->src, t->src_size) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    qemu_iovec_from_buf(t->qiov, t->qiov_offset,
+                        out_buf + t->offset_in_cluster, t->bytes);
+
+out:
+    qemu_vfree(out_buf);
+    return ret;
+}
+
+/*
+ * Read @nb_clusters consecutive compressed clusters described by
+ * @l2_entries, whose compressed data is stored contiguously in the image
+ * file (see qcow2_get_compressed_batch()).  The compressed data of all
+ * clusters is fetched with a single request; the clusters are then
+ * decompressed in parallel.
+ */
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t file_cluster_offset,
+                           const uint64_t *l2_entries,
+                           int nb_clusters,
                            uint64_t offset,
                            uint64_t bytes,
                            QEMUIOVector *qiov,
                            size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize, nb_csectors;
-    uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
+    int ret = 0, csize, i;
+    uint64_t coffset, batch_start, batch_end;
+    uint8_t *buf;
+    AioTaskPool *aio = NULL;
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entries[0], &batch_start, &csize);
+    batch_end = batch_start + csize;
+    for (i = 1; i < nb_clusters; i++) {
+        qcow2_parse_compressed_l2_entry(bs, l2_entries[i], &coffset, &csize);
+        assert(coffset >= batch_start);
+        batch_end = MAX(batch_end, coffset + csize);
+    }
 
-    coffset = file_cluster_offset & s->cluster_offset_mask;
-    nb_csectors = ((file_cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-    csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
-        (coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
+    trace_qcow2_compressed_read_batch(qemu_coroutine_self(), offset, bytes,
+                                      nb_clusters, batch_start,
+                                      batch_end - batch_start);
 
-    buf = g_try_malloc(csize);
+    buf = g_try_malloc(batch_end - batch_start);
     if (!buf) {
         return -ENOMEM;
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
-
     BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    ret = bdrv_co_pread(bs->file, batch_start, batch_end - batch_start, buf, 0);
     if (ret < 0) {
         goto fail;
     }
 
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
-        ret = -EIO;
-        goto fail;
+    if (nb_clusters > 1) {
+        aio = aio_task_pool_new(QCOW2_MAX_THREADS);
     }
 
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
+    for (i = 0; i < nb_clusters && aio_task_pool_status(aio) == 0; i++) {
+        Qcow2DecompressTask local_task;
+        Qcow2DecompressTask *task = aio ? g_new(Qcow2DecompressTask, 1)
+                                        : &local_task;
+        int offset_in_cluster = offset_into_cluster(s, offset);
+        uint64_t cur_bytes = MIN(bytes, s->cluster_size - offset_in_cluster);
+
+        qcow2_parse_compressed_l2_entry(bs, l2_entries[i], &coffset, &csize);
+
+        *task = (Qcow2DecompressTask) {
+            .task.func = qcow2_co_decompress_task_entry,
+            .bs = bs,
+            .src = buf + (coffset - batch_start),
+            .src_size = csize,
+            .offset_in_cluster = offset_in_cluster,
+            .bytes = cur_bytes,
+            .qiov = qiov,
+            .qiov_offset = qiov_offset,
+        };
+
+        if (aio) {
+            aio_task_pool_start_task(aio, &task->task);
+        } else {
+            ret = task->task.func(&task->task);
+        }
+
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+    assert(bytes == 0 || aio_task_pool_status(aio) < 0);
+
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        ret = aio_task_pool_status(aio);
+        g_free(aio);
+    }
 
 fail:
-    qemu_vfree(out_buf);
     g_free(buf);
 
     return ret;
@@ -4765,11 +5257,13 @@ static int qcow2_make_empty(BlockDriverState *bs)
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
+        !s->compression_dict_header.offset &&
         !has_data_file(bs)) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
+         * LUKS header, compression dictionary, or persistent bitmaps),
+         * because it completely
          * empties the image.  Furthermore, the L1 table and three
          * additional clusters (image header, refcount table, one
          * refcount block) have to fit inside one refcount block. It
@@ -4825,6 +5319,8 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     PreallocMode prealloc;
     bool has_backing_file;
     bool has_luks;
+    bool extended_l2;
+    size_t l2e_size;
 
     /* Parse image creation options */
     cluster_size = qcow2_opt_get_cluster_size_del(opts, &local_err);
@@ -4842,6 +5338,14 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
         goto err;
     }
 
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+    if (extended_l2 && cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+        error_setg(&local_err, "Extended L2 entries are only supported with "
+                   "cluster sizes of at least %d bytes",
+                   1 << MIN_EXTL2_CLUSTER_BITS);
+        goto err;
+    }
+
     optstr = qemu_opt_get_del(opts, BLOCK_OPT_PREALLOC);
     prealloc = qapi_enum_parse(&PreallocMode_lookup, optstr,
                                PREALLOC_MODE_OFF, &local_err);
@@ -4890,8 +5394,9 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     virtual_size = ROUND_UP(virtual_size, cluster_size);
 
     /* Check that virtual disk size is valid */
+    l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
     l2_tables = DIV_ROUND_UP(virtual_size / cluster_size,
-                             cluster_size / sizeof(uint64_t));
+                             cluster_size / l2e_size);
     if (l2_tables * sizeof(uint64_t) > QCOW_MAX_L1_SIZE) {
         error_setg(&local_err, "The image size is too large "
                                "(try using a larger cluster size)");
@@ -4956,7 +5461,8 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     info = g_new0(BlockMeasureInfo, 1);
     info->fully_allocated =
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
-                                 ctz32(refcount_bits)) + luks_payload_size;
+                                 ctz32(refcount_bits), extended_l2) +
+        luks_payload_size;
 
     /*
      * Remove data clusters that are not required.  This overestimates the
@@ -5038,6 +5544,8 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
             .compression_type   = s->compression_type,
+            .has_extended_l2    = has_subclusters(s),
+            .extended_l2        = has_subclusters(s),
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -5147,6 +5655,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (has_subclusters(s)) {
+        error_setg(errp, "Cannot downgrade an image with extended L2 entries");
+        return -ENOTSUP;
+    }
+
     /*
      * If any internal snapshot has a different size than the current
      * image size, or VM state size that exceeds 32 bits, downgrading
@@ -5459,6 +5972,19 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "is not supported");
                 return -ENOTSUP;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_DICT)) {
+            if (qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_DICT)) {
+                error_setg(errp, "Changing the compression dictionary "
+                                 "is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            bool extended_l2 = qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2,
+                                                 has_subclusters(s));
+            if (extended_l2 != has_subclusters(s)) {
+                error_setg(errp, "Changing the L2 entry size is not supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -5731,6 +6257,18 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Compression method used for image cluster compression",
             .def_value_str = "zlib"
         },
+        {
+            .name = BLOCK_OPT_COMPRESSION_DICT,
+            .type = QEMU_OPT_STRING,
+            .help = "File containing a (zstd) dictionary for image cluster "
+                    "compression"
+        },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables (32 subclusters per cluster, for "
+                    "subcluster-granular copy-on-write)",
+        },
         { /* end of list */ }
     }
 };
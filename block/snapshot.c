@@ -199,6 +199,7 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (drv->bdrv_snapshot_goto) {
         ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+        bdrv_bsc_invalidate_all(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Failed to load snapshot");
         }
@@ -227,6 +228,7 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
         ret = bdrv_snapshot_goto(file, snapshot_id, errp);
         open_ret = drv->bdrv_open(bs, options, bs->open_flags, &local_err);
+        bdrv_bsc_invalidate_all(bs);
         qobject_unref(options);
         if (open_ret < 0) {
             bdrv_unref(file);
@@ -358,7 +360,9 @@ int bdrv_snapshot_load_tmp(BlockDriverState *bs,
         return -EINVAL;
     }
     if (drv->bdrv_snapshot_load_tmp) {
-        return drv->bdrv_snapshot_load_tmp(bs, snapshot_id, name, errp);
+        int ret = drv->bdrv_snapshot_load_tmp(bs, snapshot_id, name, errp);
+        bdrv_bsc_invalidate_all(bs);
+        return ret;
     }
     error_setg(errp, "Block format '%s' used by device '%s' "
                "does not support temporarily loading internal snapshots",
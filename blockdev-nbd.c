@@ -18,6 +18,7 @@
 #include "block/nbd.h"
 #include "io/channel-socket.h"
 #include "io/net-listener.h"
+#include "sysemu/iothread.h"
 
 typedef struct NBDServerData {
     QIONetListener *listener;
@@ -155,6 +156,10 @@ void qmp_nbd_server_add(BlockExportNbd *arg, Error **errp)
     NBDExport *exp;
     int64_t len;
     AioContext *aio_context;
+    g_autofree IOThread **iothreads = NULL;
+    int nb_iothreads = 0;
+    bool multi_conn;
+    strList *e;
 
     if (!nbd_server) {
         error_setg(errp, "NBD server not running");
@@ -180,6 +185,17 @@ void qmp_nbd_server_add(BlockExportNbd *arg, Error **errp)
         return;
     }
 
+    for (e = arg->has_iothreads ? arg->iothreads : NULL; e; e = e->next) {
+        IOThread *iothread = iothread_by_id(e->value);
+
+        if (!iothread) {
+            error_setg(errp, "Cannot find iothread '%s'", e->value);
+            return;
+        }
+        iothreads = g_renew(IOThread *, iothreads, nb_iothreads + 1);
+        iothreads[nb_iothreads++] = iothread;
+    }
+
     on_eject_blk = blk_by_name(arg->device);
 
     bs = bdrv_lookup_bs(arg->device, arg->device, errp);
@@ -203,9 +219,17 @@ void qmp_nbd_server_add(BlockExportNbd *arg, Error **errp)
         arg->writable = false;
     }
 
+    if (!arg->has_multi_conn || arg->multi_conn == ON_OFF_AUTO_AUTO) {
+        multi_conn = !arg->writable;
+    } else {
+        multi_conn = arg->multi_conn == ON_OFF_AUTO_ON;
+    }
+
     exp = nbd_export_new(bs, 0, len, arg->name, arg->description, arg->bitmap,
-                         !arg->writable, !arg->writable,
-                         NULL, false, on_eject_blk, errp);
+                         !arg->writable, multi_conn,
+                         arg->has_zero_copy && arg->zero_copy,
+                         iothreads, nb_iothreads, NULL, false, on_eject_blk,
+                         errp);
     if (!exp) {
         goto out;
     }
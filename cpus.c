@@ -710,18 +710,31 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+/* The throttle percentage of @cpu, which is at least the global one */
+static int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return MAX(cpu_throttle_get_percentage(),
+               atomic_read(&cpu->throttle_percentage));
+}
+
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
-    double pct;
+    double pct, pct_max;
     double throttle_ratio;
     int64_t sleeptime_ns, endtime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    if (!cpu_throttle_get_vcpu_percentage(cpu)) {
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
+    /*
+     * The timer ticks at the rate needed by the most throttled vCPU, so
+     * sleep for our percentage of that period.  When all vCPUs are
+     * throttled alike, this is the same as pct / (1 - pct) time slices.
+     */
+    pct = (double)cpu_throttle_get_vcpu_percentage(cpu)/100;
+    pct_max = MAX((double)opaque.host_int/100, pct);
+    throttle_ratio = pct / (1 - pct_max);
     /* Add 1ns to fix double's rounding error (like 0.9999999...) */
     sleeptime_ns = (int64_t)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS + 1);
     endtime_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + sleeptime_ns;
@@ -742,20 +755,26 @@ static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
+    int pct_max = 0;
     double pct;
 
+    CPU_FOREACH(cpu) {
+        pct_max = MAX(pct_max, cpu_throttle_get_vcpu_percentage(cpu));
+    }
+
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!pct_max) {
         return;
     }
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        if (cpu_throttle_get_vcpu_percentage(cpu) &&
+            !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
-                             RUN_ON_CPU_NULL);
+                             RUN_ON_CPU_HOST_INT(pct_max));
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
+    pct = (double)pct_max/100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
                                    CPU_THROTTLE_TIMESLICE_NS / (1-pct));
 }
@@ -772,14 +791,49 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    if (new_throttle_pct) {
+        new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+        new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    }
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    if (new_throttle_pct && !timer_pending(throttle_timer)) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+int cpu_throttle_get_vcpu(CPUState *cpu)
+{
+    return atomic_read(&cpu->throttle_percentage);
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
 }
 
 bool cpu_throttle_active(void)
 {
-    return (cpu_throttle_get_percentage() != 0);
+    CPUState *cpu;
+
+    if (cpu_throttle_get_percentage() != 0) {
+        return true;
+    }
+    CPU_FOREACH(cpu) {
+        if (atomic_read(&cpu->throttle_percentage)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 int cpu_throttle_get_percentage(void)
@@ -787,6 +841,17 @@ int cpu_throttle_get_percentage(void)
     return atomic_read(&throttle_percentage);
 }
 
+int cpu_throttle_get_max_percentage(void)
+{
+    CPUState *cpu;
+    int pct_max = cpu_throttle_get_percentage();
+
+    CPU_FOREACH(cpu) {
+        pct_max = MAX(pct_max, atomic_read(&cpu->throttle_percentage));
+    }
+    return pct_max;
+}
+
 void cpu_ticks_init(void)
 {
     seqlock_init(&timers_state.vm_clock_seqlock);
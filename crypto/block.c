@@ -318,6 +318,9 @@ void qcrypto_block_free(QCryptoBlock *block)
 }
 
 
+/* Maximum number of sector IVs that are computed under one ivgen lock */
+#define QCRYPTO_BLOCK_IV_BATCH 64
+
 typedef int (*QCryptoCipherEncDecFunc)(QCryptoCipher *cipher,
                                         const void *in,
                                         void *out,
@@ -335,7 +338,8 @@ static int do_qcrypto_block_cipher_encdec(QCryptoCipher *cipher,
                                           QCryptoCipherEncDecFunc func,
                                           Error **errp)
 {
-    g_autofree uint8_t *iv = niv ? g_new0(uint8_t, niv) : NULL;
+    size_t batch = MIN(len / sectorsize, QCRYPTO_BLOCK_IV_BATCH);
+    g_autofree uint8_t *ivs = niv ? g_new0(uint8_t, niv * batch) : NULL;
     int ret = -1;
     uint64_t startsector = offset / sectorsize;
 
@@ -343,12 +347,20 @@ static int do_qcrypto_block_cipher_encdec(QCryptoCipher *cipher,
     assert(QEMU_IS_ALIGNED(len, sectorsize));
 
     while (len > 0) {
-        size_t nbytes;
+        size_t i, nsectors = MIN(len / sectorsize, batch);
+
         if (niv) {
+            /* Take the ivgen lock once for the whole batch of sectors */
             if (ivgen_mutex) {
                 qemu_mutex_lock(ivgen_mutex);
             }
-            ret = qcrypto_ivgen_calculate(ivgen, startsector, iv, niv, errp);
+            for (i = 0; i < nsectors; i++) {
+                ret = qcrypto_ivgen_calculate(ivgen, startsector + i,
+                                              ivs + i * niv, niv, errp);
+                if (ret < 0) {
+                    break;
+                }
+            }
             if (ivgen_mutex) {
                 qemu_mutex_unlock(ivgen_mutex);
             }
@@ -356,22 +368,25 @@ static int do_qcrypto_block_cipher_encdec(QCryptoCipher *cipher,
             if (ret < 0) {
                 return -1;
             }
+        }
 
-            if (qcrypto_cipher_setiv(cipher,
-                                     iv, niv,
-                                     errp) < 0) {
-                return -1;
+        for (i = 0; i < nsectors; i++) {
+            if (niv) {
+                if (qcrypto_cipher_setiv(cipher,
+                                         ivs + i * niv, niv,
+                                         errp) < 0) {
+                    return -1;
+                }
             }
-        }
 
-        nbytes = len > sectorsize ? sectorsize : len;
-        if (func(cipher, buf, buf, nbytes, errp) < 0) {
-            return -1;
+            if (func(cipher, buf, buf, sectorsize, errp) < 0) {
+                return -1;
+            }
+            buf += sectorsize;
         }
 
-        startsector++;
-        buf += nbytes;
-        len -= nbytes;
+        startsector += nsectors;
+        len -= nsectors * sectorsize;
     }
 
     return 0;
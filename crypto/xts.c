@@ -32,6 +32,12 @@ typedef union {
     uint64_t u[2];
 } xts_uint128;
 
+/*
+ * Number of blocks whose tweaks are computed ahead so that they can be
+ * passed to the cipher function at once; 32 blocks cover a 512 byte sector.
+ */
+#define XTS_BATCH_BLOCKS 32
+
 static inline void xts_uint128_xor(xts_uint128 *D,
                                    const xts_uint128 *S1,
                                    const xts_uint128 *S2)
@@ -99,6 +105,71 @@ static inline void xts_tweak_encdec(const void *ctx,
 }
 
 
+/**
+ * xts_tweak_encdec_blocks:
+ * @param ctxt: the cipher context
+ * @param func: the cipher function
+ * @src: buffer providing the input text of @nblocks * XTS_BLOCK_SIZE bytes
+ * @dst: buffer to output the output text of @nblocks * XTS_BLOCK_SIZE bytes
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ * @nblocks: the number of blocks to process
+ *
+ * Encrypt/decrypt full blocks with a tweak, like calling xts_tweak_encdec()
+ * for each of them.  The tweaks for up to XTS_BATCH_BLOCKS blocks are
+ * computed up front, so that @func gets to process the whole batch in a
+ * single call.  This avoids the per call overhead of the cipher backend and
+ * lets it pipeline the AES rounds of independent blocks.
+ */
+static void xts_tweak_encdec_blocks(const void *ctx,
+                                    xts_cipher_func *func,
+                                    const uint8_t *src,
+                                    uint8_t *dst,
+                                    xts_uint128 *iv,
+                                    unsigned long nblocks)
+{
+    xts_uint128 tweaks[XTS_BATCH_BLOCKS];
+    xts_uint128 buf[XTS_BATCH_BLOCKS];
+
+    while (nblocks > 0) {
+        unsigned long i, n = MIN(nblocks, XTS_BATCH_BLOCKS);
+        size_t len = n * XTS_BLOCK_SIZE;
+        bool aligned = QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
+                       QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t));
+        const xts_uint128 *S;
+        xts_uint128 *D;
+
+        if (aligned) {
+            S = (const xts_uint128 *)src;
+            D = (xts_uint128 *)dst;
+        } else {
+            memcpy(buf, src, len);
+            S = D = buf;
+        }
+
+        /* tweak the input blocks and LFSR the tweak for each of them */
+        for (i = 0; i < n; i++) {
+            tweaks[i] = *iv;
+            xts_uint128_xor(&D[i], &S[i], iv);
+            xts_mult_x(iv);
+        }
+
+        func(ctx, len, D->b, D->b);
+
+        for (i = 0; i < n; i++) {
+            xts_uint128_xor(&D[i], &D[i], &tweaks[i]);
+        }
+
+        if (!aligned) {
+            memcpy(dst, buf, len);
+        }
+
+        src += len;
+        dst += len;
+        nblocks -= n;
+    }
+}
+
+
 void xts_decrypt(const void *datactx,
                  const void *tweakctx,
                  xts_cipher_func *encfunc,
@@ -127,24 +198,9 @@ void xts_decrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T.b, iv);
 
-    if (QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
-        QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t))) {
-        xts_uint128 *S = (xts_uint128 *)src;
-        xts_uint128 *D = (xts_uint128 *)dst;
-        for (i = 0; i < lim; i++, S++, D++) {
-            xts_tweak_encdec(datactx, decfunc, S, D, &T);
-        }
-    } else {
-        xts_uint128 D;
-
-        for (i = 0; i < lim; i++) {
-            memcpy(&D, src, XTS_BLOCK_SIZE);
-            xts_tweak_encdec(datactx, decfunc, &D, &D, &T);
-            memcpy(dst, &D, XTS_BLOCK_SIZE);
-            src += XTS_BLOCK_SIZE;
-            dst += XTS_BLOCK_SIZE;
-        }
-    }
+    xts_tweak_encdec_blocks(datactx, decfunc, src, dst, &T, lim);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
@@ -203,25 +259,9 @@ void xts_encrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T.b, iv);
 
-    if (QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
-        QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t))) {
-        xts_uint128 *S = (xts_uint128 *)src;
-        xts_uint128 *D = (xts_uint128 *)dst;
-        for (i = 0; i < lim; i++, S++, D++) {
-            xts_tweak_encdec(datactx, encfunc, S, D, &T);
-        }
-    } else {
-        xts_uint128 D;
-
-        for (i = 0; i < lim; i++) {
-            memcpy(&D, src, XTS_BLOCK_SIZE);
-            xts_tweak_encdec(datactx, encfunc, &D, &D, &T);
-            memcpy(dst, &D, XTS_BLOCK_SIZE);
-
-            dst += XTS_BLOCK_SIZE;
-            src += XTS_BLOCK_SIZE;
-        }
-    }
+    xts_tweak_encdec_blocks(datactx, encfunc, src, dst, &T, lim);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
@@ -579,6 +579,19 @@ SRST
     Show current migration xbzrle cache size.
 ERST
 
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show dirty page rate measurement results",
+        .cmd        = hmp_info_dirty_rate,
+    },
+
+SRST
+  ``info dirty_rate``
+    Show the results of the last dirty page rate measurement.
+ERST
+
     {
         .name       = "balloon",
         .args_type  = "",
@@ -1072,6 +1072,21 @@ SRST
   migration (or once already in postcopy).
 ERST
 
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:l",
+        .params     = "second",
+        .help       = "start measuring the dirty page rate of the guest "
+                      "for the given number of seconds",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+SRST
+``calc_dirty_rate`` *second*
+  Start measuring the dirty page rate of the guest over *second* seconds,
+  without starting a migration.  Use ``info dirty_rate`` to get the results.
+ERST
+
     {
         .name       = "x_colo_lost_heartbeat",
         .args_type  = "",
@@ -43,5 +43,7 @@ int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
 
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
+void block_copy_get_stats(BlockCopyState *s, uint64_t *offloaded_bytes,
+                          uint64_t *bounced_bytes);
 
 #endif /* BLOCK_COPY_H */
@@ -58,6 +58,8 @@
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
 #define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_COMPRESSION_DICT  "compression_dict"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -784,6 +786,26 @@ struct BdrvChild {
     QLIST_ENTRY(BdrvChild) next_parent;
 };
 
+/*
+ * Cache of the results returned by a format driver's .bdrv_co_block_status()
+ * for one node, see block/block-status-cache.c.  All fields are protected by
+ * @lock.
+ */
+typedef struct BdrvBlockStatusCache {
+    QemuMutex lock;
+
+    /* Non-overlapping BdrvBlockStatusExtent objects, sorted by offset */
+    GTree *extents;
+    unsigned int nb_extents;
+
+    /* Incremented on every invalidation, so that racing fills are dropped */
+    uint64_t gen;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+} BdrvBlockStatusCache;
+
 /*
  * Note: the function bdrv_append() copies and swaps contents of
  * BlockDriverStates, so if you add new fields to this struct, please
@@ -910,6 +932,9 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /* Cached allocation status of this node (without its backing chain) */
+    BdrvBlockStatusCache block_status_cache;
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -1306,6 +1331,21 @@ bool blk_dev_is_medium_locked(BlockBackend *blk);
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t offset, int64_t bytes);
 
+void bdrv_bsc_init(BlockDriverState *bs);
+void bdrv_bsc_destroy(BlockDriverState *bs);
+bool bdrv_bsc_is_enabled(BlockDriverState *bs);
+uint64_t bdrv_bsc_generation(BlockDriverState *bs);
+bool bdrv_bsc_lookup(BlockDriverState *bs, bool want_zero,
+                     int64_t offset, int64_t bytes, int *status,
+                     int64_t *pnum, int64_t *map, BlockDriverState **file);
+void bdrv_bsc_fill(BlockDriverState *bs, uint64_t gen, bool want_zero,
+                   int64_t offset, int64_t bytes, int status,
+                   int64_t map, BlockDriverState *file);
+void bdrv_bsc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes);
+void bdrv_bsc_invalidate_all(BlockDriverState *bs);
+BlockStatusCacheStats *bdrv_bsc_get_stats(BlockDriverState *bs);
+
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out);
 void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup);
 bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
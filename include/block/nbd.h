@@ -233,6 +233,18 @@ enum {
  */
 #define NBD_MAX_STRING_SIZE 4096
 
+/*
+ * NBD_MAX_BLOCK_STATUS_EXTENTS: 1 MiB of extents data. An empirical
+ * constant. If an increase is needed, note that the NBD protocol
+ * recommends no larger than 32 mb, so that the client won't consider
+ * the reply as a denial of service attack.
+ */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * 1024 * 1024 / 8)
+
+/* Maximum payload of a NBD_REPLY_TYPE_BLOCK_STATUS chunk we accept */
+#define NBD_MAX_BLOCK_STATUS_PAYLOAD \
+    (sizeof(uint32_t) + NBD_MAX_BLOCK_STATUS_EXTENTS * sizeof(NBDExtent))
+
 /* Two types of reply structures */
 #define NBD_SIMPLE_REPLY_MAGIC      0x67446698
 #define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
@@ -330,9 +342,11 @@ typedef struct NBDClient NBDClient;
 
 NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
                           uint64_t size, const char *name, const char *desc,
-                          const char *bitmap, bool readonly, bool shared,
-                          void (*close)(NBDExport *), bool writethrough,
-                          BlockBackend *on_eject_blk, Error **errp);
+                          const char *bitmap, bool readonly, bool multi_conn,
+                          bool zero_copy, IOThread **iothreads,
+                          int nb_iothreads, void (*close)(NBDExport *),
+                          bool writethrough, BlockBackend *on_eject_blk,
+                          Error **errp);
 void nbd_export_close(NBDExport *exp);
 void nbd_export_remove(NBDExport *exp, NbdServerRemoveMode mode, Error **errp);
 void nbd_export_get(NBDExport *exp);
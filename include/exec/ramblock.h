@@ -59,6 +59,16 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * With the fixed-ram migration capability, each page of the block
+     * is stored at @pages_offset plus its offset in the block, and
+     * @file_bmap tracks which pages hold data in the file.  The bitmap
+     * itself is stored at @bitmap_offset.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    uint64_t pages_offset;
 };
 #endif
 #endif
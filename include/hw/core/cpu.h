@@ -433,6 +433,13 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle percentage of this vCPU only, see cpu_throttle_set_vcpu() */
+    int throttle_percentage;
+    /*
+     * Pages whose first write since the last dirty bitmap sync was done
+     * by this vCPU, while dirty logging is on.  Only counted with TCG.
+     */
+    uint32_t dirty_pages;
 
     bool ignore_memory_transaction_failures;
 
@@ -831,10 +838,29 @@ CPUState *cpu_by_arch_id(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vCPU to throttle.
+ * @new_throttle_pct: Percent of sleep time, 0 or 1 to 99.
+ *
+ * Like cpu_throttle_set, but only throttles @cpu, on top of the
+ * throttling of all vcpus.  A percentage of 0 stops throttling @cpu.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu:
+ * @cpu: The vCPU to query.
+ *
+ * Returns: The throttle percentage set with cpu_throttle_set_vcpu for @cpu.
+ */
+int cpu_throttle_get_vcpu(CPUState *cpu);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set and
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
@@ -854,6 +880,14 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_get_max_percentage:
+ *
+ * Returns: The throttle percentage of the most throttled vcpu, taking
+ * both cpu_throttle_set and cpu_throttle_set_vcpu into account.
+ */
+int cpu_throttle_get_max_percentage(void);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
@@ -0,0 +1,60 @@
+/*
+ * Linux userfaultfd helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef USERFAULTFD_H
+#define USERFAULTFD_H
+
+#include <linux/userfaultfd.h>
+
+/**
+ * uffd_query_features: get the features supported by the kernel
+ *
+ * Returns: 0 on success, or -1 if userfaultfd is not available.
+ *
+ * @features: returns the UFFD_FEATURE_* bits
+ */
+int uffd_query_features(uint64_t *features);
+
+/**
+ * uffd_create_fd: create a userfaultfd and enable @features on it
+ *
+ * Returns: the new file descriptor, or -1 on failure.
+ */
+int uffd_create_fd(uint64_t features, bool non_blocking);
+void uffd_close_fd(int uffd_fd);
+
+/**
+ * uffd_register_memory: start tracking faults in a memory range
+ *
+ * Returns: 0 on success, or -1 on failure.
+ *
+ * @mode: UFFDIO_REGISTER_MODE_* bits
+ * @ioctls: if not NULL, returns the mask of the ioctls that are
+ *          supported on the range
+ */
+int uffd_register_memory(int uffd_fd, void *addr, uint64_t length,
+                         uint64_t mode, uint64_t *ioctls);
+int uffd_unregister_memory(int uffd_fd, void *addr, uint64_t length);
+
+/**
+ * uffd_change_protection: write-protect a memory range, or remove the
+ * protection, waking up the threads that wait on it unless @dont_wake
+ *
+ * Returns: 0 on success, or -1 on failure.
+ */
+int uffd_change_protection(int uffd_fd, void *addr, uint64_t length,
+                           bool wp, bool dont_wake);
+
+/**
+ * uffd_read_events: read pending events from a non-blocking userfaultfd
+ *
+ * Returns: the number of events read, 0 if there are none, or -1 on
+ * failure.
+ */
+int uffd_read_events(int uffd_fd, struct uffd_msg *msgs, int count);
+
+#endif /* USERFAULTFD_H */
@@ -26,6 +26,14 @@
 #include "io/channel-watch.h"
 #include "trace.h"
 #include "qapi/clone-visitor.h"
+#ifdef CONFIG_LINUX
+#include <linux/errqueue.h>
+#include <poll.h>
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define QEMU_MSG_ZEROCOPY
+#endif
+#endif
 
 #define SOCKET_MAX_FDS 16
 
@@ -69,11 +77,37 @@ qio_channel_socket_new(void)
 }
 
 
+/*
+ * Zero copy transmission is only supported by the kernel for TCP (and
+ * UDP) sockets; setting SO_ZEROCOPY fails for everything else.
+ */
+static void
+qio_channel_socket_probe_zero_copy(QIOChannelSocket *sioc)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int v = 1;
+
+    if (sioc->localAddr.ss_family != AF_INET &&
+        sioc->localAddr.ss_family != AF_INET6) {
+        return;
+    }
+
+    if (qemu_setsockopt(sioc->fd, SOL_SOCKET, SO_ZEROCOPY,
+                        &v, sizeof(v)) == 0) {
+        qio_channel_set_feature(QIO_CHANNEL(sioc),
+                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+    }
+#endif
+}
+
+
 static int
 qio_channel_socket_set_fd(QIOChannelSocket *sioc,
                           int fd,
                           Error **errp)
 {
+    bool connected = true;
+
     if (sioc->fd != -1) {
         error_setg(errp, "Socket is already open");
         return -1;
@@ -94,6 +128,7 @@ qio_channel_socket_set_fd(QIOChannelSocket *sioc,
                              "Unable to query remote socket address");
             goto error;
         }
+        connected = false;
     }
 
     if (getsockname(fd, (struct sockaddr *)&sioc->localAddr,
@@ -110,6 +145,10 @@ qio_channel_socket_set_fd(QIOChannelSocket *sioc,
     }
 #endif /* WIN32 */
 
+    if (connected) {
+        qio_channel_socket_probe_zero_copy(sioc);
+    }
+
     return 0;
 
  error:
@@ -387,6 +426,8 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
     }
 #endif /* WIN32 */
 
+    qio_channel_socket_probe_zero_copy(cioc);
+
     trace_qio_channel_socket_accept_complete(ioc, cioc, cioc->fd);
     return cioc;
 
@@ -572,6 +613,168 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     }
     return ret;
 }
+
+#ifdef QEMU_MSG_ZEROCOPY
+static ssize_t qio_channel_socket_writev_zero_copy(QIOChannel *ioc,
+                                                   const struct iovec *iov,
+                                                   size_t niov,
+                                                   Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    ssize_t ret;
+    struct msghdr msg = { NULL, };
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = niov;
+
+ retry:
+    ret = sendmsg(sioc->fd, &msg, MSG_ZEROCOPY);
+    if (ret <= 0) {
+        switch (errno) {
+        case EAGAIN:
+            return QIO_CHANNEL_ERR_BLOCK;
+        case EINTR:
+            goto retry;
+        case ENOBUFS:
+            /*
+             * The pages could not be pinned (optmem_max or the locked
+             * memory limit was hit), so just copy the data this time.
+             */
+            return qio_channel_socket_writev(ioc, iov, niov, NULL, 0, errp);
+        }
+        error_setg_errno(errp, errno,
+                         "Unable to write to socket");
+        return -1;
+    }
+
+    /* Every successful call is acknowledged by one completion ID */
+    sioc->zero_copy_queued++;
+    trace_qio_channel_socket_writev_zero_copy(sioc, ret,
+                                              sioc->zero_copy_queued);
+    return ret;
+}
+
+/* Bounds of the interval at which coroutines check for completions */
+#define ZERO_COPY_FLUSH_SLEEP_MIN_NS (20 * SCALE_US)
+#define ZERO_COPY_FLUSH_SLEEP_MAX_NS (1 * SCALE_MS)
+
+/*
+ * Wait up to @timeout ms (-1 for no limit) until the socket reports an
+ * error condition, which is how completions on the error queue are
+ * signalled.  No events are requested, so a writable socket does not wake
+ * us up.  Returns the poll revents, or -errno on failure.
+ */
+static int qio_channel_socket_poll_err(QIOChannelSocket *sioc, int timeout)
+{
+    struct pollfd pfd = { .fd = sioc->fd, .events = 0 };
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : pfd.revents;
+}
+
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    uint64_t queued = sioc->zero_copy_queued;
+    struct msghdr msg = { NULL, };
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    char control[CMSG_SPACE(sizeof(*serr))];
+    int64_t sleep_ns = ZERO_COPY_FLUSH_SLEEP_MIN_NS;
+    int revents = 0;
+    int ret;
+
+    while (sioc->zero_copy_sent < queued) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        memset(control, 0, sizeof(control));
+
+        ret = recvmsg(sioc->fd, &msg, MSG_ERRQUEUE);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                error_setg_errno(errp, errno,
+                                 "Unable to read socket error queue");
+                return -1;
+            }
+
+            /*
+             * The last wakeup did not come from the error queue, so the
+             * connection is gone or has a pending socket error.
+             */
+            if (revents & (POLLHUP | POLLNVAL)) {
+                error_setg(errp, "Socket closed with zero copy data pending");
+                return -1;
+            }
+            if (revents & POLLERR) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+
+                if (getsockopt(sioc->fd, SOL_SOCKET, SO_ERROR,
+                               &err, &len) == 0 && err) {
+                    error_setg_errno(errp, err, "Socket error while waiting "
+                                     "for zero copy completions");
+                    return -1;
+                }
+            }
+
+            /*
+             * Completions are signalled as POLLERR.  The aio fd handlers
+             * cannot wait for that alone: the read and write handlers also
+             * fire whenever the socket is readable or writable, and are
+             * owned by the coroutines reading from and writing to the
+             * channel.  So in coroutine context, sleep for a growing
+             * interval and check again, rather than blocking the thread.
+             */
+            if (qemu_in_coroutine()) {
+                qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, sleep_ns);
+                sleep_ns = MIN(sleep_ns * 2, ZERO_COPY_FLUSH_SLEEP_MAX_NS);
+                revents = qio_channel_socket_poll_err(sioc, 0);
+            } else {
+                revents = qio_channel_socket_poll_err(sioc, -1);
+            }
+            if (revents < 0) {
+                error_setg_errno(errp, -revents, "Unable to poll socket");
+                return -1;
+            }
+            continue;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm ||
+            !((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+              (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+            error_setg_errno(errp, EPROTOTYPE,
+                             "Unexpected message in socket error queue");
+            return -1;
+        }
+
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno) {
+            error_setg(errp, "Unexpected socket error (origin %u, errno %u)",
+                       serr->ee_origin, serr->ee_errno);
+            return -1;
+        }
+
+        /* [ee_info, ee_data] is the range of completed IDs */
+        sioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
+        sleep_ns = ZERO_COPY_FLUSH_SLEEP_MIN_NS;
+        revents = 0;
+        trace_qio_channel_socket_flush(sioc, serr->ee_info, serr->ee_data,
+                                       serr->ee_code ==
+                                       SO_EE_CODE_ZEROCOPY_COPIED);
+    }
+
+    return 0;
+}
+#endif /* QEMU_MSG_ZEROCOPY */
 #else /* WIN32 */
 static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
                                         const struct iovec *iov,
@@ -787,6 +990,10 @@ static void qio_channel_socket_class_init(ObjectClass *klass,
     ioc_klass->io_set_delay = qio_channel_socket_set_delay;
     ioc_klass->io_create_watch = qio_channel_socket_create_watch;
     ioc_klass->io_set_aio_fd_handler = qio_channel_socket_set_aio_fd_handler;
+#ifdef QEMU_MSG_ZEROCOPY
+    ioc_klass->io_writev_zero_copy = qio_channel_socket_writev_zero_copy;
+    ioc_klass->io_flush = qio_channel_socket_flush;
+#endif
 }
 
 static const TypeInfo qio_channel_socket_info = {
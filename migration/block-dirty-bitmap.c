@@ -53,6 +53,10 @@
  * [ be64: buffer size  ] \ ! (flags & ZEROES)
  * [ n bytes: buffer    ] /
  *
+ * Chunks with bits usually cover CHUNK_SIZE bytes of bitmap data.  A ZEROES
+ * chunk may cover any number of those, so that clean areas of the bitmap are
+ * sent as a single run.
+ *
  * The last chunk in stream should contain flags & EOS. The chunk may skip
  * device and/or bitmap names, assuming them to be the same with the previous
  * chunk.
@@ -254,6 +258,19 @@ static void send_bitmap_bits(QEMUFile *f, DirtyBitmapMigBitmapState *dbms,
     g_free(buf);
 }
 
+static void send_bitmap_zeroes(QEMUFile *f, DirtyBitmapMigBitmapState *dbms,
+                               uint64_t start_sector, uint32_t nr_sectors)
+{
+    uint32_t flags = DIRTY_BITMAP_MIG_FLAG_BITS | DIRTY_BITMAP_MIG_FLAG_ZEROES;
+
+    trace_send_bitmap_bits(flags, start_sector, nr_sectors, 0);
+
+    send_bitmap_header(f, dbms, flags);
+
+    qemu_put_be64(f, start_sector);
+    qemu_put_be32(f, nr_sectors);
+}
+
 /* Called with iothread lock taken.  */
 static void dirty_bitmap_mig_cleanup(void)
 {
@@ -403,13 +420,47 @@ fail:
     return -1;
 }
 
+/*
+ * Return the number of sectors starting at dbms->cur_sector that are clean
+ * in the bitmap, rounded down to whole chunks unless the run extends to the
+ * end of the disk.
+ */
+static uint64_t bulk_phase_clean_sectors(DirtyBitmapMigBitmapState *dbms)
+{
+    int64_t next_dirty = bdrv_dirty_bitmap_next_dirty(
+        dbms->bitmap, dbms->cur_sector << BDRV_SECTOR_BITS,
+        (dbms->total_sectors - dbms->cur_sector) << BDRV_SECTOR_BITS);
+    uint64_t end_sector;
+
+    if (next_dirty < 0) {
+        end_sector = dbms->total_sectors;
+    } else {
+        end_sector = QEMU_ALIGN_DOWN(next_dirty >> BDRV_SECTOR_BITS,
+                                     dbms->sectors_per_chunk);
+    }
+
+    return end_sector - dbms->cur_sector;
+}
+
 /* Called with no lock taken.  */
 static void bulk_phase_send_chunk(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
 {
-    uint32_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
-                             dbms->sectors_per_chunk);
-
-    send_bitmap_bits(f, dbms, dbms->cur_sector, nr_sectors);
+    uint64_t max_sectors = QEMU_ALIGN_DOWN(UINT32_MAX, dbms->sectors_per_chunk);
+    uint64_t clean_sectors = bulk_phase_clean_sectors(dbms);
+    uint32_t nr_sectors;
+
+    if (clean_sectors && max_sectors) {
+        /*
+         * Large bitmaps are usually mostly clean, so don't serialize and
+         * send their clean areas chunk by chunk.
+         */
+        nr_sectors = MIN(clean_sectors, max_sectors);
+        send_bitmap_zeroes(f, dbms, dbms->cur_sector, nr_sectors);
+    } else {
+        nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
+                         dbms->sectors_per_chunk);
+        send_bitmap_bits(f, dbms, dbms->cur_sector, nr_sectors);
+    }
 
     dbms->cur_sector += nr_sectors;
     if (dbms->cur_sector >= dbms->total_sectors) {
@@ -0,0 +1,265 @@
+/*
+ * Dirty page rate measurement
+ *
+ * Estimates how fast the guest dirties its memory without starting a
+ * migration, and without enabling dirty logging: a random sample of the
+ * pages of each RAMBlock is hashed, and hashed again at the end of the
+ * measurement to see how many of them were modified in the meantime.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "ram.h"
+#include "dirtyrate.h"
+#include "trace.h"
+
+typedef struct {
+    char *idstr;
+    uint64_t length;
+    uint64_t sample_pages;
+    /* page numbers of the sampled pages, and their hashes */
+    uint64_t *pages;
+    uint32_t *hashes;
+    uint64_t dirty_sample_pages;
+    uint64_t dirty_pages_rate;
+} DirtyRateBlock;
+
+/*
+ * Only the measurement thread writes the results, while the status is
+ * DIRTY_RATE_STATUS_MEASURING; they are only read from the monitor, which
+ * is also where measurements get started.
+ */
+static struct {
+    int status;
+    int64_t start_time;
+    int64_t calc_time;
+    uint64_t sample_pages;
+    DirtyRateBlock *blocks;
+    int nblocks;
+    uint64_t dirty_pages_rate;
+} dirty_rate;
+
+static uint32_t dirtyrate_hash_page(RAMBlock *block, uint64_t page)
+{
+    size_t page_size = qemu_target_page_size();
+
+    return crc32(0, block->host + page * page_size, page_size);
+}
+
+static void dirtyrate_free_blocks(void)
+{
+    int i;
+
+    for (i = 0; i < dirty_rate.nblocks; i++) {
+        g_free(dirty_rate.blocks[i].idstr);
+        g_free(dirty_rate.blocks[i].pages);
+        g_free(dirty_rate.blocks[i].hashes);
+    }
+    g_free(dirty_rate.blocks);
+    dirty_rate.blocks = NULL;
+    dirty_rate.nblocks = 0;
+}
+
+/* Called with the RCU read lock held */
+static void dirtyrate_sample_blocks(void)
+{
+    size_t page_size = qemu_target_page_size();
+    RAMBlock *block;
+    int n = 0;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        n++;
+    }
+    dirty_rate.blocks = g_new0(DirtyRateBlock, n);
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        DirtyRateBlock *b;
+        uint64_t nr_pages = block->used_length / page_size;
+        uint64_t i;
+
+        if (!nr_pages || dirty_rate.nblocks == n) {
+            continue;
+        }
+
+        b = &dirty_rate.blocks[dirty_rate.nblocks++];
+        b->idstr = g_strdup(block->idstr);
+        b->length = block->used_length;
+        b->sample_pages = MAX(1, dirty_rate.sample_pages *
+                                 block->used_length / GiB);
+        b->sample_pages = MIN(b->sample_pages, nr_pages);
+        b->pages = g_new(uint64_t, b->sample_pages);
+        b->hashes = g_new(uint32_t, b->sample_pages);
+
+        for (i = 0; i < b->sample_pages; i++) {
+            uint64_t rand = (uint64_t)g_random_int() << 32 | g_random_int();
+
+            b->pages[i] = rand % nr_pages;
+            b->hashes[i] = dirtyrate_hash_page(block, b->pages[i]);
+        }
+    }
+}
+
+/* Called with the RCU read lock held */
+static void dirtyrate_compare_blocks(void)
+{
+    int i;
+
+    for (i = 0; i < dirty_rate.nblocks; i++) {
+        DirtyRateBlock *b = &dirty_rate.blocks[i];
+        RAMBlock *block = qemu_ram_block_by_name(b->idstr);
+        uint64_t j;
+
+        /* Skip blocks that went away or were resized meanwhile */
+        if (!block || block->used_length != b->length) {
+            b->sample_pages = 0;
+            continue;
+        }
+
+        for (j = 0; j < b->sample_pages; j++) {
+            if (dirtyrate_hash_page(block, b->pages[j]) != b->hashes[j]) {
+                b->dirty_sample_pages++;
+            }
+        }
+    }
+}
+
+static void dirtyrate_calc(int64_t elapsed_ms)
+{
+    size_t page_size = qemu_target_page_size();
+    int i;
+
+    dirty_rate.dirty_pages_rate = 0;
+    for (i = 0; i < dirty_rate.nblocks; i++) {
+        DirtyRateBlock *b = &dirty_rate.blocks[i];
+        uint64_t dirty_pages;
+
+        if (!b->sample_pages) {
+            continue;
+        }
+        dirty_pages = b->dirty_sample_pages * (b->length / page_size) /
+                      b->sample_pages;
+        b->dirty_pages_rate = dirty_pages * 1000 / MAX(elapsed_ms, 1);
+        dirty_rate.dirty_pages_rate += b->dirty_pages_rate;
+
+        trace_dirtyrate_block(b->idstr, b->sample_pages,
+                              b->dirty_sample_pages, b->dirty_pages_rate);
+    }
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    int64_t start, elapsed;
+
+    rcu_register_thread();
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        dirtyrate_sample_blocks();
+    }
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    g_usleep(dirty_rate.calc_time * G_USEC_PER_SEC);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        dirtyrate_compare_blocks();
+    }
+    elapsed = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
+
+    dirtyrate_calc(elapsed);
+    trace_dirtyrate_calc(elapsed, dirty_rate.dirty_pages_rate);
+
+    atomic_store_release(&dirty_rate.status, DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    QemuThread thread;
+
+    if (atomic_load_acquire(&dirty_rate.status) ==
+        DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty page rate measurement is already "
+                   "in progress");
+        return;
+    }
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, "calc-time must be between %d and %d seconds",
+                   DIRTYRATE_MIN_CALC_TIME, DIRTYRATE_MAX_CALC_TIME);
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < DIRTYRATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, "sample-pages must be between %d and %d",
+                   DIRTYRATE_MIN_SAMPLE_PAGES, DIRTYRATE_MAX_SAMPLE_PAGES);
+        return;
+    }
+
+    dirtyrate_free_blocks();
+    dirty_rate.start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    dirty_rate.calc_time = calc_time;
+    dirty_rate.sample_pages = sample_pages;
+    dirty_rate.dirty_pages_rate = 0;
+    atomic_set(&dirty_rate.status, DIRTY_RATE_STATUS_MEASURING);
+
+    qemu_thread_create(&thread, "dirtyrate", dirtyrate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    DirtyRateRamBlockList **tail = &info->ramblocks;
+    int i;
+
+    info->status = atomic_load_acquire(&dirty_rate.status);
+    info->start_time = dirty_rate.start_time;
+    info->calc_time = dirty_rate.calc_time;
+    info->sample_pages = dirty_rate.sample_pages;
+
+    if (info->status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate.dirty_pages_rate *
+                       qemu_target_page_size() / MiB;
+    info->has_dirty_pages_rate = true;
+    info->dirty_pages_rate = dirty_rate.dirty_pages_rate;
+
+    info->has_ramblocks = true;
+    for (i = 0; i < dirty_rate.nblocks; i++) {
+        DirtyRateBlock *b = &dirty_rate.blocks[i];
+        DirtyRateRamBlockList *entry;
+
+        if (!b->sample_pages) {
+            continue;
+        }
+        entry = g_new0(DirtyRateRamBlockList, 1);
+        entry->value = g_new0(DirtyRateRamBlock, 1);
+        entry->value->id = g_strdup(b->idstr);
+        entry->value->size = b->length;
+        entry->value->sample_pages = b->sample_pages;
+        entry->value->dirty_sample_pages = b->dirty_sample_pages;
+        entry->value->dirty_pages_rate = b->dirty_pages_rate;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return info;
+}
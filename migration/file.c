@@ -0,0 +1,205 @@
+/*
+ * QEMU live migration to/from a file
+ *
+ * Besides the plain migration stream, a file allows the pages of RAM to
+ * be stored at fixed offsets (see the fixed-ram capability), so that they
+ * can be written and read by several multifd channels in parallel.  Each
+ * multifd channel opens the file on its own.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+static struct FileOutgoingArgs {
+    char *fname;
+} outgoing_args;
+
+static bool file_check_channel(QIOChannel *ioc, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_fixed_ram()) {
+        if (migrate_use_multifd()) {
+            error_setg(errp, "multifd migration to a file requires the "
+                       "fixed-ram capability");
+            return false;
+        }
+        return true;
+    }
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        error_setg(errp, "fixed-ram migration requires a seekable file");
+        return false;
+    }
+    if (migrate_use_multifd() &&
+        migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+        error_setg(errp, "fixed-ram migration does not support multifd "
+                   "compression");
+        return false;
+    }
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "fixed-ram migration does not support TLS");
+        return false;
+    }
+    return true;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+    QIOChannel *ioc;
+
+    trace_migration_file_outgoing(filename);
+
+    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+    ioc = QIO_CHANNEL(fioc);
+    if (!file_check_channel(ioc, errp)) {
+        object_unref(OBJECT(ioc));
+        return;
+    }
+
+    g_free(outgoing_args.fname);
+    outgoing_args.fname = g_strdup(filename);
+
+    qio_channel_set_name(ioc, "migration-file-outgoing");
+    migration_channel_connect(s, ioc, NULL, NULL);
+    object_unref(OBJECT(ioc));
+}
+
+/* Opens the file once more for a multifd channel */
+void file_send_channel_create(QIOTaskFunc f, void *data)
+{
+    QIOChannelFile *fioc;
+    QIOTask *task;
+    Error *err = NULL;
+
+    fioc = qio_channel_file_new_path(outgoing_args.fname, O_WRONLY, 0, &err);
+    task = qio_task_new(OBJECT(fioc), f, data, NULL);
+    if (!fioc) {
+        qio_task_set_error(task, err);
+    } else {
+        qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-multifd");
+    }
+    qio_task_complete(task);
+}
+
+int file_send_channel_destroy(QIOChannel *send)
+{
+    object_unref(OBJECT(send));
+    g_free(outgoing_args.fname);
+    outgoing_args.fname = NULL;
+    return 0;
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    const char *filename = opaque;
+    int i;
+
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+
+    /* The multifd channels read the same file */
+    for (i = 0; migrate_use_multifd() && i < migrate_multifd_channels(); i++) {
+        Error *local_err = NULL;
+        QIOChannelFile *fioc;
+
+        fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, &local_err);
+        if (!fioc) {
+            error_report_err(local_err);
+            break;
+        }
+        qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-multifd");
+        migration_channel_process_incoming(QIO_CHANNEL(fioc));
+        object_unref(OBJECT(fioc));
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QIOChannelFile *fioc;
+    QIOChannel *ioc;
+
+    trace_migration_file_incoming(filename);
+
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+    ioc = QIO_CHANNEL(fioc);
+    if (!file_check_channel(ioc, errp)) {
+        object_unref(OBJECT(ioc));
+        return;
+    }
+
+    qio_channel_set_name(ioc, "migration-file-incoming");
+    qio_channel_add_watch_full(ioc, G_IO_IN,
+                               file_accept_incoming_migration,
+                               g_strdup(filename), g_free,
+                               g_main_context_get_thread_default());
+}
+
+/*
+ * file_pwrite_all: write a buffer to a fixed offset of the file
+ *
+ * Returns 0 on success, or -1 on error
+ */
+int file_pwrite_all(QIOChannel *ioc, const uint8_t *buf, size_t len,
+                    off_t offset, Error **errp)
+{
+    while (len) {
+        ssize_t ret = qio_channel_pwrite(ioc, (char *)buf, len, offset, errp);
+
+        if (ret < 0) {
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/*
+ * file_pread_all: fill a buffer from a fixed offset of the file
+ *
+ * Returns 0 on success, or -1 on error or if the file is too short
+ */
+int file_pread_all(QIOChannel *ioc, uint8_t *buf, size_t len,
+                   off_t offset, Error **errp)
+{
+    while (len) {
+        ssize_t ret = qio_channel_pread(ioc, (char *)buf, len, offset, errp);
+
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            error_setg(errp, "Unexpected end of file at offset %lld",
+                       (long long int)offset);
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
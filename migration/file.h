@@ -0,0 +1,26 @@
+/*
+ * QEMU live migration to/from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_FILE_H
+#define QEMU_MIGRATION_FILE_H
+
+#include "io/channel.h"
+#include "io/task.h"
+
+void file_start_incoming_migration(const char *filename, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp);
+
+void file_send_channel_create(QIOTaskFunc f, void *data);
+int file_send_channel_destroy(QIOChannel *send);
+
+int file_pwrite_all(QIOChannel *ioc, const uint8_t *buf, size_t len,
+                    off_t offset, Error **errp);
+int file_pread_all(QIOChannel *ioc, uint8_t *buf, size_t len,
+                   off_t offset, Error **errp);
+#endif
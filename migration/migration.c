@@ -20,6 +20,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
@@ -54,6 +55,7 @@
 #include "net/announce.h"
 #include "qemu/queue.h"
 #include "multifd.h"
+#include "sysemu/cpus.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -94,6 +96,8 @@
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+/* Worker threads for syncing the dirty bitmap */
+#define DEFAULT_MIGRATE_DIRTY_SYNC_THREADS 4
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -220,6 +224,10 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -250,6 +258,23 @@ static bool migrate_late_block_activate(void)
         MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE];
 }
 
+/*
+ * The postcopy preemption channel is always a plain socket, so it can't
+ * be used with TLS: the destination would expect a TLS handshake on it,
+ * and the pages would otherwise go out unencrypted.
+ */
+static bool migrate_postcopy_preempt_check_tls(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (migrate_postcopy_preempt() &&
+        s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "postcopy-preempt does not support TLS");
+        return false;
+    }
+    return true;
+}
+
 /*
  * Called on -incoming with a defer: uri.
  * The migration can be started later after any parameters have been
@@ -364,6 +389,13 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
+    } else if (migrate_fixed_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "fixed-ram migration requires a file: URI");
+    } else if (migrate_postcopy_preempt() && !strstart(uri, "tcp:", NULL) &&
+               !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "postcopy-preempt requires a tcp: or unix: URI");
+    } else if (!migrate_postcopy_preempt_check_tls(errp)) {
+        /* Error detected, put into errp */
     } else if (strstart(uri, "tcp:", &p)) {
         tcp_start_incoming_migration(p, errp);
 #ifdef CONFIG_RDMA
@@ -376,6 +408,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -626,9 +660,15 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd and postcopy preemption need more than one
+         * channel, we wait.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migrate_use_multifd() &&
+                          !migrate_postcopy_preempt();
+    } else if (migrate_postcopy_preempt()) {
+        /* The source connects it right after the main channel */
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        start_migration = true;
     } else {
         /* Multiple connections */
         assert(migrate_use_multifd());
@@ -656,6 +696,9 @@ bool migration_has_all_channels(void)
     bool all_channels;
 
     all_channels = multifd_recv_all_channels_created();
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
 
     return all_channels && mis->from_src_file != NULL;
 }
@@ -787,6 +830,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->cpu_throttle_increment = s->parameters.cpu_throttle_increment;
     params->has_cpu_throttle_tailslow = true;
     params->cpu_throttle_tailslow = s->parameters.cpu_throttle_tailslow;
+    params->has_cpu_throttle_per_vcpu = true;
+    params->cpu_throttle_per_vcpu = s->parameters.cpu_throttle_per_vcpu;
     params->has_tls_creds = true;
     params->tls_creds = g_strdup(s->parameters.tls_creds);
     params->has_tls_hostname = true;
@@ -950,7 +995,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
 
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
-        info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        info->cpu_throttle_percentage = cpu_throttle_get_max_percentage();
     }
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
@@ -1082,6 +1127,80 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "postcopy-preempt requires postcopy-ram");
+            return false;
+        }
+        /* The extra channel is told apart by the order of connections */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "postcopy-preempt is not compatible with "
+                       "multifd");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_FIXED_RAM]) {
+        /* Pages are stored once, at their offset in the file */
+        if (cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "fixed-ram is not compatible with xbzrle "
+                       "or compress");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "fixed-ram is not compatible with postcopy "
+                       "or COLO");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+        /* The guest keeps running while RAM is saved, in a single pass */
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_DIRTY_BITMAPS,
+            MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME,
+            MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE,
+            MIGRATION_CAPABILITY_RETURN_PATH,
+            MIGRATION_CAPABILITY_MULTIFD,
+            MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER,
+            MIGRATION_CAPABILITY_AUTO_CONVERGE,
+            MIGRATION_CAPABILITY_RELEASE_RAM,
+            MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_VALIDATE_UUID,
+            MIGRATION_CAPABILITY_BLOCK,
+            MIGRATION_CAPABILITY_FIXED_RAM,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "background-snapshot is not compatible "
+                           "with %s",
+                           MigrationCapability_str(incompatible[i]));
+                return false;
+            }
+        }
+
+        if (!ram_write_tracking_available()) {
+            error_setg(errp, "background-snapshot is not supported by the "
+                       "host kernel");
+            return false;
+        }
+        if (!ram_write_tracking_compatible()) {
+            error_setg(errp, "background-snapshot is not compatible with "
+                       "the guest memory configuration");
+            error_append_hint(errp, "Shared and huge page memory backends "
+                              "can't be write-protected.\n");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1334,6 +1453,10 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
         dest->cpu_throttle_tailslow = params->cpu_throttle_tailslow;
     }
 
+    if (params->has_cpu_throttle_per_vcpu) {
+        dest->cpu_throttle_per_vcpu = params->cpu_throttle_per_vcpu;
+    }
+
     if (params->has_tls_creds) {
         assert(params->tls_creds->type == QTYPE_QSTRING);
         dest->tls_creds = g_strdup(params->tls_creds->u.s);
@@ -1426,6 +1549,10 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.cpu_throttle_tailslow = params->cpu_throttle_tailslow;
     }
 
+    if (params->has_cpu_throttle_per_vcpu) {
+        s->parameters.cpu_throttle_per_vcpu = params->cpu_throttle_per_vcpu;
+    }
+
     if (params->has_tls_creds) {
         g_free(s->parameters.tls_creds);
         assert(params->tls_creds->type == QTYPE_QSTRING);
@@ -1608,8 +1735,18 @@ static void migrate_fd_cleanup(MigrationState *s)
     qemu_bh_delete(s->cleanup_bh);
     s->cleanup_bh = NULL;
 
+    if (s->postcopy_qemufile_src && migration_has_failed(s)) {
+        /* Don't let the postcopy preemption thread block on the channel */
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
+
     qemu_savevm_state_cleanup();
 
+    if (s->postcopy_qemufile_src) {
+        qemu_fclose(s->postcopy_qemufile_src);
+        s->postcopy_qemufile_src = NULL;
+    }
+
     if (s->to_dst_file) {
         QEMUFile *tmp;
 
@@ -1715,6 +1852,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING && s->postcopy_qemufile_src) {
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -1901,6 +2041,18 @@ void qmp_migrate_recover(const char *uri, Error **errp)
         return;
     }
 
+    if (migrate_postcopy_preempt()) {
+        error_setg(errp, "Postcopy recovery cannot work "
+                   "when postcopy-preempt capability is set");
+        return;
+    }
+
+    if (migrate_use_multifd() && migrate_multifd_postcopy()) {
+        error_setg(errp, "Postcopy recovery cannot work "
+                   "when postcopy pages are sent over multifd");
+        return;
+    }
+
     if (atomic_cmpxchg(&mis->postcopy_recover_triggered,
                        false, true) == true) {
         error_setg(errp, "Migrate recovery is triggered already");
@@ -1989,6 +2141,20 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
             return false;
         }
 
+        /* The preemption channel can't be reconnected */
+        if (migrate_postcopy_preempt()) {
+            error_setg(errp, "Postcopy recovery cannot work "
+                       "when postcopy-preempt capability is set");
+            return false;
+        }
+
+        /* Neither can the multifd channels */
+        if (migrate_use_multifd() && migrate_multifd_postcopy()) {
+            error_setg(errp, "Postcopy recovery cannot work "
+                       "when postcopy pages are sent over multifd");
+            return false;
+        }
+
         /* This is a resume, skip init status */
         return true;
     }
@@ -2049,6 +2215,30 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_fixed_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "fixed-ram migration requires a file: URI");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
+    if (migrate_postcopy_preempt() && !strstart(uri, "tcp:", NULL) &&
+        !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "postcopy-preempt requires a tcp: or unix: URI");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
+    if (!migrate_postcopy_preempt_check_tls(errp)) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
 #ifdef CONFIG_RDMA
@@ -2061,6 +2251,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -2251,6 +2443,33 @@ bool migrate_ignore_shared(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
 }
 
+bool migrate_fixed_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
 bool migrate_validate_uuid(void)
 {
     MigrationState *s;
@@ -2324,6 +2543,42 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+bool migrate_multifd_zero_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->multifd_zero_pages;
+}
+
+bool migrate_multifd_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->multifd_postcopy;
+}
+
+int migrate_dirty_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->dirty_sync_threads;
+}
+
+int migrate_dirty_sync_chunk_shift(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->dirty_sync_chunk_shift;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -2761,6 +3016,11 @@ static int postcopy_start(MigrationState *ms)
         qemu_savevm_send_ping(ms->to_dst_file, 2);
     }
 
+    if (migrate_postcopy_preempt()) {
+        /* From now on, requested pages don't queue behind the others */
+        ram_postcopy_preempt_start(ms->postcopy_qemufile_src);
+    }
+
     /*
      * While loading the device state we may trigger page transfer
      * requests and the fd must be free to process those, and thus
@@ -3403,6 +3663,20 @@ static void *migration_thread(void *opaque)
     object_ref(OBJECT(s));
     update_iteration_initial_status(s);
 
+    /*
+     * The destination waits for the postcopy preemption channel before
+     * loading anything, and tells it apart because it comes second.
+     */
+    if (migrate_postcopy_preempt()) {
+        Error *local_err = NULL;
+
+        if (postcopy_preempt_setup(s, &local_err)) {
+            migrate_set_error(s, local_err);
+            error_report_err(local_err);
+            qemu_file_set_error(s->to_dst_file, -ENOTCONN);
+        }
+    }
+
     qemu_savevm_state_header(s->to_dst_file);
 
     /*
@@ -3489,6 +3763,181 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+static void bg_migration_completion(MigrationState *s, QIOChannelBuffer *bioc)
+{
+    int ret;
+
+    /*
+     * All of RAM has been saved.  Remove the write protection before
+     * taking the iothread lock: a thread that holds it and writes to a
+     * page that is still protected would wait for us to resolve the
+     * fault, while we wait for the lock.
+     */
+    ram_write_tracking_stop();
+
+    /* Finish the RAM sections, and append the state of the devices */
+    qemu_mutex_lock_iothread();
+    ret = qemu_savevm_state_complete_precopy(s->to_dst_file, true, false);
+    qemu_mutex_unlock_iothread();
+
+    if (!ret) {
+        qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+        qemu_fflush(s->to_dst_file);
+    }
+
+    if (ret < 0 || qemu_file_get_error(s->to_dst_file)) {
+        trace_migration_completion_file_err();
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+        return;
+    }
+
+    migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_COMPLETED);
+}
+
+static void bg_migration_iteration_finish(MigrationState *s)
+{
+    qemu_mutex_lock_iothread();
+    switch (s->state) {
+    case MIGRATION_STATUS_COMPLETED:
+        migration_calculate_complete(s);
+        break;
+
+    case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_CANCELLED:
+    case MIGRATION_STATUS_CANCELLING:
+        /* The VM kept running, there is nothing to restore */
+        break;
+
+    default:
+        /* Should not reach here, but if so, forgive the VM. */
+        error_report("%s: Unknown ending state %d", __func__, s->state);
+        break;
+    }
+    migrate_fd_cleanup_schedule(s);
+    qemu_mutex_unlock_iothread();
+}
+
+/*
+ * Restarting the VM calls the VM state change handlers, and some of them
+ * write to guest RAM (e.g. virtio rings).  With RAM write-protected, only
+ * the migration thread can resolve those faults, so it must not be the one
+ * that restarts the VM.
+ */
+static void bg_migration_vm_start_bh(void *opaque)
+{
+    MigrationState *s = opaque;
+
+    qemu_bh_delete(s->vm_start_bh);
+    s->vm_start_bh = NULL;
+
+    vm_start();
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->downtime_start;
+}
+
+/*
+ * Background snapshot thread on the source VM.
+ *
+ * The VM is only stopped while the state of the devices is saved and
+ * guest RAM gets write-protected, then RAM is saved while the VM runs
+ * (see ram_write_tracking_start()).  The stream is the same as for a
+ * migration, so the device state is kept in a buffer until all of RAM
+ * has been sent.
+ */
+static void *bg_migration_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    MigThrError thr_error;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    bool urgent = false;
+    int ret;
+
+    rcu_register_thread();
+
+    object_ref(OBJECT(s));
+    update_iteration_initial_status(s);
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_setup(s->to_dst_file);
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    trace_migration_thread_setup_complete();
+
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "vmstate-buffer");
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    /* Keep populating the guest RAM out of the downtime */
+    ram_write_tracking_prepare();
+
+    qemu_mutex_lock_iothread();
+    s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
+    s->vm_was_running = runstate_is_running();
+    ret = global_state_store();
+    if (!ret && s->vm_was_running) {
+        ret = vm_stop_force_state(RUN_STATE_SAVE_VM);
+    }
+    if (!ret) {
+        cpu_synchronize_all_states();
+        ret = qemu_savevm_state_complete_precopy_non_iterable(fb, false,
+                                                              false);
+    }
+    if (!ret) {
+        qemu_fflush(fb);
+        ret = qemu_file_get_error(fb);
+    }
+    if (!ret) {
+        ret = ram_write_tracking_start();
+    }
+    if (s->vm_was_running) {
+        s->vm_start_bh = qemu_bh_new(bg_migration_vm_start_bh, s);
+        qemu_bh_schedule(s->vm_start_bh);
+    } else {
+        s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                      s->downtime_start;
+    }
+    qemu_mutex_unlock_iothread();
+
+    if (ret) {
+        error_report("%s: failed to save the state of the devices",
+                     __func__);
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+    }
+
+    while (migration_is_active(s)) {
+        /* All of RAM is sent in one pass, which ends the snapshot */
+        if ((urgent || !qemu_file_rate_limit(s->to_dst_file)) &&
+            qemu_savevm_state_iterate(s->to_dst_file, false) > 0) {
+            bg_migration_completion(s, bioc);
+            break;
+        }
+
+        thr_error = migration_detect_error(s);
+        if (thr_error == MIG_THR_ERR_FATAL) {
+            break;
+        }
+
+        urgent = migration_rate_limit();
+    }
+
+    trace_migration_thread_after_loop();
+    bg_migration_iteration_finish(s);
+    qemu_fclose(fb);
+    object_unref(OBJECT(s));
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s, Error *error_in)
 {
     Error *local_err = NULL;
@@ -3552,8 +4001,13 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         migrate_fd_cleanup(s);
         return;
     }
-    qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "bg_snapshot", bg_migration_thread,
+                           s, QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "live_migration", migration_thread,
+                           s, QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
@@ -3574,6 +4028,14 @@ void migration_global_dump(Monitor *mon)
                    ms->decompress_error_check ? "on" : "off");
     monitor_printf(mon, "clear-bitmap-shift: %u\n",
                    ms->clear_bitmap_shift);
+    monitor_printf(mon, "multifd-zero-pages: %s\n",
+                   ms->multifd_zero_pages ? "on" : "off");
+    monitor_printf(mon, "multifd-postcopy: %s\n",
+                   ms->multifd_postcopy ? "on" : "off");
+    monitor_printf(mon, "dirty-sync-threads: %u\n",
+                   ms->dirty_sync_threads);
+    monitor_printf(mon, "dirty-sync-chunk-shift: %u\n",
+                   ms->dirty_sync_chunk_shift);
 }
 
 #define DEFINE_PROP_MIG_CAP(name, x)             \
@@ -3590,6 +4052,14 @@ static Property migration_properties[] = {
                       decompress_error_check, true),
     DEFINE_PROP_UINT8("x-clear-bitmap-shift", MigrationState,
                       clear_bitmap_shift, CLEAR_BITMAP_SHIFT_DEFAULT),
+    DEFINE_PROP_BOOL("multifd-zero-pages", MigrationState,
+                     multifd_zero_pages, true),
+    DEFINE_PROP_BOOL("multifd-postcopy", MigrationState,
+                     multifd_postcopy, true),
+    DEFINE_PROP_UINT8("x-dirty-sync-threads", MigrationState,
+                      dirty_sync_threads, DEFAULT_MIGRATE_DIRTY_SYNC_THREADS),
+    DEFINE_PROP_UINT8("x-dirty-sync-chunk-shift", MigrationState,
+                      dirty_sync_chunk_shift, DIRTY_SYNC_CHUNK_SHIFT_DEFAULT),
 
     /* Migration parameters */
     DEFINE_PROP_UINT8("x-compress-level", MigrationState,
@@ -3614,6 +4084,8 @@ static Property migration_properties[] = {
                       DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT),
     DEFINE_PROP_BOOL("x-cpu-throttle-tailslow", MigrationState,
                       parameters.cpu_throttle_tailslow, false),
+    DEFINE_PROP_BOOL("x-cpu-throttle-per-vcpu", MigrationState,
+                      parameters.cpu_throttle_per_vcpu, false),
     DEFINE_PROP_SIZE("x-max-bandwidth", MigrationState,
                       parameters.max_bandwidth, MAX_THROTTLE),
     DEFINE_PROP_UINT64("x-downtime-limit", MigrationState,
@@ -3721,6 +4193,7 @@ static void migration_instance_init(Object *obj)
     params->has_cpu_throttle_initial = true;
     params->has_cpu_throttle_increment = true;
     params->has_cpu_throttle_tailslow = true;
+    params->has_cpu_throttle_per_vcpu = true;
     params->has_max_bandwidth = true;
     params->has_downtime_limit = true;
     params->has_x_checkpoint_delay = true;
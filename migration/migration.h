@@ -43,6 +43,12 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * 1<<18=256K pages -> 1G chunk when page size is 4K.  Guests no larger
+ * than two chunks are synced by the migration thread alone.
+ */
+#define DIRTY_SYNC_CHUNK_SHIFT_DEFAULT    18
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -67,6 +73,11 @@ struct MigrationIncomingState {
     QemuThread     listen_thread;
     QemuSemaphore  listen_thread_sem;
 
+    /* Postcopy preemption channel, and the thread loading it */
+    QEMUFile      *postcopy_qemufile_dst;
+    bool           have_preempt_thread;
+    QemuThread     postcopy_preempt_thread;
+
     /* For the kernel to send us notifications */
     int       userfault_fd;
     /* To notify the fault_thread to wake, e.g., when need to quit */
@@ -134,6 +145,8 @@ struct MigrationState
     /*< public >*/
     QemuThread thread;
     QEMUBH *cleanup_bh;
+    /* Restarts the VM once background snapshot write-protected RAM */
+    QEMUBH *vm_start_bh;
     QEMUFile *to_dst_file;
     /*
      * Protects to_dst_file pointer.  We need to make sure we won't
@@ -141,6 +154,8 @@ struct MigrationState
      * be used in OOB command handler.
      */
     QemuMutex qemu_file_lock;
+    /* Postcopy preemption channel, for the pages requested by destination */
+    QEMUFile *postcopy_qemufile_src;
 
     /*
      * Used to allow urgent requests to override rate limiting.
@@ -261,6 +276,34 @@ struct MigrationState
      * (which is in 4M chunk).
      */
     uint8_t clear_bitmap_shift;
+
+    /*
+     * Whether zero pages are detected by the multifd send threads and
+     * sent as part of the multifd packets.  Destinations older than 5.1
+     * do not understand them, so it is left at false for older machine
+     * types.
+     */
+    bool multifd_zero_pages;
+
+    /*
+     * Whether the background pages keep going through the multifd
+     * channels once in postcopy.  Destinations older than 5.1 expect
+     * all postcopy pages on the main channel.
+     */
+    bool multifd_postcopy;
+
+    /*
+     * Number of threads that sync the dirty bitmap of the RAMBlocks
+     * together with the migration thread, 0 to only use the latter.
+     */
+    uint8_t dirty_sync_threads;
+
+    /*
+     * Size of the chunks the dirty sync threads work on, in the same
+     * unit as clear_bitmap_shift.  Chunks are never smaller than the
+     * clear bitmap chunks of the RAMBlock.
+     */
+    uint8_t dirty_sync_chunk_shift;
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
@@ -294,6 +337,9 @@ bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
+bool migrate_fixed_ram(void);
+bool migrate_background_snapshot(void);
+bool migrate_postcopy_preempt(void);
 bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
@@ -303,6 +349,10 @@ int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
 int migrate_multifd_zlib_level(void);
 int migrate_multifd_zstd_level(void);
+bool migrate_multifd_zero_pages(void);
+bool migrate_multifd_postcopy(void);
+int migrate_dirty_sync_threads(void);
+int migrate_dirty_sync_chunk_shift(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -12,6 +12,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
+#include "qemu/bitops.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -19,7 +21,9 @@
 #include "qapi/error.h"
 #include "ram.h"
 #include "migration.h"
+#include "postcopy-ram.h"
 #include "socket.h"
+#include "file.h"
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
@@ -241,6 +245,7 @@ static MultiFDPages_t *multifd_pages_init(size_t size)
     pages->allocated = size;
     pages->iov = g_new0(struct iovec, size);
     pages->offset = g_new0(ram_addr_t, size);
+    pages->zero = g_new0(ram_addr_t, size);
 
     return pages;
 }
@@ -255,6 +260,9 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     pages->iov = NULL;
     g_free(pages->offset);
     pages->offset = NULL;
+    pages->zero_num = 0;
+    g_free(pages->zero);
+    pages->zero = NULL;
     g_free(pages);
 }
 
@@ -266,6 +274,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->flags = cpu_to_be32(p->flags);
     packet->pages_alloc = cpu_to_be32(p->pages->allocated);
     packet->pages_used = cpu_to_be32(p->pages->used);
+    packet->zero_pages = cpu_to_be32(p->pages->zero_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
 
@@ -279,6 +288,12 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
         packet->offset[i] = cpu_to_be64(temp);
     }
+
+    for (i = 0; i < p->pages->zero_num; i++) {
+        uint64_t temp = p->pages->zero[i];
+
+        packet->offset[p->pages->used + i] = cpu_to_be64(temp);
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -324,20 +339,25 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     if (packet->pages_alloc > p->pages->allocated) {
         multifd_pages_clear(p->pages);
         p->pages = multifd_pages_init(packet->pages_alloc);
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
     }
 
     p->pages->used = be32_to_cpu(packet->pages_used);
-    if (p->pages->used > packet->pages_alloc) {
+    p->pages->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->pages->used > packet->pages_alloc ||
+        p->pages->zero_num > packet->pages_alloc - p->pages->used) {
         error_setg(errp, "multifd: received packet "
-                   "with %d pages and expected maximum pages are %d",
-                   p->pages->used, packet->pages_alloc) ;
+                   "with %d pages and %d zero pages and expected maximum "
+                   "pages are %d", p->pages->used, p->pages->zero_num,
+                   packet->pages_alloc) ;
         return -1;
     }
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->pages->used == 0) {
+    if (p->pages->used == 0 && p->pages->zero_num == 0) {
         return 0;
     }
 
@@ -350,6 +370,19 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+        /* A huge page has to be placed at once, it is never sent here */
+        if (block->page_size != qemu_target_page_size()) {
+            error_setg(errp, "multifd: postcopy packet for ram block %s "
+                       "with page size %zu", block->idstr, block->page_size);
+            return -1;
+        }
+        if (!p->postcopy_buf) {
+            p->postcopy_buf = g_malloc(p->pages->allocated *
+                                       qemu_target_page_size());
+        }
+    }
+
     for (i = 0; i < p->pages->used; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
@@ -359,10 +392,31 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
+        p->pages->offset[i] = offset;
         p->pages->iov[i].iov_len = qemu_target_page_size();
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            /* placing the page marks it as received */
+            p->pages->iov[i].iov_base = p->postcopy_buf +
+                                        i * qemu_target_page_size();
+        } else {
+            p->pages->iov[i].iov_base = block->host + offset;
+            ramblock_recv_bitmap_set(block, block->host + offset);
+        }
     }
 
+    for (i = 0; i < p->pages->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->pages->used + i]);
+
+        if (offset > (block->used_length - qemu_target_page_size())) {
+            error_setg(errp, "multifd: zero page offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, block->max_length);
+            return -1;
+        }
+        p->pages->zero[i] = offset;
+    }
+    p->pages->block = block;
+
     return 0;
 }
 
@@ -402,13 +456,38 @@ struct {
  * false.
  */
 
+/*
+ * multifd_send_account: account for what a channel has sent
+ *
+ * The channel threads only know which pages are zero pages, and how
+ * much data they wrote, once they have processed a packet.  They
+ * collect these numbers in their params, and the migration thread adds
+ * them to the migration counters whenever it hands out new work to the
+ * channel and when syncing, so that only it ever updates ram_counters.
+ *
+ * Called with p->mutex held.
+ *
+ * @f: QEMUFile used for rate limiting
+ * @p: Params for the channel
+ */
+static void multifd_send_account(QEMUFile *f, MultiFDSendParams *p)
+{
+    qemu_file_update_transfer(f, p->acct_bytes);
+    ram_counters.multifd_bytes += p->acct_bytes;
+    ram_counters.transferred += p->acct_bytes;
+    ram_counters.normal += p->acct_normal_pages;
+    ram_counters.duplicate += p->acct_zero_pages;
+    p->acct_bytes = 0;
+    p->acct_normal_pages = 0;
+    p->acct_zero_pages = 0;
+}
+
 static int multifd_send_pages(QEMUFile *f)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
 
     if (atomic_read(&multifd_send_state->exiting)) {
         return -1;
@@ -435,13 +514,16 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->block);
 
     p->packet_num = multifd_send_state->packet_num++;
+    /*
+     * Each iteration ends with a sync that flushes the pending pages, so
+     * a batch never mixes pages from before and after the switch.
+     */
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    }
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->used) * qemu_target_page_size()
-                + p->packet_len;
-    qemu_file_update_transfer(f, transferred);
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;;
+    multifd_send_account(f, p);
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 
@@ -535,7 +617,11 @@ void multifd_save_cleanup(void)
         MultiFDSendParams *p = &multifd_send_state->params[i];
         Error *local_err = NULL;
 
-        socket_send_channel_destroy(p->c);
+        if (migrate_fixed_ram()) {
+            file_send_channel_destroy(p->c);
+        } else {
+            socket_send_channel_destroy(p->c);
+        }
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
@@ -591,9 +677,6 @@ void multifd_send_sync_main(QEMUFile *f)
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
         p->pending_job++;
-        qemu_file_update_transfer(f, p->packet_len);
-        ram_counters.multifd_bytes += p->packet_len;
-        ram_counters.transferred += p->packet_len;
         qemu_mutex_unlock(&p->mutex);
         qemu_sem_post(&p->sem);
     }
@@ -602,10 +685,92 @@ void multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account(f, p);
+        qemu_mutex_unlock(&p->mutex);
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/**
+ * multifd_send_zero_page_detect: split the pages of a packet
+ *
+ * Moves the zero pages out of p->pages->offset into p->pages->zero, so
+ * that only their offsets are sent.  The remaining pages are compacted
+ * at the start of the offset and iov arrays, and p->pages->used is
+ * updated to their number.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t normal = 0;
+    int i;
+
+    pages->zero_num = 0;
+    /* With fixed-ram, zero pages are left as holes in the file */
+    if (!migrate_multifd_zero_pages() && !migrate_fixed_ram()) {
+        return;
+    }
+
+    for (i = 0; i < pages->used; i++) {
+        ram_addr_t offset = pages->offset[i];
+
+        if (buffer_is_zero(pages->block->host + offset, page_size)) {
+            pages->zero[pages->zero_num++] = offset;
+        } else {
+            pages->offset[normal] = offset;
+            pages->iov[normal] = pages->iov[i];
+            normal++;
+        }
+    }
+    pages->used = normal;
+}
+
+/**
+ * multifd_send_fixed_ram: write the pages to their place in the file
+ *
+ * Runs of consecutive pages are written with a single request, and the
+ * block's file bitmap is updated to tell which pages are present.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_send_fixed_ram(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    RAMBlock *block = pages->block;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i, j, k;
+
+    for (i = 0; i < pages->zero_num; i++) {
+        clear_bit_atomic(pages->zero[i] / page_size, block->file_bmap);
+    }
+
+    for (i = 0; i < pages->used; i = j) {
+        ram_addr_t offset = pages->offset[i];
+
+        for (j = i + 1; j < pages->used; j++) {
+            if (pages->offset[j] != pages->offset[j - 1] + page_size) {
+                break;
+            }
+        }
+        if (file_pwrite_all(p->c, block->host + offset, (j - i) * page_size,
+                            block->pages_offset + offset, errp) < 0) {
+            return -1;
+        }
+        for (k = i; k < j; k++) {
+            set_bit_atomic(pages->offset[k] / page_size, block->file_bmap);
+        }
+    }
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -616,12 +781,15 @@ static void *multifd_send_thread(void *opaque)
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        ret = -1;
-        goto out;
+    /* With fixed-ram, the channels write to the file directly */
+    if (!migrate_fixed_ram()) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            ret = -1;
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
     }
-    /* initial packet */
-    p->num_packets = 1;
 
     while (true) {
         qemu_sem_wait(&p->sem);
@@ -632,10 +800,44 @@ static void *multifd_send_thread(void *opaque)
         qemu_mutex_lock(&p->mutex);
 
         if (p->pending_job) {
-            uint32_t used = p->pages->used;
+            uint32_t used, zero_num;
             uint64_t packet_num = p->packet_num;
             flags = p->flags;
 
+            multifd_send_zero_page_detect(p);
+            used = p->pages->used;
+            zero_num = p->pages->zero_num;
+
+            if (migrate_fixed_ram()) {
+                p->flags = 0;
+                p->num_pages += used;
+                p->num_zero_pages += zero_num;
+                p->acct_normal_pages += used;
+                p->acct_zero_pages += zero_num;
+                p->acct_bytes += (uint64_t)used * qemu_target_page_size();
+                qemu_mutex_unlock(&p->mutex);
+
+                trace_multifd_send(p->id, packet_num, used, zero_num, flags, 0);
+
+                ret = multifd_send_fixed_ram(p, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+
+                qemu_mutex_lock(&p->mutex);
+                p->pages->used = 0;
+                p->pages->zero_num = 0;
+                p->pages->block = NULL;
+                p->pending_job--;
+                qemu_mutex_unlock(&p->mutex);
+
+                if (flags & MULTIFD_FLAG_SYNC) {
+                    qemu_sem_post(&p->sem_sync);
+                }
+                qemu_sem_post(&multifd_send_state->channels_ready);
+                continue;
+            }
+
             if (used) {
                 ret = multifd_send_state->ops->send_prepare(p, used,
                                                             &local_err);
@@ -643,16 +845,23 @@ static void *multifd_send_thread(void *opaque)
                     qemu_mutex_unlock(&p->mutex);
                     break;
                 }
+            } else {
+                p->next_packet_size = 0;
             }
             multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
+            p->num_zero_pages += zero_num;
+            p->acct_normal_pages += used;
+            p->acct_zero_pages += zero_num;
+            p->acct_bytes += p->packet_len + p->next_packet_size;
             p->pages->used = 0;
+            p->pages->zero_num = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
+            trace_multifd_send(p->id, packet_num, used, zero_num, flags,
                                p->next_packet_size);
 
             ret = qio_channel_write_all(p->c, (void *)p->packet,
@@ -706,7 +915,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -773,7 +983,11 @@ int multifd_save_setup(Error **errp)
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
         p->packet->version = cpu_to_be32(MULTIFD_VERSION);
         p->name = g_strdup_printf("multifdsend_%d", i);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        if (migrate_fixed_ram()) {
+            file_send_channel_create(multifd_new_send_channel_async, p);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p);
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -798,8 +1012,14 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* fixed-ram: array of pages to read, like multifd_send_state->pages */
+    MultiFDPages_t *pages;
+    /* fixed-ram: recv channels ready */
+    QemuSemaphore channels_ready;
     /* multifd ops */
     MultiFDMethods *ops;
+    /* postcopy pages can only be placed once the destination listens */
+    QemuEvent postcopy_listening;
 } *multifd_recv_state;
 
 static void multifd_recv_terminate_threads(Error *err)
@@ -823,6 +1043,7 @@ static void multifd_recv_terminate_threads(Error *err)
 
         qemu_mutex_lock(&p->mutex);
         p->quit = true;
+        qemu_sem_post(&p->sem);
         /*
          * We could arrive here for two reasons:
          *  - normal quit, i.e. everything went fine, just finished
@@ -834,6 +1055,8 @@ static void multifd_recv_terminate_threads(Error *err)
         }
         qemu_mutex_unlock(&p->mutex);
     }
+    /* wake up the channels waiting to place postcopy pages */
+    qemu_event_set(&multifd_recv_state->postcopy_listening);
 }
 
 int multifd_load_cleanup(Error **errp)
@@ -863,6 +1086,7 @@ int multifd_load_cleanup(Error **errp)
         object_unref(OBJECT(p->c));
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
         qemu_sem_destroy(&p->sem_sync);
         g_free(p->name);
         p->name = NULL;
@@ -871,9 +1095,15 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_sem_destroy(&multifd_recv_state->channels_ready);
+    qemu_event_destroy(&multifd_recv_state->postcopy_listening);
+    multifd_pages_clear(multifd_recv_state->pages);
+    multifd_recv_state->pages = NULL;
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
@@ -882,6 +1112,99 @@ int multifd_load_cleanup(Error **errp)
     return 0;
 }
 
+/*
+ * With fixed-ram there are no packets on the channels: the main thread
+ * reads the bitmap of each block and hands out the pages to read to the
+ * channels, the same way the sending side hands out pages to send.
+ */
+static int multifd_recv_pages(void)
+{
+    int i;
+    static int next_channel;
+    MultiFDRecvParams *p = NULL; /* make happy gcc */
+    MultiFDPages_t *pages = multifd_recv_state->pages;
+
+    qemu_sem_wait(&multifd_recv_state->channels_ready);
+    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
+        p = &multifd_recv_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            error_report("%s: channel %d has already quit!", __func__, i);
+            qemu_mutex_unlock(&p->mutex);
+            return -1;
+        }
+        if (!p->pending_job) {
+            p->pending_job++;
+            next_channel = (i + 1) % migrate_multifd_channels();
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    multifd_recv_state->pages = p->pages;
+    p->pages = pages;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    return 1;
+}
+
+int multifd_recv_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages_t *pages = multifd_recv_state->pages;
+
+    if (pages->block && pages->block != block) {
+        if (multifd_recv_pages() < 0) {
+            return -1;
+        }
+        pages = multifd_recv_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used] = offset;
+    pages->used++;
+
+    if (pages->used == pages->allocated) {
+        return multifd_recv_pages();
+    }
+    return 1;
+}
+
+static void multifd_recv_fixed_ram_sync_main(void)
+{
+    int i;
+
+    if (multifd_recv_state->pages->used) {
+        if (multifd_recv_pages() < 0) {
+            error_report("%s: multifd_recv_pages fail", __func__);
+            return;
+        }
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        trace_multifd_recv_sync_main_signal(p->id);
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            error_report("%s: channel %d has already quit", __func__, i);
+            qemu_mutex_unlock(&p->mutex);
+            return;
+        }
+        p->flags |= MULTIFD_FLAG_SYNC;
+        p->pending_job++;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        trace_multifd_recv_sync_main_wait(p->id);
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
+}
+
 void multifd_recv_sync_main(void)
 {
     int i;
@@ -889,6 +1212,10 @@ void multifd_recv_sync_main(void)
     if (!migrate_use_multifd()) {
         return;
     }
+    if (migrate_fixed_ram()) {
+        multifd_recv_fixed_ram_sync_main();
+        return;
+    }
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
@@ -909,6 +1236,90 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/**
+ * multifd_recv_zero_pages: apply the zero pages of a packet
+ *
+ * Pages that were never received are still untouched (and thus zero)
+ * on the destination, so they are only marked as received instead of
+ * being written, which would allocate memory for them.  Pages that
+ * were received before get cleared.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    int i;
+
+    for (i = 0; i < pages->zero_num; i++) {
+        void *host = pages->block->host + pages->zero[i];
+
+        if (ramblock_recv_bitmap_test_byte_offset(pages->block,
+                                                  pages->zero[i])) {
+            ram_handle_compressed(host, 0, page_size);
+        } else {
+            ramblock_recv_bitmap_set(pages->block, host);
+        }
+    }
+}
+
+/**
+ * multifd_recv_postcopy_listen: let the channels place postcopy pages
+ *
+ * Called once the destination is listening, i.e. once the guest memory
+ * is registered with userfaultfd.  The packets that come in before
+ * have to wait, as a page can only be placed atomically from then on.
+ */
+void multifd_recv_postcopy_listen(void)
+{
+    if (!multifd_recv_state) {
+        return;
+    }
+    qemu_event_set(&multifd_recv_state->postcopy_listening);
+}
+
+/**
+ * multifd_recv_postcopy_place: place the pages of a postcopy packet
+ *
+ * The pages were received (or decompressed) into p->postcopy_buf, and
+ * are copied from there atomically, waking up the faulting threads.
+ * Zero pages are always missing in postcopy, so they are placed too.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_recv_postcopy_place(MultiFDRecvParams *p, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    MultiFDPages_t *pages = p->pages;
+    RAMBlock *block = pages->block;
+    int i;
+
+    for (i = 0; i < pages->used; i++) {
+        if (postcopy_place_page(mis, block->host + pages->offset[i],
+                                pages->iov[i].iov_base, block)) {
+            error_setg(errp, "multifd %u: failed to place page at "
+                       RAM_ADDR_FMT " of %s", p->id, pages->offset[i],
+                       block->idstr);
+            return -1;
+        }
+    }
+    for (i = 0; i < pages->zero_num; i++) {
+        if (postcopy_place_page_zero(mis, block->host + pages->zero[i],
+                                     block)) {
+            error_setg(errp, "multifd %u: failed to place zero page at "
+                       RAM_ADDR_FMT " of %s", p->id, pages->zero[i],
+                       block->idstr);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -919,7 +1330,7 @@ static void *multifd_recv_thread(void *opaque)
     rcu_register_thread();
 
     while (true) {
-        uint32_t used;
+        uint32_t used, zero_num;
         uint32_t flags;
 
         if (p->quit) {
@@ -943,19 +1354,46 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        zero_num = p->pages->zero_num;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, used, zero_num, flags,
                            p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
+        p->num_zero_pages += zero_num;
         qemu_mutex_unlock(&p->mutex);
 
-        if (used) {
-            ret = multifd_recv_state->ops->recv_pages(p, used, &local_err);
-            if (ret != 0) {
-                break;
+        if (flags & MULTIFD_FLAG_POSTCOPY) {
+            if (used) {
+                ret = multifd_recv_state->ops->recv_pages(p, used,
+                                                          &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
+            if (used || zero_num) {
+                qemu_event_wait(&multifd_recv_state->postcopy_listening);
+                if (p->quit) {
+                    break;
+                }
+                ret = multifd_recv_postcopy_place(p, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
+        } else {
+            if (zero_num) {
+                multifd_recv_zero_pages(p);
+            }
+
+            if (used) {
+                ret = multifd_recv_state->ops->recv_pages(p, used,
+                                                          &local_err);
+                if (ret != 0) {
+                    break;
+                }
             }
         }
 
@@ -974,7 +1412,111 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
+
+    return NULL;
+}
+
+/**
+ * multifd_recv_fixed_ram: read the pages from their place in the file
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_recv_fixed_ram(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    RAMBlock *block = pages->block;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i, j;
+
+    for (i = 0; i < pages->used; i = j) {
+        ram_addr_t offset = pages->offset[i];
+
+        for (j = i + 1; j < pages->used; j++) {
+            if (pages->offset[j] != pages->offset[j - 1] + page_size) {
+                break;
+            }
+        }
+        if (file_pread_all(p->c, block->host + offset, (j - i) * page_size,
+                           block->pages_offset + offset, errp) < 0) {
+            return -1;
+        }
+        ramblock_recv_bitmap_set_range(block, block->host + offset, j - i);
+    }
+    return 0;
+}
+
+static void *multifd_recv_fixed_ram_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    int ret = 0;
+
+    trace_multifd_recv_thread_start(p->id);
+    rcu_register_thread();
+
+    qemu_sem_post(&multifd_recv_state->channels_ready);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->pending_job) {
+            uint32_t used = p->pages->used;
+            uint32_t flags = p->flags;
+
+            p->flags = 0;
+            p->num_pages += used;
+            qemu_mutex_unlock(&p->mutex);
+
+            trace_multifd_recv(p->id, 0, used, 0, flags, 0);
+
+            ret = multifd_recv_fixed_ram(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            p->pending_job--;
+            qemu_mutex_unlock(&p->mutex);
+
+            if (flags & MULTIFD_FLAG_SYNC) {
+                qemu_sem_post(&multifd_recv_state->sem_sync);
+            }
+            qemu_sem_post(&multifd_recv_state->channels_ready);
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+            /* sometimes there are spurious wakeups */
+        }
+    }
+
+    if (local_err) {
+        multifd_recv_terminate_threads(local_err);
+        error_free(local_err);
+    }
+
+    /* Don't leave the main thread waiting for us */
+    if (ret != 0) {
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+        qemu_sem_post(&multifd_recv_state->channels_ready);
+    }
+
+    qemu_mutex_lock(&p->mutex);
+    p->running = false;
+    qemu_mutex_unlock(&p->mutex);
+
+    rcu_unregister_thread();
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -993,14 +1535,19 @@ int multifd_load_setup(Error **errp)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     atomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_sem_init(&multifd_recv_state->channels_ready, 0);
+    qemu_event_init(&multifd_recv_state->postcopy_listening, false);
+    multifd_recv_state->pages = multifd_pages_init(page_count);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
         qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
         qemu_sem_init(&p->sem_sync, 0);
         p->quit = false;
+        p->pending_job = 0;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
         p->packet_len = sizeof(MultiFDPacket_t)
@@ -1046,7 +1593,12 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
     Error *local_err = NULL;
     int id;
 
-    id = multifd_recv_initial_packet(ioc, &local_err);
+    if (migrate_fixed_ram()) {
+        /* The channels are opened in order and don't send any packet */
+        id = atomic_read(&multifd_recv_state->count);
+    } else {
+        id = multifd_recv_initial_packet(ioc, &local_err);
+    }
     if (id < 0) {
         multifd_recv_terminate_threads(local_err);
         error_propagate_prepend(errp, local_err,
@@ -1067,12 +1619,17 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
     }
     p->c = ioc;
     object_ref(OBJECT(ioc));
-    /* initial packet */
-    p->num_packets = 1;
 
     p->running = true;
-    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_fixed_ram()) {
+        qemu_thread_create(&p->thread, p->name, multifd_recv_fixed_ram_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    } else {
+        /* initial packet */
+        p->num_packets = 1;
+        qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
     atomic_inc(&multifd_recv_state->count);
     return atomic_read(&multifd_recv_state->count) ==
            migrate_multifd_channels();
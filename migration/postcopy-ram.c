@@ -20,9 +20,12 @@
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
+#include "qemu-file-channel.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
+#include "multifd.h"
+#include "socket.h"
 #include "qapi/error.h"
 #include "qemu/notify.h"
 #include "qemu/rcu.h"
@@ -90,7 +93,7 @@ int postcopy_notify(enum PostcopyNotifyReason reason, Error **errp)
 
 #if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
 #include <sys/eventfd.h>
-#include <linux/userfaultfd.h>
+#include "qemu/userfaultfd.h"
 
 typedef struct PostcopyBlocktimeContext {
     /* time when page fault initiated per vCPU */
@@ -193,47 +196,6 @@ static uint32_t get_postcopy_total_blocktime(void)
     return bc->total_blocktime;
 }
 
-/**
- * receive_ufd_features: check userfault fd features, to request only supported
- * features in the future.
- *
- * Returns: true on success
- *
- * __NR_userfaultfd - should be checked before
- *  @features: out parameter will contain uffdio_api.features provided by kernel
- *              in case of success
- */
-static bool receive_ufd_features(uint64_t *features)
-{
-    struct uffdio_api api_struct = {0};
-    int ufd;
-    bool ret = true;
-
-    /* if we are here __NR_userfaultfd should exists */
-    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
-    if (ufd == -1) {
-        error_report("%s: syscall __NR_userfaultfd failed: %s", __func__,
-                     strerror(errno));
-        return false;
-    }
-
-    /* ask features */
-    api_struct.api = UFFD_API;
-    api_struct.features = 0;
-    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
-        error_report("%s: UFFDIO_API failed: %s", __func__,
-                     strerror(errno));
-        ret = false;
-        goto release_ufd;
-    }
-
-    *features = api_struct.features;
-
-release_ufd:
-    close(ufd);
-    return ret;
-}
-
 /**
  * request_ufd_features: this function should be called only once on a newly
  * opened ufd, subsequent calls will lead to error.
@@ -278,7 +240,7 @@ static bool ufd_check_and_apply(int ufd, MigrationIncomingState *mis)
      * userfault fd features is persistent
      */
     if (!supported_features) {
-        if (!receive_ufd_features(&supported_features)) {
+        if (uffd_query_features(&supported_features)) {
             error_report("%s failed", __func__);
             return false;
         }
@@ -541,6 +503,18 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /*
+         * The source ends the channel before the main one, unless the
+         * migration failed.
+         */
+        if (mis->state == MIGRATION_STATUS_FAILED) {
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
+        qemu_thread_join(&mis->postcopy_preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -1094,6 +1068,30 @@ retry:
     return NULL;
 }
 
+/*
+ * Load the pages that the source sends on the postcopy preemption channel,
+ * in answer to the requests of the fault thread
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    ret = ram_load_postcopy_preempt(mis->postcopy_qemufile_dst);
+    if (ret < 0 && mis->state != MIGRATION_STATUS_FAILED) {
+        error_report("%s: failed to load requested pages: %d", __func__, ret);
+        /* The faulting vCPUs can't be woken up anymore, stop the load too */
+        qemu_file_shutdown(mis->from_src_file);
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit();
+    return NULL;
+}
+
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
     /* Open the fd for the kernel to give us userfaults */
@@ -1166,6 +1164,17 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
      */
     postcopy_balloon_inhibit(true);
 
+    if (migrate_postcopy_preempt()) {
+        /* The channel is always connected before the load starts */
+        qemu_thread_create(&mis->postcopy_preempt_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
+    /* The multifd channels can place their pages from now on */
+    multifd_recv_postcopy_listen();
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
@@ -1338,6 +1347,47 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 
 /* ------------------------------------------------------------------------- */
 
+/**
+ * postcopy_preempt_new_channel: called on the destination when the
+ *   postcopy preemption channel is connected
+ *
+ * @mis: The current incoming migration state
+ * @file: The channel, only read by the postcopy/preempt thread
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    qemu_file_set_blocking(file, true);
+    mis->postcopy_qemufile_dst = file;
+    trace_postcopy_preempt_new_channel();
+}
+
+/**
+ * postcopy_preempt_setup: called on the source, before anything is sent
+ *   on the main channel, to connect the postcopy preemption channel
+ *
+ * Returns 0 on success, -1 on failure
+ *
+ * @s: The current migration state
+ * @errp: Error pointer
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    QIOChannel *ioc = socket_send_channel_create_sync(errp);
+
+    if (!ioc) {
+        return -1;
+    }
+
+    qio_channel_set_name(ioc, "migration-postcopy-preempt");
+    /* Requested pages are sent one request at a time, don't delay them */
+    qio_channel_set_delay(ioc, false);
+    s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+    object_unref(OBJECT(ioc));
+
+    trace_postcopy_preempt_setup();
+    return 0;
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
@@ -106,6 +106,10 @@ PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
 
+/* Postcopy preemption channel, for the pages requested by the destination */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+
 /*
  * To be called once at the start before any device initialisation
  */
@@ -657,6 +657,55 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Returns the position of the next byte to be read from or written to
+ * the underlying channel.  Only valid for files on seekable channels that
+ * were positioned at offset 0 when the QEMUFile was created.
+ */
+int64_t qemu_get_offset(QEMUFile *f)
+{
+    if (qemu_file_is_writable(f)) {
+        return qemu_ftell_fast(f);
+    }
+    return f->pos - (f->buf_size - f->buf_index);
+}
+
+/*
+ * Continues reading or writing the stream at @offset of the underlying
+ * channel, e.g. to skip data that was transferred out of band.
+ */
+void qemu_set_offset(QEMUFile *f, int64_t offset)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_err = NULL;
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        /* Drop whatever we have read ahead */
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    if (!ioc) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return;
+    }
+    if (qio_channel_io_seek(ioc, offset, SEEK_SET, &local_err) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_err);
+        return;
+    }
+    f->pos = offset;
+}
+
+QIOChannel *qemu_file_get_ioc(QEMUFile *f)
+{
+    if (!f->ops->get_ioc) {
+        return NULL;
+    }
+    return f->ops->get_ioc(f->opaque);
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
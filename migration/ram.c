@@ -29,6 +29,7 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -52,9 +53,16 @@
 #include "migration/colo.h"
 #include "block.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/tcg.h"
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "file.h"
+#include "sysemu/balloon.h"
+
+#if defined(__linux__)
+#include "qemu/userfaultfd.h"
+#endif
 
 /***********************************************************/
 /* ram save/restore */
@@ -168,10 +176,6 @@ static bool ramblock_is_ignored(RAMBlock *block)
     INTERNAL_RAMBLOCK_FOREACH(block)                   \
         if (ramblock_is_ignored(block)) {} else
 
-#define RAMBLOCK_FOREACH_MIGRATABLE(block)             \
-    INTERNAL_RAMBLOCK_FOREACH(block)                   \
-        if (!qemu_ram_is_migratable(block)) {} else
-
 #undef RAMBLOCK_FOREACH
 
 int foreach_not_ignored_block(RAMBlockIterFunc func, void *opaque)
@@ -353,6 +357,25 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+
+    /* userfaultfd write-protecting RAM for background snapshots, or -1 */
+    int uffdio_fd;
+    /* Saved pages that are still write-protected, if wp_release_block */
+    RAMBlock *wp_release_block;
+    unsigned long wp_release_start;
+    unsigned long wp_release_end;
+
+    /* Postcopy preemption channel, and the thread sending requested pages */
+    QEMUFile *preempt_f;
+    QemuThread preempt_thread;
+    QemuSemaphore preempt_sem;
+    /* Protected by src_page_req_mutex */
+    bool preempt_running;
+    QSIMPLEQ_HEAD(, RAMSrcPageRequest) preempt_requests;
+    /* Pages sent by the preemption thread, added to ram_counters at the end */
+    uint64_t preempt_normal_pages;
+    uint64_t preempt_zero_pages;
+    uint64_t preempt_bytes;
 };
 typedef struct RAMState RAMState;
 
@@ -409,6 +432,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* Set when the page was requested by the destination */
+    bool         postcopy_requested;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -611,6 +636,52 @@ static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
     return size;
 }
 
+/**
+ * mig_throttle_vcpus_down: throttle down the vCPUs that dirty memory
+ *
+ * Splits the dirty rate threshold evenly between the vCPUs, and only
+ * throttles the ones that dirtied more than their share during the last
+ * period (or more than the average, if none did), the same way
+ * mig_throttle_guest_down() throttles the whole guest.  The throttling of
+ * vCPUs that dirtied less than half of that is relaxed again.
+ */
+static void mig_throttle_vcpus_down(uint64_t bytes_dirty_threshold)
+{
+    MigrationState *s = migrate_get_current();
+    int pct_initial = s->parameters.cpu_throttle_initial;
+    int pct_increment = s->parameters.cpu_throttle_increment;
+    int pct_max = s->parameters.max_cpu_throttle;
+    uint64_t dirty_total = 0, limit;
+    CPUState *cpu;
+    int ncpus = 0;
+
+    CPU_FOREACH(cpu) {
+        dirty_total += atomic_read(&cpu->dirty_pages);
+        ncpus++;
+    }
+    limit = MIN(bytes_dirty_threshold / TARGET_PAGE_SIZE, dirty_total) / ncpus;
+
+    CPU_FOREACH(cpu) {
+        uint64_t dirty = atomic_read(&cpu->dirty_pages);
+        int throttle_now = cpu_throttle_get_vcpu(cpu);
+        int throttle_new;
+
+        if (dirty > limit) {
+            throttle_new = throttle_now ?
+                           MIN(throttle_now + pct_increment, pct_max) :
+                           pct_initial;
+        } else if (dirty < limit / 2 && throttle_now) {
+            throttle_new = MAX(throttle_now - pct_increment, 0);
+        } else {
+            continue;
+        }
+
+        trace_migration_throttle_vcpu(cpu->cpu_index, dirty, limit,
+                                      throttle_new);
+        cpu_throttle_set_vcpu(cpu, throttle_new);
+    }
+}
+
 /**
  * mig_throttle_guest_down: throotle down the guest
  *
@@ -632,6 +703,12 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
     uint64_t throttle_now = cpu_throttle_get_percentage();
     uint64_t cpu_now, cpu_ideal, throttle_inc;
 
+    /* Dirty pages can only be attributed to the vCPUs with TCG */
+    if (s->parameters.cpu_throttle_per_vcpu && tcg_enabled()) {
+        mig_throttle_vcpus_down(bytes_dirty_threshold);
+        return;
+    }
+
     /* We have not started throttling yet. Let's start it. */
     if (!cpu_throttle_active()) {
         cpu_throttle_set(pct_initial);
@@ -741,7 +818,13 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
      * sent, in all cases except where we skip the page.
      */
     if (!last_stage && encoded_len != 0) {
-        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+        if (encoded_len == -1) {
+            memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+        } else {
+            /* Only copy the bytes that changed, like the destination does */
+            xbzrle_decode_buffer(XBZRLE.encoded_buf, encoded_len,
+                                 prev_cached_page, TARGET_PAGE_SIZE);
+        }
         /*
          * In the case where we couldn't compress, ensure that the caller
          * sends the data from the cache, since the guest might have
@@ -945,6 +1028,16 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
     }
 }
 
+/* Per-vCPU throttling looks at the pages dirtied during the last period */
+static void migration_reset_vcpu_dirty_pages(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->dirty_pages, 0);
+    }
+}
+
 static void migration_trigger_throttle(RAMState *rs)
 {
     MigrationState *s = migrate_get_current();
@@ -972,12 +1065,227 @@ static void migration_trigger_throttle(RAMState *rs)
                                     bytes_dirty_threshold);
         }
     }
+
+    migration_reset_vcpu_dirty_pages();
 }
 
-static void migration_bitmap_sync(RAMState *rs)
+/*
+ * On large guests, syncing the migration bitmaps from the dirty memory
+ * bitmaps takes long enough to show up in the downtime.  The RAMBlocks
+ * are split in chunks that worker threads sync in parallel with the
+ * migration thread.  Chunks are aligned to the clear bitmap chunks (and
+ * so to a long of the migration bitmap), so that no two chunks ever
+ * update the same word of either bitmap.  Their size is set by the
+ * x-dirty-sync-chunk-shift property.
+ */
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} DirtySyncChunk;
+
+static struct {
+    QemuThread *threads;
+    int nthreads;
+    /* chunk size in target pages, as a shift */
+    uint8_t chunk_shift;
+    QemuMutex mutex;
+    /* wakes the workers up for a new sync, or to quit */
+    QemuCond cond;
+    /* wakes the migration thread up once the workers are done */
+    QemuCond done_cond;
+    /* these fields are protected by @mutex */
+    DirtySyncChunk *chunks;
+    int nchunks;
+    int chunks_alloc;
+    /* number of the current sync, workers compare it with the last one */
+    uint64_t generation;
+    /* workers that have not finished the current sync yet */
+    int busy;
+    /* dirty pages found by the current sync */
+    uint64_t migration_dirty_pages;
+    uint64_t num_dirty_pages_period;
+    bool quit;
+    /* index of the next chunk to sync, updated atomically */
+    int next_chunk;
+} *dirty_sync;
+
+static void dirty_sync_chunks(void)
+{
+    uint64_t dirty_pages = 0, dirty_pages_period = 0;
+    int i;
+
+    while ((i = atomic_fetch_inc(&dirty_sync->next_chunk)) <
+           dirty_sync->nchunks) {
+        DirtySyncChunk *chunk = &dirty_sync->chunks[i];
+
+        dirty_pages +=
+            cpu_physical_memory_sync_dirty_bitmap(chunk->block, chunk->start,
+                                                  chunk->length,
+                                                  &dirty_pages_period);
+    }
+
+    qemu_mutex_lock(&dirty_sync->mutex);
+    dirty_sync->migration_dirty_pages += dirty_pages;
+    dirty_sync->num_dirty_pages_period += dirty_pages_period;
+    qemu_mutex_unlock(&dirty_sync->mutex);
+}
+
+static void *dirty_sync_thread(void *opaque)
+{
+    uint64_t generation = 0;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&dirty_sync->mutex);
+    while (!dirty_sync->quit) {
+        if (dirty_sync->generation == generation) {
+            qemu_cond_wait(&dirty_sync->cond, &dirty_sync->mutex);
+            continue;
+        }
+        generation = dirty_sync->generation;
+        qemu_mutex_unlock(&dirty_sync->mutex);
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            dirty_sync_chunks();
+        }
+
+        qemu_mutex_lock(&dirty_sync->mutex);
+        if (--dirty_sync->busy == 0) {
+            qemu_cond_signal(&dirty_sync->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&dirty_sync->mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void dirty_sync_threads_setup(void)
+{
+    uint8_t shift = MIN(MAX(migrate_dirty_sync_chunk_shift(),
+                            CLEAR_BITMAP_SHIFT_MIN),
+                        CLEAR_BITMAP_SHIFT_MAX);
+    uint64_t chunk_size = (uint64_t)TARGET_PAGE_SIZE << shift;
+    int nthreads = migrate_dirty_sync_threads();
+    int i;
+
+    /* Not worth it if the guest fits in a couple of chunks */
+    if (!nthreads || ram_bytes_total() <= 2 * chunk_size) {
+        return;
+    }
+
+    dirty_sync = g_malloc0(sizeof(*dirty_sync));
+    dirty_sync->chunk_shift = shift;
+    qemu_mutex_init(&dirty_sync->mutex);
+    qemu_cond_init(&dirty_sync->cond);
+    qemu_cond_init(&dirty_sync->done_cond);
+    dirty_sync->nthreads = nthreads;
+    dirty_sync->threads = g_new0(QemuThread, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_create(&dirty_sync->threads[i], "dirtysync",
+                           dirty_sync_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dirty_sync_threads_cleanup(void)
+{
+    int i;
+
+    if (!dirty_sync) {
+        return;
+    }
+
+    qemu_mutex_lock(&dirty_sync->mutex);
+    dirty_sync->quit = true;
+    qemu_cond_broadcast(&dirty_sync->cond);
+    qemu_mutex_unlock(&dirty_sync->mutex);
+    for (i = 0; i < dirty_sync->nthreads; i++) {
+        qemu_thread_join(&dirty_sync->threads[i]);
+    }
+
+    qemu_cond_destroy(&dirty_sync->done_cond);
+    qemu_cond_destroy(&dirty_sync->cond);
+    qemu_mutex_destroy(&dirty_sync->mutex);
+    g_free(dirty_sync->threads);
+    g_free(dirty_sync->chunks);
+    g_free(dirty_sync);
+    dirty_sync = NULL;
+}
+
+static void dirty_sync_add_chunks(RAMBlock *block)
+{
+    uint8_t shift = MAX(block->clear_bmap_shift, dirty_sync->chunk_shift);
+    ram_addr_t chunk_size = (ram_addr_t)TARGET_PAGE_SIZE << shift;
+    ram_addr_t start;
+
+    for (start = 0; start < block->used_length; start += chunk_size) {
+        DirtySyncChunk *chunk;
+
+        if (dirty_sync->nchunks == dirty_sync->chunks_alloc) {
+            dirty_sync->chunks_alloc = MAX(16, dirty_sync->chunks_alloc * 2);
+            dirty_sync->chunks = g_renew(DirtySyncChunk, dirty_sync->chunks,
+                                         dirty_sync->chunks_alloc);
+        }
+        chunk = &dirty_sync->chunks[dirty_sync->nchunks++];
+        chunk->block = block;
+        chunk->start = start;
+        chunk->length = MIN(chunk_size, block->used_length - start);
+    }
+}
+
+/*
+ * Syncs the migration bitmap of all RAMBlocks, in parallel if the
+ * worker threads were set up.  Returns the number of chunks synced in
+ * parallel, or 0 if the RAMBlocks were synced by this thread alone.
+ *
+ * Called with rs->bitmap_mutex and the RCU read lock held.
+ */
+static int ramblock_sync_dirty_bitmaps(RAMState *rs)
 {
     RAMBlock *block;
-    int64_t end_time;
+    int nchunks;
+
+    if (!dirty_sync) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+        return 0;
+    }
+
+    qemu_mutex_lock(&dirty_sync->mutex);
+    dirty_sync->nchunks = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        dirty_sync_add_chunks(block);
+    }
+    nchunks = dirty_sync->nchunks;
+    dirty_sync->migration_dirty_pages = 0;
+    dirty_sync->num_dirty_pages_period = 0;
+    atomic_set(&dirty_sync->next_chunk, 0);
+    dirty_sync->busy = dirty_sync->nthreads;
+    dirty_sync->generation++;
+    qemu_cond_broadcast(&dirty_sync->cond);
+    qemu_mutex_unlock(&dirty_sync->mutex);
+
+    /* Lend a hand, then wait for the stragglers */
+    dirty_sync_chunks();
+
+    qemu_mutex_lock(&dirty_sync->mutex);
+    while (dirty_sync->busy) {
+        qemu_cond_wait(&dirty_sync->done_cond, &dirty_sync->mutex);
+    }
+    rs->migration_dirty_pages += dirty_sync->migration_dirty_pages;
+    rs->num_dirty_pages_period += dirty_sync->num_dirty_pages_period;
+    qemu_mutex_unlock(&dirty_sync->mutex);
+
+    return nchunks;
+}
+
+static void migration_bitmap_sync(RAMState *rs)
+{
+    int64_t start_time, log_sync_time, end_time;
+    int nchunks;
 
     ram_counters.dirty_sync_count++;
 
@@ -986,19 +1294,24 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
+    start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync();
+    log_sync_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
-        }
+        nchunks = ramblock_sync_dirty_bitmaps(rs);
         ram_counters.remaining = ram_bytes_remaining();
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
     memory_global_after_dirty_log_sync();
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    trace_migration_bitmap_sync_time(log_sync_time - start_time,
+                                     qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                     log_sync_time,
+                                     nchunks,
+                                     dirty_sync ? dirty_sync->nthreads : 0);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1178,7 +1491,8 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 {
     int pages = -1;
     uint8_t *p;
-    bool send_async = true;
+    /* Background snapshots unprotect the page once it's been copied */
+    bool send_async = !migrate_background_snapshot();
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
     ram_addr_t current_addr = block->offset + offset;
@@ -1212,14 +1526,52 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
+    /* The page counters are updated once a channel has sent the page */
     if (multifd_queue_page(rs->f, block, offset) < 0) {
         return -1;
     }
-    ram_counters.normal++;
 
     return 1;
 }
 
+/**
+ * ram_save_fixed_ram_page: write a page to its fixed offset in the file
+ *
+ * Zero pages are not written, they are left as holes in the file and
+ * marked as such in the block's file bitmap.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_fixed_ram_page(RAMState *rs, RAMBlock *block,
+                                   ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    Error *local_err = NULL;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    if (file_pwrite_all(qemu_file_get_ioc(rs->f), p, TARGET_PAGE_SIZE,
+                        block->pages_offset + offset, &local_err) < 0) {
+        qemu_file_set_error_obj(rs->f, -EIO, local_err);
+        return -1;
+    }
+    set_bit(page, block->file_bmap);
+
+    ram_counters.normal++;
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    qemu_file_update_transfer(rs->f, TARGET_PAGE_SIZE);
+    return 1;
+}
+
 static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
                                  ram_addr_t offset, uint8_t *source_buf)
 {
@@ -1426,22 +1778,351 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
         block = entry->rb;
         *offset = entry->offset;
 
-        if (entry->len > TARGET_PAGE_SIZE) {
-            entry->len -= TARGET_PAGE_SIZE;
-            entry->offset += TARGET_PAGE_SIZE;
-        } else {
-            memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
-            g_free(entry);
-            migration_consume_urgent_request();
-        }
-    }
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            memory_region_unref(block->mr);
+            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
+            g_free(entry);
+            migration_consume_urgent_request();
+        }
+    }
+
+    return block;
+}
+
+#if defined(__linux__)
+/*
+ * Background snapshots
+ *
+ * The VM is only stopped while the state of the devices is saved.  Guest
+ * RAM gets write-protected with userfaultfd at the same time, and is then
+ * saved in a single pass while the guest runs.  When the guest writes to
+ * a page that was not saved yet, the vCPU blocks and the migration thread
+ * receives a fault event: it saves that page before any other, and then
+ * removes the protection, which wakes the vCPU up.  Pages are copied into
+ * the QEMUFile buffer when they are saved, so that their protection can
+ * be removed before they are written out.
+ */
+
+/* Saved pages get unprotected in batches of up to that many pages */
+#define WRITE_TRACKING_RELEASE_MAX 256
+
+static bool ramblock_skip_write_tracking(RAMBlock *block)
+{
+    /* Nothing to do with read-only and MMIO-writable regions */
+    return block->mr->readonly || block->mr->rom_device;
+}
+
+/**
+ * ram_write_tracking_available: check if the kernel supports
+ * write-protecting memory with userfaultfd
+ */
+bool ram_write_tracking_available(void)
+{
+    uint64_t features;
+
+    if (uffd_query_features(&features)) {
+        return false;
+    }
+    return !!(features & UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+}
+
+/**
+ * ram_write_tracking_compatible: check if all the RAMBlocks can be
+ * write-protected, which is not the case of shared memory or hugetlbfs
+ * mappings
+ */
+bool ram_write_tracking_compatible(void)
+{
+    const uint64_t uffd_ioctls_mask = BIT(_UFFDIO_WRITEPROTECT);
+    RAMBlock *block;
+    bool ret = false;
+    int uffd_fd;
+
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, false);
+    if (uffd_fd < 0) {
+        return false;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        uint64_t uffd_ioctls;
+
+        if (ramblock_skip_write_tracking(block)) {
+            continue;
+        }
+        /* The registration goes away with the file descriptor */
+        if (uffd_register_memory(uffd_fd, block->host, block->used_length,
+                                 UFFDIO_REGISTER_MODE_WP, &uffd_ioctls)) {
+            goto out;
+        }
+        if ((uffd_ioctls & uffd_ioctls_mask) != uffd_ioctls_mask) {
+            goto out;
+        }
+    }
+    ret = true;
+
+out:
+    uffd_close_fd(uffd_fd);
+    return ret;
+}
+
+/**
+ * ram_write_tracking_prepare: populate the pages of guest RAM
+ *
+ * Write-protection only applies to the pages that are present, reading
+ * them maps the shared zero page where nothing was written yet.  This is
+ * done before stopping the VM, so that it doesn't add to the downtime.
+ */
+void ram_write_tracking_prepare(void)
+{
+    RAMBlock *block;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        size_t page_size = qemu_ram_pagesize(block);
+        ram_addr_t offset;
+
+        if (ramblock_skip_write_tracking(block)) {
+            continue;
+        }
+        for (offset = 0; offset < block->used_length; offset += page_size) {
+            (void)*((volatile char *)block->host + offset);
+        }
+    }
+}
+
+/**
+ * ram_write_tracking_start: write-protect guest RAM
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * Called with the VM stopped and the iothread lock held.
+ */
+int ram_write_tracking_start(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+    int uffd_fd;
+
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, true);
+    if (uffd_fd < 0) {
+        return -1;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (ramblock_skip_write_tracking(block)) {
+            continue;
+        }
+        if (uffd_register_memory(uffd_fd, block->host, block->used_length,
+                                 UFFDIO_REGISTER_MODE_WP, NULL)) {
+            goto fail;
+        }
+        block->flags |= RAM_UF_WRITEPROTECT;
+        memory_region_ref(block->mr);
+
+        if (uffd_change_protection(uffd_fd, block->host, block->used_length,
+                                   true, false)) {
+            goto fail;
+        }
+        trace_ram_write_tracking_ramblock_start(block->idstr,
+                                                block->page_size, block->host,
+                                                block->used_length);
+    }
+
+    /* A discarded page would lose its protection */
+    qemu_balloon_inhibit(true);
+    rs->uffdio_fd = uffd_fd;
+    return 0;
+
+fail:
+    error_report("ram_write_tracking_start() failed: restoring initial "
+                 "memory state");
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!(block->flags & RAM_UF_WRITEPROTECT)) {
+            continue;
+        }
+        /* Unregistering also removes the protection */
+        uffd_unregister_memory(uffd_fd, block->host, block->used_length);
+        block->flags &= ~RAM_UF_WRITEPROTECT;
+        memory_region_unref(block->mr);
+    }
+    uffd_close_fd(uffd_fd);
+    return -1;
+}
+
+/**
+ * ram_write_tracking_stop: remove the protection of guest RAM
+ *
+ * This also wakes up the vCPUs that still wait for a page, if the
+ * snapshot failed.
+ */
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs || rs->uffdio_fd < 0) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!(block->flags & RAM_UF_WRITEPROTECT)) {
+            continue;
+        }
+        uffd_change_protection(rs->uffdio_fd, block->host, block->used_length,
+                               false, false);
+        uffd_unregister_memory(rs->uffdio_fd, block->host,
+                               block->used_length);
+        block->flags &= ~RAM_UF_WRITEPROTECT;
+        memory_region_unref(block->mr);
+    }
+
+    uffd_close_fd(rs->uffdio_fd);
+    rs->uffdio_fd = -1;
+    rs->wp_release_block = NULL;
+    qemu_balloon_inhibit(false);
+}
+
+/* Removes the protection of the saved pages that are still protected */
+static int ram_write_tracking_release(RAMState *rs)
+{
+    RAMBlock *block = rs->wp_release_block;
+    ram_addr_t start, length;
+
+    if (!block) {
+        return 0;
+    }
+    rs->wp_release_block = NULL;
+
+    start = (ram_addr_t)rs->wp_release_start << TARGET_PAGE_BITS;
+    length = (ram_addr_t)(rs->wp_release_end - rs->wp_release_start) <<
+             TARGET_PAGE_BITS;
+    return uffd_change_protection(rs->uffdio_fd, block->host + start, length,
+                                  false, false);
+}
+
+/*
+ * Queues the removal of the protection of pages [@start, @end) of @block,
+ * which were just saved.  Saved host pages are always whole, so that the
+ * range is aligned as UFFDIO_WRITEPROTECT requires.
+ */
+static int ram_write_tracking_release_add(RAMState *rs, RAMBlock *block,
+                                          unsigned long start,
+                                          unsigned long end)
+{
+    if (!(block->flags & RAM_UF_WRITEPROTECT)) {
+        return 0;
+    }
+
+    if (rs->wp_release_block == block && rs->wp_release_end == start) {
+        rs->wp_release_end = end;
+    } else {
+        if (ram_write_tracking_release(rs)) {
+            return -1;
+        }
+        rs->wp_release_block = block;
+        rs->wp_release_start = start;
+        rs->wp_release_end = end;
+    }
+
+    if (rs->wp_release_end - rs->wp_release_start >=
+        WRITE_TRACKING_RELEASE_MAX) {
+        return ram_write_tracking_release(rs);
+    }
+    return 0;
+}
+
+/**
+ * poll_fault_page: get the page the guest is waiting for, if any
+ *
+ * Returns the RAMBlock of the page, or NULL if the guest doesn't wait
+ *
+ * @rs: current RAM state
+ * @offset: used to return the offset of the host page within the RAMBlock
+ */
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    struct uffd_msg uffd_msg;
+    RAMBlock *block;
+    void *addr;
+
+    if (rs->uffdio_fd < 0 ||
+        uffd_read_events(rs->uffdio_fd, &uffd_msg, 1) <= 0) {
+        return NULL;
+    }
+
+    /* The guest may be waiting for a page that was saved already */
+    ram_write_tracking_release(rs);
+
+    if (uffd_msg.event != UFFD_EVENT_PAGEFAULT) {
+        return NULL;
+    }
+    addr = (void *)(uintptr_t)uffd_msg.arg.pagefault.address;
+    block = qemu_ram_block_from_host(addr, false, offset);
+    if (!block || !(block->flags & RAM_UF_WRITEPROTECT)) {
+        error_report("%s: unexpected write fault at %p", __func__, addr);
+        return NULL;
+    }
+    *offset = ROUND_DOWN(*offset, qemu_ram_pagesize(block));
+
+    trace_ram_write_tracking_fault(block->idstr, *offset);
+    return block;
+}
+#else
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+bool ram_write_tracking_compatible(void)
+{
+    return false;
+}
+
+void ram_write_tracking_prepare(void)
+{
+}
+
+int ram_write_tracking_start(void)
+{
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+
+static int ram_write_tracking_release(RAMState *rs)
+{
+    return 0;
+}
 
-    return block;
+static int ram_write_tracking_release_add(RAMState *rs, RAMBlock *block,
+                                          unsigned long start,
+                                          unsigned long end)
+{
+    return 0;
+}
+
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    return NULL;
 }
+#endif /* defined(__linux__) */
 
 /**
- * get_queued_page: unqueue a page from the postcopy requests
+ * get_queued_page: unqueue a page from the postcopy requests, or a page
+ * the guest waits for during a background snapshot
  *
  * Skips pages that are already sent (!dirty)
  *
@@ -1458,6 +2139,9 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     do {
         block = unqueue_page(rs, &offset);
+        if (!block) {
+            block = poll_fault_page(rs, &offset);
+        }
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -1502,6 +2186,7 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
          */
         pss->complete_round = false;
     }
+    pss->postcopy_requested = !!block;
 
     return !!block;
 }
@@ -1526,6 +2211,11 @@ static void migration_page_queue_free(RAMState *rs)
         QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
         g_free(mspr);
     }
+    QSIMPLEQ_FOREACH_SAFE(mspr, &rs->preempt_requests, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&rs->preempt_requests, next_req);
+        g_free(mspr);
+    }
 }
 
 /**
@@ -1586,13 +2276,168 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
 
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&rs->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
-    migration_make_urgent_request();
+    /*
+     * Huge pages must be sent whole, on a single channel, so they stay
+     * with the migration thread.
+     */
+    if (rs->preempt_running && ramblock->page_size == TARGET_PAGE_SIZE) {
+        QSIMPLEQ_INSERT_TAIL(&rs->preempt_requests, new_entry, next_req);
+        qemu_sem_post(&rs->preempt_sem);
+    } else {
+        QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
+        migration_make_urgent_request();
+    }
     qemu_mutex_unlock(&rs->src_page_req_mutex);
 
     return 0;
 }
 
+/**
+ * ram_postcopy_preempt_send: send the requested pages that are still dirty
+ * on the postcopy preemption channel
+ *
+ * Every page carries the name of its RAMBlock, and is copied into the
+ * QEMUFile, since the migration thread may send other pages of the block
+ * at the same time.  The pages already sent by the migration thread are
+ * skipped, the destination gets them from the main channel.
+ *
+ * Returns zero on success or negative on error
+ *
+ * @rs: current RAM state
+ * @req: the request from the destination
+ */
+static int ram_postcopy_preempt_send(RAMState *rs,
+                                     struct RAMSrcPageRequest *req)
+{
+    QEMUFile *f = rs->preempt_f;
+    RAMBlock *block = req->rb;
+    unsigned long page = req->offset >> TARGET_PAGE_BITS;
+    unsigned long end = DIV_ROUND_UP(req->offset + req->len,
+                                     TARGET_PAGE_SIZE);
+    size_t len = strlen(block->idstr);
+    int pages = 0;
+
+    for (; page < end; page++) {
+        ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+        uint8_t *p = block->host + offset;
+        bool zero;
+
+        if (!migration_bitmap_clear_dirty(rs, block, page)) {
+            continue;
+        }
+
+        zero = is_zero_range(p, TARGET_PAGE_SIZE);
+        qemu_put_be64(f, offset | (zero ? RAM_SAVE_FLAG_ZERO :
+                                          RAM_SAVE_FLAG_PAGE));
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)block->idstr, len);
+        rs->preempt_bytes += 8 + 1 + len;
+        if (zero) {
+            qemu_put_byte(f, 0);
+            rs->preempt_bytes += 1;
+            rs->preempt_zero_pages++;
+        } else {
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+            rs->preempt_bytes += TARGET_PAGE_SIZE;
+            rs->preempt_normal_pages++;
+        }
+        ram_release_pages(block->idstr, offset, 1);
+        pages++;
+    }
+
+    trace_ram_postcopy_preempt_send(block->idstr, req->offset, req->len,
+                                    pages);
+    qemu_fflush(f);
+    return qemu_file_get_error(f);
+}
+
+static void *ram_postcopy_preempt_thread(void *opaque)
+{
+    RAMState *rs = opaque;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    while (!ret) {
+        struct RAMSrcPageRequest *req;
+
+        qemu_sem_wait(&rs->preempt_sem);
+
+        qemu_mutex_lock(&rs->src_page_req_mutex);
+        req = QSIMPLEQ_FIRST(&rs->preempt_requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&rs->preempt_requests, next_req);
+        }
+        qemu_mutex_unlock(&rs->src_page_req_mutex);
+
+        if (!req) {
+            /* Only posted without a request when asked to quit */
+            break;
+        }
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = ram_postcopy_preempt_send(rs, req);
+        }
+        memory_region_unref(req->rb->mr);
+        g_free(req);
+    }
+
+    if (ret) {
+        error_report("%s: failed to send requested pages: %d", __func__, ret);
+        /* The destination can't get them anymore, fail the migration */
+        qemu_file_set_error(rs->f, ret);
+    } else {
+        /* Let the destination's preemption thread finish */
+        qemu_put_be64(rs->preempt_f, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(rs->preempt_f);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/**
+ * ram_postcopy_preempt_start: send the pages requested by the destination
+ * from now on with a dedicated thread, on their own channel, so that they
+ * don't wait behind the pages queued by the migration thread
+ *
+ * @f: the postcopy preemption channel
+ */
+void ram_postcopy_preempt_start(QEMUFile *f)
+{
+    RAMState *rs = ram_state;
+
+    rs->preempt_f = f;
+    qemu_mutex_lock(&rs->src_page_req_mutex);
+    rs->preempt_running = true;
+    qemu_mutex_unlock(&rs->src_page_req_mutex);
+
+    qemu_thread_create(&rs->preempt_thread, "postcopy/psend",
+                       ram_postcopy_preempt_thread, rs, QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * Stops the postcopy preemption thread, once it has sent the requests
+ * that are already queued.
+ */
+static void ram_postcopy_preempt_stop(RAMState *rs)
+{
+    qemu_mutex_lock(&rs->src_page_req_mutex);
+    if (!rs->preempt_running) {
+        qemu_mutex_unlock(&rs->src_page_req_mutex);
+        return;
+    }
+    rs->preempt_running = false;
+    qemu_mutex_unlock(&rs->src_page_req_mutex);
+
+    qemu_sem_post(&rs->preempt_sem);
+    qemu_thread_join(&rs->preempt_thread);
+
+    ram_counters.normal += rs->preempt_normal_pages;
+    ram_counters.duplicate += rs->preempt_zero_pages;
+    ram_counters.transferred += rs->preempt_bytes;
+}
+
 static bool save_page_use_compression(RAMState *rs)
 {
     if (!migrate_use_compression()) {
@@ -1659,6 +2504,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    bool use_multifd;
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
@@ -1669,6 +2515,33 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
+    /*
+     * Do not use multifd for:
+     * 1. Compression as the first page in the new block should be posted out
+     *    before sending the compressed page
+     * 2. In postcopy, huge pages as one whole host page should be placed,
+     *    and pages requested by the destination, which must not wait
+     *    behind the background pages queued on the channels
+     */
+    use_multifd = !save_page_use_compression(rs) && migrate_use_multifd();
+    if (use_multifd && migration_in_postcopy()) {
+        use_multifd = migrate_multifd_postcopy() &&
+                      block->page_size == TARGET_PAGE_SIZE &&
+                      !pss->postcopy_requested;
+    }
+
+    if (migrate_fixed_ram()) {
+        if (use_multifd) {
+            return ram_save_multifd_page(rs, block, offset);
+        }
+        return ram_save_fixed_ram_page(rs, block, offset);
+    }
+
+    /* Leave checking for zero pages to the multifd channels */
+    if (use_multifd && migrate_multifd_zero_pages()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -1683,14 +2556,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
-    /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -1721,6 +2587,7 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
 
     if (ramblock_is_ignored(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
@@ -1747,6 +2614,11 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
              offset_in_ramblock(pss->block,
                                 ((ram_addr_t)pss->page) << TARGET_PAGE_BITS));
 
+    if (ram_write_tracking_release_add(rs, pss->block, start_page,
+                                       pss->page) < 0) {
+        return -1;
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->page--;
     return pages;
@@ -1781,6 +2653,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     pss.block = rs->last_seen_block;
     pss.page = rs->last_page;
     pss.complete_round = false;
+    pss.postcopy_requested = false;
 
     if (!pss.block) {
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
@@ -1860,6 +2733,7 @@ static void ram_state_cleanup(RAMState **rsp)
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
+        qemu_sem_destroy(&(*rsp)->preempt_sem);
         g_free(*rsp);
         *rsp = NULL;
     }
@@ -1889,13 +2763,23 @@ static void ram_save_cleanup(void *opaque)
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against the migration bitmap
      */
-    memory_global_dirty_log_stop();
+    if (*rsp) {
+        ram_postcopy_preempt_stop(*rsp);
+    }
+    if (migrate_background_snapshot()) {
+        ram_write_tracking_stop();
+    } else {
+        memory_global_dirty_log_stop();
+    }
+    dirty_sync_threads_cleanup();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -2290,6 +3174,9 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    qemu_sem_init(&(*rsp)->preempt_sem, 0);
+    QSIMPLEQ_INIT(&(*rsp)->preempt_requests);
+    (*rsp)->uffdio_fd = -1;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -2349,8 +3236,12 @@ static void ram_init_bitmaps(RAMState *rs)
 
     WITH_RCU_READ_LOCK_GUARD() {
         ram_list_init_bitmaps();
-        memory_global_dirty_log_start();
-        migration_bitmap_sync_precopy(rs);
+        /* Background snapshots save every page once, without dirty log */
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_start();
+            migration_reset_vcpu_dirty_pages();
+            migration_bitmap_sync_precopy(rs);
+        }
     }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
@@ -2367,6 +3258,7 @@ static int ram_init_all(RAMState **rsp)
         return -1;
     }
 
+    dirty_sync_threads_setup();
     ram_init_bitmaps(*rsp);
 
     return 0;
@@ -2461,6 +3353,57 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
  * granularity of these critical sections.
  */
 
+/*
+ * With fixed-ram, each block's pages are written to a fixed offset in the
+ * file, after a small header and a bitmap of the pages that are present.
+ * The pages area is aligned so that it can be read with large requests.
+ */
+#define FIXED_RAM_HDR_VERSION 1
+#define FIXED_RAM_FILE_ALIGNMENT (1 * MiB)
+
+static void fixed_ram_insert_header(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long num_pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = DIV_ROUND_UP(num_pages, BITS_PER_BYTE);
+
+    block->file_bmap = bitmap_new(num_pages);
+
+    /* The bitmap follows the header: version, page size and two offsets */
+    block->bitmap_offset = qemu_get_offset(f) + sizeof(uint32_t) +
+                           3 * sizeof(uint64_t);
+    block->pages_offset = ROUND_UP(block->bitmap_offset + bitmap_size,
+                                   FIXED_RAM_FILE_ALIGNMENT);
+
+    qemu_put_be32(f, FIXED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    /* Continue the stream after the space reserved for the pages */
+    qemu_set_offset(f, block->pages_offset + block->used_length);
+}
+
+static int fixed_ram_write_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+    Error *local_err = NULL;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        unsigned long num_pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t bitmap_size = DIV_ROUND_UP(num_pages, BITS_PER_BYTE);
+
+        bitmap_to_le(block->file_bmap, block->file_bmap, num_pages);
+        if (file_pwrite_all(qemu_file_get_ioc(f), (uint8_t *)block->file_bmap,
+                            bitmap_size, block->bitmap_offset,
+                            &local_err) < 0) {
+            qemu_file_set_error_obj(f, -EIO, local_err);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * ram_save_setup: Setup RAM for migration
  *
@@ -2501,6 +3444,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_fixed_ram()) {
+                fixed_ram_insert_header(f, block);
+            }
         }
     }
 
@@ -2604,6 +3550,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
      */
     ram_control_after_iterate(f, RAM_CONTROL_ROUND);
 
+    /* Don't let the guest wait for saved pages while we are rate limited */
+    if (ram_write_tracking_release(rs) < 0) {
+        qemu_file_set_error(f, -EFAULT);
+    }
+
 out:
     if (ret >= 0
         && migration_is_setup_or_active(migrate_get_current()->state)) {
@@ -2638,7 +3589,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     int ret = 0;
 
     WITH_RCU_READ_LOCK_GUARD() {
-        if (!migration_in_postcopy()) {
+        if (!migration_in_postcopy() && !migrate_background_snapshot()) {
             migration_bitmap_sync_precopy(rs);
         }
 
@@ -2665,8 +3616,23 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     }
 
+    /* Close the preemption channel before the main one */
+    ram_postcopy_preempt_stop(rs);
+
+    if (ret >= 0 && ram_write_tracking_release(rs) < 0) {
+        ret = -EFAULT;
+    }
+
     if (ret >= 0) {
         multifd_send_sync_main(rs->f);
+        if (migrate_fixed_ram()) {
+            WITH_RCU_READ_LOCK_GUARD() {
+                ret = fixed_ram_write_bitmaps(f);
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
     }
@@ -2685,7 +3651,7 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
 
-    if (!migration_in_postcopy() &&
+    if (!migration_in_postcopy() && !migrate_background_snapshot() &&
         remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         WITH_RCU_READ_LOCK_GUARD() {
@@ -3344,6 +4310,104 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/**
+ * ram_load_postcopy_preempt: load the pages sent on the postcopy
+ * preemption channel, until the source ends it with RAM_SAVE_FLAG_EOS
+ *
+ * Runs in its own thread, concurrently with ram_load_postcopy().  The
+ * channel only carries target pages of RAMBlocks that don't use huge
+ * pages, each with the name of its RAMBlock, so every page is placed as
+ * soon as it is received.
+ *
+ * Returns zero on success or negative on error
+ *
+ * @f: the postcopy preemption channel
+ */
+int ram_load_postcopy_preempt(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    void *page_buffer = g_malloc(TARGET_PAGE_SIZE);
+    int ret = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    while (!ret) {
+        ram_addr_t addr;
+        RAMBlock *block;
+        void *host;
+        void *place_source;
+        char id[256];
+        uint8_t len, ch;
+        int flags;
+
+        addr = qemu_get_be64(f);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            break;
+        }
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+        if (flags == RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        block = qemu_ram_block_by_name(id);
+        if (!block || ramblock_is_ignored(block) ||
+            block->page_size != TARGET_PAGE_SIZE) {
+            error_report("%s: bad block '%s'", __func__, id);
+            ret = -EINVAL;
+            break;
+        }
+        host = host_from_ram_block_offset(block, addr);
+        if (!host) {
+            error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+            ret = -EINVAL;
+            break;
+        }
+
+        trace_ram_load_postcopy_preempt(id, (uint64_t)addr, flags);
+        switch (flags) {
+        case RAM_SAVE_FLAG_ZERO:
+            ch = qemu_get_byte(f);
+            ret = qemu_file_get_error(f);
+            if (ret) {
+                break;
+            }
+            if (ch) {
+                memset(page_buffer, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, page_buffer, block);
+            } else {
+                ret = postcopy_place_page_zero(mis, host, block);
+            }
+            break;
+
+        case RAM_SAVE_FLAG_PAGE:
+            place_source = page_buffer;
+            qemu_get_buffer_in_place(f, (uint8_t **)&place_source,
+                                     TARGET_PAGE_SIZE);
+            ret = qemu_file_get_error(f);
+            if (ret) {
+                break;
+            }
+            ret = postcopy_place_page(mis, host, place_source, block);
+            break;
+
+        default:
+            error_report("Unknown combination of migration flags: %#x"
+                         " (postcopy preempt)", flags);
+            ret = -EINVAL;
+            break;
+        }
+    }
+
+    g_free(page_buffer);
+    return ret;
+}
+
 static bool postcopy_is_advised(void)
 {
     PostcopyState ps = postcopy_state_get();
@@ -3398,6 +4462,99 @@ void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+/*
+ * Loads the pages of a fixed-ram block straight from the file, following
+ * the bitmap of present pages.  With multifd the reads are spread across
+ * the channels; this waits until all of them have completed.
+ */
+static int parse_ramblock_fixed_ram(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    unsigned long num_pages = length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = DIV_ROUND_UP(num_pages, BITS_PER_BYTE);
+    unsigned long *bitmap;
+    unsigned long set_bit_idx, clear_bit_idx;
+    Error *local_err = NULL;
+    uint32_t version;
+    uint64_t page_size;
+    int ret = 0;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    block->bitmap_offset = qemu_get_be64(f);
+    block->pages_offset = qemu_get_be64(f);
+
+    if (version != FIXED_RAM_HDR_VERSION) {
+        error_report("Unsupported fixed-ram header version %u for block %s",
+                     version, block->idstr);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched fixed-ram page size %" PRIu64
+                     " for block %s", page_size, block->idstr);
+        return -EINVAL;
+    }
+    if (!QEMU_IS_ALIGNED(block->pages_offset, FIXED_RAM_FILE_ALIGNMENT)) {
+        error_report("Misaligned fixed-ram pages offset %" PRIu64
+                     " for block %s", block->pages_offset, block->idstr);
+        return -EINVAL;
+    }
+
+    bitmap = bitmap_new(num_pages);
+    if (file_pread_all(ioc, (uint8_t *)bitmap, bitmap_size,
+                       block->bitmap_offset, &local_err) < 0) {
+        error_report_err(local_err);
+        ret = -EIO;
+        goto out;
+    }
+    bitmap_from_le(bitmap, bitmap, num_pages);
+
+    for (set_bit_idx = find_first_bit(bitmap, num_pages);
+         set_bit_idx < num_pages;
+         set_bit_idx = find_next_bit(bitmap, num_pages, clear_bit_idx + 1)) {
+        ram_addr_t offset = set_bit_idx << TARGET_PAGE_BITS;
+        size_t len;
+
+        clear_bit_idx = find_next_zero_bit(bitmap, num_pages, set_bit_idx + 1);
+        len = (clear_bit_idx - set_bit_idx) << TARGET_PAGE_BITS;
+
+        if (migrate_use_multifd()) {
+            ram_addr_t end = offset + len;
+
+            for (; offset < end; offset += TARGET_PAGE_SIZE) {
+                if (multifd_recv_queue_page(block, offset) < 0) {
+                    ret = -EIO;
+                    goto out;
+                }
+            }
+            continue;
+        }
+
+        if (file_pread_all(ioc, block->host + offset, len,
+                           block->pages_offset + offset, &local_err) < 0) {
+            error_report_err(local_err);
+            ret = -EIO;
+            goto out;
+        }
+        ramblock_recv_bitmap_set_range(block, block->host + offset,
+                                       len >> TARGET_PAGE_BITS);
+    }
+
+    if (migrate_use_multifd()) {
+        multifd_recv_sync_main();
+    }
+
+out:
+    g_free(bitmap);
+    if (!ret) {
+        /* Skip over the pages, the stream continues after them */
+        qemu_set_offset(f, block->pages_offset + length);
+        ret = qemu_file_get_error(f);
+    }
+    return ret;
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -3537,6 +4694,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_fixed_ram()) {
+                        ret = parse_ramblock_fixed_ram(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -54,6 +54,7 @@
 #include "qemu/main-loop.h"
 #include "block/snapshot.h"
 #include "qemu/cutils.h"
+#include "qemu/timer.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
 #include "sysemu/replay.h"
@@ -246,6 +247,9 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* sections loaded by the last load, and time spent on them (us) */
+    uint64_t load_sections;
+    int64_t load_time;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -878,11 +882,48 @@ void vmstate_unregister(VMStateIf *obj, const VMStateDescription *vmsd,
 
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se)
 {
+    int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    int64_t elapsed;
+    int ret;
+
     trace_vmstate_load(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
     if (!se->vmsd) {         /* Old style */
-        return se->ops->load_state(f, se->opaque, se->load_version_id);
+        ret = se->ops->load_state(f, se->opaque, se->load_version_id);
+    } else {
+        ret = vmstate_load_state(f, se->vmsd, se->opaque,
+                                 se->load_version_id);
+    }
+
+    elapsed = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+    se->load_sections++;
+    se->load_time += elapsed;
+    trace_vmstate_load_time(se->idstr, se->instance_id, elapsed, ret);
+
+    return ret;
+}
+
+VMStateLoadTimeList *qmp_query_vmstate_load_times(Error **errp)
+{
+    VMStateLoadTimeList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        VMStateLoadTimeList *entry;
+
+        if (!se->load_sections) {
+            continue;
+        }
+        entry = g_new0(VMStateLoadTimeList, 1);
+        entry->value = g_new0(VMStateLoadTime, 1);
+        entry->value->id = g_strdup(se->idstr);
+        entry->value->instance_id = se->instance_id;
+        entry->value->sections = se->load_sections;
+        entry->value->load_time = se->load_time;
+        *tail = entry;
+        tail = &entry->next;
     }
-    return vmstate_load_state(f, se->vmsd, se->opaque, se->load_version_id);
+
+    return head;
 }
 
 static void vmstate_save_old_style(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
@@ -2393,6 +2434,11 @@ static int qemu_loadvm_state_setup(QEMUFile *f)
     int ret;
 
     trace_loadvm_state_setup();
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->load_sections = 0;
+        se->load_time = 0;
+    }
+
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->load_setup) {
             continue;
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +127,266 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+/*
+ * The vectorized encoders compare a whole vector of bytes at once, and
+ * find where the current run ends from the mask of equal bytes.  Only
+ * the scans differ between them, the encoding itself is shared and
+ * produces exactly the same output as xbzrle_encode_buffer_int().
+ */
+typedef int (*XBZRLEScanFn)(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen);
+
+static int xbzrle_encode_scan(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen,
+                              XBZRLEScanFn find_diff, XBZRLEScanFn find_same)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0;
+    uint8_t *nzrun_start;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        zrun_len = find_diff(old_buf, new_buf, i, slen) - i;
+        i += zrun_len;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        nzrun_start = new_buf + i;
+        nzrun_len = find_same(old_buf, new_buf, i, slen) - i;
+        i += nzrun_len;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, nzrun_start, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Returns the offset of the first byte that differs, starting from @i */
+static int xbzrle_find_diff_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t neq = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (neq) {
+            return i + ctz32(neq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+/* Returns the offset of the first byte that is unchanged, starting from @i */
+static int xbzrle_find_same_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#pragma GCC pop_options
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_scan(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_find_diff_avx2, xbzrle_find_same_avx2);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static int xbzrle_find_diff_avx512bw(const uint8_t *old_buf,
+                                     const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint64_t neq = _mm512_cmpneq_epi8_mask(a, b);
+
+        if (neq) {
+            return i + ctz64(neq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_find_same_avx512bw(const uint8_t *old_buf,
+                                     const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(a, b);
+
+        if (eq) {
+            return i + ctz64(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#pragma GCC pop_options
+
+static int xbzrle_encode_buffer_avx512bw(uint8_t *old_buf, uint8_t *new_buf,
+                                         int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_scan(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_find_diff_avx512bw,
+                              xbzrle_find_same_avx512bw);
+}
+#endif /* CONFIG_AVX512BW_OPT */
+
+/* As in util/bufferiszero.c, the most preferred ISA has the lowest bit */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+typedef int (*XBZRLEEncodeFn)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen);
+
+static unsigned cpuid_cache;
+static XBZRLEEncodeFn encode_accel = xbzrle_encode_buffer_int;
+static const char *encode_accel_name = "int";
+
+static void init_accel(unsigned cache)
+{
+    encode_accel = xbzrle_encode_buffer_int;
+    encode_accel_name = "int";
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        encode_accel = xbzrle_encode_buffer_avx2;
+        encode_accel_name = "avx2";
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        encode_accel = xbzrle_encode_buffer_avx512bw;
+        encode_accel_name = "avx512bw";
+    }
+#endif
+}
+
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* See util/bufferiszero.c for the XCR0 bits */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F) &&
+                (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /*
+     * Same as test_buffer_is_zero_next_accel(), except that the fastest
+     * encoder is selected again once all of them have been used.
+     */
+    if (cpuid_cache == 0) {
+        init_cpuid_cache();
+        return false;
+    }
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#define select_encode_fn encode_accel
+
+#else
+#define select_encode_fn xbzrle_encode_buffer_int
+static const char *encode_accel_name = "int";
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+#endif
+
+const char *test_xbzrle_encode_accel_name(void)
+{
+    return encode_accel_name;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return select_encode_fn(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -18,4 +18,12 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/*
+ * For the tests and benchmarks: switch the encoder to the next slower
+ * instruction set (or back to the fastest one, returning false, after
+ * the last one), and return the name of the current one.
+ */
+bool test_xbzrle_encode_next_accel(void);
+const char *test_xbzrle_encode_accel_name(void);
 #endif
@@ -426,6 +426,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_CPU_THROTTLE_TAILSLOW),
             params->cpu_throttle_tailslow ? "on" : "off");
+        assert(params->has_cpu_throttle_per_vcpu);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_CPU_THROTTLE_PER_VCPU),
+            params->cpu_throttle_per_vcpu ? "on" : "off");
         assert(params->has_max_cpu_throttle);
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_CPU_THROTTLE),
@@ -480,6 +484,36 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateRamBlockList *block;
+
+    monitor_printf(mon, "Status: %s\n", DirtyRateStatus_str(info->status));
+    if (info->status == DIRTY_RATE_STATUS_UNSTARTED) {
+        goto out;
+    }
+    monitor_printf(mon, "Start Time: %" PRIi64 " (s)\n", info->start_time);
+    monitor_printf(mon, "Period: %" PRIi64 " (s)\n", info->calc_time);
+    monitor_printf(mon, "Sample Pages: %" PRIu64 " (per GiB)\n",
+                   info->sample_pages);
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRIu64 " (MB/s), "
+                       "%" PRIu64 " (pages/s)\n",
+                       info->dirty_rate, info->dirty_pages_rate);
+    }
+    for (block = info->ramblocks; block; block = block->next) {
+        monitor_printf(mon, "  %s: %" PRIu64 "/%" PRIu64 " sampled pages "
+                       "dirty, %" PRIu64 " (pages/s)\n",
+                       block->value->id, block->value->dirty_sample_pages,
+                       block->value->sample_pages,
+                       block->value->dirty_pages_rate);
+    }
+
+out:
+    qapi_free_DirtyRateInfo(info);
+}
+
 
 #ifdef CONFIG_VNC
 /* Helper for hmp_info_vnc_clients, _servers */
@@ -1285,6 +1319,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_cpu_throttle_tailslow = true;
         visit_type_bool(v, param, &p->cpu_throttle_tailslow, &err);
         break;
+    case MIGRATION_PARAMETER_CPU_THROTTLE_PER_VCPU:
+        p->has_cpu_throttle_per_vcpu = true;
+        visit_type_bool(v, param, &p->cpu_throttle_per_vcpu, &err);
+        break;
     case MIGRATION_PARAMETER_MAX_CPU_THROTTLE:
         p->has_max_cpu_throttle = true;
         visit_type_int(v, param, &p->max_cpu_throttle, &err);
@@ -1425,6 +1463,22 @@ void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, err);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t sec = qdict_get_int(qdict, "second");
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(sec, false, 0, &err);
+    if (err) {
+        hmp_handle_error(mon, err);
+        return;
+    }
+
+    monitor_printf(mon, "Measuring the dirty page rate for %" PRIi64
+                   " seconds, use 'info dirty_rate' to get the results.\n",
+                   sec);
+}
+
 void hmp_x_colo_lost_heartbeat(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -23,17 +23,16 @@
 #include "trace.h"
 #include "nbd-internal.h"
 #include "qemu/units.h"
+#include "sysemu/iothread.h"
 
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_DIRTY_BITMAP 1
 
 /*
- * NBD_MAX_BLOCK_STATUS_EXTENTS: 1 MiB of extents data. An empirical
- * constant. If an increase is needed, note that the NBD protocol
- * recommends no larger than 32 mb, so that the client won't consider
- * the reply as a denial of service attack.
+ * Pinning the pages and waiting for the completion notification only pays
+ * off for larger payloads, smaller replies are always copied.
  */
-#define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
+#define NBD_ZERO_COPY_MIN_SIZE (64 * KiB)
 
 static int system_errno_to_nbd_errno(int err)
 {
@@ -94,6 +93,18 @@ struct NBDExport {
 
     AioContext *ctx;
 
+    /*
+     * IOThreads that client connections are spread across (round-robin).
+     * Only the socket I/O of a connection runs there, request processing
+     * and the block layer stay in @ctx.
+     */
+    IOThread **iothreads;
+    int nb_iothreads;
+    int next_iothread;
+
+    /* Send read payloads with qio_channel_writev_zero_copy() if possible */
+    bool zero_copy;
+
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
 
@@ -124,10 +135,14 @@ struct NBDClient {
     QIOChannelSocket *sioc; /* The underlying data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
 
+    /* Context for the socket I/O if it is not the export's AioContext */
+    AioContext *ctx;
+
     Coroutine *recv_coroutine;
 
     CoMutex send_lock;
     Coroutine *send_coroutine;
+    CoMutex flush_lock; /* Serializes qio_channel_flush() calls */
 
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
@@ -1309,8 +1324,18 @@ static coroutine_fn int nbd_negotiate(NBDClient *client, Error **errp)
         return ret;
     }
 
-    /* Attach the channel to the same AioContext as the export */
-    if (client->exp && client->exp->ctx) {
+    /*
+     * Attach the channel to the next IOThread of the export, or to the same
+     * AioContext as the export
+     */
+    if (client->exp && client->exp->nb_iothreads) {
+        NBDExport *exp = client->exp;
+        IOThread *iothread = exp->iothreads[exp->next_iothread];
+
+        exp->next_iothread = (exp->next_iothread + 1) % exp->nb_iothreads;
+        client->ctx = iothread_get_aio_context(iothread);
+        qio_channel_attach_aio_context(client->ioc, client->ctx);
+    } else if (client->exp && client->exp->ctx) {
         qio_channel_attach_aio_context(client->ioc, client->exp->ctx);
     }
 
@@ -1446,6 +1471,10 @@ static void blk_aio_attached(AioContext *ctx, void *opaque)
     exp->ctx = ctx;
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
+        if (client->ctx) {
+            /* Connection keeps running in its own IOThread */
+            continue;
+        }
         qio_channel_attach_aio_context(client->ioc, ctx);
         if (client->recv_coroutine) {
             aio_co_schedule(ctx, client->recv_coroutine);
@@ -1464,7 +1493,9 @@ static void blk_aio_detach(void *opaque)
     trace_nbd_blk_aio_detach(exp->name, exp->ctx);
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
-        qio_channel_detach_aio_context(client->ioc);
+        if (!client->ctx) {
+            qio_channel_detach_aio_context(client->ioc);
+        }
     }
 
     exp->ctx = NULL;
@@ -1483,9 +1514,11 @@ static void nbd_eject_notifier(Notifier *n, void *data)
 
 NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
                           uint64_t size, const char *name, const char *desc,
-                          const char *bitmap, bool readonly, bool shared,
-                          void (*close)(NBDExport *), bool writethrough,
-                          BlockBackend *on_eject_blk, Error **errp)
+                          const char *bitmap, bool readonly, bool multi_conn,
+                          bool zero_copy, IOThread **iothreads,
+                          int nb_iothreads, void (*close)(NBDExport *),
+                          bool writethrough, BlockBackend *on_eject_blk,
+                          Error **errp)
 {
     AioContext *ctx;
     BlockBackend *blk;
@@ -1531,13 +1564,19 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
                      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_CACHE);
     if (readonly) {
         exp->nbdflags |= NBD_FLAG_READ_ONLY;
-        if (shared) {
-            exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
-        }
     } else {
         exp->nbdflags |= (NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES |
                           NBD_FLAG_SEND_FAST_ZERO);
     }
+    /*
+     * All connections share one BlockBackend, so a flush on any of them
+     * covers the writes completed on all of them, as required for
+     * NBD_FLAG_CAN_MULTI_CONN, even for writable exports.
+     */
+    if (multi_conn) {
+        exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
+    exp->zero_copy = zero_copy;
     assert(size <= INT64_MAX - dev_offset);
     exp->size = QEMU_ALIGN_DOWN(size, BDRV_SECTOR_SIZE);
 
@@ -1578,6 +1617,17 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
         assert(strlen(exp->export_bitmap_context) < NBD_MAX_STRING_SIZE);
     }
 
+    if (nb_iothreads) {
+        int i;
+
+        exp->iothreads = g_new(IOThread *, nb_iothreads);
+        for (i = 0; i < nb_iothreads; i++) {
+            exp->iothreads[i] = iothreads[i];
+            object_ref(OBJECT(iothreads[i]));
+        }
+        exp->nb_iothreads = nb_iothreads;
+    }
+
     exp->close = close;
     exp->ctx = ctx;
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
@@ -1665,6 +1715,8 @@ void nbd_export_get(NBDExport *exp)
 
 void nbd_export_put(NBDExport *exp)
 {
+    int i;
+
     assert(exp->refcount > 0);
     if (exp->refcount == 1) {
         nbd_export_close(exp);
@@ -1700,6 +1752,11 @@ void nbd_export_put(NBDExport *exp)
             g_free(exp->export_bitmap_context);
         }
 
+        for (i = 0; i < exp->nb_iothreads; i++) {
+            object_unref(OBJECT(exp->iothreads[i]));
+        }
+        g_free(exp->iothreads);
+
         g_free(exp);
     }
 }
@@ -1722,20 +1779,105 @@ void nbd_export_close_all(void)
     }
 }
 
+/*
+ * Requests are processed in the export's AioContext.  Connections that were
+ * assigned an IOThread of their own move there for the socket I/O only, so
+ * that receiving, sending (and encrypting) data for several connections can
+ * use several threads.
+ */
+static void coroutine_fn nbd_co_enter_client_ctx(NBDClient *client)
+{
+    if (client->ctx) {
+        aio_co_reschedule_self(client->ctx);
+    }
+}
+
+static void coroutine_fn nbd_co_leave_client_ctx(NBDClient *client)
+{
+    AioContext *ctx;
+
+    if (!client->ctx) {
+        return;
+    }
+
+    /*
+     * The export may have moved to another AioContext while we were away;
+     * once we run in its context, it can't change under our feet anymore.
+     */
+    while ((ctx = blk_get_aio_context(client->exp->blk)) !=
+           qemu_get_current_aio_context()) {
+        aio_co_reschedule_self(ctx);
+    }
+}
+
 static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
                                         unsigned niov, Error **errp)
 {
     int ret;
 
     g_assert(qemu_in_coroutine());
+    nbd_co_enter_client_ctx(client);
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
 
     ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
 
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+    nbd_co_leave_client_ctx(client);
+
+    return ret;
+}
+
+/*
+ * Like nbd_co_send_iov(), but for replies that carry read data.  If the
+ * export and the channel allow it, the reply is sent without copying the
+ * payload into the socket buffers.  The kernel keeps referencing the pages
+ * until the data has been transmitted, so wait for that to happen before
+ * returning and giving the caller back its buffers (and stack).  The wait
+ * happens outside of send_lock, so that other replies can be sent while
+ * the data is still in flight.
+ */
+static int coroutine_fn nbd_co_send_iov_data(NBDClient *client,
+                                             struct iovec *iov,
+                                             unsigned niov, Error **errp)
+{
+    int ret;
+
+    if (!client->exp->zero_copy ||
+        iov_size(iov, niov) < NBD_ZERO_COPY_MIN_SIZE ||
+        !qio_channel_has_feature(client->ioc,
+                                 QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY))
+    {
+        return nbd_co_send_iov(client, iov, niov, errp);
+    }
+
+    g_assert(qemu_in_coroutine());
+    nbd_co_enter_client_ctx(client);
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    ret = qio_channel_writev_zero_copy_all(client->ioc, iov, niov, errp);
+
     client->send_coroutine = NULL;
     qemu_co_mutex_unlock(&client->send_lock);
 
+    /*
+     * Even if the write failed, part of the payload may have been queued,
+     * and the caller must not reuse the buffers before the kernel released
+     * them.  If the flush fails too, shut the channel down, so that the
+     * socket stops transmitting from them and the client is dropped.
+     */
+    qemu_co_mutex_lock(&client->flush_lock);
+    if (qio_channel_flush(client->ioc, ret < 0 ? NULL : errp) < 0) {
+        qio_channel_shutdown(client->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        ret = -1;
+    }
+    qemu_co_mutex_unlock(&client->flush_lock);
+    ret = ret < 0 ? -EIO : 0;
+
+    nbd_co_leave_client_ctx(client);
+
     return ret;
 }
 
@@ -1765,7 +1907,7 @@ static int nbd_co_send_simple_reply(NBDClient *client,
                                    len);
     set_be_simple_reply(&reply, nbd_err, handle);
 
-    return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
+    return nbd_co_send_iov_data(client, iov, len ? 2 : 1, errp);
 }
 
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
@@ -1814,7 +1956,7 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov_data(client, iov, 2, errp);
 }
 
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
@@ -1993,11 +2135,16 @@ static int nbd_extent_array_add(NBDExtentArray *ea,
     return 0;
 }
 
+static uint32_t blockstatus_to_flags(int status)
+{
+    return (status & BDRV_BLOCK_ALLOCATED ? 0 : NBD_STATE_HOLE) |
+           (status & BDRV_BLOCK_ZERO      ? NBD_STATE_ZERO : 0);
+}
+
 static int blockstatus_to_extents(BlockDriverState *bs, uint64_t offset,
                                   uint64_t bytes, NBDExtentArray *ea)
 {
     while (bytes) {
-        uint32_t flags;
         int64_t num;
         int ret = bdrv_block_status_above(bs, NULL, offset, bytes, &num,
                                           NULL, NULL);
@@ -2006,10 +2153,7 @@ static int blockstatus_to_extents(BlockDriverState *bs, uint64_t offset,
             return ret;
         }
 
-        flags = (ret & BDRV_BLOCK_ALLOCATED ? 0 : NBD_STATE_HOLE) |
-                (ret & BDRV_BLOCK_ZERO      ? NBD_STATE_ZERO : 0);
-
-        if (nbd_extent_array_add(ea, num, flags) < 0) {
+        if (nbd_extent_array_add(ea, num, blockstatus_to_flags(ret)) < 0) {
             return 0;
         }
 
@@ -2020,6 +2164,42 @@ static int blockstatus_to_extents(BlockDriverState *bs, uint64_t offset,
     return 0;
 }
 
+/*
+ * The last extent of a reply may reach beyond the requested range.  Grow it
+ * for as long as the status stays the same (up to @end), so that clients
+ * mapping a large sparse image can skip a whole hole in a single round trip
+ * instead of one per request.  This is only an optimisation, so errors just
+ * end the extent.
+ */
+static void blockstatus_extend_last(BlockDriverState *bs, uint64_t offset,
+                                    uint64_t end, NBDExtentArray *ea)
+{
+    NBDExtent *last = &ea->extents[ea->count - 1];
+    const uint32_t max_length = QEMU_ALIGN_DOWN(UINT32_MAX, 1 * MiB);
+    uint64_t orig_length = last->length;
+
+    while (offset < end && last->length < max_length) {
+        int64_t num;
+        int ret = bdrv_block_status_above(bs, NULL, offset,
+                                          MIN(end - offset,
+                                              max_length - last->length),
+                                          &num, NULL, NULL);
+
+        if (ret < 0 || blockstatus_to_flags(ret) != last->flags) {
+            break;
+        }
+
+        last->length += num;
+        ea->total_length += num;
+        offset += num;
+    }
+
+    if (last->length > orig_length) {
+        trace_nbd_co_send_block_status_extend(offset - last->length,
+                                              orig_length, last->length);
+    }
+}
+
 /*
  * nbd_co_send_extents
  *
@@ -2065,6 +2245,10 @@ static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
                 client, handle, -ret, "can't get block status", errp);
     }
 
+    if (!dont_fragment && ea->count && ea->total_length == length) {
+        blockstatus_extend_last(bs, offset + length, client->exp->size, ea);
+    }
+
     return nbd_co_send_extents(client, handle, ea, last, context_id, errp);
 }
 
@@ -2438,7 +2622,9 @@ static coroutine_fn void nbd_trip(void *opaque)
     }
 
     req = nbd_request_get(client);
+    nbd_co_enter_client_ctx(client);
     ret = nbd_co_receive_request(req, &request, &local_err);
+    nbd_co_leave_client_ctx(client);
     client->recv_coroutine = NULL;
 
     if (client->closing) {
@@ -2508,6 +2694,7 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
     Error *local_err = NULL;
 
     qemu_co_mutex_init(&client->send_lock);
+    qemu_co_mutex_init(&client->flush_lock);
 
     if (nbd_negotiate(client, &local_err)) {
         if (local_err) {
@@ -33,6 +33,8 @@
 #include "qapi/qobject-output-visitor.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
@@ -79,6 +81,12 @@ enum {
     OPTION_DISABLE = 273,
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
+    OPTION_TEE = 276,
+    OPTION_READ_PERCENT = 277,
+    OPTION_RANDOM = 278,
+    OPTION_SEED = 279,
+    OPTION_QUEUES = 280,
+    OPTION_LATENCY_HISTOGRAM = 281,
 };
 
 typedef enum OutputFormat {
@@ -196,6 +204,8 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--tee' creates an additional output image that receives the same\n"
+           "       data as 'output_filename' (can be given multiple times)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1666,6 +1676,12 @@ enum ImgConvertBlockStatus {
 
 #define MAX_COROUTINES 16
 
+/* Additional target that receives a copy of everything written to the first */
+typedef struct ImgConvertTee {
+    BlockBackend *blk;
+    bool has_zero_init;
+} ImgConvertTee;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1678,6 +1694,8 @@ typedef struct ImgConvertState {
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
+    ImgConvertTee *tee;
+    int tee_num;
     bool has_zero_init;
     bool compressed;
     bool unallocated_blocks_are_zero;
@@ -1688,6 +1706,7 @@ typedef struct ImgConvertState {
     bool copy_range;
     bool salvage;
     bool quiet;
+    bool progress;
     int min_sparse;
     int alignment;
     size_t cluster_sectors;
@@ -1859,8 +1878,10 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
-static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
-                                         int nb_sectors, uint8_t *buf,
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         BlockBackend *blk, bool has_zero_init,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
                                          enum ImgConvertBlockStatus status)
 {
     int ret;
@@ -1891,7 +1912,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                 (s->compressed &&
                  !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
             {
-                ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
+                ret = blk_co_pwrite(blk, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
                 if (ret < 0) {
                     return ret;
@@ -1901,11 +1922,11 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
             /* fall-through */
 
         case BLK_ZERO:
-            if (s->has_zero_init) {
+            if (has_zero_init) {
                 assert(!s->target_has_backing);
                 break;
             }
-            ret = blk_co_pwrite_zeroes(s->target,
+            ret = blk_co_pwrite_zeroes(blk,
                                        sector_num << BDRV_SECTOR_BITS,
                                        n << BDRV_SECTOR_BITS,
                                        BDRV_REQ_MAY_UNMAP);
@@ -2000,7 +2021,8 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         s->sector_num += n;
         qemu_co_mutex_unlock(&s->lock);
 
-        if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
+        if (s->progress &&
+            (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO))) {
             s->allocated_done += n;
             qemu_progress_print(100.0 * s->allocated_done /
                                         s->allocated_sectors, 0);
@@ -2037,7 +2059,14 @@ retry:
                     goto retry;
                 }
             } else {
-                ret = convert_co_write(s, sector_num, n, buf, status);
+                ret = convert_co_write(s, s->target, s->has_zero_init,
+                                       sector_num, n, buf, status);
+                /* Fan the buffer out to the other targets */
+                for (i = 0; ret >= 0 && i < s->tee_num; i++) {
+                    ret = convert_co_write(s, s->tee[i].blk,
+                                           s->tee[i].has_zero_init,
+                                           sector_num, n, buf, status);
+                }
             }
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
@@ -2073,26 +2102,42 @@ retry:
     }
 }
 
-static int convert_do_copy(ImgConvertState *s)
+/*
+ * Check whether @blk has zero initialisation or can get it efficiently.
+ * @has_zero_init is the value known so far.
+ */
+static bool convert_check_zero_init(ImgConvertState *s, BlockBackend *blk,
+                                    bool has_zero_init)
 {
-    int ret, i, n;
-    int64_t sector_num = 0;
-
-    /* Check whether we have zero initialisation or can get it efficiently */
-    if (!s->has_zero_init && s->target_is_new && s->min_sparse &&
+    if (!has_zero_init && s->target_is_new && s->min_sparse &&
         !s->target_has_backing) {
-        s->has_zero_init = bdrv_has_zero_init(blk_bs(s->target));
+        has_zero_init = bdrv_has_zero_init(blk_bs(blk));
     }
 
-    if (!s->has_zero_init && !s->target_has_backing &&
-        bdrv_can_write_zeroes_with_unmap(blk_bs(s->target)))
+    if (!has_zero_init && !s->target_has_backing &&
+        bdrv_can_write_zeroes_with_unmap(blk_bs(blk)))
     {
-        ret = blk_make_zero(s->target, BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK);
+        int ret = blk_make_zero(blk,
+                                BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK);
         if (ret == 0) {
-            s->has_zero_init = true;
+            has_zero_init = true;
         }
     }
 
+    return has_zero_init;
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int ret, i, n;
+    int64_t sector_num = 0;
+
+    s->has_zero_init = convert_check_zero_init(s, s->target, s->has_zero_init);
+    for (i = 0; i < s->tee_num; i++) {
+        s->tee[i].has_zero_init =
+            convert_check_zero_init(s, s->tee[i].blk, false);
+    }
+
     /* Allocate buffer for copied data. For compressed images, only one cluster
      * can be copied at a time. */
     if (s->compressed) {
@@ -2103,7 +2148,12 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
-    while (sector_num < s->total_sectors) {
+    /*
+     * The number of allocated sectors is only needed for progress output.
+     * Without it, block status queries are done only while copying, where
+     * they overlap with the I/O of the other coroutines.
+     */
+    while (s->progress && sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
             return n;
@@ -2136,6 +2186,12 @@ static int convert_do_copy(ImgConvertState *s)
         if (ret < 0) {
             return ret;
         }
+        for (i = 0; i < s->tee_num; i++) {
+            ret = blk_pwrite_compressed(s->tee[i].blk, 0, NULL, 0);
+            if (ret < 0) {
+                return ret;
+            }
+        }
     }
 
     return s->ret;
@@ -2187,7 +2243,7 @@ static int img_convert(int argc, char **argv)
     BlockDriverState *out_bs;
     QemuOpts *opts = NULL, *sn_opts = NULL;
     QemuOptsList *create_opts = NULL;
-    QDict *open_opts = NULL;
+    QDict *open_opts = NULL, *tee_create_opts = NULL;
     char *options = NULL;
     Error *local_err = NULL;
     bool writethrough, src_writethrough, image_opts = false,
@@ -2196,6 +2252,8 @@ static int img_convert(int argc, char **argv)
     bool force_share = false;
     bool explict_min_sparse = false;
     bool bitmaps = false;
+    const char **tee_filenames = NULL;
+    int i;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2216,6 +2274,7 @@ static int img_convert(int argc, char **argv)
             {"salvage", no_argument, 0, OPTION_SALVAGE},
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
+            {"tee", required_argument, 0, OPTION_TEE},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WU",
@@ -2344,6 +2403,10 @@ static int img_convert(int argc, char **argv)
         case OPTION_BITMAPS:
             bitmaps = true;
             break;
+        case OPTION_TEE:
+            tee_filenames = g_renew(const char *, tee_filenames, s.tee_num + 1);
+            tee_filenames[s.tee_num++] = optarg;
+            break;
         }
     }
 
@@ -2387,6 +2450,16 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (s.tee_num && skip_create) {
+        error_report("--tee cannot be used with -n");
+        goto fail_getopt;
+    }
+
+    if (s.tee_num && s.copy_range) {
+        error_report("Cannot enable copy offloading when --tee is used");
+        goto fail_getopt;
+    }
+
     s.src_num = argc - optind - 1;
     out_filename = s.src_num >= 1 ? argv[argc - 1] : NULL;
 
@@ -2416,6 +2489,7 @@ static int img_convert(int argc, char **argv)
     if (s.quiet) {
         progress = false;
     }
+    s.progress = progress;
     qemu_progress_init(progress, 1.0);
     qemu_progress_print(0, 100);
 
@@ -2587,6 +2661,11 @@ static int img_convert(int argc, char **argv)
         open_opts = qdict_new();
         qemu_opt_foreach(opts, img_add_key_secrets, open_opts, &error_abort);
 
+        /* The additional targets are created with the same options */
+        if (s.tee_num) {
+            tee_create_opts = qemu_opts_to_qdict(opts, NULL);
+        }
+
         /* Create the new image */
         ret = bdrv_create(drv, out_filename, opts, &local_err);
         if (ret < 0) {
@@ -2624,6 +2703,34 @@ static int img_convert(int argc, char **argv)
     }
     out_bs = blk_bs(s.target);
 
+    s.tee = g_new0(ImgConvertTee, s.tee_num);
+    for (i = 0; i < s.tee_num; i++) {
+        QemuOpts *tee_opts;
+        QDict *tee_open_opts;
+
+        tee_opts = qemu_opts_from_qdict(create_opts, tee_create_opts,
+                                        &error_abort);
+        tee_open_opts = qdict_new();
+        qemu_opt_foreach(tee_opts, img_add_key_secrets, tee_open_opts,
+                         &error_abort);
+
+        ret = bdrv_create(drv, tee_filenames[i], tee_opts, &local_err);
+        qemu_opts_del(tee_opts);
+        if (ret < 0) {
+            error_reportf_err(local_err, "%s: error while converting %s: ",
+                              tee_filenames[i], out_fmt);
+            qobject_unref(tee_open_opts);
+            goto out;
+        }
+
+        s.tee[i].blk = img_open_file(tee_filenames[i], tee_open_opts, out_fmt,
+                                     flags, writethrough, s.quiet, false);
+        if (!s.tee[i].blk) {
+            ret = -1;
+            goto out;
+        }
+    }
+
     if (bitmaps && !bdrv_supports_persistent_dirty_bitmap(out_bs)) {
         error_report("Format driver '%s' does not support bitmaps",
                      out_bs->drv->format_name);
@@ -2694,6 +2801,9 @@ static int img_convert(int argc, char **argv)
     /* Now copy the bitmaps */
     if (bitmaps && ret == 0) {
         ret = convert_copy_bitmaps(blk_bs(s.src[0]), out_bs);
+        for (i = 0; ret == 0 && i < s.tee_num; i++) {
+            ret = convert_copy_bitmaps(blk_bs(s.src[0]), blk_bs(s.tee[i].blk));
+        }
     }
 
 out:
@@ -2705,7 +2815,14 @@ out:
     qemu_opts_free(create_opts);
     qemu_opts_del(sn_opts);
     qobject_unref(open_opts);
+    qobject_unref(tee_create_opts);
     blk_unref(s.target);
+    if (s.tee) {
+        for (i = 0; i < s.tee_num; i++) {
+            blk_unref(s.tee[i].blk);
+        }
+        g_free(s.tee);
+    }
     if (s.src) {
         for (bs_i = 0; bs_i < s.src_num; bs_i++) {
             blk_unref(s.src[bs_i]);
@@ -2714,6 +2831,7 @@ out:
     }
     g_free(s.src_sectors);
 fail_getopt:
+    g_free(tee_filenames);
     g_free(options);
 
     return !!ret;
@@ -4252,10 +4370,21 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    BlockAcctCookie acct;
+    bool in_use;
+} BenchRequest;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
-    bool write;
+    int read_percent;
+    int random_percent;
+    GRand *rand;
     int bufsize;
     int step;
     int nrreq;
@@ -4263,12 +4392,16 @@ typedef struct BenchData {
     int flush_interval;
     bool drain_on_flush;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+
+    /* Each queue is a sequential stream of requests in its own area */
+    int nr_queues;
+    uint64_t *queue_offset;
+    int next_queue;
 
     int in_flight;
     bool in_flush;
-    uint64_t offset;
-} BenchData;
+};
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -4278,6 +4411,57 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
+/* Returns true with a probability of @percent % */
+static bool bench_rand_percent(BenchData *b, int percent)
+{
+    if (percent <= 0) {
+        return false;
+    } else if (percent >= 100) {
+        return true;
+    }
+    return g_rand_int_range(b->rand, 0, 100) < percent;
+}
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset;
+    int q;
+
+    if (bench_rand_percent(b, b->random_percent)) {
+        uint64_t nb_blocks = MAX(b->image_size / b->bufsize, 1);
+        uint64_t r = ((uint64_t)g_rand_int(b->rand) << 32) |
+                     g_rand_int(b->rand);
+
+        return (r % nb_blocks) * b->bufsize;
+    }
+
+    q = b->next_queue;
+    b->next_queue = (q + 1) % b->nr_queues;
+
+    offset = b->queue_offset[q];
+    b->queue_offset[q] += b->step;
+    b->queue_offset[q] %= b->image_size;
+
+    return offset;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_request_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    if (ret < 0) {
+        block_acct_failed(blk_get_stats(b->blk), &req->acct);
+    } else {
+        block_acct_done(blk_get_stats(b->blk), &req->acct);
+    }
+    req->in_use = false;
+
+    bench_cb(b, ret);
+}
+
 static void bench_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
@@ -4323,18 +4507,36 @@ static void bench_cb(void *opaque, int ret)
     }
 
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
+        BenchRequest *req = NULL;
+        int64_t offset;
+        bool is_read;
+        int i;
+
+        for (i = 0; i < b->nrreq; i++) {
+            if (!b->reqs[i].in_use) {
+                req = &b->reqs[i];
+                break;
+            }
+        }
+        assert(req);
+
         /* blk_aio_* might look for completed I/Os and kick bench_cb
          * again, so make sure this operation is counted by in_flight
-         * and b->offset is ready for the next submission.
+         * and the offset is ready for the next submission.
          */
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
+        req->in_use = true;
+        offset = bench_next_offset(b);
+        is_read = bench_rand_percent(b, b->read_percent);
+
+        block_acct_start(blk_get_stats(b->blk), &req->acct, b->bufsize,
+                         is_read ? BLOCK_ACCT_READ : BLOCK_ACCT_WRITE);
+        if (is_read) {
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0,
+                                 bench_request_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0,
+                                  bench_request_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -4343,6 +4545,115 @@ static void bench_cb(void *opaque, int ret)
     }
 }
 
+/* Parses a comma separated list of latency bin boundaries in microseconds */
+static uint64List *bench_parse_histogram(const char *str)
+{
+    uint64List *list = NULL, **next = &list;
+    char **boundaries = g_strsplit(str, ",", 0);
+    uint64_t last = 0;
+    int i;
+
+    for (i = 0; boundaries[i]; i++) {
+        uint64_t val;
+
+        if (qemu_strtou64(boundaries[i], NULL, 0, &val) < 0 ||
+            val <= last || val > UINT64_MAX / SCALE_US) {
+            error_report("Invalid latency histogram boundary '%s'",
+                         boundaries[i]);
+            qapi_free_uint64List(list);
+            list = NULL;
+            break;
+        }
+        last = val;
+
+        *next = g_new0(uint64List, 1);
+        (*next)->value = val * SCALE_US;
+        next = &(*next)->next;
+    }
+
+    g_strfreev(boundaries);
+    return list;
+}
+
+static void bench_dump_histogram(const char *name, BlockLatencyHistogram *hist)
+{
+    int i;
+
+    printf("%s latency histogram:\n", name);
+    for (i = 0; i < hist->nbins; i++) {
+        uint64_t start = i ? hist->boundaries[i - 1] / SCALE_US : 0;
+
+        if (i < hist->nbins - 1) {
+            printf("  [%" PRIu64 " us, %" PRIu64 " us): %" PRIu64 "\n",
+                   start, hist->boundaries[i] / SCALE_US, hist->bins[i]);
+        } else {
+            printf("  [%" PRIu64 " us, inf): %" PRIu64 "\n",
+                   start, hist->bins[i]);
+        }
+    }
+}
+
+static QDict *bench_histogram_to_qdict(BlockLatencyHistogram *hist)
+{
+    QDict *dict = qdict_new();
+    QList *boundaries = qlist_new();
+    QList *bins = qlist_new();
+    int i;
+
+    for (i = 0; i < hist->nbins; i++) {
+        if (i < hist->nbins - 1) {
+            qlist_append_int(boundaries, hist->boundaries[i]);
+        }
+        qlist_append_int(bins, hist->bins[i]);
+    }
+    qdict_put(dict, "boundaries", boundaries);
+    qdict_put(dict, "bins", bins);
+
+    return dict;
+}
+
+static void bench_dump_json(BenchData *b, int count, double seconds,
+                            bool histogram)
+{
+    BlockAcctStats *stats = blk_get_stats(b->blk);
+    enum BlockAcctType types[] = { BLOCK_ACCT_READ, BLOCK_ACCT_WRITE };
+    const char *names[] = { "read", "write" };
+    QDict *dict = qdict_new();
+    QString *str;
+    int i;
+
+    qdict_put_int(dict, "requests", count);
+    qdict_put_int(dict, "request-size", b->bufsize);
+    qdict_put_int(dict, "depth", b->nrreq);
+    qdict_put_int(dict, "queues", b->nr_queues);
+    qdict_put_int(dict, "read-percent", b->read_percent);
+    qdict_put_int(dict, "random-percent", b->random_percent);
+    qdict_put(dict, "seconds", qnum_from_double(seconds));
+    qdict_put(dict, "iops", qnum_from_double(seconds ? count / seconds : 0));
+
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        enum BlockAcctType type = types[i];
+        BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+        uint64_t ops = stats->nr_ops[type];
+        QDict *d = qdict_new();
+
+        qdict_put_int(d, "operations", ops);
+        qdict_put_int(d, "bytes", stats->nr_bytes[type]);
+        qdict_put_int(d, "total-time-ns", stats->total_time_ns[type]);
+        qdict_put_int(d, "avg-latency-ns",
+                      ops ? stats->total_time_ns[type] / ops : 0);
+        if (histogram) {
+            qdict_put(d, "latency-histogram", bench_histogram_to_qdict(hist));
+        }
+        qdict_put(dict, names[i], d);
+    }
+
+    str = qobject_to_json_pretty(QOBJECT(dict));
+    printf("%s\n", qstring_get_str(str));
+    qobject_unref(str);
+    qobject_unref(dict);
+}
+
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
@@ -4358,12 +4669,19 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    int read_percent = -1;
+    int random_percent = 0;
+    uint32_t seed = 0;
+    int nr_queues = 1;
+    uint64List *histogram = NULL;
+    OutputFormat output_format = OFORMAT_HUMAN;
     int64_t image_size;
     BlockBackend *blk = NULL;
     BenchData data = {};
     int flags = 0;
     bool writethrough = false;
     struct timeval t1, t2;
+    double seconds;
     int i;
     bool force_share = false;
     size_t buf_size;
@@ -4376,6 +4694,13 @@ static int img_bench(int argc, char **argv)
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
             {"force-share", no_argument, 0, 'U'},
+            {"read-percent", required_argument, 0, OPTION_READ_PERCENT},
+            {"random", required_argument, 0, OPTION_RANDOM},
+            {"seed", required_argument, 0, OPTION_SEED},
+            {"queues", required_argument, 0, OPTION_QUEUES},
+            {"latency-histogram", required_argument, 0,
+             OPTION_LATENCY_HISTOGRAM},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
@@ -4509,6 +4834,70 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_READ_PERCENT:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            read_percent = res;
+            break;
+        }
+        case OPTION_RANDOM:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid random percentage specified");
+                return 1;
+            }
+            random_percent = res;
+            break;
+        }
+        case OPTION_SEED:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > UINT32_MAX) {
+                error_report("Invalid random seed specified");
+                return 1;
+            }
+            seed = res;
+            break;
+        }
+        case OPTION_QUEUES:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 ||
+                res < 1 || res > INT_MAX) {
+                error_report("Invalid number of queues specified");
+                return 1;
+            }
+            nr_queues = res;
+            break;
+        }
+        case OPTION_LATENCY_HISTOGRAM:
+            qapi_free_uint64List(histogram);
+            histogram = bench_parse_histogram(optarg);
+            if (!histogram) {
+                return 1;
+            }
+            break;
+        case OPTION_OUTPUT:
+            if (!strcmp(optarg, "json")) {
+                output_format = OFORMAT_JSON;
+            } else if (!strcmp(optarg, "human")) {
+                output_format = OFORMAT_HUMAN;
+            } else {
+                error_report("--output must be used with human or json as "
+                             "argument.");
+                ret = -1;
+                goto out;
+            }
+            break;
         }
     }
 
@@ -4517,7 +4906,17 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
+    if (read_percent < 0) {
+        read_percent = is_write ? 0 : 100;
+    } else if (is_write) {
+        error_report("-w and --read-percent are mutually exclusive");
+        ret = -1;
+        goto out;
+    } else if (read_percent < 100) {
+        flags |= BDRV_O_RDWR;
+    }
+
+    if (read_percent == 100 && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
@@ -4548,17 +4947,49 @@ static int img_bench(int argc, char **argv)
         .step           = step ?: bufsize,
         .nrreq          = depth,
         .n              = count,
-        .offset         = offset,
-        .write          = is_write,
+        .read_percent   = read_percent,
+        .random_percent = random_percent,
+        .rand           = g_rand_new_with_seed(seed),
+        .nr_queues      = nr_queues,
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+
+    /* Queues start at equally spaced positions after the first offset */
+    data.queue_offset = g_new(uint64_t, nr_queues);
+    for (i = 0; i < nr_queues; i++) {
+        uint64_t area = QEMU_ALIGN_DOWN(image_size / nr_queues, bufsize ?: 1);
+        data.queue_offset[i] = (offset + i * area) % image_size;
+    }
+
+    if (histogram) {
+        BlockAcctStats *stats = blk_get_stats(blk);
+
+        block_latency_histogram_set(stats, BLOCK_ACCT_READ, histogram);
+        block_latency_histogram_set(stats, BLOCK_ACCT_WRITE, histogram);
+    }
+
+    if (output_format == OFORMAT_HUMAN) {
+        const char *type = read_percent == 100 ? "read" :
+                           read_percent == 0 ? "write" : "mixed";
+
+        printf("Sending %d %s requests, %d bytes each, %d in parallel "
+               "(starting at offset %" PRId64 ", step size %d)\n",
+               data.n, type, data.bufsize, data.nrreq, offset, data.step);
+        if (read_percent > 0 && read_percent < 100) {
+            printf("Using %d%% reads and %d%% writes\n",
+                   read_percent, 100 - read_percent);
+        }
+        if (random_percent) {
+            printf("Using random offsets for %d%% of the requests "
+                   "(seed %" PRIu32 ")\n", random_percent, seed);
+        }
+        if (nr_queues > 1) {
+            printf("Using %d sequential queues\n", nr_queues);
+        }
+        if (flush_interval) {
+            printf("Sending flush every %d requests\n", flush_interval);
+        }
     }
 
     buf_size = data.nrreq * data.bufsize;
@@ -4567,10 +4998,11 @@ static int img_bench(int argc, char **argv)
 
     blk_register_buf(blk, data.buf, buf_size);
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
+    data.reqs = g_new0(BenchRequest, data.nrreq);
     for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
+        data.reqs[i].b = &data;
+        qemu_iovec_init(&data.reqs[i].qiov, 1);
+        qemu_iovec_add(&data.reqs[i].qiov,
                        data.buf + i * data.bufsize, data.bufsize);
     }
 
@@ -4582,14 +5014,40 @@ static int img_bench(int argc, char **argv)
     }
     gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    seconds = (t2.tv_sec - t1.tv_sec)
+              + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+
+    if (output_format == OFORMAT_JSON) {
+        bench_dump_json(&data, count, seconds, histogram);
+    } else {
+        BlockAcctStats *stats = blk_get_stats(blk);
+
+        printf("Run completed in %3.3f seconds.\n", seconds);
+        if (histogram && read_percent > 0) {
+            bench_dump_histogram("Read",
+                                 &stats->latency_histogram[BLOCK_ACCT_READ]);
+        }
+        if (histogram && read_percent < 100) {
+            bench_dump_histogram("Write",
+                                 &stats->latency_histogram[BLOCK_ACCT_WRITE]);
+        }
+    }
 
 out:
     if (data.buf) {
         blk_unregister_buf(blk, data.buf);
     }
+    if (data.reqs) {
+        for (i = 0; i < data.nrreq; i++) {
+            qemu_iovec_destroy(&data.reqs[i].qiov);
+        }
+        g_free(data.reqs);
+    }
+    g_free(data.queue_offset);
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
+    qapi_free_uint64List(histogram);
     qemu_vfree(data.buf);
     blk_unref(blk);
 
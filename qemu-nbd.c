@@ -27,6 +27,7 @@
 #include "sysemu/block-backend.h"
 #include "block/block_int.h"
 #include "block/nbd.h"
+#include "sysemu/iothread.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
@@ -62,6 +63,9 @@
 #define QEMU_NBD_OPT_FORK          263
 #define QEMU_NBD_OPT_TLSAUTHZ      264
 #define QEMU_NBD_OPT_PID_FILE      265
+#define QEMU_NBD_OPT_MULTI_CONN    266
+#define QEMU_NBD_OPT_IOTHREADS     267
+#define QEMU_NBD_OPT_ZERO_COPY     268
 
 #define MBR_SIZE 512
 
@@ -97,6 +101,12 @@ static void usage(const char *name)
 "  -v, --verbose             display extra debugging information\n"
 "  -x, --export-name=NAME    expose export by name (default is empty string)\n"
 "  -D, --description=TEXT    export a human-readable description\n"
+"      --multi-conn=MODE     advertise that clients may open several\n"
+"                            connections (on, off, auto; default auto: only\n"
+"                            for read-only exports shared by several clients)\n"
+"      --iothreads=NUM       spread the connections across NUM I/O threads\n"
+"      --zero-copy           send read data without copying it into socket\n"
+"                            buffers (MSG_ZEROCOPY, TCP only)\n"
 "\n"
 "Exposing part of the image:\n"
 "  -o, --offset=OFFSET       offset into the image\n"
@@ -506,6 +516,20 @@ static const char *socket_activation_validate_opts(const char *device,
     return NULL;
 }
 
+static IOThread **qemu_nbd_create_iothreads(int nb_iothreads)
+{
+    IOThread **iothreads = g_new0(IOThread *, nb_iothreads);
+    int i;
+
+    for (i = 0; i < nb_iothreads; i++) {
+        g_autofree char *id = g_strdup_printf("qemu-nbd-iothread%d", i);
+
+        iothreads[i] = iothread_create(id, &error_fatal);
+    }
+
+    return iothreads;
+}
+
 static void qemu_nbd_shutdown(void)
 {
     job_cancel_sync_all();
@@ -560,6 +584,9 @@ int main(int argc, char **argv)
         { "trace", required_argument, NULL, 'T' },
         { "fork", no_argument, NULL, QEMU_NBD_OPT_FORK },
         { "pid-file", required_argument, NULL, QEMU_NBD_OPT_PID_FILE },
+        { "multi-conn", required_argument, NULL, QEMU_NBD_OPT_MULTI_CONN },
+        { "iothreads", required_argument, NULL, QEMU_NBD_OPT_IOTHREADS },
+        { "zero-copy", no_argument, NULL, QEMU_NBD_OPT_ZERO_COPY },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -586,6 +613,10 @@ int main(int argc, char **argv)
     int old_stderr = -1;
     unsigned socket_activation;
     const char *pid_file_name = NULL;
+    OnOffAuto multi_conn = ON_OFF_AUTO_AUTO;
+    int nb_iothreads = 0;
+    IOThread **iothreads = NULL;
+    bool zero_copy = false;
 
     /* The client thread uses SIGTERM to interrupt the server.  A signal
      * handler ensures that "qemu-nbd -v -c" exits with a nice status code.
@@ -784,6 +815,24 @@ int main(int argc, char **argv)
         case QEMU_NBD_OPT_PID_FILE:
             pid_file_name = optarg;
             break;
+        case QEMU_NBD_OPT_MULTI_CONN:
+            multi_conn = qapi_enum_parse(&OnOffAuto_lookup, optarg, -1,
+                                         &local_err);
+            if (local_err) {
+                error_reportf_err(local_err, "Invalid multi-conn mode: ");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case QEMU_NBD_OPT_IOTHREADS:
+            if (qemu_strtoi(optarg, NULL, 0, &nb_iothreads) < 0 ||
+                nb_iothreads < 0) {
+                error_report("Invalid number of I/O threads '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case QEMU_NBD_OPT_ZERO_COPY:
+            zero_copy = true;
+            break;
         }
     }
 
@@ -794,7 +843,8 @@ int main(int argc, char **argv)
         }
         if (export_name || export_description || dev_offset ||
             device || disconnect || fmt || sn_id_or_name || bitmap ||
-            seen_aio || seen_discard || seen_cache) {
+            seen_aio || seen_discard || seen_cache ||
+            multi_conn != ON_OFF_AUTO_AUTO || nb_iothreads || zero_copy) {
             error_report("List mode is incompatible with per-device settings");
             exit(EXIT_FAILURE);
         }
@@ -1059,10 +1109,19 @@ int main(int argc, char **argv)
     }
     fd_size -= dev_offset;
 
+    if (multi_conn == ON_OFF_AUTO_AUTO) {
+        multi_conn = readonly && shared > 1 ? ON_OFF_AUTO_ON : ON_OFF_AUTO_OFF;
+    }
+
+    /* Threads must be created after forking */
+    iothreads = qemu_nbd_create_iothreads(nb_iothreads);
     export = nbd_export_new(bs, dev_offset, fd_size, export_name,
-                            export_description, bitmap, readonly, shared > 1,
+                            export_description, bitmap, readonly,
+                            multi_conn == ON_OFF_AUTO_ON, zero_copy,
+                            iothreads, nb_iothreads,
                             nbd_export_closed, writethrough, NULL,
                             &error_fatal);
+    g_free(iothreads);
 
     if (device) {
 #if HAVE_NBD_DEVICE
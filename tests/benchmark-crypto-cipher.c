@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/bswap.h"
 #include "crypto/init.h"
 #include "crypto/cipher.h"
 
@@ -96,6 +97,75 @@ static void test_cipher_speed(size_t chunk_size,
 }
 
 
+/*
+ * Encrypt and decrypt @chunk_size bytes as a sequence of 512 byte sectors,
+ * each with its own plain64 IV, like the LUKS and qcow2 encryption code does
+ */
+static void test_cipher_speed_xts_sectors(size_t chunk_size,
+                                          QCryptoCipherAlgorithm alg)
+{
+    QCryptoCipher *cipher;
+    Error *err = NULL;
+    uint8_t *key = NULL, *buf = NULL;
+    uint8_t iv[16];
+    const size_t sector_size = 512;
+    size_t nkey;
+    const size_t total = 2 * GiB;
+    size_t remain;
+    uint64_t sector;
+    size_t i;
+    int pass;
+
+    if (!qcrypto_cipher_supports(alg, QCRYPTO_CIPHER_MODE_XTS)) {
+        return;
+    }
+
+    g_assert(qcrypto_cipher_get_iv_len(alg, QCRYPTO_CIPHER_MODE_XTS) ==
+             sizeof(iv));
+
+    nkey = qcrypto_cipher_get_key_len(alg) * 2;
+    key = g_new0(uint8_t, nkey);
+    memset(key, g_test_rand_int(), nkey);
+
+    buf = g_new0(uint8_t, chunk_size);
+    memset(buf, g_test_rand_int(), chunk_size);
+
+    cipher = qcrypto_cipher_new(alg, QCRYPTO_CIPHER_MODE_XTS,
+                                key, nkey, &err);
+    g_assert(cipher != NULL);
+
+    for (pass = 0; pass < 2; pass++) {
+        g_test_timer_start();
+        remain = total;
+        sector = 0;
+        while (remain) {
+            for (i = 0; i < chunk_size; i += sector_size, sector++) {
+                memset(iv, 0, sizeof(iv));
+                stq_le_p(iv, sector);
+                g_assert(qcrypto_cipher_setiv(cipher, iv, sizeof(iv),
+                                              &err) == 0);
+                if (pass == 0) {
+                    g_assert(qcrypto_cipher_encrypt(cipher, buf + i, buf + i,
+                                                    sector_size, &err) == 0);
+                } else {
+                    g_assert(qcrypto_cipher_decrypt(cipher, buf + i, buf + i,
+                                                    sector_size, &err) == 0);
+                }
+            }
+            remain -= chunk_size;
+        }
+        g_test_timer_elapsed();
+
+        g_print("%s chunk %zu bytes ", pass == 0 ? "Enc" : "Dec", chunk_size);
+        g_print("%.2f MB/sec ", (double)total / MiB / g_test_timer_last());
+    }
+
+    qcrypto_cipher_free(cipher);
+    g_free(buf);
+    g_free(key);
+}
+
+
 static void test_cipher_speed_ecb_aes_128(const void *opaque)
 {
     size_t chunk_size = (size_t)opaque;
@@ -160,6 +230,18 @@ static void test_cipher_speed_xts_aes_256(const void *opaque)
                       QCRYPTO_CIPHER_ALG_AES_256);
 }
 
+static void test_cipher_speed_xts_sectors_aes_128(const void *opaque)
+{
+    size_t chunk_size = (size_t)opaque;
+    test_cipher_speed_xts_sectors(chunk_size, QCRYPTO_CIPHER_ALG_AES_128);
+}
+
+static void test_cipher_speed_xts_sectors_aes_256(const void *opaque)
+{
+    size_t chunk_size = (size_t)opaque;
+    test_cipher_speed_xts_sectors(chunk_size, QCRYPTO_CIPHER_ALG_AES_256);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -193,6 +275,8 @@ int main(int argc, char **argv)
         ADD_TEST(ctr, aes, 256, chunk);         \
         ADD_TEST(xts, aes, 128, chunk);         \
         ADD_TEST(xts, aes, 256, chunk);         \
+        ADD_TEST(xts_sectors, aes, 128, chunk); \
+        ADD_TEST(xts_sectors, aes, 256, chunk); \
     } while (0)
 
     ADD_TESTS(512);
@@ -0,0 +1,166 @@
+/*
+ * QEMU I/O channel sockets throughput benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/thread.h"
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "io/channel-socket.h"
+#include "socket-helpers.h"
+
+typedef struct QIOChannelBenchOpts {
+    size_t chunk_size;
+    bool zero_copy;
+} QIOChannelBenchOpts;
+
+typedef struct QIOChannelBenchReader {
+    QIOChannel *ioc;
+    size_t total;
+} QIOChannelBenchReader;
+
+static void *bench_reader_thread(void *opaque)
+{
+    QIOChannelBenchReader *reader = opaque;
+    size_t bufsize = 1 * MiB;
+    char *buf = g_malloc(bufsize);
+    size_t remain = reader->total;
+
+    while (remain) {
+        ssize_t ret = qio_channel_read(reader->ioc, buf, MIN(remain, bufsize),
+                                       &error_abort);
+        g_assert(ret > 0);
+        remain -= ret;
+    }
+
+    g_free(buf);
+    return NULL;
+}
+
+static void bench_setup(QIOChannel **src, QIOChannel **dst)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *laddr;
+    QIOChannelSocket *lioc;
+
+    listen_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    listen_addr->u.inet.host = g_strdup("127.0.0.1");
+    listen_addr->u.inet.port = NULL; /* Auto-select */
+
+    lioc = qio_channel_socket_new();
+    qio_channel_socket_listen_sync(lioc, listen_addr, 1, &error_abort);
+    laddr = qio_channel_socket_get_local_address(lioc, &error_abort);
+
+    *src = QIO_CHANNEL(qio_channel_socket_new());
+    qio_channel_socket_connect_sync(QIO_CHANNEL_SOCKET(*src), laddr,
+                                    &error_abort);
+    qio_channel_set_delay(*src, false);
+
+    qio_channel_wait(QIO_CHANNEL(lioc), G_IO_IN);
+    *dst = QIO_CHANNEL(qio_channel_socket_accept(lioc, &error_abort));
+    g_assert(*dst);
+
+    qapi_free_SocketAddress(laddr);
+    qapi_free_SocketAddress(listen_addr);
+    object_unref(OBJECT(lioc));
+}
+
+static void test_io_channel_socket_speed(const void *opaque)
+{
+    const QIOChannelBenchOpts *opts = opaque;
+    QIOChannelBenchReader reader;
+    QemuThread thread;
+    QIOChannel *src, *dst;
+    const size_t total = 2 * GiB;
+    size_t remain;
+    struct iovec iov;
+    uint8_t *buf;
+    int ret;
+
+    bench_setup(&src, &dst);
+    if (opts->zero_copy &&
+        !qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        g_print("(zero copy not supported) ");
+        goto out;
+    }
+
+    buf = qemu_memalign(qemu_real_host_page_size, opts->chunk_size);
+    memset(buf, g_test_rand_int(), opts->chunk_size);
+    iov.iov_base = buf;
+    iov.iov_len = opts->chunk_size;
+
+    reader.ioc = dst;
+    reader.total = total;
+    qemu_thread_create(&thread, "bench-reader", bench_reader_thread, &reader,
+                       QEMU_THREAD_JOINABLE);
+
+    g_test_timer_start();
+    remain = total;
+    while (remain) {
+        /* Like the NBD server, wait for every buffer to be released */
+        if (opts->zero_copy) {
+            ret = qio_channel_writev_zero_copy_all(src, &iov, 1, &error_abort);
+            g_assert(ret == 0);
+            ret = qio_channel_flush(src, &error_abort);
+        } else {
+            ret = qio_channel_writev_all(src, &iov, 1, &error_abort);
+        }
+        g_assert(ret == 0);
+
+        remain -= opts->chunk_size;
+    }
+    qemu_thread_join(&thread);
+    g_test_timer_elapsed();
+
+    g_print("%.2f MB/sec ", (double)total / MiB / g_test_timer_last());
+
+    qemu_vfree(buf);
+out:
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+}
+
+int main(int argc, char **argv)
+{
+    bool has_ipv4, has_ipv6;
+    char name[64];
+
+    module_call_init(MODULE_INIT_QOM);
+    socket_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (socket_check_protocol_support(&has_ipv4, &has_ipv6) < 0) {
+        g_printerr("socket_check_protocol_support() failed\n");
+        return 1;
+    }
+    if (!has_ipv4) {
+        return 0;
+    }
+
+#define TEST_ONE(c, z)                                                  \
+    QIOChannelBenchOpts opts ## c ## z = {                              \
+        .chunk_size = c, .zero_copy = z,                                \
+    };                                                                  \
+    memset(name, 0, sizeof(name));                                      \
+    snprintf(name, sizeof(name),                                        \
+             "/io/channel/socket/benchmark/%s/bufsize-%d",              \
+             z ? "zero-copy" : "copy", c);                              \
+    g_test_add_data_func(name, &opts ## c ## z,                         \
+                         test_io_channel_socket_speed);
+
+    TEST_ONE(65536, false);
+    TEST_ONE(65536, true);
+    TEST_ONE(262144, false);
+    TEST_ONE(262144, true);
+    TEST_ONE(1048576, false);
+    TEST_ONE(1048576, true);
+    TEST_ONE(4194304, false);
+    TEST_ONE(4194304, true);
+
+    return g_test_run();
+}
@@ -0,0 +1,132 @@
+/*
+ * Xor Based Zero Run Length Encoding benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define NR_PAGES 1024
+
+typedef struct XBZRLEBenchPattern {
+    const char *name;
+    /* runs of @run_len changed bytes, at random offsets */
+    int runs;
+    int run_len;
+} XBZRLEBenchPattern;
+
+/*
+ * Roughly what a page looks like when it gets dirtied again: a few
+ * counters or pointers updated, some scattered byte flags, a buffer
+ * partly rewritten, or a page rewritten almost completely.
+ */
+static const XBZRLEBenchPattern patterns[] = {
+    { "unchanged", 0, 0 },
+    { "words-8", 8, 8 },
+    { "bytes-64", 64, 1 },
+    { "block-512", 1, 512 },
+    { "words-128", 128, 8 },
+    { "block-2048", 1, 2048 },
+};
+
+static void bench_fill(const XBZRLEBenchPattern *pattern,
+                       uint8_t *old_buf, uint8_t *new_buf)
+{
+    int i, j;
+
+    for (i = 0; i < NR_PAGES * PAGE_SIZE; i += sizeof(uint32_t)) {
+        *(uint32_t *)(old_buf + i) = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, NR_PAGES * PAGE_SIZE);
+
+    for (i = 0; i < NR_PAGES; i++) {
+        uint8_t *page = new_buf + i * PAGE_SIZE;
+
+        for (j = 0; j < pattern->runs; j++) {
+            int offset = g_test_rand_int_range(0, PAGE_SIZE -
+                                                  pattern->run_len + 1);
+            int k;
+
+            /* Keep the offsets of changed words aligned, like in memory */
+            if (pattern->run_len == 8) {
+                offset &= ~7;
+            }
+            for (k = offset; k < offset + pattern->run_len; k++) {
+                page[k] = ~page[k];
+            }
+        }
+    }
+}
+
+static void test_xbzrle_speed(const void *opaque)
+{
+    const XBZRLEBenchPattern *pattern = opaque;
+    const size_t total = 1 * GiB;
+    uint8_t *old_buf = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *encoded = g_malloc(NR_PAGES * PAGE_SIZE);
+    int *encoded_len = g_new(int, NR_PAGES);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    size_t done, encoded_total = 0;
+    int i;
+
+    bench_fill(pattern, old_buf, new_buf);
+
+    do {
+        g_test_timer_start();
+        encoded_total = 0;
+        for (done = 0; done < total; done += NR_PAGES * PAGE_SIZE) {
+            for (i = 0; i < NR_PAGES; i++) {
+                encoded_len[i] =
+                    xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                         new_buf + i * PAGE_SIZE, PAGE_SIZE,
+                                         encoded + i * PAGE_SIZE, PAGE_SIZE);
+                encoded_total += MAX(encoded_len[i], 0);
+            }
+        }
+        g_test_timer_elapsed();
+
+        g_print("%s encode %.2f MB/sec ", test_xbzrle_encode_accel_name(),
+                (double)total / MiB / g_test_timer_last());
+    } while (test_xbzrle_encode_next_accel());
+
+    g_test_timer_start();
+    for (done = 0; done < total; done += NR_PAGES * PAGE_SIZE) {
+        for (i = 0; i < NR_PAGES; i++) {
+            if (encoded_len[i] > 0) {
+                xbzrle_decode_buffer(encoded + i * PAGE_SIZE, encoded_len[i],
+                                     decoded, PAGE_SIZE);
+            }
+        }
+    }
+    g_test_timer_elapsed();
+
+    g_print("decode %.2f MB/sec ratio %.1f ",
+            (double)total / MiB / g_test_timer_last(),
+            encoded_total ? (double)total / encoded_total : 0);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(encoded);
+    g_free(encoded_len);
+    g_free(decoded);
+}
+
+int main(int argc, char **argv)
+{
+    char name[64];
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+        snprintf(name, sizeof(name), "/xbzrle/benchmark/%s",
+                 patterns[i].name);
+        g_test_add_data_func(name, &patterns[i], test_xbzrle_speed);
+    }
+
+    return g_test_run();
+}
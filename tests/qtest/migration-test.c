@@ -15,6 +15,7 @@
 #include "libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -356,6 +357,19 @@ static void migrate_set_parameter_int(QTestState *who, const char *parameter,
     migrate_check_parameter_int(who, parameter, value);
 }
 
+static void migrate_set_parameter_bool(QTestState *who, const char *parameter,
+                                       bool value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-parameters',"
+                    "'arguments': { %s: %i } }",
+                    parameter, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+}
+
 static char *migrate_get_parameter_str(QTestState *who,
                                        const char *parameter)
 {
@@ -465,6 +479,10 @@ typedef struct {
     bool use_shmem;
     /* only launch the target process */
     bool only_target;
+    /* send requested postcopy pages on their own channel */
+    bool postcopy_preempt;
+    /* keep sending the background pages over multifd in postcopy */
+    bool postcopy_multifd;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -703,6 +721,7 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    bool postcopy_preempt = args->postcopy_preempt;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, args)) {
@@ -712,6 +731,16 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(from, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+    if (args->postcopy_multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+    }
 
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
@@ -760,6 +789,32 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_multifd(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_multifd = true;
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -823,6 +878,48 @@ static void test_postcopy_recovery(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_recovery_multifd(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    char *uri;
+
+    args->hide_stderr = true;
+    args->postcopy_multifd = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "max-postcopy-bandwidth", 4096);
+    migrate_postcopy_start(from, to);
+    wait_for_migration_status(from, "postcopy-active", NULL);
+
+    migrate_pause(from);
+    wait_for_migration_status(to, "postcopy-paused",
+                              (const char * []) { "failed", "active",
+                                                  "completed", NULL });
+
+    /* The multifd channels can't be rebuilt, so recovery is refused */
+    uri = g_strdup_printf("unix:%s/migsocket-recover", tmpfs);
+    rsp = qtest_qmp(to, "{ 'execute': 'migrate-recover', "
+                    "  'arguments': { 'uri': %s } }", uri);
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    wait_for_migration_status(from, "postcopy-paused",
+                              (const char * []) { "failed", "active",
+                                                  "completed", NULL });
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate', "
+                    "  'arguments': { 'uri': %s, 'resume': true } }", uri);
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+    g_free(uri);
+
+    test_migrate_end(from, to, false);
+}
+
 static void test_baddest(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -880,6 +977,107 @@ static void test_precopy_unix(void)
     g_free(uri);
 }
 
+/*
+ * Split the guest RAM in many small chunks so that the dirty bitmap is
+ * synced by several threads at once, and check that no page is lost.
+ */
+static void test_precopy_dirty_sync_threads(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    g_free(args->opts_source);
+    args->opts_source =
+        g_strdup("-global migration.x-dirty-sync-threads=4 "
+                 "-global migration.x-dirty-sync-chunk-shift=10 "
+                 "-global migration.x-clear-bitmap-shift=10");
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* Go through a few syncs while the guest keeps dirtying memory */
+    wait_for_migration_pass(from);
+    wait_for_migration_pass(from);
+
+    /* 300 ms should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_precopy_load_times(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    QList *list;
+    QObject *e;
+    bool found_ram = false;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    rsp = qtest_qmp(to, "{ 'execute': 'query-vmstate-load-times' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    list = qdict_get_qlist(rsp, "return");
+    g_assert(list);
+    while ((e = qlist_pop(list))) {
+        QDict *entry = qobject_to(QDict, e);
+
+        g_assert_cmpint(qdict_get_int(entry, "sections"), >, 0);
+        g_assert_cmpint(qdict_get_int(entry, "load-time"), >=, 0);
+        if (!strcmp(qdict_get_str(entry, "id"), "ram")) {
+            found_ram = true;
+        }
+        qobject_unref(e);
+    }
+    g_assert(found_ram);
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 #if 0
 /* Currently upset on aarch64 TCG */
 static void test_ignore_shared(void)
@@ -1175,7 +1373,7 @@ static void test_validate_uuid_dst_not_set(void)
     do_test_validate_uuid(args, false);
 }
 
-static void test_migrate_auto_converge(void)
+static void do_test_migrate_auto_converge(bool per_vcpu)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     MigrateStart *args = migrate_start_new();
@@ -1205,6 +1403,7 @@ static void test_migrate_auto_converge(void)
     migrate_set_parameter_int(from, "cpu-throttle-initial", init_pct);
     migrate_set_parameter_int(from, "cpu-throttle-increment", inc_pct);
     migrate_set_parameter_int(from, "max-cpu-throttle", max_pct);
+    migrate_set_parameter_bool(from, "cpu-throttle-per-vcpu", per_vcpu);
 
     /*
      * Set the initial parameters so that the migration could not converge
@@ -1260,13 +1459,72 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+static void test_migrate_auto_converge(void)
+{
+    do_test_migrate_auto_converge(false);
+}
+
+static void test_migrate_auto_converge_per_vcpu(void)
+{
+    do_test_migrate_auto_converge(true);
+}
+
+static void test_dirty_rate(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp, *info;
+    const char *status;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    rsp = wait_command(from, "{ 'execute': 'query-dirty-rate' }");
+    g_assert_cmpstr(qdict_get_str(rsp, "status"), ==, "unstarted");
+    qobject_unref(rsp);
+
+    /* Wait for the guest to start dirtying its memory */
+    wait_for_serial("src_serial");
+
+    rsp = wait_command(from, "{ 'execute': 'calc-dirty-rate',"
+                             "  'arguments': { 'calc-time': 1 }}");
+    qobject_unref(rsp);
+
+    do {
+        g_usleep(100 * 1000);
+        info = wait_command(from, "{ 'execute': 'query-dirty-rate' }");
+        status = qdict_get_str(info, "status");
+        if (strcmp(status, "measured")) {
+            g_assert_cmpstr(status, ==, "measuring");
+            qobject_unref(info);
+            info = NULL;
+        }
+    } while (!info);
+
+    g_assert_cmpint(qdict_get_int(info, "calc-time"), ==, 1);
+    /* The guest keeps incrementing a byte in each page of 100MB */
+    g_assert_cmpint(qdict_get_int(info, "dirty-pages-rate"), >, 0);
+    g_assert(qdict_haskey(info, "ramblocks"));
+    qobject_unref(info);
+
+    test_migrate_end(from, to, false);
+}
+
+static void test_multifd_tcp(const char *method, bool zero_pages)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
     QDict *rsp;
     char *uri;
 
+    if (!zero_pages) {
+        /* Check zero pages in the migration thread like 5.0 did */
+        g_free(args->opts_source);
+        args->opts_source =
+            g_strdup("-global migration.multifd-zero-pages=off");
+    }
+
     if (test_migrate_start(&from, &to, "defer", args)) {
         return;
     }
@@ -1318,20 +1576,121 @@ static void test_multifd_tcp(const char *method)
     g_free(uri);
 }
 
+static void test_precopy_file_fixed_ram(bool multifd)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "fixed-ram", "true");
+    migrate_set_capability(to, "fixed-ram", "true");
+    if (multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", "true");
+        migrate_set_capability(to, "multifd", "true");
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    /* Save the guest to the file, then restore it from there */
+    migrate_qmp(from, uri, "{}");
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+    g_free(uri);
+}
+
+static void test_precopy_file_fixed_ram_single(void)
+{
+    test_precopy_file_fixed_ram(false);
+}
+
+static void test_precopy_file_fixed_ram_multifd(void)
+{
+    test_precopy_file_fixed_ram(true);
+}
+
+static void test_background_snapshot(void)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                    "'arguments': { 'capabilities': [ {"
+                    "'capability': 'background-snapshot',"
+                    "'state': true } ] } }");
+    if (qdict_haskey(rsp, "error")) {
+        /* The host kernel can't write-protect memory with userfaultfd */
+        qobject_unref(rsp);
+        test_migrate_end(from, to, false);
+        g_free(uri);
+        return;
+    }
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    /*
+     * The guest keeps writing to its memory during the snapshot, the
+     * checks of the destination RAM catch any page saved too late.
+     */
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+    g_free(uri);
+}
+
 static void test_multifd_tcp_none(void)
 {
-    test_multifd_tcp("none");
+    test_multifd_tcp("none", true);
+}
+
+static void test_multifd_tcp_none_legacy_zero(void)
+{
+    test_multifd_tcp("none", false);
 }
 
 static void test_multifd_tcp_zlib(void)
 {
-    test_multifd_tcp("zlib");
+    test_multifd_tcp("zlib", true);
 }
 
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
-    test_multifd_tcp("zstd");
+    test_multifd_tcp("zstd", true);
 }
 #endif
 
@@ -1480,11 +1839,24 @@ int main(int argc, char **argv)
     module_call_init(MODULE_INIT_QOM);
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/multifd", test_postcopy_multifd);
+    qtest_add_func("/migration/postcopy/multifd/recovery",
+                   test_postcopy_recovery_multifd);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
+    qtest_add_func("/migration/precopy/unix/dirty-sync-threads",
+                   test_precopy_dirty_sync_threads);
+    qtest_add_func("/migration/precopy/unix/load-times",
+                   test_precopy_load_times);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/precopy/file/fixed-ram",
+                   test_precopy_file_fixed_ram_single);
+    qtest_add_func("/migration/precopy/file/fixed-ram/multifd",
+                   test_precopy_file_fixed_ram_multifd);
+    qtest_add_func("/migration/background-snapshot", test_background_snapshot);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
@@ -1496,7 +1868,12 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
+    qtest_add_func("/migration/auto_converge/per_vcpu",
+                   test_migrate_auto_converge_per_vcpu);
+    qtest_add_func("/migration/dirty_rate", test_dirty_rate);
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/none/legacy-zero",
+                   test_multifd_tcp_none_legacy_zero);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
 #ifdef CONFIG_ZSTD
@@ -398,6 +398,44 @@ static void test_hbitmap_reset_all(TestHBitmapData *data,
     hbitmap_test_reset_all(data);
 }
 
+/*
+ * The last level is allocated in pages of L3 / 8 bits; make sure that pages
+ * are allocated and freed correctly when setting and resetting ranges that
+ * cross page boundaries.
+ */
+static void test_hbitmap_sparse(TestHBitmapData *data,
+                                const void *unused)
+{
+    HBitmap *other;
+
+    hbitmap_test_init(data, L3 * 4, 0);
+    hbitmap_test_set(data, L3 / 8 - 1, 2);
+    hbitmap_test_set(data, L3 * 3 + 5, L1);
+    hbitmap_test_reset(data, L3 / 8 - 1, 1);
+    hbitmap_test_reset(data, L3 / 8, 1);
+    hbitmap_test_set(data, L3, L3 + L2);
+    hbitmap_test_reset(data, L3 + L1, L3);
+    hbitmap_test_check(data, 0);
+    g_assert_cmpint(hbitmap_next_dirty(data->hb, 0, data->size), ==, L3);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3, data->size - L3), ==,
+                    L3 + L1);
+
+    /* Merging with an empty bitmap must not change anything */
+    other = hbitmap_alloc(L3 * 4, 0);
+    g_assert(hbitmap_merge(data->hb, other, data->hb));
+    hbitmap_test_check(data, 0);
+
+    /* ... and merging into it must copy everything */
+    g_assert(hbitmap_merge(data->hb, other, other));
+    g_assert_cmpint(hbitmap_count(other), ==, hbitmap_count(data->hb));
+    g_assert_cmpint(hbitmap_next_dirty(other, L3 * 2, L3 * 2), ==, L3 * 3 + 5);
+    hbitmap_free(other);
+
+    hbitmap_test_reset(data, 0, data->size);
+    hbitmap_test_check(data, 0);
+    g_assert(hbitmap_empty(data->hb));
+}
+
 static void test_hbitmap_granularity(TestHBitmapData *data,
                                      const void *unused)
 {
@@ -1061,6 +1099,7 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
+    hbitmap_test_add("/hbitmap/sparse", test_hbitmap_sparse);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
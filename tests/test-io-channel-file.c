@@ -92,6 +92,52 @@ static void test_io_channel_fd(void)
 }
 
 
+static void test_io_channel_file_positioned(void)
+{
+    QIOChannel *src, *dst;
+    char wbuf[] = "0123456789";
+    char rbuf[10];
+    ssize_t ret;
+
+    unlink(TEST_FILE);
+    src = QIO_CHANNEL(qio_channel_file_new_path(
+                          TEST_FILE,
+                          O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, TEST_MASK,
+                          &error_abort));
+    if (!qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        g_test_skip("positioned I/O is not supported");
+        goto out;
+    }
+    dst = QIO_CHANNEL(qio_channel_file_new_path(
+                          TEST_FILE,
+                          O_RDONLY | O_BINARY, 0,
+                          &error_abort));
+
+    /* Write the second half first, leaving a hole */
+    ret = qio_channel_pwrite(src, wbuf + 5, 5, 4096 + 5, &error_abort);
+    g_assert_cmpint(ret, ==, 5);
+    ret = qio_channel_pwrite(src, wbuf, 5, 4096, &error_abort);
+    g_assert_cmpint(ret, ==, 5);
+
+    /* Positioned writes do not move the stream position */
+    ret = qio_channel_write(src, "x", 1, &error_abort);
+    g_assert_cmpint(ret, ==, 1);
+
+    ret = qio_channel_pread(dst, rbuf, sizeof(rbuf), 4096, &error_abort);
+    g_assert_cmpint(ret, ==, sizeof(rbuf));
+    g_assert(memcmp(rbuf, wbuf, sizeof(rbuf)) == 0);
+
+    ret = qio_channel_pread(dst, rbuf, 2, 0, &error_abort);
+    g_assert_cmpint(ret, ==, 2);
+    g_assert(rbuf[0] == 'x' && rbuf[1] == 0);
+
+    object_unref(OBJECT(dst));
+out:
+    unlink(TEST_FILE);
+    object_unref(OBJECT(src));
+}
+
+
 #ifndef _WIN32
 static void test_io_channel_pipe(bool async)
 {
@@ -137,6 +183,8 @@ int main(int argc, char **argv)
     g_test_add_func("/io/channel/file", test_io_channel_file);
     g_test_add_func("/io/channel/file/rdwr", test_io_channel_file_rdwr);
     g_test_add_func("/io/channel/file/fd", test_io_channel_fd);
+    g_test_add_func("/io/channel/file/positioned",
+                    test_io_channel_file_positioned);
 #ifndef _WIN32
     g_test_add_func("/io/channel/pipe/sync", test_io_channel_pipe_sync);
     g_test_add_func("/io/channel/pipe/async", test_io_channel_pipe_async);
@@ -169,9 +169,101 @@ static void test_encode_decode(void)
 {
     int i;
 
-    for (i = 0; i < 10000; i++) {
-        encode_decode_range();
+    do {
+        for (i = 0; i < 10000; i++) {
+            encode_decode_range();
+        }
+    } while (test_xbzrle_encode_next_accel());
+}
+
+/* Byte at a time reference encoder, for the vectorized ones */
+static int encode_reference(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                            uint8_t *dst, int dlen)
+{
+    int d = 0, i = 0, start;
+
+    while (i < slen) {
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        for (start = i; i < slen && old_buf[i] == new_buf[i]; i++) {
+            /* zrun */
+        }
+        if (i - start == slen) {
+            return 0;
+        }
+        if (i == slen) {
+            return d;
+        }
+        d += uleb128_encode_small(dst + d, i - start);
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        for (start = i; i < slen && old_buf[i] != new_buf[i]; i++) {
+            /* nzrun */
+        }
+        d += uleb128_encode_small(dst + d, i - start);
+        if (d + i - start > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, i - start);
+        d += i - start;
+    }
+
+    return d;
+}
+
+static void encode_accel_random(void)
+{
+    uint8_t *buffer = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    int runs = g_test_rand_int_range(0, 256);
+    int max_len = g_test_rand_int_range(1, 128);
+    int dlen = g_test_rand_int_range(PAGE_SIZE / 8, PAGE_SIZE + 1);
+    int i, j, rc, expected_rc;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        buffer[i] = g_test_rand_int();
+    }
+    memcpy(test, buffer, PAGE_SIZE);
+
+    for (i = 0; i < runs; i++) {
+        int offset = g_test_rand_int_range(0, PAGE_SIZE);
+        int len = g_test_rand_int_range(1, max_len + 1);
+
+        for (j = offset; j < MIN(offset + len, PAGE_SIZE); j++) {
+            test[j] = buffer[j] + g_test_rand_int_range(1, 256);
+        }
     }
+
+    expected_rc = encode_reference(buffer, test, PAGE_SIZE, expected, dlen);
+    rc = xbzrle_encode_buffer(buffer, test, PAGE_SIZE, compressed, dlen);
+    g_assert_cmpint(rc, ==, expected_rc);
+    if (rc > 0) {
+        g_assert(memcmp(compressed, expected, rc) == 0);
+
+        rc = xbzrle_decode_buffer(compressed, rc, buffer, PAGE_SIZE);
+        g_assert(rc <= PAGE_SIZE);
+        g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+    }
+
+    g_free(buffer);
+    g_free(test);
+    g_free(compressed);
+    g_free(expected);
+}
+
+static void test_encode_accel(void)
+{
+    int i;
+
+    do {
+        for (i = 0; i < 10000; i++) {
+            encode_accel_random();
+        }
+    } while (test_xbzrle_encode_next_accel());
 }
 
 int main(int argc, char **argv)
@@ -186,6 +278,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -50,8 +50,18 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level is by far the largest one (all others together only take
+ * about 1/(B-1) of its size), so it is split into pages that are only
+ * allocated when a bit in them gets set, and freed again when they become
+ * empty.  This keeps the memory used by large, sparsely dirtied bitmaps
+ * proportional to the dirty areas rather than to the size of the disk.
  */
 
+/* Words per page of the last level (4 KiB on 64-bit hosts) */
+#define HBITMAP_PAGE_SHIFT      9
+#define HBITMAP_PAGE_WORDS      (1UL << HBITMAP_PAGE_SHIFT)
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -93,14 +103,101 @@ struct HBitmap {
      * actual bitmap.
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
-     * bitmap will still allocate HBITMAP_LEVELS arrays.
+     * bitmap will still allocate HBITMAP_LEVELS - 1 arrays.  The last level
+     * is stored in @pages instead, so levels[HBITMAP_LEVELS - 1] is NULL.
      */
     unsigned long *levels[HBITMAP_LEVELS];
 
-    /* The length of each levels[] array. */
+    /* The length of each levels[] array (in words, also for the last level) */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /* Pages of HBITMAP_PAGE_WORDS words of the last level; NULL means zero */
+    unsigned long **pages;
+    uint64_t nb_pages;
 };
 
+static const unsigned long hb_zero_page[HBITMAP_PAGE_WORDS];
+
+static inline uint64_t hb_nb_pages(uint64_t words)
+{
+    return DIV_ROUND_UP(words, HBITMAP_PAGE_WORDS);
+}
+
+static inline unsigned long hb_word(const HBitmap *hb, int level, uint64_t pos)
+{
+    const unsigned long *page;
+
+    if (level < HBITMAP_LEVELS - 1) {
+        return hb->levels[level][pos];
+    }
+
+    page = hb->pages[pos >> HBITMAP_PAGE_SHIFT];
+    return page ? page[pos & (HBITMAP_PAGE_WORDS - 1)] : 0;
+}
+
+/*
+ * Return a pointer to a word in the bitmap.  If the word is in a page of the
+ * last level that isn't allocated yet, either allocate the page or return
+ * NULL, depending on @alloc.
+ */
+static inline unsigned long *hb_word_ptr(HBitmap *hb, int level, uint64_t pos,
+                                         bool alloc)
+{
+    unsigned long **page;
+
+    if (level < HBITMAP_LEVELS - 1) {
+        return &hb->levels[level][pos];
+    }
+
+    page = &hb->pages[pos >> HBITMAP_PAGE_SHIFT];
+    if (!*page) {
+        if (!alloc) {
+            return NULL;
+        }
+        *page = g_new0(unsigned long, HBITMAP_PAGE_WORDS);
+    }
+    return &(*page)[pos & (HBITMAP_PAGE_WORDS - 1)];
+}
+
+/*
+ * Free the pages between @first and @last (inclusive) that contain only
+ * zeroes.  The levels above the last one must be up to date.
+ */
+static void hb_free_empty_pages(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    /* Each bit in the 2nd-last level tells whether a word is nonzero */
+    const unsigned long *upper = hb->levels[HBITMAP_LEVELS - 2];
+    const uint64_t upper_words = HBITMAP_PAGE_WORDS >> BITS_PER_LEVEL;
+    uint64_t p, i, end;
+
+    for (p = first; p <= last; p++) {
+        if (!hb->pages[p]) {
+            continue;
+        }
+
+        end = MIN((p + 1) * upper_words, hb->sizes[HBITMAP_LEVELS - 2]);
+        for (i = p * upper_words; i < end; i++) {
+            if (upper[i]) {
+                break;
+            }
+        }
+        if (i == end) {
+            g_free(hb->pages[p]);
+            hb->pages[p] = NULL;
+        }
+    }
+}
+
+static void hb_free_pages(HBitmap *hb)
+{
+    uint64_t p;
+
+    for (p = 0; p < hb->nb_pages; p++) {
+        g_free(hb->pages[p]);
+        hb->pages[p] = NULL;
+    }
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -136,7 +233,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +246,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_word(hbi->hb, HBITMAP_LEVELS - 1, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +279,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -220,8 +317,7 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -241,19 +337,21 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
      * in them, let's set them.
      */
     start_bit_offset = (start >> hb->granularity) & (BITS_PER_LONG - 1);
-    cur |= (1UL << start_bit_offset) - 1;
     assert((start >> hb->granularity) < hb->size);
+    cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
+    cur |= (1UL << start_bit_offset) - 1;
 
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        } while (pos < sz &&
+                 hb_word(hb, HBITMAP_LEVELS - 1, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -406,18 +504,22 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_elem(hb_word_ptr(hb, level, i, true),
+                               start, next - 1);
         for (;;) {
+            unsigned long *elem;
+
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            elem = hb_word_ptr(hb, level, i, true);
+            changed |= (*elem == 0);
+            *elem = ~0UL;
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(hb_word_ptr(hb, level, i, true), start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -464,6 +566,11 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
     assert((last >> BITS_PER_LEVEL) == (start >> BITS_PER_LEVEL));
     assert(start <= last);
 
+    /* Unallocated pages contain only zeroes */
+    if (!elem) {
+        return false;
+    }
+
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
     blanked = *elem != 0 && ((*elem & ~mask) == 0);
@@ -490,25 +597,30 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_elem(hb_word_ptr(hb, level, i, false), start, next - 1)) {
             changed = true;
         } else {
             pos++;
         }
 
         for (;;) {
+            unsigned long *elem;
+
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            elem = hb_word_ptr(hb, level, i, false);
+            if (elem) {
+                changed |= (*elem != 0);
+                *elem = 0UL;
+            }
         }
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_elem(hb_word_ptr(hb, level, i, false), start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -544,9 +656,12 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     assert(last < hb->size);
 
     hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
-        hbitmap_set(hb->meta, start, count);
+    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last)) {
+        hb_free_empty_pages(hb, (first >> BITS_PER_LEVEL) >> HBITMAP_PAGE_SHIFT,
+                            (last >> BITS_PER_LEVEL) >> HBITMAP_PAGE_SHIFT);
+        if (hb->meta) {
+            hbitmap_set(hb->meta, start, count);
+        }
     }
 }
 
@@ -555,7 +670,8 @@ void hbitmap_reset_all(HBitmap *hb)
     unsigned int i;
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    hb_free_pages(hb);
+    for (i = HBITMAP_LEVELS - 1; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -588,7 +704,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_word(hb, HBITMAP_LEVELS - 1, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -605,7 +721,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -619,7 +735,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -627,12 +743,12 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t first;
 
     if (!count) {
         return 0;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &first, &el_count);
 
     return el_count * sizeof(unsigned long);
 }
@@ -641,21 +757,19 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t first, i;
 
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
+    serialization_chunk(hb, start, count, &first, &el_count);
 
-    while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+    for (i = first; i < first + el_count; i++) {
+        unsigned long el = hb_word(hb, HBITMAP_LEVELS - 1, i);
 
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
-        cur++;
     }
 }
 
@@ -664,25 +778,25 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t first, i;
 
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
+    serialization_chunk(hb, start, count, &first, &el_count);
 
-    while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+    for (i = first; i < first + el_count; i++) {
+        unsigned long el, *cur;
 
-        if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
-        } else {
-            le64_to_cpus((uint64_t *)cur);
-        }
+        memcpy(&el, buf, sizeof(el));
+        el = (BITS_PER_LONG == 32 ? le32_to_cpu(el) : le64_to_cpu(el));
+        buf += sizeof(el);
 
-        buf += sizeof(unsigned long);
-        cur++;
+        /* Don't allocate pages just to store zeroes in them */
+        cur = hb_word_ptr(hb, HBITMAP_LEVELS - 1, i, el != 0);
+        if (cur) {
+            *cur = el;
+        }
     }
     if (finish) {
         hbitmap_deserialize_finish(hb);
@@ -693,14 +807,21 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, i;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    /* Pages that become empty are freed by hbitmap_deserialize_finish() */
+    for (i = first; i < first + el_count; i++) {
+        unsigned long *cur = hb_word_ptr(hb, HBITMAP_LEVELS - 1, i, false);
+
+        if (cur) {
+            *cur = 0;
+        }
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -710,14 +831,16 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, i;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    for (i = first; i < first + el_count; i++) {
+        *hb_word_ptr(hb, HBITMAP_LEVELS - 1, i, true) = ~0UL;
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -737,7 +860,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (hb_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -745,6 +868,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb_free_empty_pages(bitmap, 0, bitmap->nb_pages - 1);
     bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
 }
 
@@ -755,6 +879,8 @@ void hbitmap_free(HBitmap *hb)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
+    hb_free_pages(hb);
+    g_free(hb->pages);
     g_free(hb);
 }
 
@@ -775,7 +901,12 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        if (i == HBITMAP_LEVELS - 1) {
+            hb->nb_pages = hb_nb_pages(size);
+            hb->pages = g_new0(unsigned long *, hb->nb_pages);
+        } else {
+            hb->levels[i] = g_new0(unsigned long, size);
+        }
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -787,6 +918,24 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     return hb;
 }
 
+/*
+ * Words beyond the end of the bitmap are always zero (hbitmap_truncate()
+ * clears them before shrinking), so pages can be kept or dropped as a whole.
+ */
+static void hb_truncate_pages(HBitmap *hb, uint64_t nb_pages)
+{
+    uint64_t p;
+
+    for (p = nb_pages; p < hb->nb_pages; p++) {
+        g_free(hb->pages[p]);
+    }
+    hb->pages = g_renew(unsigned long *, hb->pages, nb_pages);
+    for (p = hb->nb_pages; p < nb_pages; p++) {
+        hb->pages[p] = NULL;
+    }
+    hb->nb_pages = nb_pages;
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
@@ -829,6 +978,10 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HBITMAP_LEVELS - 1) {
+            hb_truncate_pages(hb, hb_nb_pages(size));
+            continue;
+        }
         hb->levels[i] = g_realloc(hb->levels[i], size * sizeof(unsigned long));
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -864,6 +1017,33 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/* Last level part of hbitmap_merge() for bitmaps of the same granularity */
+static void hbitmap_merge_pages(const HBitmap *a, const HBitmap *b,
+                                HBitmap *result)
+{
+    uint64_t p, j;
+
+    for (p = 0; p < a->nb_pages; p++) {
+        const unsigned long *pa = a->pages[p];
+        const unsigned long *pb = b->pages[p];
+        unsigned long *dst;
+
+        if (!pa && !pb) {
+            g_free(result->pages[p]);
+            result->pages[p] = NULL;
+            continue;
+        }
+
+        dst = result->pages[p];
+        if (!dst) {
+            dst = result->pages[p] = g_new0(unsigned long, HBITMAP_PAGE_WORDS);
+        }
+        for (j = 0; j < HBITMAP_PAGE_WORDS; j++) {
+            dst[j] = (pa ? pa[j] : 0) | (pb ? pb[j] : 0);
+        }
+    }
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -910,11 +1090,12 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
+    hbitmap_merge_pages(a, b, result);
 
     /* Recompute the dirty count */
     result->count = hb_count_between(result, 0, result->size - 1);
@@ -924,10 +1105,21 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    uint64_t words = bitmap->sizes[HBITMAP_LEVELS - 1];
+    struct iovec *iov = g_new(struct iovec, bitmap->nb_pages);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+    uint64_t p;
+
+    /* Hash the last level as if it was stored in a single array */
+    for (p = 0; p < bitmap->nb_pages; p++) {
+        iov[p].iov_base = bitmap->pages[p] ? bitmap->pages[p]
+                                           : (void *)hb_zero_page;
+        iov[p].iov_len = MIN(words - p * HBITMAP_PAGE_WORDS,
+                             HBITMAP_PAGE_WORDS) * sizeof(unsigned long);
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, bitmap->nb_pages,
+                         &hash, errp);
+    g_free(iov);
 
     return hash;
 }
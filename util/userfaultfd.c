@@ -0,0 +1,177 @@
+/*
+ * Linux userfaultfd helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/userfaultfd.h"
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+static int uffd_open(int flags)
+{
+#ifdef __NR_userfaultfd
+    return syscall(__NR_userfaultfd, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int uffd_query_features(uint64_t *features)
+{
+    struct uffdio_api api_struct = { 0 };
+    int uffd_fd;
+    int ret = -1;
+
+    uffd_fd = uffd_open(O_CLOEXEC);
+    if (uffd_fd < 0) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    /* Ask for the supported features, without enabling any */
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(uffd_fd, UFFDIO_API, &api_struct)) {
+        error_report("%s: UFFDIO_API failed: %s", __func__, strerror(errno));
+        goto out;
+    }
+    *features = api_struct.features;
+    ret = 0;
+
+out:
+    close(uffd_fd);
+    return ret;
+}
+
+int uffd_create_fd(uint64_t features, bool non_blocking)
+{
+    struct uffdio_api api_struct = { 0 };
+    uint64_t ioctl_mask = BIT(_UFFDIO_REGISTER) | BIT(_UFFDIO_UNREGISTER);
+    int uffd_fd;
+
+    uffd_fd = uffd_open(O_CLOEXEC | (non_blocking ? O_NONBLOCK : 0));
+    if (uffd_fd < 0) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    /* UFFDIO_API can only be used once on each file descriptor */
+    api_struct.api = UFFD_API;
+    api_struct.features = features;
+    if (ioctl(uffd_fd, UFFDIO_API, &api_struct)) {
+        error_report("%s: UFFDIO_API failed, features %" PRIx64 ": %s",
+                     __func__, features, strerror(errno));
+        goto fail;
+    }
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        error_report("%s: missing userfault ioctls: %" PRIx64, __func__,
+                     (uint64_t)(~api_struct.ioctls & ioctl_mask));
+        goto fail;
+    }
+
+    return uffd_fd;
+
+fail:
+    close(uffd_fd);
+    return -1;
+}
+
+void uffd_close_fd(int uffd_fd)
+{
+    assert(uffd_fd >= 0);
+    close(uffd_fd);
+}
+
+int uffd_register_memory(int uffd_fd, void *addr, uint64_t length,
+                         uint64_t mode, uint64_t *ioctls)
+{
+    struct uffdio_register uffd_register;
+
+    uffd_register.range.start = (uintptr_t)addr;
+    uffd_register.range.len = length;
+    uffd_register.mode = mode;
+
+    if (ioctl(uffd_fd, UFFDIO_REGISTER, &uffd_register)) {
+        error_report("%s: UFFDIO_REGISTER failed: addr=%p len=%" PRIu64
+                     " mode=%" PRIx64 ": %s", __func__, addr, length, mode,
+                     strerror(errno));
+        return -1;
+    }
+    if (ioctls) {
+        *ioctls = uffd_register.ioctls;
+    }
+
+    return 0;
+}
+
+int uffd_unregister_memory(int uffd_fd, void *addr, uint64_t length)
+{
+    struct uffdio_range uffd_range;
+
+    uffd_range.start = (uintptr_t)addr;
+    uffd_range.len = length;
+
+    if (ioctl(uffd_fd, UFFDIO_UNREGISTER, &uffd_range)) {
+        error_report("%s: UFFDIO_UNREGISTER failed: addr=%p len=%" PRIu64
+                     ": %s", __func__, addr, length, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int uffd_change_protection(int uffd_fd, void *addr, uint64_t length,
+                           bool wp, bool dont_wake)
+{
+    struct uffdio_writeprotect uffd_writeprotect;
+
+    uffd_writeprotect.range.start = (uintptr_t)addr;
+    uffd_writeprotect.range.len = length;
+    if (!wp && dont_wake) {
+        /* DONTWAKE is meaningful only on protection release */
+        uffd_writeprotect.mode = UFFDIO_WRITEPROTECT_MODE_DONTWAKE;
+    } else {
+        uffd_writeprotect.mode = (wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0);
+    }
+
+    if (ioctl(uffd_fd, UFFDIO_WRITEPROTECT, &uffd_writeprotect)) {
+        error_report("%s: UFFDIO_WRITEPROTECT failed: addr=%p len=%" PRIu64
+                     " wp=%d: %s", __func__, addr, length, wp,
+                     strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int uffd_read_events(int uffd_fd, struct uffd_msg *msgs, int count)
+{
+    size_t size = sizeof(struct uffd_msg) * count;
+    ssize_t res;
+
+    do {
+        res = read(uffd_fd, msgs, size);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0) {
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        error_report("%s: read() failed: %s", __func__, strerror(errno));
+        return -1;
+    }
+    if (res % sizeof(struct uffd_msg)) {
+        error_report("%s: read() returned a partial event: %zd",
+                     __func__, res);
+        return -1;
+    }
+
+    return res / sizeof(struct uffd_msg);
+}